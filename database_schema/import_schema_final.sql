@@ -12,6 +12,11 @@ CREATE TABLE IF NOT EXISTS domains (
   user_id       BIGINT UNSIGNED NOT NULL,
   domain        VARCHAR(253) NOT NULL,
   status        ENUM('active','paused','deleted') NOT NULL DEFAULT 'active',
+  stale_while_revalidate_sec INT NULL COMMENT 'NULL = proxy default',
+  stale_if_error_sec         INT NULL COMMENT 'NULL = proxy default',
+  cache_ttl_sec              INT NULL COMMENT 'Fixed TTL overriding origin headers',
+  cache_quota_bytes          BIGINT UNSIGNED NULL COMMENT 'RAM cache cap for this domain, NULL = none',
+  cache_weight               INT NULL COMMENT 'Share of the RAM cache relative to other domains, NULL = 1',
   created_at    DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP,
   updated_at    DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
   PRIMARY KEY (id),
@@ -29,6 +34,27 @@ CREATE TABLE IF NOT EXISTS domain_origins (
   KEY idx_origins_domain (domain_id),
   CONSTRAINT fk_origins_domain FOREIGN KEY (domain_id) REFERENCES domains(id) ON DELETE CASCADE
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci COMMENT='Multiple backend origin IPs per domain';
+
+CREATE TABLE IF NOT EXISTS domain_cache_policies (
+  id                  BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+  domain_id           BIGINT UNSIGNED NOT NULL,
+  path_prefix         VARCHAR(255) NOT NULL DEFAULT '/' COMMENT 'Longest matching prefix wins',
+  ttl_sec             INT NULL COMMENT 'Fixed TTL overriding origin headers and the domain TTL',
+  max_object_bytes    INT NULL COMMENT 'NULL = proxy default',
+  admission           TINYINT NULL COMMENT '0 = cache on first miss, 1 = second-hit admission, NULL = proxy default',
+  ignore_query_params VARCHAR(255) NULL COMMENT 'Comma list left out of the cache key, e.g. utm_*,fbclid',
+  cacheable_statuses  VARCHAR(64) NULL COMMENT 'Comma list, NULL = 200 only',
+  keep_query_params   VARCHAR(255) NULL COMMENT 'Comma list, when set the only parameters in the cache key',
+  key_headers         VARCHAR(255) NULL COMMENT 'Request headers whose values split the cache key, e.g. Accept-Language',
+  key_cookies         VARCHAR(255) NULL COMMENT 'Cookies whose values split the cache key, e.g. currency,ab_*',
+  key_fold_path       TINYINT NOT NULL DEFAULT 0 COMMENT '1 = key on the lowercased path',
+  key_device_class    TINYINT NOT NULL DEFAULT 0 COMMENT '1 = split the key by desktop/mobile/tablet User-Agent',
+  created_at          DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  updated_at          DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
+  PRIMARY KEY (id),
+  UNIQUE KEY uk_policies_domain_prefix (domain_id, path_prefix),
+  CONSTRAINT fk_policies_domain FOREIGN KEY (domain_id) REFERENCES domains(id) ON DELETE CASCADE
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci COMMENT='Per-domain, per-path cache policies';
 CREATE TABLE IF NOT EXISTS blacklist (
   ip            VARCHAR(45) NOT NULL,
   created_at    DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP,
@@ -79,8 +105,48 @@ CREATE TABLE IF NOT EXISTS cache_stats_minute (
   miss           INT UNSIGNED NOT NULL DEFAULT 0,
   byte_hit       BIGINT UNSIGNED NOT NULL DEFAULT 0,
   byte_miss      BIGINT UNSIGNED NOT NULL DEFAULT 0,
+  bytes_cached   BIGINT UNSIGNED NULL COMMENT 'Domain row (route_bucket = ''*''): RAM held at the end of the minute',
+  entries_cached INT UNSIGNED NULL,
+  quota_bytes    BIGINT UNSIGNED NULL COMMENT 'Hard cap, or the weighted share when the domain has none',
+  evictions      INT UNSIGNED NULL,
   PRIMARY KEY (ts_minute, domain_id, host, route_bucket),
   KEY idx_csm_domain_time (domain_id, ts_minute),
   KEY idx_csm_timestamp (ts_minute DESC),
   CONSTRAINT fk_cache_stats_domain FOREIGN KEY (domain_id) REFERENCES domains(id) ON DELETE CASCADE
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci COMMENT='Per-minute cache performance indicators (per route)';
+
+-- Upgrades for databases created before the cache columns above: CREATE TABLE IF NOT
+-- EXISTS leaves existing tables as they are, and the route loader selects these columns.
+-- Safe to run again, each column is only added when missing.
+DROP PROCEDURE IF EXISTS add_column_if_missing;
+DELIMITER //
+CREATE PROCEDURE add_column_if_missing(IN tbl VARCHAR(64), IN col VARCHAR(64), IN def VARCHAR(512))
+BEGIN
+  IF NOT EXISTS (SELECT 1 FROM information_schema.COLUMNS
+                 WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = tbl AND COLUMN_NAME = col) THEN
+    SET @ddl = CONCAT('ALTER TABLE `', tbl, '` ADD COLUMN `', col, '` ', def);
+    PREPARE stmt FROM @ddl;
+    EXECUTE stmt;
+    DEALLOCATE PREPARE stmt;
+  END IF;
+END//
+DELIMITER ;
+
+CALL add_column_if_missing('domains', 'stale_while_revalidate_sec', 'INT NULL COMMENT ''NULL = proxy default'' AFTER status');
+CALL add_column_if_missing('domains', 'stale_if_error_sec', 'INT NULL COMMENT ''NULL = proxy default'' AFTER stale_while_revalidate_sec');
+CALL add_column_if_missing('domains', 'cache_ttl_sec', 'INT NULL COMMENT ''Fixed TTL overriding origin headers'' AFTER stale_if_error_sec');
+CALL add_column_if_missing('domains', 'cache_quota_bytes', 'BIGINT UNSIGNED NULL COMMENT ''RAM cache cap for this domain, NULL = none'' AFTER cache_ttl_sec');
+CALL add_column_if_missing('domains', 'cache_weight', 'INT NULL COMMENT ''Share of the RAM cache relative to other domains, NULL = 1'' AFTER cache_quota_bytes');
+
+CALL add_column_if_missing('domain_cache_policies', 'keep_query_params', 'VARCHAR(255) NULL COMMENT ''Comma list, when set the only parameters in the cache key'' AFTER cacheable_statuses');
+CALL add_column_if_missing('domain_cache_policies', 'key_headers', 'VARCHAR(255) NULL COMMENT ''Request headers whose values split the cache key, e.g. Accept-Language'' AFTER keep_query_params');
+CALL add_column_if_missing('domain_cache_policies', 'key_cookies', 'VARCHAR(255) NULL COMMENT ''Cookies whose values split the cache key, e.g. currency,ab_*'' AFTER key_headers');
+CALL add_column_if_missing('domain_cache_policies', 'key_fold_path', 'TINYINT NOT NULL DEFAULT 0 COMMENT ''1 = key on the lowercased path'' AFTER key_cookies');
+CALL add_column_if_missing('domain_cache_policies', 'key_device_class', 'TINYINT NOT NULL DEFAULT 0 COMMENT ''1 = split the key by desktop/mobile/tablet User-Agent'' AFTER key_fold_path');
+
+CALL add_column_if_missing('cache_stats_minute', 'bytes_cached', 'BIGINT UNSIGNED NULL COMMENT ''Domain row (route_bucket = ''''*''''): RAM held at the end of the minute'' AFTER byte_miss');
+CALL add_column_if_missing('cache_stats_minute', 'entries_cached', 'INT UNSIGNED NULL AFTER bytes_cached');
+CALL add_column_if_missing('cache_stats_minute', 'quota_bytes', 'BIGINT UNSIGNED NULL COMMENT ''Hard cap, or the weighted share when the domain has none'' AFTER entries_cached');
+CALL add_column_if_missing('cache_stats_minute', 'evictions', 'INT UNSIGNED NULL AFTER quota_bytes');
+
+DROP PROCEDURE add_column_if_missing;
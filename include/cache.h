@@ -4,6 +4,7 @@
 #include <windows.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "cache_key_rules.h"
 
 #define CACHE_MAX_OBJECT_BYTES 131072 
 #define CACHE_DEFAULT_TTL_SEC 120
@@ -11,40 +12,205 @@
 #define CACHE_MAX_VARY_LEN 128
 #define CACHE_DEFAULT_SECOND_HIT_WINDOW 10  
 #define CACHE_BUCKETS_PER_SHARD 256 
+#define CACHE_INDEX_GROUP 16          // control bytes probed at once (one SSE2 compare)
+#define CACHE_INDEX_INITIAL_SLOTS 256 // per shard; the index grows as entries are added
+#define CACHE_INDEX_MIGRATE_GROUPS 2  // old-table groups moved per insert while resizing
+#define CACHE_SEGMENT_BYTES 16384        // largest segment; a body grows to it from small ones
+#define CACHE_SEGMENT_MIN_BYTES 256
+#define CACHE_FILL_WAIT_MS 10000
+#define CACHE_SEND_GATHER_MAX 32
+#define CACHE_MAX_TAGS 16          // surrogate keys + path prefixes indexed per entry
+#define CACHE_MAX_PATH_TAGS 6      // "/", "/a/", "/a/b/", ... deeper prefixes are not indexed
+#define CACHE_TAG_BUCKETS_PER_SHARD 256
+#define CACHE_TAG_KEY 'k'          // Surrogate-Key / Cache-Tag value
+#define CACHE_TAG_PREFIX 'p'       // path prefix ending in '/'
+#define CACHE_MAX_POLICY_STATUSES 8
+#define CACHE_EVICT_HIGH_PCT 95       // background evictor wakes above this share of max_bytes
+#define CACHE_EVICT_LOW_PCT 90        // ... and evicts down to this one
+#define CACHE_EVICT_SAMPLE_SHARDS 8   // shards compared per batch to find the coldest tail
+#define CACHE_EVICT_BATCH 32
+#define CACHE_MAX_RANGES 8            // requests with more ranges get the whole object
+#define CACHE_RANGE_SLICE_BYTES (1024U * 1024U)  // uncached objects fill by range in slices of this size
+#define CACHE_RANGE_MAX_SLICES 4096
+#define CACHE_SLICE_PARENT_BUCKETS 4096 // objects with range slices, remembered for exact purges
+#define CACHE_SLICE_PARENT_LOCKS 64
+#define CACHE_MAX_STATUS_RULES 8
+#define CACHE_STATUS_EVICT_SCAN 32    // LRU tail entries searched for same-status victims when a cap is hit
+#define CACHE_L1_SLOTS 16             // hottest values each worker thread serves without the shard lock
+#define CACHE_L1_CANDIDATES 64
+#define CACHE_L1_SAMPLE_EVERY 16      // locked hits per thread between samples
+#define CACHE_L1_ADMIT_SAMPLES 4      // samples of one key before it gets an L1 slot
+#define CACHE_L1_REF_BATCH 64         // value references a slot takes at once
+#define CACHE_L1_REVALIDATE_MS 1000   // L1 hits go through the shard this often, keeping its LRU warm
+#define CACHE_CONTENT_BUCKETS_PER_SHARD 1024  // content store: identical bodies are kept once
+#define CACHE_SWEEP_INTERVAL_MS 1000  // expired entries are swept this often (by the evictor thread)
+#define CACHE_SWEEP_BUDGET_US 2000    // CPU time one sweep may spend
+#define CACHE_SWEEP_BATCH 64          // expired entries freed per shard lock hold
+#define CACHE_SWEEP_RETRY_SEC 5       // expired fills still streaming are looked at again after this
+#define CACHE_MAX_TENANTS 1024        // per-domain partitions; later domains share tenant 0
+#define CACHE_TENANT_DEFAULT_WEIGHT 1
+#define CACHE_TENANT_VICTIMS 4        // tenants furthest over their share, evicted from first
+#define CACHE_LARGE_FILLS_MAX 8       // fills past CACHE_MAX_OBJECT_BYTES in flight at once
+
+// Content codings a client accepts (bitmask)
+#define CACHE_ENCODING_IDENTITY 0x0
+#define CACHE_ENCODING_GZIP     0x1
+
+// State of a value's compressed variant
+#define CACHE_VARIANT_NONE    0
+#define CACHE_VARIANT_PENDING 1
+#define CACHE_VARIANT_READY   2
+#define CACHE_VARIANT_SKIPPED 3
+
+// One piece of a body chain; full once len reaches cap
+typedef struct cache_segment_s {
+    struct cache_segment_s *next;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t data[];
+} cache_segment_t;
+
+// Body stored as a segment chain; may still be filling while readers stream it
+typedef struct cache_body_s {
+    cache_segment_t *head;
+    cache_segment_t *tail;
+    uint64_t len;
+    uint64_t expected;        // announced length, sizes the segments; 0 if unknown
+    uint64_t alloc_bytes;     // heap held by the segments
+    volatile LONG64 *account; // charged as it grows until its entry is, see cache_body_account
+    int complete;
+    int aborted;
+    SRWLOCK lock;
+    CONDITION_VARIABLE more;
+} cache_body_t;
+
+typedef struct cache_body_cursor_s {
+    const cache_segment_t *seg;
+    uint32_t seg_off;
+    uint64_t pos;
+} cache_body_cursor_t;
+
+struct cache_content_s;
 
 typedef struct cache_value_s {
-    uint8_t *body;
-    uint32_t body_len;
+    cache_body_t *body;
+    uint32_t body_len;        // final length, 0 while filling
+    long long content_length; // length announced by origin, -1 if unknown
     uint32_t status_code;
     char content_type[64]; 
     uint32_t expires_at; 
     char etag[64];
     char last_modified[64];
+    uint32_t stale_while_revalidate; // seconds past expires_at it may be served while refreshing
+    uint32_t stale_if_error;         // seconds past expires_at it may stand in for origin errors
+    volatile LONG refreshing;        // a background refresh is in flight
+    char *header;             // status line + filtered origin headers, each CRLF-terminated
+    uint32_t header_len;      // (no Content-Length/Age/terminator: appended per hit)
+    uint32_t age_base;        // response time minus the Age origin reported
+    int compressible;         // text-like 200 the origin sent uncompressed
+    cache_body_t *gz_body;    // gzip variant, built in the background once body is complete
+    uint64_t gz_len;
+    volatile LONG gz_state;   // CACHE_VARIANT_*
+    uint64_t *tags;           // purge index keys (cache_tag_hash), fixed once published
+    uint32_t ntags;
+    volatile LONG purged;     // removed by a purge: an unfinished fill must not re-store it
+    uint64_t range_total;     // full object length when this is one range slice, 0 otherwise
+    struct cache_content_s *content;  // content store record once committed; owns body when
+                                      // body == content->body, otherwise body is this value's own
+    uint16_t tenant;          // cache_tenant_find() of the request host, 0 = shared
+    char *url;                // "https://host/path?query" it was filled from, NULL if unknown
+    volatile LONG refcnt;     // one ref held by the cache, one per reader/filler
 } cache_value_t;
 
+// One distinct committed body, shared by every value with the same bytes
+typedef struct cache_content_s {
+    uint64_t hash;
+    char fingerprint[16];
+    cache_body_t *body;
+    uint64_t len;
+    volatile LONG refcnt;     // one per value pointing here
+    struct cache_content_s *hnext;
+} cache_content_t;
+
+struct cache_entry_s;
+struct cache_tag_s;
+
+// One entry's membership in one tag list of its shard
+typedef struct cache_tag_member_s {
+    struct cache_tag_s *tag;
+    struct cache_entry_s *entry;
+    struct cache_tag_member_s *prev;
+    struct cache_tag_member_s *next;
+} cache_tag_member_t;
+
+// Entries of a shard carrying one tag, so a purge touches only its matches
+typedef struct cache_tag_s {
+    uint64_t tag_hash;
+    cache_tag_member_t *members;
+    uint32_t count;
+    struct cache_tag_s *hnext;
+} cache_tag_t;
+
 typedef struct cache_entry_s {
     uint64_t key_hash; 
     char key_fingerprint[16]; 
     cache_value_t *val;
-    struct cache_entry_s *hnext;  
+    struct cache_entry_s *hnext;   // chains victims / purged entries once out of the index
     struct cache_entry_s *lru_prev; 
     struct cache_entry_s *lru_next;
-    volatile LONG refcnt;  
     uint32_t created_at; 
+    uint32_t last_access;          // GetTickCount() of the last store or hit
+    cache_tag_member_t **tag_members;  // one per val->tags, for O(1) unlinking
+    uint32_t ntags;
+    uint32_t sweep_at;             // expires_at plus stale grace: no longer servable after this
+    uint32_t heap_slot;            // 1-based position in the shard's expiry heap, 0 = not queued
+    uint16_t tenant;               // val->tenant when the entry was created
+    struct cache_entry_s *tenant_prev;  // the shard's LRU restricted to this tenant
+    struct cache_entry_s *tenant_next;
 } cache_entry_t;
 
+// One tenant's entries in a shard, in the same order as the shard LRU
+typedef struct cache_tenant_lru_s {
+    cache_entry_t *head;
+    cache_entry_t *tail;
+} cache_tenant_lru_t;
+
+// Open-addressing table: one control byte per slot (empty, deleted, or 0x80 | 7 hash
+// bits), probed a group at a time so a lookup touches one entry per real match
+typedef struct cache_index_table_s {
+    uint8_t *ctrl;
+    cache_entry_t **slots;
+    uint32_t capacity;      // power of two, at least CACHE_INDEX_GROUP
+    uint32_t used;
+    uint32_t tombstones;
+} cache_index_table_t;
+
+// A resize drains old into cur a few groups per insert instead of rehashing at once
+typedef struct cache_index_s {
+    cache_index_table_t cur;
+    cache_index_table_t old;    // capacity 0 unless a resize is in progress
+    uint32_t migrate_group;     // next group of old to move
+} cache_index_t;
+
 typedef struct cache_shard_s {
     SRWLOCK lock;
-    cache_entry_t **buckets; 
-    uint32_t nbuckets;
+    cache_index_t index;
     cache_entry_t *lru_head;
     cache_entry_t *lru_tail;
     uint64_t bytes_used; 
     uint64_t hits;
     uint64_t misses;
     uint64_t evictions;
+    uint64_t stale_hits;
     uint64_t byte_hits; 
     uint64_t byte_misses; 
+    cache_tag_t **tag_buckets;
+    uint32_t ntag_buckets;
+    cache_entry_t **expiry_heap;   // min-heap on sweep_at
+    uint32_t expiry_count;
+    uint32_t expiry_cap;
+    uint64_t expired;              // entries freed by the sweeper
+    cache_tenant_lru_t *tenant_lru;  // CACHE_MAX_TENANTS lists
 } cache_shard_t;
 
 typedef struct second_hit_entry_s {
@@ -60,16 +226,52 @@ typedef struct second_hit_shard_s {
     uint32_t nbuckets;
 } second_hit_shard_t;
 
+// Origin fetch in flight for a key, used to collapse concurrent misses
+typedef struct inflight_fill_s {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    struct inflight_fill_s *next;
+} inflight_fill_t;
+
+typedef struct inflight_shard_s {
+    SRWLOCK lock;
+    CONDITION_VARIABLE done;
+    inflight_fill_t *fills;
+    uint64_t collapsed;
+} inflight_shard_t;
+
+// Non-200 status cached by default (redirects, 404/410, brief 5xx shielding)
+typedef struct cache_status_rule_s {
+    uint32_t status_code;
+    uint32_t ttl_sec;       // TTL when origin sends none, and the most origin may give
+    uint64_t max_bytes;     // RAM all entries with this status may use, 0 = global budget only
+} cache_status_rule_t;
+
 typedef struct http_cache_s {
     cache_shard_t shards[CACHE_NUM_SHARDS];
     second_hit_shard_t hit_trackers[CACHE_NUM_SHARDS]; 
-    uint64_t max_bytes;
+    inflight_shard_t inflight[CACHE_NUM_SHARDS];
+    volatile uint64_t max_bytes;    // may be resized at runtime, see cache_set_max_bytes
     uint32_t default_ttl_sec;
     uint32_t second_hit_window_sec;
     uint8_t enabled;
+    // Global budget: every shard charges here, the evictor keeps it between the watermarks
+    volatile LONG64 bytes_used;
+    volatile LONG64 fill_bytes;     // bodies still filling, until their entry is charged
+    volatile LONG large_fills;
+    volatile uint64_t high_watermark;
+    volatile uint64_t low_watermark;
+    HANDLE evictor_thread;
+    HANDLE evictor_wake;
+    volatile LONG evictor_stop;
+    // Set once before traffic; bytes are charged per rule like the global total
+    cache_status_rule_t status_rules[CACHE_MAX_STATUS_RULES];
+    uint32_t nstatus_rules;
+    volatile LONG64 status_bytes[CACHE_MAX_STATUS_RULES];
 } http_cache_t;
 
 typedef enum {
+    CACHE_RESULT_STALE = 2,   // expired but inside its stale grace period
     CACHE_RESULT_HIT = 1,
     CACHE_RESULT_MISS = 0,
     CACHE_RESULT_ERROR = -1
@@ -78,23 +280,177 @@ typedef enum {
 int cache_init(uint64_t max_bytes, uint32_t default_ttl, uint32_t second_hit_window);
 void cache_shutdown(void);
 
+// Non-200 statuses cacheable without a route policy; call after cache_init, before traffic
+int cache_set_status_rules(const cache_status_rule_t *rules, uint32_t count);
+
+// Rule for status_code, NULL if it is not cached by default
+const cache_status_rule_t *cache_status_rule(uint32_t status_code);
+
+// Reason phrase for the status line of a cached response
+const char *cache_status_reason(uint32_t status_code);
+
 cache_result_t cache_get(const char *method, const char *scheme, 
                         const char *host, const char *path, 
                         const char *query, const char *vary_header,
                         cache_value_t **out);
 
+// Same as cache_get() for a precomputed key. HIT and STALE both return an acquired value
+cache_result_t cache_get_key(uint64_t key_hash, const char *fingerprint, cache_value_t **out);
+
+// Whether the key has an entry, fresh or stale; no LRU, counter or L1 effects
+int cache_contains_key(uint64_t key_hash, const char *fingerprint);
+
 int cache_put(const char *method, const char *scheme,
               const char *host, const char *path, const char *query,
               const char *vary_header, uint32_t status_code,
               const uint8_t *body, uint32_t body_len,
               const char *content_type, uint32_t ttl_seconds);
 
-void cache_entry_release(cache_entry_t *entry);
 void cache_evict_until_under(uint64_t max_bytes);
 
+// Resize the RAM budget at runtime; the watermarks follow and the evictor trims down to it
+void cache_set_max_bytes(uint64_t max_bytes);
+// Current budget and bytes charged against it, without taking shard locks
+void cache_get_budget(uint64_t *max_bytes, uint64_t *bytes_used);
+
+// Value lifetime: cache_get() returns an acquired value, release it when done
+cache_value_t *cache_value_create(uint32_t status_code, const char *content_type,
+                                  long long content_length);
+void cache_value_acquire(cache_value_t *val);
+void cache_value_release(cache_value_t *val);
+// Drops n references at once, bypassing the calling thread's L1
+void cache_value_release_refs(cache_value_t *val, LONG n);
+
+// Per-thread L1 of the hottest values (cache_l1.c): cache_get_key() serves from it
+// first. Every removal or replacement in a shard must call cache_l1_invalidate()
+int cache_l1_get(uint64_t key_hash, const char *fingerprint, cache_value_t **out);
+// After a locked hit, with the shard lock held: revalidates or samples the key
+void cache_l1_sample(uint64_t key_hash, const char *fingerprint, cache_value_t *val);
+// After a locked lookup found no fresh value: drops this thread's slot for the key
+void cache_l1_forget(uint64_t key_hash, const char *fingerprint);
+void cache_l1_invalidate(uint32_t shard_idx);
+// Returns 1 if the reference went back to this thread's L1 instead of the refcount
+int cache_l1_absorb(cache_value_t *val);
+void cache_l1_get_stats(uint64_t *hits, uint64_t *byte_hits);
+
+// Streaming fill: publish a filling value so concurrent readers can attach,
+// then commit it once complete (or abort to unpublish it)
+int cache_publish_fill(uint64_t key_hash, const char *fingerprint,
+                       cache_value_t *val, uint32_t ttl_seconds);
+int cache_commit_fill(uint64_t key_hash, const char *fingerprint, cache_value_t *val);
+void cache_abort_fill(uint64_t key_hash, const char *fingerprint, cache_value_t *val);
+
+// Origin confirmed val with a 304: fresh again for ttl_seconds, the TTL of the 304's own
+// headers (the caller's default only when it has none). 0 leaves val as stale as it was,
+// good for the response at hand only. Returns -1 if it is no longer cached
+int cache_refresh_ttl(uint64_t key_hash, const char *fingerprint, cache_value_t *val,
+                      uint32_t ttl_seconds);
+
+// Snapshot support: a committed value reloaded at startup, and the hottest
+// fresh values per shard (each item holds its own reference).
+// cache_restore_value() stores any complete value; range slices use it too
+typedef struct {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    cache_value_t *val;
+} cache_hot_item_t;
+
+int cache_restore_value(uint64_t key_hash, const char *fingerprint, cache_value_t *val);
+int cache_collect_hot(cache_hot_item_t **items_out, size_t *count_out, uint64_t max_bytes);
+
+// Attach a finished gzip variant to val and charge it to its shard.
+// Returns -1 (gz not taken) if val is no longer the cached value for the key
+int cache_attach_gzip(uint64_t key_hash, const char *fingerprint, cache_value_t *val,
+                      cache_body_t *gz);
+
+// Per-shard entry index (cache_index.c); callers hold the shard lock
+int cache_index_init(cache_index_t *idx, uint32_t capacity);
+void cache_index_free(cache_index_t *idx);
+cache_entry_t *cache_index_find(const cache_index_t *idx, uint64_t key_hash, const char *fingerprint);
+// entry must not be indexed yet; -1 if the table could not grow
+int cache_index_insert(cache_index_t *idx, cache_entry_t *entry);
+void cache_index_remove(cache_index_t *idx, const cache_entry_t *entry);
+uint32_t cache_index_count(const cache_index_t *idx);
+
+// Content store (cache_content.c). Intern returns the record for the bytes with an
+// acquired reference: the existing one, or a new one that took ownership of body
+// (*adopted = 1). Release returns the heap freed when the last reference went
+void cache_content_hash(const cache_body_t *body, uint64_t *hash_out, char *fingerprint_out);
+cache_content_t *cache_content_intern(uint64_t hash, const char *fingerprint, cache_body_t *body,
+                                      uint64_t len, int *adopted);
+void cache_content_acquire(cache_content_t *content);
+uint64_t cache_content_release(cache_content_t *content);
+// Distinct bodies stored, their bytes, stores that found their bytes already
+// cached, and the bytes those duplicates would otherwise take
+void cache_content_get_metrics(uint64_t *contents, uint64_t *unique_bytes,
+                               uint64_t *dedup_hits, uint64_t *bytes_saved);
+
+// Tenant partitions (cache_tenant.c): one per configured domain, keyed by its
+// cache_tag_scope(); hosts without one share tenant 0. Each tenant is charged the
+// full size of its entries, shared bodies included
+typedef struct {
+    uint64_t bytes_used;
+    uint64_t entries;
+    uint64_t quota_bytes;     // 0 = no hard cap
+    uint64_t share_bytes;     // quota, or weighted share of the cache, as last rebalanced
+    uint64_t evictions;       // since the previous cache_tenant_take_stats()
+} cache_tenant_stats_t;
+
+// Registers or updates host's tenant; returns its id, 0 if the table is full
+uint16_t cache_tenant_configure(const char *host, uint64_t quota_bytes, uint32_t weight);
+uint16_t cache_tenant_find(uint64_t scope);
+void cache_tenant_charge(uint16_t tenant, int64_t bytes, int64_t entries);
+void cache_tenant_count_eviction(uint16_t tenant);
+// Recomputes every tenant's share of capacity and the ones evicted from first
+void cache_tenant_rebalance(uint64_t capacity);
+// Up to CACHE_TENANT_VICTIMS tenant ids plus one, 16 bits each, furthest over share first
+uint64_t cache_tenant_victims(void);
+int cache_tenant_over_share(uint16_t tenant);
+uint64_t cache_tenant_quota(uint16_t tenant);
+// Bytes by which the tenant would exceed its quota after adding extra (0 = within)
+uint64_t cache_tenant_quota_excess(uint16_t tenant, uint64_t extra);
+// -1 if host has no tenant of its own
+int cache_tenant_take_stats(const char *host, cache_tenant_stats_t *out);
+
+// Segment chain bodies (cache_body.c)
+cache_body_t *cache_body_create(void);
+void cache_body_free(cache_body_t *body);
+int cache_body_append(cache_body_t *body, const uint8_t *data, size_t len);
+int cache_body_append_from(cache_body_t *dst, const cache_body_t *src);
+// Segments are sized for a body of len bytes instead of growing from small ones
+void cache_body_expect(cache_body_t *body, uint64_t len);
+// Heap the body holds, what the cache is charged for it; fixed once it is complete
+uint64_t cache_body_bytes(const cache_body_t *body);
+// Charges the body's heap to *counter, now and as segments are added; NULL takes it back
+void cache_body_account(cache_body_t *body, volatile LONG64 *counter);
+void cache_body_finish(cache_body_t *body);
+void cache_body_abort(cache_body_t *body);
+int cache_body_is_complete(cache_body_t *body);
+uint64_t cache_body_available(cache_body_t *body);
+int cache_body_wait_complete(cache_body_t *body, uint32_t timeout_ms);
+void cache_body_cursor_init(cache_body_cursor_t *cur);
+// Returns 1 with the next contiguous run of bytes, 0 at end of body, -1 on abort/timeout
+int cache_body_read(cache_body_t *body, cache_body_cursor_t *cur,
+                    const uint8_t **data_out, size_t *len_out, uint32_t timeout_ms);
+
 int cache_check_admission(uint64_t key_hash, const char *key_fingerprint);
 
+// Request collapsing: the first miss for a key becomes the leader and fetches from
+// origin; later misses wait until the leader has published its fill (or given up)
+// Returns 1 if the caller is now the leader, 0 if another fetch is in flight
+int cache_fill_begin(uint64_t key_hash, const char *key_fingerprint);
+// Returns 0 once the in-flight fetch finished, -1 on timeout
+int cache_fill_wait(uint64_t key_hash, const char *key_fingerprint, uint32_t timeout_ms);
+void cache_fill_end(uint64_t key_hash, const char *key_fingerprint);
+uint64_t cache_get_collapsed_count(void);
+// A fill growing past CACHE_MAX_OBJECT_BYTES needs one of CACHE_LARGE_FILLS_MAX slots.
+// Returns 0 if one was taken; cache_large_fill_end gives it back
+int cache_large_fill_begin(void);
+void cache_large_fill_end(void);
+
 void cache_get_metrics(uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *bytes_used);
+// Entries the background sweeper freed after they expired unrequested
+uint64_t cache_get_expired_count(void);
 double cache_get_hit_rate(void);
 
 void cache_get_egress_bytes(uint64_t *cached_bytes, uint64_t *missed_bytes);
@@ -107,6 +463,16 @@ int cache_invalidate(const char *method, const char *scheme,
                      const char *host, const char *path,
                      const char *query, const char *vary_header);
 
+// Invalidate by precomputed key (RAM and disk tier)
+int cache_invalidate_key(uint64_t key_hash, const char *fingerprint);
+
+// Purge index: tags are scoped to the request host
+uint64_t cache_tag_scope(const char *host);
+uint64_t cache_tag_hash(uint64_t scope, char kind, const char *tag, size_t len);
+// Drop every entry carrying the tag (RAM and the disk copy of each match);
+// returns the number of entries removed
+int cache_purge_tag(uint64_t tag_hash);
+
 int build_cache_key(const char *method, const char *scheme,
                    const char *host, const char *path, 
                    const char *query, const char *vary_header,
@@ -114,6 +480,13 @@ int build_cache_key(const char *method, const char *scheme,
 
 void cache_key_hash(const char *key, uint64_t *hash_out, char *fingerprint_out);
 
+// Hash and fingerprint of the key build_cache_key() would produce, in one
+// pass without building it; equal to cache_key_hash() of that string
+int cache_key_compute(const char *method, const char *scheme,
+                      const char *host, const char *path,
+                      const char *query, const char *vary_header,
+                      uint64_t *hash_out, char *fingerprint_out);
+
 uint32_t cache_key_to_shard(uint64_t key_hash);
 
 uint64_t fnv1a_hash(const char *key, size_t len);
@@ -123,15 +496,73 @@ typedef struct {
     uint64_t key_hash;
     char key_fingerprint[16];
     int should_cache;
+    int fill_leader;    // registered as the in-flight fetch for this key
+    int bypass_admission;            // key already proven popular (refresh, stale refetch)
+    uint32_t stale_while_revalidate; // route defaults when origin sends no directive
+    uint32_t stale_if_error;
+    uint32_t ttl_override;  // route TTL that ignores origin freshness (0 = none)
+    uint32_t min_ttl;       // clamps applied to origin-derived TTLs (0 = none)
+    uint32_t max_ttl;
+    uint32_t response_ttl;  // TTL derived from the last response headers processed
+    uint32_t accept_encoding;  // CACHE_ENCODING_* the client accepts
+    int https;                 // keyed under the https scheme
+    uint64_t tag_scope;        // cache_tag_scope(host)
+    uint16_t tenant;           // cache_tenant_find(tag_scope)
+    uint64_t path_tags[CACHE_MAX_PATH_TAGS];
+    uint32_t npath_tags;
+    uint16_t cacheable_statuses[CACHE_MAX_POLICY_STATUSES];  // route policy; none = 200 + status rules
+    uint32_t ncacheable_statuses;
+    int has_stale;          // an expired copy exists: an error response must not replace it
 } cache_key_info_t;
 
+// Freshness information from one response header block
 typedef struct {
-    uint8_t *buffer;
-    size_t size;
-    size_t capacity;
+    int no_store;                 // no-store, private, no-cache, Set-Cookie or Vary: *
+    int must_revalidate;          // stale serving not allowed
+    long max_age;                 // -1 when absent
+    long s_maxage;
+    long stale_while_revalidate;
+    long stale_if_error;
+    long expires_ttl;             // Expires relative to Date, -1 when absent
+    long age;                     // Age already spent upstream
+} cache_freshness_t;
+
+void cache_parse_freshness(const char *header_buf, const char *hdr_end, cache_freshness_t *f);
+
+// TTL for a response: s-maxage > max-age > Expires > default_ttl, minus Age,
+// clamped by the route policy. 0 means not cacheable
+uint32_t cache_freshness_ttl(const cache_freshness_t *f, const cache_key_info_t *policy,
+                             uint32_t default_ttl);
+
+// Incremental Transfer-Encoding: chunked decoder; payload bytes are passed to a sink
+typedef int (*cache_dechunk_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+typedef struct {
+    int state;
+    uint64_t remaining;
+    uint64_t max_chunk;   // larger chunk sizes are rejected (0 = no limit)
+} cache_dechunk_t;
+
+void cache_dechunk_init(cache_dechunk_t *d, uint64_t max_chunk);
+// Returns 1 once the last chunk and trailers are consumed, 0 if more input is
+// needed, -1 on malformed input, bytes past the end or a sink failure
+int cache_dechunk(cache_dechunk_t *d, const uint8_t *data, size_t len,
+                  cache_dechunk_sink_t sink, void *ctx);
+
+typedef struct {
+    cache_value_t *value;      // value being filled (own reference)
+    size_t size;               // decoded body bytes so far
+    size_t max_bytes;
+    long long content_length;  // -1 when unknown
     uint32_t status_code;
     char content_type[128];
     int complete;
+    int published;             // value visible in cache while filling
+    struct cache_disk_writer_s *disk;  // body streamed to the disk tier instead of RAM
+    int large;                 // holds a cache_large_fill_begin() slot
+    // Transfer-Encoding: chunked decoder
+    int is_chunked;
+    cache_dechunk_t dechunk;
 } cache_buffer_t;
 
 // Prepare cache key (hash + fingerprint) from request info
@@ -140,39 +571,162 @@ int cache_prepare_key(const char *method, const char *scheme,
                       const char *query, const char *vary_header,
                       cache_key_info_t *key_info);
 
-// Check if response should be cached based on conditions
+// Check if response should be cached based on conditions; policy may list
+// cacheable statuses (NULL or none listed = 200 and the cache_status_rule() ones)
 int cache_should_cache_response(const char *method, uint32_t status_code,
                                 int is_chunked, long long content_length,
-                                uint32_t max_object_bytes);
+                                uint32_t max_object_bytes, const cache_key_info_t *policy);
 
-// Initialize cache buffer
-int cache_buffer_init(cache_buffer_t *buf, size_t capacity);
+// Initialize cache buffer (no body memory is reserved up front)
+int cache_buffer_init(cache_buffer_t *buf, long long content_length, int is_chunked, size_t max_bytes);
 
-// Append data to cache buffer
+// Append wire bytes to cache buffer (de-chunks when needed); -1 drops the fill
 int cache_buffer_append(cache_buffer_t *buf, const uint8_t *data, size_t len);
 
 // Check if cache buffer is complete
 int cache_buffer_is_complete(cache_buffer_t *buf, long long content_length);
 
-// Free cache buffer
-void cache_buffer_free(cache_buffer_t *buf);
+// Free cache buffer; an unfinished fill is aborted and unpublished
+void cache_buffer_free(cache_buffer_t *buf, const cache_key_info_t *key_info);
 
-// Try to store response in cache (with admission check and all logic)
+// Commit a completed fill to the cache, remembering the URL it came from
 int cache_try_store(const cache_key_info_t *key_info,
-                   const cache_buffer_t *buf,
-                   const char *method, const char *scheme,
-                   const char *host, const char *path,
-                   const char *query, const char *vary_header,
-                   uint32_t ttl_seconds);
+                   cache_buffer_t *buf, const char *host,
+                   const char *path, const char *query);
+
+// Byte ranges of a Range request header, as sent; resolved per object
+typedef struct {
+    uint32_t count;                   // 0: no usable Range header, serve the whole object
+    int64_t first[CACHE_MAX_RANGES];  // -1 for a suffix range ("-N")
+    int64_t last[CACHE_MAX_RANGES];   // -1 when open ("N-"), N for a suffix range
+    char if_range[80];                // If-Range validator, empty when absent
+} cache_range_t;
+
+// Ranges resolved against an object and the 206 framing around them
+typedef struct {
+    uint32_t count;
+    uint64_t total;
+    uint64_t first[CACHE_MAX_RANGES];
+    uint64_t last[CACHE_MAX_RANGES];
+    uint64_t body_len;                // 206 body, multipart framing included
+    char content_type[64];            // multipart/byteranges when count > 1
+    char part_head[CACHE_MAX_RANGES][192];
+    uint32_t part_len[CACHE_MAX_RANGES];
+    char trailer[48];
+    uint32_t trailer_len;
+} cache_range_plan_t;
+
+// Parse Range/If-Range; returns the number of ranges (0 when absent or malformed)
+uint32_t cache_parse_range(const char *request_buffer, cache_range_t *range);
+
+// Whether If-Range (if any) still matches the object's validators
+int cache_range_applies(const cache_range_t *range, const char *etag, const char *last_modified);
+
+// Resolve against an object of total bytes; returns the satisfiable range count (0 = 416)
+uint32_t cache_range_plan(const cache_range_t *range, uint64_t total, const char *content_type,
+                          cache_range_plan_t *plan);
+
+// Key of one CACHE_RANGE_SLICE_BYTES slice of the object with the given key
+void cache_slice_key(uint64_t key_hash, const char *fingerprint, uint32_t slice,
+                     uint64_t *hash_out, char *fingerprint_out);
+
+// Record that slice of the object with the given key is being stored, until expires_at
+void cache_note_slice(uint64_t key_hash, const char *fingerprint, uint32_t slice, uint32_t expires_at);
+
+// Drop every range slice noted for the key; returns the number removed
+int cache_invalidate_slices(uint64_t key_hash, const char *fingerprint);
+
+// Header value of name (without colon) before hdr_end; returns its length or -1
+int cache_header_value(const char *buf, const char *hdr_end, const char *name,
+                       char *out, size_t out_size);
+
+// Send head (may be NULL), then bytes [offset, offset + len) of body, waiting on a fill
+// Returns 0 on success, -1 if nothing was sent, -2 if it broke off midway
+int cache_send_body_span(void *client_fd, void *ssl, cache_body_t *body,
+                         const char *head, int head_len, uint64_t offset, uint64_t len);
+
+// 416 for an object of total bytes; returns 0 or -1
+int cache_send_range_not_satisfiable(void *client_fd, void *ssl, uint64_t total);
+
+// Build the response header sent for a cache hit; returns header length or -1
+int cache_build_hit_header(char *out, size_t out_size, uint32_t status_code,
+                           const char *content_type, uint64_t body_len, uint32_t expires_at,
+                           const char *etag, const char *last_modified);
 
 // Send cached response to client
 int cache_send_response(void *client_fd, void *ssl, cache_value_t *cached_value);
 
 // Handle cache hit: check expiry, send response, track metrics
-// Returns: 1 if cache hit was valid and sent, 0 otherwise
+// Returns: 1 if cache hit was valid and sent, 0 if nothing was sent,
+//          -1 if the response broke off midway (connection must be dropped)
+// accept_encoding picks the gzip variant when the client takes it and one is ready;
+// range (may be NULL) answers with 206/416 from the identity body
 int cache_handle_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
                     const char *path, const char *query, const char *method,
-                    const char *host, uint64_t bytes_in, uint64_t *bytes_out);
+                    const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                    uint64_t bytes_in, uint64_t *bytes_out);
+
+// Serve a value origin has just confirmed with a 304, even if that 304 left it expired
+// (served once as a hit, max-age=0). Returns like cache_handle_hit()
+int cache_handle_revalidated_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
+                                 const char *path, const char *query, const char *method,
+                                 const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                                 uint64_t bytes_in, uint64_t *bytes_out);
+
+// Serve an expired value inside its grace period (marked stale, max-age=0)
+// Returns like cache_handle_hit()
+int cache_handle_stale_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
+                           const char *path, const char *query, const char *method,
+                           const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                           uint64_t bytes_in, uint64_t *bytes_out);
+
+// Client sent If-None-Match/If-Modified-Since
+int cache_request_is_conditional(const char *request_buffer);
+
+// Answer a conditional request from a fresh value with 304 Not Modified
+// Returns: 1 if a 304 was sent, 0 if validators don't match, -1 on send failure
+int cache_handle_not_modified(void *client_fd, void *ssl, cache_value_t *cached_value,
+                              const char *request_buffer, const char *path, const char *query,
+                              const char *method, const char *host, uint64_t bytes_in);
+
+// Build If-None-Match/If-Modified-Since lines (CRLF terminated) from stored validators
+// Returns length written (0 if the value has no validators) or -1
+int cache_build_revalidation_headers(const cache_value_t *val, char *out, size_t out_size);
+
+// Whether an expired value may still be served while refreshing / in place of an origin error
+int cache_stale_while_revalidate_ok(const cache_value_t *val);
+int cache_stale_if_error_ok(const cache_value_t *val);
+
+// Admin requests (PURGE/BAN, WARM) carry X-Purge-Token: token, or come from loopback
+// once cache_admin_configure() allowed that (off by default)
+void cache_admin_configure(int trust_loopback);
+int cache_admin_authorized(const char *request_buffer, const char *client_ip, const char *token);
+
+// PURGE/BAN from loopback or with a matching X-Purge-Token: by Surrogate-Key
+// request header, by prefix ("/a/b/*") or the exact URL, keyed under the route's
+// rules (may be NULL) as the purge request selects. Always responds; returns 1
+int cache_handle_purge(void *client_fd, void *ssl, const char *request_buffer,
+                       const char *host, const char *path, const char *query,
+                       const cache_key_rules_t *rules, const char *client_ip, const char *token);
+
+// Look the key up in the disk tier and serve it from there, answering a matching
+// If-None-Match/If-Modified-Since in request_buffer with 304
+// Returns: 1 if served from disk, 0 otherwise
+int cache_handle_disk_hit(void *client_fd, void *ssl, const cache_key_info_t *key_info,
+                          const char *request_buffer, const char *path, const char *query,
+                          const char *method, const char *host, const cache_range_t *range,
+                          uint64_t bytes_in, uint64_t *bytes_out);
+
+// Wait for an in-flight fetch of the same key and serve its result
+// Returns: 1 if served from cache, 0 if the caller should go to origin
+int cache_collapse_miss(void *client_fd, void *ssl, cache_key_info_t *key_info,
+                        const char *path, const char *query, const char *method,
+                        const char *host, const cache_range_t *range,
+                        uint64_t bytes_in, uint64_t *bytes_out,
+                        uint32_t *status_code_out);
+
+// Give up fill leadership (wakes collapsed waiters)
+void cache_release_fill_leader(cache_key_info_t *key_info);
 
 // Record request metrics (for cache miss)
 void cache_record_metrics(const char *path, const char *query, const char *method,
@@ -188,9 +742,12 @@ int cache_extract_request_info(const char *request_buffer, char *method_out, siz
 // Process response headers: parse status, content-type, content-length, chunked
 // Initialize cache buffer if response should be cached
 // Returns: 0 on success, -1 on error
+// Admitted responses are published right away so other requests can attach
+// The TTL comes from the origin's freshness headers; default_ttl applies when it sends none
 int cache_process_response_headers(const char *header_buf, int header_len, int body_len,
                                  const char *method, cache_key_info_t *key_info,
                                  cache_buffer_t *buf, uint32_t max_object_bytes,
+                                 uint32_t default_ttl,
                                  uint32_t *status_code_out, long long *content_length_out,
                                  int *is_chunked_out);
 
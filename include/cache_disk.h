@@ -0,0 +1,136 @@
+#ifndef CACHE_DISK_H
+#define CACHE_DISK_H
+
+#include <windows.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_DISK_SEGMENT_BYTES (64ULL * 1024ULL * 1024ULL)
+#define CACHE_DISK_MIN_SEGMENTS 2
+#define CACHE_DISK_MAX_SEGMENTS 1024
+#define CACHE_DISK_INDEX_SHARDS 64
+#define CACHE_DISK_BUCKETS_PER_SHARD 4096
+#define CACHE_DISK_RECORD_MAGIC 0x4B534443u
+#define CACHE_DISK_DEFAULT_MAX_OBJECT_BYTES (32U * 1024U * 1024U)
+#define CACHE_DISK_MAX_HEADER_BYTES (32U * 1024U)   // larger origin headers aren't kept
+
+struct cache_value_s;
+
+// Location of one object inside the segment log
+typedef struct cache_disk_item_s {
+    uint32_t segment;
+    uint32_t generation;
+    uint64_t offset;        // of the body; the stored header ends here
+    uint32_t body_len;
+    uint32_t header_len;    // stored origin header (cache_value_t.header), 0 if none
+    uint32_t status_code;
+    uint32_t expires_at;
+    uint32_t age_base;
+    int compressible;
+    uint64_t range_total;   // full object length when this is one range slice
+    char content_type[64];
+    char etag[64];
+    char last_modified[64];
+} cache_disk_item_t;
+
+// On-disk record header, followed by header_len bytes of origin header and
+// body_len bytes of body
+typedef struct cache_disk_record_s {
+    uint32_t magic;
+    uint32_t status_code;
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    uint32_t expires_at;
+    uint32_t body_len;
+    uint64_t range_total;
+    char content_type[64];
+    uint32_t header_len;
+    uint32_t age_base;
+    uint32_t compressible;
+    char etag[64];
+    char last_modified[64];
+} cache_disk_record_t;
+
+// Object being written into a span reserved for it in the segment log. The segment
+// is held like a send while the writer is open, so the ring never wraps onto it
+typedef struct cache_disk_writer_s {
+    cache_disk_record_t rec;
+    uint32_t segment;
+    uint32_t generation;
+    uint64_t offset;        // of the record header; the origin header and body follow it
+    uint64_t written;       // body bytes so far
+    int active;
+} cache_disk_writer_t;
+
+typedef struct cache_disk_node_s {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    cache_disk_item_t item;
+    struct cache_disk_node_s *hnext;
+} cache_disk_node_t;
+
+typedef struct cache_disk_index_shard_s {
+    SRWLOCK lock;
+    cache_disk_node_t **buckets;
+    uint32_t nbuckets;
+    uint64_t items;
+} cache_disk_index_shard_t;
+
+// Key written into a segment, so a wrap drops just that segment's index nodes
+typedef struct cache_disk_key_s {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+} cache_disk_key_t;
+
+typedef struct cache_disk_segment_s {
+    HANDLE handle;
+    volatile LONG generation;
+    volatile LONG readers;  // sends and open writers; the ring skips the segment while any remain
+    uint64_t write_offset;
+    cache_disk_key_t *keys; // written since the segment was last reused; under write_lock
+    uint32_t nkeys;
+    uint32_t keys_cap;
+} cache_disk_segment_t;
+
+int cache_disk_init(const char *dir, uint64_t max_bytes, uint32_t max_object_bytes);
+void cache_disk_shutdown(void);
+int cache_disk_is_enabled(void);
+uint32_t cache_disk_max_object_bytes(void);
+
+// Append the complete val (origin header, validators and body) to the segment log
+// and index it (replaces older copy of same key)
+int cache_disk_put(uint64_t key_hash, const char *fingerprint, const struct cache_value_s *val);
+
+// Streamed variant of cache_disk_put: begin stores val's header and reserves room for
+// body_len bytes, write appends them, and commit indexes the object once all of them
+// are written. A writer that is not committed must be abandoned. Each returns 0 on
+// success, -1 otherwise
+int cache_disk_begin(cache_disk_writer_t *w, uint64_t key_hash, const char *fingerprint,
+                     const struct cache_value_s *val, uint32_t body_len);
+int cache_disk_write(cache_disk_writer_t *w, const void *data, size_t len);
+int cache_disk_commit(cache_disk_writer_t *w);
+void cache_disk_abandon(cache_disk_writer_t *w);
+
+// Returns 0 and fills out if a fresh copy of the key is on disk, -1 otherwise
+int cache_disk_lookup(uint64_t key_hash, const char *fingerprint, cache_disk_item_t *out);
+
+// Copy the item's stored origin header into out (item->header_len bytes)
+// Returns: 0 on success, -1 if the item was overwritten or has none
+int cache_disk_read_header(const cache_disk_item_t *item, char *out, size_t out_size);
+
+// Send header + body to the client (TransmitFile for plain sockets, read loop for TLS)
+// Returns: 0 on success, -1 if the item was overwritten or sending failed
+int cache_disk_send(void *client_fd, void *ssl, const cache_disk_item_t *item);
+
+// Send head, body bytes [offset, offset + len) and tail (head/tail may be NULL)
+// Returns: 0 on success, -1 if the item was overwritten or sending failed
+int cache_disk_send_span(void *client_fd, void *ssl, const cache_disk_item_t *item,
+                         const char *head, int head_len, uint64_t offset, uint64_t len,
+                         const char *tail, int tail_len);
+
+// Returns 0 if a copy was dropped, -1 if none was indexed
+int cache_disk_invalidate(uint64_t key_hash, const char *fingerprint);
+
+void cache_disk_get_metrics(uint64_t *hits, uint64_t *misses, uint64_t *items, uint64_t *bytes_written);
+
+#endif
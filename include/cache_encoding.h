@@ -0,0 +1,27 @@
+#ifndef CACHE_ENCODING_H
+#define CACHE_ENCODING_H
+
+#include "cache.h"
+#include <stdint.h>
+
+#define CACHE_GZIP_MIN_BYTES 1024
+#define CACHE_GZIP_LEVEL 6
+// A variant must save at least 1/CACHE_GZIP_MIN_SAVING of the body to be kept
+#define CACHE_GZIP_MIN_SAVING 10
+
+// CACHE_ENCODING_* the request's Accept-Encoding allows (q=0 excludes a coding)
+uint32_t cache_parse_accept_encoding(const char *request_buffer);
+
+// text/*, JSON, JavaScript, XML, SVG and similar
+int cache_content_type_compressible(const char *content_type);
+
+// Build val's gzip variant on the worker pool once its body is complete
+// Returns 0 if queued, -1 if not eligible, already built or queueing failed
+int cache_gzip_schedule(uint64_t key_hash, const char *fingerprint, cache_value_t *val);
+
+// Count a hit served from a compressed variant (saved = identity - encoded bytes)
+void cache_encoding_record_hit(uint64_t saved);
+
+void cache_encoding_get_metrics(uint64_t *variants, uint64_t *compressed_hits, uint64_t *bytes_saved);
+
+#endif
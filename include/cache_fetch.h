@@ -0,0 +1,55 @@
+#ifndef CACHE_FETCH_H
+#define CACHE_FETCH_H
+
+#include "cache.h"
+#include <stdint.h>
+
+// Background fetches (stale refresh, prefetch, warming) run on their own small pool,
+// never on the client workers; a full queue drops the job
+#define CACHE_FETCH_WORKERS 4
+#define CACHE_FETCH_QUEUE_MAX 256
+
+// Origin fetch that fills the cache without a client attached
+// (background refresh of stale entries, revalidated with their ETag/Last-Modified)
+typedef struct cache_fetch_req_s {
+    char backend_host[256];
+    int backend_port;
+    int is_https;
+    char host[256];
+    char path[512];
+    char query[512];
+    cache_key_info_t key_info;
+    uint32_t ttl_seconds;   // default when the origin sends no freshness headers
+    uint32_t max_object_bytes;
+    cache_value_t *stale;   // value being refreshed (own reference), may be NULL
+} cache_fetch_req_t;
+
+// Fetch from origin and store the response; returns 0 if it was cached
+int cache_fetch_run(cache_fetch_req_t *req);
+
+// Fetch one CACHE_RANGE_SLICE_BYTES slice of the object with a Range request and
+// store it under the slice key (if the origin allows). Returns the slice with its
+// own reference, or NULL if the origin did not answer with a 206 for it
+cache_value_t *cache_fetch_slice(const cache_fetch_req_t *req, uint32_t slice,
+                                 uint64_t slice_hash, const char *slice_fp);
+
+// Answer a single "N-" / "N-M" range of an object that is not cached, from cached
+// slices plus slices filled from origin, so seeks never pull the whole file.
+// Records request metrics. Returns: 1 if served, 0 if not applicable (nothing sent),
+//          -1 if the response broke off midway (connection must be dropped)
+int cache_fetch_serve_range(void *client_fd, void *ssl, const cache_fetch_req_t *req,
+                            const cache_range_t *range, const char *method,
+                            uint64_t bytes_in, uint64_t *bytes_out);
+
+void cache_fetch_start(void);
+void cache_fetch_stop(void);
+
+// Queue task(arg) on the background pool
+// Returns 0 if queued, -1 if the pool is full or not running
+int cache_fetch_submit(void (*task)(void *), void *arg);
+
+// Queue a refresh of a stale value on the background pool; at most one per value
+// Returns 0 if queued, -1 if a refresh is already running or queueing failed
+int cache_fetch_refresh_async(const cache_fetch_req_t *req, cache_value_t *stale);
+
+#endif
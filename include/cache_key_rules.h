@@ -0,0 +1,58 @@
+#ifndef CACHE_KEY_RULES_H
+#define CACHE_KEY_RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_KEY_MAX_NAMES 16       // per list; later names are ignored
+#define CACHE_KEY_NAMES_BYTES 512
+
+// Device classes a User-Agent collapses to
+#define CACHE_DEVICE_DESKTOP 0
+#define CACHE_DEVICE_MOBILE  1
+#define CACHE_DEVICE_TABLET  2
+
+typedef struct {
+    uint16_t off;               // into cache_key_rules_t.names
+    uint8_t len;
+    uint8_t prefix;             // "utm_*": matches every name starting with the len bytes
+} cache_key_name_t;
+
+typedef struct {
+    cache_key_name_t names[CACHE_KEY_MAX_NAMES];
+    uint32_t count;
+} cache_key_list_t;
+
+// How one route policy builds its cache keys, compiled from the policy's
+// comma lists when the routes are loaded
+typedef struct cache_key_rules_s {
+    cache_key_list_t drop_params;   // query parameters left out of the key
+    cache_key_list_t keep_params;   // when any: the only parameters kept
+    cache_key_list_t headers;       // request headers whose values split the key
+    cache_key_list_t cookies;       // cookies whose values split the key
+    int fold_path;                  // the key uses the lowercased path
+    int device_class;               // User-Agent splits the key by CACHE_DEVICE_*
+    int active;                     // any of the above is set
+    uint32_t names_len;
+    char names[CACHE_KEY_NAMES_BYTES];
+} cache_key_rules_t;
+
+// Compiles "utm_*,fbclid" style lists (any may be NULL). Header names match
+// case-insensitively, parameter and cookie names exactly. Returns -1 if a list
+// had more names than fit; the ones that fit are kept
+int cache_key_rules_compile(cache_key_rules_t *rules, const char *drop_params, const char *keep_params,
+                            const char *headers, const char *cookies, int fold_path, int device_class);
+
+// Key inputs of a request under rules (NULL: path and query as they are, no vary):
+// the path, the query with only the kept parameters, and the selected header,
+// cookie and device values ("h:accept-language=de|c:currency=EUR|d:1").
+// Returns 0, or -1 if an output was too small
+int cache_key_rules_apply(const cache_key_rules_t *rules, const char *request_buffer,
+                          const char *path, const char *query,
+                          char *path_out, size_t path_size, char *query_out, size_t query_size,
+                          char *vary_out, size_t vary_size);
+
+// CACHE_DEVICE_* of a User-Agent value
+int cache_device_class(const char *user_agent);
+
+#endif
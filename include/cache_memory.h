@@ -0,0 +1,22 @@
+#ifndef CACHE_MEMORY_H
+#define CACHE_MEMORY_H
+
+#include <stdint.h>
+
+#define CACHE_MEMORY_INTERVAL_MS 1000
+#define CACHE_MEMORY_LOAD_PCT 95         // system memory load at which the budget backs off
+#define CACHE_MEMORY_BACKOFF_PCT 80      // share of the budget kept per interval while it does
+#define CACHE_MEMORY_GROW_PCT 5          // of the configured size regained per interval at most
+#define CACHE_MEMORY_MIN_DIV 8           // default floor: the configured size over this
+
+// Resize the RAM cache budget between min_bytes (0 = default floor) and its configured size
+// so the process commit stays under target_pct of its memory limit: limit_bytes, else the
+// job object's memory limit, else none (system memory pressure alone shrinks it)
+int cache_memory_start(uint64_t limit_bytes, uint32_t target_pct, uint64_t min_bytes);
+void cache_memory_stop(void);
+
+// Current and configured budget, process commit, the limit in use, and times the budget shrank
+void cache_memory_get_metrics(uint64_t *budget, uint64_t *ceiling, uint64_t *commit,
+                              uint64_t *limit, uint64_t *shrinks);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CACHE_PREFETCH_H
+#define CACHE_PREFETCH_H
+
+#include "cache_fetch.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_PREFETCH_PAGES 1024        // pages remembered, direct-mapped by host + path
+#define CACHE_PREFETCH_LOCKS 64
+#define CACHE_PREFETCH_LINKS 8           // sub-resources remembered per page
+#define CACHE_PREFETCH_TARGET_MAX 256    // longer sub-resource URLs are not learned
+#define CACHE_PREFETCH_MIN_HITS 2        // references before a sub-resource is warmed
+#define CACHE_PREFETCH_DECAY_SEC 600     // a page's counts halve this often, so old links fade
+
+// Prefetching is off until configured with max_inflight > 0; per_sec caps fetches started per second
+void cache_prefetch_configure(uint32_t max_inflight, uint32_t per_sec);
+
+// Whether the request is a page navigation (or frame) rather than a sub-resource fetch
+int cache_prefetch_is_navigation(const char *request_buffer);
+
+// Path of the same-host Referer page of a sub-resource request into page_out; 0 if it has one
+int cache_prefetch_referer(const char *request_buffer, const char *host,
+                           char *page_out, size_t page_size);
+
+// Learn that page pulled in path?query. Only call once the sub-resource was stored or served
+// from cache, so clients can't plant arbitrary URLs for the prefetcher to fetch
+void cache_prefetch_observe(const char *host, const char *page, const char *path, const char *query);
+
+// Learn the rel=preload targets of a page's Link response headers; returns how many
+int cache_prefetch_learn_links(const char *host, const char *page,
+                               const char *header, const char *hdr_end);
+
+// Sub-resources ("path?query") worth warming after a miss on page, most referenced first
+int cache_prefetch_links(const char *host, const char *page,
+                         char out[][CACHE_PREFETCH_TARGET_MAX], int max_out);
+
+// Fill req on the background fetch pool unless it is cached or over the concurrency
+// or rate limit; the job is dropped if the key is being filled when it starts.
+// Returns 0 if queued
+int cache_prefetch_submit(const cache_fetch_req_t *req);
+
+void cache_prefetch_get_metrics(uint64_t *queued, uint64_t *stored, uint64_t *dropped);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CACHE_SNAPSHOT_H
+#define CACHE_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define CACHE_SNAPSHOT_MAGIC 0x50534350u   // "PCSP"
+#define CACHE_SNAPSHOT_VERSION 5
+#define CACHE_SNAPSHOT_RECORD_MAGIC 0x52534350u
+#define CACHE_SNAPSHOT_MAX_HEADER_BYTES 65536
+#define CACHE_SNAPSHOT_MAX_URL_BYTES 2048
+
+typedef struct cache_snapshot_file_header_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t created_at;
+    uint32_t count;
+} cache_snapshot_file_header_t;
+
+// One entry, followed by ntags purge tags, url_len bytes of URL, header_len bytes
+// of stored header, body_len bytes of body and gz_len bytes of gzip variant
+typedef struct cache_snapshot_record_s {
+    uint32_t magic;
+    uint32_t status_code;
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    uint32_t expires_at;
+    uint32_t age_base;
+    uint32_t stale_while_revalidate;
+    uint32_t stale_if_error;
+    uint32_t compressible;
+    uint32_t header_len;
+    uint32_t body_len;
+    uint32_t gz_len;
+    uint32_t ntags;
+    uint32_t url_len;
+    uint64_t range_total;
+    char content_type[64];
+    char etag[64];
+    char last_modified[64];
+} cache_snapshot_record_t;
+
+// Write the hottest fresh entries (up to max_bytes of payload) to path, atomically
+int cache_snapshot_save(const char *path, uint64_t max_bytes);
+
+// Load a snapshot into the cache, skipping expired entries
+// Returns the number of entries restored, -1 if the file is missing or of another version
+int cache_snapshot_load(const char *path);
+
+// URLs of the snapshot's entries on host, hottest first, at most max_urls. Returns
+// the count and a malloc'ed array of malloc'ed strings, or -1 if the file is unusable
+int cache_snapshot_urls(const char *path, const char *host, uint32_t max_urls, char ***urls_out);
+
+// Periodic background snapshots; stop writes a final one
+int cache_snapshot_start(const char *path, uint32_t interval_sec, uint64_t max_bytes);
+void cache_snapshot_stop(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef CACHE_WARM_H
+#define CACHE_WARM_H
+
+#include "cache_fetch.h"
+#include <stdint.h>
+
+#define CACHE_WARM_MAX_JOBS 16           // running and finished jobs kept for status
+#define CACHE_WARM_MAX_URLS 100000       // per job
+#define CACHE_WARM_MAX_URL_LEN 2048
+#define CACHE_WARM_MAX_BODY (4 * 1024 * 1024)   // URL list of one WARM request
+#define CACHE_WARM_MAX_ORIGINS 64        // origins with fetches in flight at once
+#define CACHE_WARM_IDLE_MS 50
+
+// Fetch request for url ("/path?query") on host as a client on https (or http)
+// would key it; -1 if the URL can't be fetched in the background
+typedef int (*cache_warm_build_fn)(const char *host, const char *url, int https, cache_fetch_req_t *req);
+
+// per_sec: fetches started per second (0 = unlimited); per_origin: in flight per backend
+void cache_warm_configure(uint32_t per_sec, uint32_t per_origin, cache_warm_build_fn build);
+
+// Queue a job over urls ("https://host/path?query"), which the warmer takes over
+// either way. Returns the job id, or -1 if every job slot is still running
+int cache_warm_start(const char *host, char **urls, uint32_t count);
+
+// WARM authorized by cache_admin_authorized(): "WARM /" with one URL or path per
+// body line, or an "X-Warm-Top: N" header for the N hottest URLs of host in the snapshot;
+// "WARM /status" reports the host's jobs. Always responds; returns 1
+int cache_handle_warm(void *client_fd, void *ssl, const char *request_buffer, int received,
+                      const char *host, const char *path, int is_https,
+                      const char *client_ip, const char *token, const char *snapshot_path);
+
+void cache_warm_stop(void);
+
+#endif
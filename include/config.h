@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #define MAX_HOST_LEN 64
+#define MAX_CACHE_STATUS_RULES 8
 
 typedef struct {
     char listen_host[MAX_HOST_LEN];
@@ -30,6 +31,43 @@ typedef struct {
     unsigned int cache_default_ttl_sec;
     unsigned int cache_max_object_bytes;
     unsigned int cache_second_hit_window;
+    // Disk cache tier
+    int cache_disk_enabled;
+    char cache_disk_dir[260];
+    unsigned long long cache_disk_max_bytes;
+    unsigned int cache_disk_max_object_bytes;
+    // Stale serving defaults (routes may override)
+    unsigned int cache_stale_while_revalidate_sec;
+    unsigned int cache_stale_if_error_sec;
+    // Clamps for origin-derived TTLs (0 = no clamp)
+    unsigned int cache_min_ttl_sec;
+    unsigned int cache_max_ttl_sec;
+    // Non-200 statuses cached by default, one "cache_status = <code> <ttl_sec> <max_bytes>" line each
+    unsigned int cache_status_count;
+    unsigned int cache_status_code[MAX_CACHE_STATUS_RULES];
+    unsigned int cache_status_ttl_sec[MAX_CACHE_STATUS_RULES];
+    unsigned long long cache_status_max_bytes[MAX_CACHE_STATUS_RULES];
+    // Warm restart snapshot (0 bytes = cache_max_bytes)
+    int cache_snapshot_enabled;
+    char cache_snapshot_path[260];
+    unsigned int cache_snapshot_interval_sec;
+    unsigned long long cache_snapshot_max_bytes;
+    // Warming of sub-resources learned per page
+    int cache_prefetch_enabled;
+    unsigned int cache_prefetch_max_inflight;
+    unsigned int cache_prefetch_per_sec;
+    // Operator-triggered WARM jobs: fetches started per second, in flight per backend
+    unsigned int cache_warm_per_sec;
+    unsigned int cache_warm_per_origin;
+    // Memory governor: shrinks the RAM budget to keep commit under target_pct of the limit
+    // (0 bytes = the job object's limit; min 0 = cache_max_bytes / 8)
+    int cache_memory_governor_enabled;
+    unsigned long long cache_memory_limit_bytes;
+    unsigned int cache_memory_target_pct;
+    unsigned long long cache_min_bytes;
+    // Admin requests (PURGE/BAN, WARM) must send X-Purge-Token (empty = none accepted)
+    char cache_purge_token[128];
+    int cache_admin_trust_loopback;     // 1: loopback clients need no token
 } Proxy_Config;
 
 int load_config(const char* filename);
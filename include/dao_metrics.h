@@ -36,6 +36,22 @@ int dao_metrics_insert_route_cache(
     uint64_t byte_miss
 );
 
+// Whole-domain row (route_bucket '*'): summed hits and misses plus the domain's
+// RAM cache occupancy, quota (or fair share) and evictions over the minute
+int dao_metrics_insert_tenant_cache(
+    time_t timestamp,
+    uint64_t domain_id,
+    const char *host,
+    uint64_t hit_count,
+    uint64_t miss_count,
+    uint64_t byte_hit,
+    uint64_t byte_miss,
+    uint64_t bytes_cached,
+    uint64_t entries_cached,
+    uint64_t quota_bytes,
+    uint64_t evictions
+);
+
 uint64_t dao_metrics_lookup_domain_id(const char *host);
 
 uint64_t dao_metrics_lookup_domain_id_by_id(uint64_t domain_id);
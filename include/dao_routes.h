@@ -3,6 +3,8 @@
 
 #include "proxy_routes.h"
 
+// Rows loaded, or -1 if the query failed (e.g. a schema missing its migrations)
 int dao_routes_load_all_into(ProxyRoute *out, int max_out);
+int dao_cache_policies_load_all_into(CachePolicy *out, int max_out);
 
 #endif
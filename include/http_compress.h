@@ -0,0 +1,48 @@
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "cache.h"
+
+#define HTTP_COMPRESS_MIN_BYTES 1024
+#define HTTP_COMPRESS_SAMPLE_MS 1000
+
+// On-the-fly gzip of an uncached origin response on its way to the client
+typedef struct http_compress_s {
+    z_stream zs;
+    int active;
+    int is_chunked;            // origin body is chunked and is decoded first
+    cache_dechunk_t dechunk;
+    void *client_fd;
+    void *ssl;
+    uint64_t bytes_in;         // identity bytes compressed
+    uint64_t bytes_out;        // gzip bytes sent to the client
+} http_compress_t;
+
+// Starts compression when the client accepts gzip and the response is a
+// compressible, uncompressed entity. Returns 1 if active, 0 to relay as is.
+// The gzip level follows CPU load; under heavy load nothing is compressed.
+int http_compress_begin(http_compress_t *c, uint32_t accept_encoding,
+                        const char *resp_header, int header_len, uint32_t status_code,
+                        long long content_length, int is_chunked,
+                        void *client_fd, void *ssl);
+
+// Rewrite the response header for a gzip body delimited by connection close:
+// drops Content-Length/Transfer-Encoding/Accept-Ranges, weakens a strong ETag,
+// and sets Content-Encoding and Vary without repeating the origin's lines
+int http_compress_rewrite_header(const char *in, int in_len, char *out, int out_size);
+
+// Compress and send body bytes as received from origin
+// Returns 0, 1 once a chunked body has ended, -1 on error
+int http_compress_write(http_compress_t *c, const uint8_t *data, size_t len);
+
+// Flush the gzip trailer and account the bytes saved
+int http_compress_finish(http_compress_t *c);
+
+void http_compress_free(http_compress_t *c);
+
+void http_compress_get_metrics(uint64_t *responses, uint64_t *bytes_in, uint64_t *bytes_out);
+
+#endif
@@ -15,4 +15,9 @@ int acme_middleware_handle(SOCKET client_fd, const char *req_buffer, const Proxy
 int detect_backend_protocol(ProxyRoute *rec);
 int get_client_ip(SOCKET fd, char *out, size_t out_len);
 
+// Background fetch of url ("/path?query") on host's route, keyed as a client on
+// https (or http) would key it; -1 if there is no route or the key needs client headers
+struct cache_fetch_req_s;
+int proxy_build_fetch_req(const char *host, const char *url, int https, struct cache_fetch_req_s *req);
+
 #endif
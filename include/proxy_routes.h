@@ -1,14 +1,41 @@
 #ifndef PROXY_ROUTES_H
 #define PROXY_ROUTES_H
 
+#include "cache_key_rules.h"
+
+#define MAX_POLICY_STATUSES 8
+
 typedef struct ProxyRoute {
     char domain[256];
     char backend_host[256];
     int  backend_port;
     int  is_https;
+    int  stale_while_revalidate_sec;  // -1: use config default
+    int  stale_if_error_sec;          // -1: use config default
+    int  cache_ttl_sec;               // > 0: fixed TTL ignoring origin headers
+    unsigned long long cache_quota_bytes;  // > 0: RAM cache cap for the domain
+    int  cache_weight;                // share of the RAM cache, 0: default
+    int  policy_count;                // cache policies loaded for this domain
 } ProxyRoute;
 
+// Cache behaviour for one domain + path prefix (domain_cache_policies)
+typedef struct CachePolicy {
+    char domain[256];
+    char path_prefix[256];            // always ends in '/'
+    int  prefix_len;
+    int  ttl_sec;                     // > 0: fixed TTL, overrides the domain's
+    int  max_object_bytes;            // > 0: lower object size limit
+    int  admission;                   // -1: default, 0: cache on first miss, 1: second-hit admission
+    cache_key_rules_t key_rules;      // compiled from the policy's key columns
+    int  statuses[MAX_POLICY_STATUSES];  // cacheable statuses; none = 200 only
+    int  status_count;
+} CachePolicy;
+
 int load_proxy_routes();
 const ProxyRoute* find_proxy_routes(const char *domain);
 
+// Longest path-prefix policy of the route, NULL if none applies. A path equal to a
+// prefix without its trailing '/' ("/media" for "/media/") matches that prefix
+const CachePolicy* find_cache_policy(const ProxyRoute *route, const char *path);
+
 #endif
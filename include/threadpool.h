@@ -19,6 +19,7 @@ typedef struct {
     int head;
     int tail;
     int task_count;
+    int max_tasks;      // queue bound, at most MAX_TASKS
 
     CRITICAL_SECTION lock;
     CONDITION_VARIABLE cond;
@@ -26,7 +27,8 @@ typedef struct {
 } ThreadPool;
 
 void initThreadPool(ThreadPool *pool, int thread_count);
-void enqueueThreadPool(ThreadPool *pool, void (*func)(void*), void *arg);
+void initThreadPoolBounded(ThreadPool *pool, int thread_count, int max_tasks);
+int enqueueThreadPool(ThreadPool *pool, void (*func)(void*), void *arg);
 void shutdownThreadPool(ThreadPool *pool);
 
 #endif
@@ -1,5 +1,7 @@
 #include "../include/cache.h"
+#include "../include/cache_disk.h"
 #include "../include/logger.h"
+#include <process.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,12 +11,26 @@
 static http_cache_t g_cache;
 static int g_cache_initialized = 0;
 
+// Objects with range slices and how many slice indexes they may have, so a purge probes
+// only those; slices live on the disk tier mostly, out of reach of the RAM tag index
+typedef struct slice_parent_s {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    uint32_t nslices;
+    uint32_t expires_at;      // latest slice expiry; the record is pruned after it
+    struct slice_parent_s *next;
+} slice_parent_t;
+
+static slice_parent_t *g_slice_parents[CACHE_SLICE_PARENT_BUCKETS];
+static SRWLOCK g_slice_parent_locks[CACHE_SLICE_PARENT_LOCKS];
+
 static uint32_t get_current_time(void) {
     return (uint32_t)time(NULL);
 }
 
 // Forward declaration for logging
 static void log_cache_operation(const char *operation, const char *details);
+static unsigned __stdcall evictor_thread_func(void *arg);
 
 static void lru_unlink(cache_shard_t *shard, cache_entry_t *entry) {
     if (!entry) return;
@@ -34,6 +50,20 @@ static void lru_unlink(cache_shard_t *shard, cache_entry_t *entry) {
     
     entry->lru_prev = NULL;
     entry->lru_next = NULL;
+
+    cache_tenant_lru_t *tl = &shard->tenant_lru[entry->tenant];
+    if (entry->tenant_prev) {
+        entry->tenant_prev->tenant_next = entry->tenant_next;
+    } else {
+        tl->head = entry->tenant_next;
+    }
+    if (entry->tenant_next) {
+        entry->tenant_next->tenant_prev = entry->tenant_prev;
+    } else {
+        tl->tail = entry->tenant_prev;
+    }
+    entry->tenant_prev = NULL;
+    entry->tenant_next = NULL;
 }
 
 static void lru_add_to_head(cache_shard_t *shard, cache_entry_t *entry) {
@@ -49,6 +79,17 @@ static void lru_add_to_head(cache_shard_t *shard, cache_entry_t *entry) {
     }
     
     shard->lru_head = entry;
+    entry->last_access = GetTickCount();
+
+    cache_tenant_lru_t *tl = &shard->tenant_lru[entry->tenant];
+    entry->tenant_prev = NULL;
+    entry->tenant_next = tl->head;
+    if (tl->head) {
+        tl->head->tenant_prev = entry;
+    } else {
+        tl->tail = entry;
+    }
+    tl->head = entry;
 }
 
 static void lru_promote(cache_shard_t *shard, cache_entry_t *entry) {
@@ -59,73 +100,165 @@ static void lru_promote(cache_shard_t *shard, cache_entry_t *entry) {
     lru_add_to_head(shard, entry);
 }
 
-static cache_entry_t *lru_pop_tail(cache_shard_t *shard) {
-    cache_entry_t *tail = shard->lru_tail;
-    if (tail) {
-        lru_unlink(shard, tail);
-    }
-    return tail;
-}
-
 static cache_entry_t *hash_table_find(cache_shard_t *shard, 
                                       uint64_t key_hash,
                                       const char *fingerprint) {
     if (!shard || !fingerprint) return NULL;
-    
-    uint32_t bucket_idx = (uint32_t)(key_hash % shard->nbuckets);
-    cache_entry_t *entry = shard->buckets[bucket_idx];
-    
-    while (entry) {
-        if (entry->key_hash == key_hash && 
-            memcmp(entry->key_fingerprint, fingerprint, 16) == 0) {
-            return entry;
+    return cache_index_find(&shard->index, key_hash, fingerprint);
+}
+
+static cache_tag_t *tag_find(cache_shard_t *shard, uint64_t tag_hash, int create) {
+    cache_tag_t **bucket = &shard->tag_buckets[(tag_hash >> 6) % shard->ntag_buckets];
+    for (cache_tag_t *t = *bucket; t; t = t->hnext) {
+        if (t->tag_hash == tag_hash) return t;
+    }
+    if (!create) return NULL;
+
+    cache_tag_t *t = (cache_tag_t *)calloc(1, sizeof(cache_tag_t));
+    if (!t) return NULL;
+    t->tag_hash = tag_hash;
+    t->hnext = *bucket;
+    *bucket = t;
+    return t;
+}
+
+static void tag_drop(cache_shard_t *shard, cache_tag_t *tag) {
+    cache_tag_t **pp = &shard->tag_buckets[(tag->tag_hash >> 6) % shard->ntag_buckets];
+    while (*pp && *pp != tag) pp = &(*pp)->hnext;
+    if (*pp) *pp = tag->hnext;
+    free(tag);
+}
+
+// Caller holds the shard lock. A tag that cannot be indexed only makes purges miss it
+static void entry_link_tags(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_value_t *val = entry->val;
+    if (!val || val->ntags == 0 || !shard->tag_buckets) return;
+
+    entry->tag_members = (cache_tag_member_t **)calloc(val->ntags, sizeof(cache_tag_member_t *));
+    if (!entry->tag_members) return;
+
+    for (uint32_t i = 0; i < val->ntags; i++) {
+        cache_tag_t *tag = tag_find(shard, val->tags[i], 1);
+        cache_tag_member_t *m = tag ? (cache_tag_member_t *)malloc(sizeof(cache_tag_member_t)) : NULL;
+        if (!m) continue;
+        m->tag = tag;
+        m->entry = entry;
+        m->prev = NULL;
+        m->next = tag->members;
+        if (tag->members) tag->members->prev = m;
+        tag->members = m;
+        tag->count++;
+        entry->tag_members[entry->ntags++] = m;
+    }
+}
+
+static void entry_unlink_tags(cache_shard_t *shard, cache_entry_t *entry) {
+    for (uint32_t i = 0; i < entry->ntags; i++) {
+        cache_tag_member_t *m = entry->tag_members[i];
+        cache_tag_t *tag = m->tag;
+        if (m->prev) {
+            m->prev->next = m->next;
+        } else {
+            tag->members = m->next;
         }
-        entry = entry->hnext;
+        if (m->next) m->next->prev = m->prev;
+        if (--tag->count == 0) tag_drop(shard, tag);
+        free(m);
     }
-    
-    return NULL;
+    free(entry->tag_members);
+    entry->tag_members = NULL;
+    entry->ntags = 0;
 }
 
-static void hash_table_remove(cache_shard_t *shard, cache_entry_t *entry) {
-    if (!shard || !entry) return;
-    
-    uint32_t bucket_idx = (uint32_t)(entry->key_hash % shard->nbuckets);
-    cache_entry_t **bucket = &shard->buckets[bucket_idx];
-    
-    cache_entry_t *prev = NULL;
-    cache_entry_t *curr = *bucket;
-    
-    while (curr) {
-        if (curr == entry) {
-            if (prev) {
-                prev->hnext = entry->hnext;
-            } else {
-                *bucket = entry->hnext;
-            }
-            entry->hnext = NULL;
-            return;
+// Expiry heap: entries ordered by sweep_at, each knowing its slot for O(log n) removal
+static void heap_set(cache_shard_t *shard, uint32_t i, cache_entry_t *entry) {
+    shard->expiry_heap[i] = entry;
+    entry->heap_slot = i + 1;
+}
+
+static void heap_sift_up(cache_shard_t *shard, uint32_t i) {
+    cache_entry_t *entry = shard->expiry_heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (shard->expiry_heap[parent]->sweep_at <= entry->sweep_at) break;
+        heap_set(shard, i, shard->expiry_heap[parent]);
+        i = parent;
+    }
+    heap_set(shard, i, entry);
+}
+
+static void heap_sift_down(cache_shard_t *shard, uint32_t i) {
+    cache_entry_t *entry = shard->expiry_heap[i];
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= shard->expiry_count) break;
+        if (child + 1 < shard->expiry_count &&
+            shard->expiry_heap[child + 1]->sweep_at < shard->expiry_heap[child]->sweep_at) {
+            child++;
         }
-        prev = curr;
-        curr = curr->hnext;
+        if (entry->sweep_at <= shard->expiry_heap[child]->sweep_at) break;
+        heap_set(shard, i, shard->expiry_heap[child]);
+        i = child;
+    }
+    heap_set(shard, i, entry);
+}
+
+static void expiry_remove(cache_shard_t *shard, cache_entry_t *entry) {
+    if (!entry->heap_slot) return;
+    uint32_t i = entry->heap_slot - 1;
+    entry->heap_slot = 0;
+
+    cache_entry_t *last = shard->expiry_heap[--shard->expiry_count];
+    if (i == shard->expiry_count) return;
+    heap_set(shard, i, last);
+    heap_sift_up(shard, i);
+    heap_sift_down(shard, last->heap_slot - 1);
+}
+
+// Queues or requeues entry at sweep_at. An entry that cannot be queued is still
+// removed lazily by cache_get_key()
+static void expiry_schedule(cache_shard_t *shard, cache_entry_t *entry, uint32_t sweep_at) {
+    entry->sweep_at = sweep_at;
+    if (entry->heap_slot) {
+        heap_sift_up(shard, entry->heap_slot - 1);
+        heap_sift_down(shard, entry->heap_slot - 1);
+        return;
+    }
+
+    if (shard->expiry_count == shard->expiry_cap) {
+        uint32_t cap = shard->expiry_cap ? shard->expiry_cap * 2 : 256;
+        cache_entry_t **grown = (cache_entry_t **)realloc(shard->expiry_heap, cap * sizeof(cache_entry_t *));
+        if (!grown) return;
+        shard->expiry_heap = grown;
+        shard->expiry_cap = cap;
     }
+    heap_set(shard, shard->expiry_count, entry);
+    shard->expiry_count++;
+    heap_sift_up(shard, shard->expiry_count - 1);
 }
 
-static void hash_table_add(cache_shard_t *shard, cache_entry_t *entry) {
+static void hash_table_remove(cache_shard_t *shard, cache_entry_t *entry) {
     if (!shard || !entry) return;
-    
-    uint32_t bucket_idx = (uint32_t)(entry->key_hash % shard->nbuckets);
-    entry->hnext = shard->buckets[bucket_idx];
-    shard->buckets[bucket_idx] = entry;
+
+    expiry_remove(shard, entry);
+    entry_unlink_tags(shard, entry);
+    cache_index_remove(&shard->index, entry);
+    entry->hnext = NULL;
+    cache_l1_invalidate(cache_key_to_shard(entry->key_hash));
+}
+
+static int hash_table_add(cache_shard_t *shard, cache_entry_t *entry) {
+    if (!shard || !entry) return -1;
+    return cache_index_insert(&shard->index, entry);
 }
-static int init_cache_shard(cache_shard_t *shard, uint32_t nbuckets) {
+
+static int init_cache_shard(cache_shard_t *shard, uint32_t nslots) {
     if (!shard) return -1;
     
     memset(shard, 0, sizeof(cache_shard_t));
     InitializeSRWLock(&shard->lock);
     
-    shard->nbuckets = nbuckets;
-    shard->buckets = (cache_entry_t **)calloc(nbuckets, sizeof(cache_entry_t *));
-    if (!shard->buckets) {
+    if (cache_index_init(&shard->index, nslots) != 0) {
         return -1;
     }
     
@@ -137,10 +270,238 @@ static int init_cache_shard(cache_shard_t *shard, uint32_t nbuckets) {
     shard->evictions = 0;
     shard->byte_hits = 0;
     shard->byte_misses = 0;
+
+    shard->ntag_buckets = CACHE_TAG_BUCKETS_PER_SHARD;
+    shard->tag_buckets = (cache_tag_t **)calloc(shard->ntag_buckets, sizeof(cache_tag_t *));
+    shard->tenant_lru = (cache_tenant_lru_t *)calloc(CACHE_MAX_TENANTS, sizeof(cache_tenant_lru_t));
+    if (!shard->tag_buckets || !shard->tenant_lru) {
+        free(shard->tag_buckets);
+        free(shard->tenant_lru);
+        shard->tag_buckets = NULL;
+        shard->tenant_lru = NULL;
+        cache_index_free(&shard->index);
+        return -1;
+    }
     
     return 0;
 }
 
+cache_value_t *cache_value_create(uint32_t status_code, const char *content_type,
+                                  long long content_length) {
+    cache_value_t *val = (cache_value_t *)calloc(1, sizeof(cache_value_t));
+    if (!val) return NULL;
+
+    val->body = cache_body_create();
+    if (!val->body) {
+        free(val);
+        return NULL;
+    }
+
+    if (content_length > 0) cache_body_expect(val->body, (uint64_t)content_length);
+    // Counts against the budget while it fills; its entry takes the charge over at commit
+    cache_body_account(val->body, &g_cache.fill_bytes);
+    val->status_code = status_code;
+    val->content_length = content_length;
+    strncpy(val->content_type, content_type ? content_type : "text/plain",
+            sizeof(val->content_type) - 1);
+    val->content_type[sizeof(val->content_type) - 1] = '\0';
+    val->refcnt = 1;
+    return val;
+}
+
+void cache_value_acquire(cache_value_t *val) {
+    if (!val) return;
+    InterlockedIncrement(&val->refcnt);
+}
+
+void cache_value_release(cache_value_t *val) {
+    if (!val || cache_l1_absorb(val)) return;
+    cache_value_release_refs(val, 1);
+}
+
+void cache_value_release_refs(cache_value_t *val, LONG n) {
+    if (!val || n <= 0) return;
+    if (InterlockedExchangeAdd(&val->refcnt, -n) == n) {
+        cache_body_account(val->body, NULL);
+        if (val->content) {
+            if (val->body != val->content->body) cache_body_free(val->body);
+            uint64_t freed = cache_content_release(val->content);
+            if (freed) InterlockedExchangeAdd64(&g_cache.bytes_used, -(LONG64)freed);
+        } else {
+            cache_body_free(val->body);
+        }
+        cache_body_free(val->gz_body);
+        free(val->header);
+        free(val->tags);
+        free(val->url);
+        free(val);
+    }
+}
+
+// Drops the cache's reference; readers still streaming the value keep it alive
+static void free_entry(cache_entry_t *entry) {
+    if (!entry) return;
+    free(entry->tag_members);
+    cache_value_release(entry->val);
+    free(entry);
+}
+
+static uint32_t stale_grace(const cache_value_t *val) {
+    return val->stale_while_revalidate > val->stale_if_error ?
+           val->stale_while_revalidate : val->stale_if_error;
+}
+
+static uint32_t value_sweep_at(const cache_value_t *val) {
+    uint32_t grace = stale_grace(val);
+    return val->expires_at > UINT32_MAX - grace ? UINT32_MAX : val->expires_at + grace;
+}
+
+// Heap of a committed body; one still filling is not charged to its entry yet
+static uint64_t body_charge(const cache_value_t *val, const cache_body_t *body) {
+    return val->body_len ? cache_body_bytes(body) : 0;
+}
+
+// A shared body is charged once, by the content store, not per entry
+static uint64_t entry_charge(const cache_entry_t *entry) {
+    uint64_t size = sizeof(cache_entry_t) + sizeof(cache_value_t);
+    const cache_value_t *val = entry->val;
+    if (val) {
+        size += val->header_len + cache_body_bytes(val->gz_body);
+        if (!val->content || val->body != val->content->body) size += body_charge(val, val->body);
+    }
+    return size;
+}
+
+// What the entry's tenant is charged: its shared body too, so dedup does not change quotas
+static uint64_t entry_tenant_charge(const cache_entry_t *entry) {
+    uint64_t size = entry_charge(entry);
+    const cache_value_t *val = entry->val;
+    if (val && val->content && val->body == val->content->body) size += body_charge(val, val->body);
+    return size;
+}
+
+static int status_rule_index(uint32_t status_code) {
+    for (uint32_t i = 0; i < g_cache.nstatus_rules; i++) {
+        if (g_cache.status_rules[i].status_code == status_code) return (int)i;
+    }
+    return -1;
+}
+
+static int entry_status_rule(const cache_entry_t *entry) {
+    return entry->val && entry->val->status_code != 200 ? status_rule_index(entry->val->status_code) : -1;
+}
+
+static void shard_charge(cache_shard_t *shard, const cache_entry_t *entry) {
+    uint64_t size = entry_charge(entry);
+    shard->bytes_used += size;
+    InterlockedExchangeAdd64(&g_cache.bytes_used, (LONG64)size);
+    int rule = entry_status_rule(entry);
+    if (rule >= 0) InterlockedExchangeAdd64(&g_cache.status_bytes[rule], (LONG64)size);
+    cache_tenant_charge(entry->tenant, (int64_t)entry_tenant_charge(entry), 1);
+}
+
+static void shard_uncharge(cache_shard_t *shard, const cache_entry_t *entry) {
+    uint64_t size = entry_charge(entry);
+    int rule = entry_status_rule(entry);
+    if (rule >= 0) InterlockedExchangeAdd64(&g_cache.status_bytes[rule], -(LONG64)size);
+    cache_tenant_charge(entry->tenant, -(int64_t)entry_tenant_charge(entry), -1);
+    if (shard->bytes_used < size) size = shard->bytes_used;
+    shard->bytes_used -= size;
+    InterlockedExchangeAdd64(&g_cache.bytes_used, -(LONG64)size);
+}
+
+static uint64_t global_bytes_used(void) {
+    LONG64 used = InterlockedCompareExchange64(&g_cache.bytes_used, 0, 0) +
+                  InterlockedCompareExchange64(&g_cache.fill_bytes, 0, 0);
+    return used > 0 ? (uint64_t)used : 0;
+}
+
+static uint64_t status_bytes_used(int rule) {
+    LONG64 used = InterlockedCompareExchange64(&g_cache.status_bytes[rule], 0, 0);
+    return used > 0 ? (uint64_t)used : 0;
+}
+
+// The disk tier keeps no origin headers: only what a generated hit header can stand in for
+static int disk_eligible(const cache_value_t *val) {
+    return val->status_code == 200 || val->range_total > 0;
+}
+
+// Complete 200 bodies that stay in RAM go through the content store. Hashing is
+// done before the shard lock is taken; returns 0 if val should be deduplicated
+static int dedup_prepare(const cache_value_t *val, uint64_t *hash, char *fingerprint) {
+    if (val->content || val->status_code != 200 || !val->body || !cache_body_is_complete(val->body)) return -1;
+    if (val->body->len == 0 || val->body->len > CACHE_MAX_OBJECT_BYTES) return -1;
+    cache_content_hash(val->body, hash, fingerprint);
+    return 0;
+}
+
+// Copy of val's metadata over a shared body; takes over the content reference
+static cache_value_t *value_clone(const cache_value_t *val, cache_content_t *content) {
+    cache_value_t *copy = (cache_value_t *)calloc(1, sizeof(cache_value_t));
+    if (!copy) return NULL;
+
+    *copy = *val;
+    copy->body = content->body;
+    copy->content = content;
+    copy->refreshing = 0;
+    copy->gz_body = NULL;
+    copy->gz_len = 0;
+    copy->gz_state = CACHE_VARIANT_NONE;
+    copy->purged = 0;
+    copy->refcnt = 1;
+    copy->header = NULL;
+    copy->tags = NULL;
+    copy->url = NULL;
+    if (val->url) {
+        copy->url = strdup(val->url);
+        if (!copy->url) goto fail;
+    }
+    if (val->header && val->header_len) {
+        copy->header = (char *)malloc(val->header_len);
+        if (!copy->header) goto fail;
+        memcpy(copy->header, val->header, val->header_len);
+    }
+    if (val->tags && val->ntags) {
+        copy->tags = (uint64_t *)malloc(val->ntags * sizeof(uint64_t));
+        if (!copy->tags) goto fail;
+        memcpy(copy->tags, val->tags, val->ntags * sizeof(uint64_t));
+    }
+    return copy;
+
+fail:
+    free(copy->url);
+    free(copy->header);
+    free(copy);
+    return NULL;
+}
+
+// Interns val's body before it is charged to a shard. A new body is adopted by the
+// store and val itself is returned; identical cached bytes give a new value sharing
+// them (returned with one reference), and val keeps its own body for the readers
+// still streaming it. Returns val unchanged if the store cannot take it.
+static cache_value_t *dedup_value(cache_value_t *val, uint64_t hash, const char *fingerprint) {
+    int adopted = 0;
+    uint64_t len = val->body->len;
+    cache_content_t *content = cache_content_intern(hash, fingerprint, val->body, len, &adopted);
+    if (!content) return val;
+
+    if (adopted) {
+        val->content = content;
+        InterlockedExchangeAdd64(&g_cache.bytes_used, (LONG64)cache_body_bytes(val->body));
+        return val;
+    }
+
+    cache_value_t *copy = value_clone(val, content);
+    if (!copy) {
+        cache_content_release(content);
+        return val;
+    }
+    // Lets the gzip variant built from val's own body attach to the copy
+    cache_content_acquire(content);
+    val->content = content;
+    return copy;
+}
+
 static void cleanup_cache_shard(cache_shard_t *shard) {
     if (!shard) return;
     
@@ -148,22 +509,26 @@ static void cleanup_cache_shard(cache_shard_t *shard) {
     cache_entry_t *entry = shard->lru_head;
     while (entry) {
         cache_entry_t *next = entry->lru_next;
-        
-        if (entry->val) {
-            if (entry->val->body) {
-                free(entry->val->body);
-            }
-            free(entry->val);
-        }
-        free(entry);
+        entry_unlink_tags(shard, entry);
+        shard_uncharge(shard, entry);
+        free_entry(entry);
         entry = next;
     }
-    
-    if (shard->buckets) {
-        free(shard->buckets);
-        shard->buckets = NULL;
+    free(shard->tenant_lru);
+    shard->tenant_lru = NULL;
+
+    if (shard->tag_buckets) {
+        free(shard->tag_buckets);
+        shard->tag_buckets = NULL;
     }
     
+    cache_index_free(&shard->index);
+    free(shard->expiry_heap);
+    shard->expiry_heap = NULL;
+    shard->expiry_count = 0;
+    shard->expiry_cap = 0;
+    cache_l1_invalidate((uint32_t)(shard - g_cache.shards));
+    
     ReleaseSRWLockExclusive(&shard->lock);
 }
 
@@ -204,6 +569,25 @@ static void cleanup_second_hit_shard(second_hit_shard_t *shard) {
     ReleaseSRWLockExclusive(&shard->lock);
 }
 
+static void init_inflight_shard(inflight_shard_t *shard) {
+    memset(shard, 0, sizeof(inflight_shard_t));
+    InitializeSRWLock(&shard->lock);
+    InitializeConditionVariable(&shard->done);
+}
+
+static void cleanup_inflight_shard(inflight_shard_t *shard) {
+    AcquireSRWLockExclusive(&shard->lock);
+    inflight_fill_t *fill = shard->fills;
+    while (fill) {
+        inflight_fill_t *next = fill->next;
+        free(fill);
+        fill = next;
+    }
+    shard->fills = NULL;
+    ReleaseSRWLockExclusive(&shard->lock);
+    WakeAllConditionVariable(&shard->done);
+}
+
 int cache_init(uint64_t max_bytes, uint32_t default_ttl, uint32_t second_hit_window) {
     if (g_cache_initialized) {
         log_message("WARN", "Cache already initialized");
@@ -215,9 +599,11 @@ int cache_init(uint64_t max_bytes, uint32_t default_ttl, uint32_t second_hit_win
     g_cache.default_ttl_sec = default_ttl > 0 ? default_ttl : CACHE_DEFAULT_TTL_SEC;
     g_cache.second_hit_window_sec = second_hit_window > 0 ? second_hit_window : CACHE_DEFAULT_SECOND_HIT_WINDOW;
     g_cache.enabled = 1;
+    g_cache.high_watermark = g_cache.max_bytes / 100 * CACHE_EVICT_HIGH_PCT;
+    g_cache.low_watermark = g_cache.max_bytes / 100 * CACHE_EVICT_LOW_PCT;
 
     for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
-        if (init_cache_shard(&g_cache.shards[i], CACHE_BUCKETS_PER_SHARD) != 0) {
+        if (init_cache_shard(&g_cache.shards[i], CACHE_INDEX_INITIAL_SLOTS) != 0) {
             log_message("ERROR", "Failed to initialize cache shard");
             for (int j = 0; j < i; j++) {
                 cleanup_cache_shard(&g_cache.shards[j]);
@@ -239,8 +625,21 @@ int cache_init(uint64_t max_bytes, uint32_t default_ttl, uint32_t second_hit_win
             return -1;
         }
     }
+
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        init_inflight_shard(&g_cache.inflight[i]);
+    }
     
     g_cache_initialized = 1;
+
+    // Without the evictor, writers evict from their own shard (see shard_enforce_limit_locked)
+    g_cache.evictor_wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (g_cache.evictor_wake) {
+        g_cache.evictor_thread = (HANDLE)_beginthreadex(NULL, 0, evictor_thread_func, NULL, 0, NULL);
+    }
+    if (!g_cache.evictor_thread) {
+        log_message("WARN", "Cache evictor thread not started, evicting inline");
+    }
     
     char log_buf[256];
     snprintf(log_buf, sizeof(log_buf), 
@@ -251,11 +650,52 @@ int cache_init(uint64_t max_bytes, uint32_t default_ttl, uint32_t second_hit_win
     return 0;
 }
 
+int cache_set_status_rules(const cache_status_rule_t *rules, uint32_t count) {
+    if (!g_cache_initialized || (count > 0 && !rules)) return -1;
+    if (count > CACHE_MAX_STATUS_RULES) count = CACHE_MAX_STATUS_RULES;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        // 200 is always cached, 206 never; a repeated status keeps its first rule
+        if (rules[i].status_code < 100 || rules[i].status_code > 599 ||
+            rules[i].status_code == 200 || rules[i].status_code == 206 || rules[i].ttl_sec == 0 ||
+            status_rule_index(rules[i].status_code) >= 0) {
+            continue;
+        }
+        g_cache.status_rules[n++] = rules[i];
+        g_cache.nstatus_rules = n;
+
+        char log_buf[128];
+        snprintf(log_buf, sizeof(log_buf), "Caching status %u: ttl=%u, max_bytes=%llu",
+                 rules[i].status_code, rules[i].ttl_sec, (unsigned long long)rules[i].max_bytes);
+        log_message("INFO", log_buf);
+    }
+    return 0;
+}
+
+const cache_status_rule_t *cache_status_rule(uint32_t status_code) {
+    if (!g_cache_initialized || status_code == 200) return NULL;
+    int rule = status_rule_index(status_code);
+    return rule >= 0 ? &g_cache.status_rules[rule] : NULL;
+}
+
 void cache_shutdown(void) {
     if (!g_cache_initialized) return;
     
     g_cache.enabled = 0;
 
+    if (g_cache.evictor_thread) {
+        InterlockedExchange(&g_cache.evictor_stop, 1);
+        SetEvent(g_cache.evictor_wake);
+        WaitForSingleObject(g_cache.evictor_thread, INFINITE);
+        CloseHandle(g_cache.evictor_thread);
+        g_cache.evictor_thread = NULL;
+    }
+    if (g_cache.evictor_wake) {
+        CloseHandle(g_cache.evictor_wake);
+        g_cache.evictor_wake = NULL;
+    }
+
     for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
         cleanup_cache_shard(&g_cache.shards[i]);
     }
@@ -263,21 +703,23 @@ void cache_shutdown(void) {
     for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
         cleanup_second_hit_shard(&g_cache.hit_trackers[i]);
     }
+
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        cleanup_inflight_shard(&g_cache.inflight[i]);
+    }
+
+    for (int i = 0; i < CACHE_SLICE_PARENT_BUCKETS; i++) {
+        while (g_slice_parents[i]) {
+            slice_parent_t *next = g_slice_parents[i]->next;
+            free(g_slice_parents[i]);
+            g_slice_parents[i] = next;
+        }
+    }
     
     g_cache_initialized = 0;
     log_message("INFO", "Cache shutdown complete");
 }
 
-static void entry_acquire(cache_entry_t *entry) {
-    if (!entry) return;
-    InterlockedIncrement(&entry->refcnt);
-}
-
-void cache_entry_release(cache_entry_t *entry) {
-    if (!entry) return;
-    InterlockedDecrement(&entry->refcnt);
-}
-
 static second_hit_entry_t *tracker_find(second_hit_shard_t *shard,
                                          uint64_t key_hash,
                                          const char *fingerprint) {
@@ -378,15 +820,24 @@ cache_result_t cache_get(const char *method, const char *scheme,
         return CACHE_RESULT_ERROR;
     }
 
-    char key_buf[2048];
-    if (build_cache_key(method, scheme, host, path, query, vary_header, 
-                       key_buf, sizeof(key_buf)) != 0) {
+    uint64_t key_hash;
+    char fingerprint[16];
+    if (cache_key_compute(method, scheme, host, path, query, vary_header, &key_hash, fingerprint) != 0) {
+        return CACHE_RESULT_ERROR;
+    }
+
+    return cache_get_key(key_hash, fingerprint, out);
+}
+
+cache_result_t cache_get_key(uint64_t key_hash, const char *fingerprint, cache_value_t **out) {
+    if (!g_cache_initialized || !g_cache.enabled || !fingerprint || !out) {
         return CACHE_RESULT_ERROR;
     }
 
-    uint64_t key_hash;
-    char fingerprint[16];
-    cache_key_hash(key_buf, &key_hash, fingerprint);
+    // The hottest keys: no shard lock, no LRU or counter writes
+    if (cache_l1_get(key_hash, fingerprint, out)) {
+        return CACHE_RESULT_HIT;
+    }
 
     uint32_t shard_idx = cache_key_to_shard(key_hash);
     cache_shard_t *shard = &g_cache.shards[shard_idx];
@@ -399,48 +850,58 @@ cache_result_t cache_get(const char *method, const char *scheme,
         // MISS
         shard->misses++;
         ReleaseSRWLockExclusive(&shard->lock);
+        cache_l1_forget(key_hash, fingerprint);
         *out = NULL;
         return CACHE_RESULT_MISS;
     }
 
     uint32_t now = get_current_time();
+    if (entry->val && now >= entry->val->expires_at &&
+        now - entry->val->expires_at < stale_grace(entry->val)) {
+        // Expired but still inside its grace period: caller decides whether to serve it
+        cache_value_t *stale = entry->val;
+        cache_value_acquire(stale);
+        shard->stale_hits++;
+        ReleaseSRWLockExclusive(&shard->lock);
+        cache_l1_forget(key_hash, fingerprint);
+        *out = stale;
+        return CACHE_RESULT_STALE;
+    }
     if (entry->val && now >= entry->val->expires_at) {
         // Expired - remove it
         hash_table_remove(shard, entry);
         lru_unlink(shard, entry);
-        uint64_t entry_size = sizeof(cache_entry_t) + sizeof(cache_value_t);
-        if (entry->val && entry->val->body) {
-            entry_size += entry->val->body_len;
-        }
-
-        if (shard->bytes_used >= entry_size) {
-            shard->bytes_used -= entry_size;
-        } else {
-            shard->bytes_used = 0;
-        }
-        
-        if (entry->val) {
-            if (entry->val->body) free(entry->val->body);
-            free(entry->val);
-        }
-        free(entry);
+        shard_uncharge(shard, entry);
+        free_entry(entry);
         shard->misses++;
         ReleaseSRWLockExclusive(&shard->lock);
+        cache_l1_forget(key_hash, fingerprint);
+
+        // The key has proven popular, so its refetch is admitted straight away
+        second_hit_shard_t *tracker = &g_cache.hit_trackers[shard_idx];
+        AcquireSRWLockExclusive(&tracker->lock);
+        if (!tracker_find(tracker, key_hash, fingerprint)) {
+            tracker_add(tracker, key_hash, fingerprint, now);
+        }
+        ReleaseSRWLockExclusive(&tracker->lock);
+
         *out = NULL;
         return CACHE_RESULT_MISS;
     }
 
     lru_promote(shard, entry);
-    entry_acquire(entry);
+    cache_value_t *val = entry->val;
+    cache_value_acquire(val);
     shard->hits++;
 
-    if (entry->val && entry->val->body) {
-        shard->byte_hits += entry->val->body_len;
+    if (val) {
+        shard->byte_hits += val->body_len;
+        cache_l1_sample(key_hash, fingerprint, val);
     }
     
     ReleaseSRWLockExclusive(&shard->lock);
     
-    *out = entry->val;
+    *out = val;
 
     static volatile LONG hit_log_counter = 0;
     if (InterlockedIncrement(&hit_log_counter) % 100 == 0) {
@@ -455,8 +916,34 @@ cache_result_t cache_get(const char *method, const char *scheme,
     return CACHE_RESULT_HIT;
 }
 
-static void evict_shard_until_under(cache_shard_t *shard, uint64_t target_bytes, int max_evictions) {
-    if (!shard || target_bytes == 0) return;
+int cache_contains_key(uint64_t key_hash, const char *fingerprint) {
+    if (!g_cache_initialized || !g_cache.enabled || !fingerprint) return 0;
+
+    cache_shard_t *shard = &g_cache.shards[cache_key_to_shard(key_hash)];
+    AcquireSRWLockShared(&shard->lock);
+    int found = hash_table_find(shard, key_hash, fingerprint) != NULL;
+    ReleaseSRWLockShared(&shard->lock);
+    return found;
+}
+
+static volatile LONG evict_log_counter = 0;
+
+// Oldest entry of the tenant furthest over its share that has one here, so a
+// tenant filling the cache pays with its own entries; plain LRU when none is over
+static cache_entry_t *pick_victim(cache_shard_t *shard) {
+    for (uint64_t victims = cache_tenant_victims(); victims; victims >>= 16) {
+        uint16_t tenant = (uint16_t)((victims & 0xFFFF) - 1);
+        cache_entry_t *entry = shard->tenant_lru[tenant].tail;
+        if (entry && cache_tenant_over_share(tenant)) return entry;
+    }
+    return shard->lru_tail;
+}
+
+// Unlinks LRU victims from the shard; they are chained through hnext into *victims
+// so the caller can demote them to the disk tier after dropping the shard lock.
+static void evict_shard_until_under(cache_shard_t *shard, uint64_t target_bytes, int max_evictions,
+                                    cache_entry_t **victims) {
+    if (!shard) return;
     
     int evicted_count = 0;
     const int SAFETY_MAX_EVICTIONS = 100; 
@@ -469,33 +956,25 @@ static void evict_shard_until_under(cache_shard_t *shard, uint64_t target_bytes,
            evicted_count < max_evictions && 
            shard->lru_tail) {
         
-        cache_entry_t *evict_entry = lru_pop_tail(shard);
+        cache_entry_t *evict_entry = pick_victim(shard);
         if (!evict_entry) break;
-        uint64_t entry_size = sizeof(cache_entry_t) + sizeof(cache_value_t);
-        if (evict_entry->val && evict_entry->val->body) {
-            entry_size += evict_entry->val->body_len;
-        }
+        lru_unlink(shard, evict_entry);
         hash_table_remove(shard, evict_entry);
-        
-        // Free memory
-        if (evict_entry->val) {
-            if (evict_entry->val->body) {
-                free(evict_entry->val->body);
-            }
-            free(evict_entry->val);
-        }
-        free(evict_entry);
-        if (shard->bytes_used >= entry_size) {
-            shard->bytes_used -= entry_size;
+        shard_uncharge(shard, evict_entry);
+        cache_tenant_count_eviction(evict_entry->tenant);
+
+        if (victims) {
+            evict_entry->hnext = *victims;
+            *victims = evict_entry;
         } else {
-            shard->bytes_used = 0;
+            free_entry(evict_entry);
         }
         
         shard->evictions++;
         evicted_count++;
     }
 
-    if (evicted_count > 0) {
+    if (evicted_count > 0 && InterlockedIncrement(&evict_log_counter) % 100 == 0) {
         char log_buf[128];
         snprintf(log_buf, sizeof(log_buf), "Evicted %d entries, shard bytes_used now: %llu / %llu",
                  evicted_count, shard->bytes_used, target_bytes);
@@ -503,147 +982,629 @@ static void evict_shard_until_under(cache_shard_t *shard, uint64_t target_bytes,
     }
 }
 
-int cache_put(const char *method, const char *scheme,
-              const char *host, const char *path, const char *query,
-              const char *vary_header, uint32_t status_code,
-              const uint8_t *body, uint32_t body_len,
-              const char *content_type, uint32_t ttl_seconds) {
-    if (!g_cache_initialized || !g_cache.enabled) {
-        return -1;
+// Called without the shard lock held: still-fresh victims move to the disk tier
+static void demote_and_free(cache_entry_t *victims) {
+    uint32_t now = get_current_time();
+    while (victims) {
+        cache_entry_t *next = victims->hnext;
+        cache_value_t *val = victims->val;
+        if (cache_disk_is_enabled() && val && val->body_len > 0 && now < val->expires_at &&
+            disk_eligible(val)) {
+            cache_disk_put(victims->key_hash, victims->key_fingerprint, val);
+        }
+        free_entry(victims);
+        victims = next;
     }
+}
 
-    if (!body || body_len == 0 || body_len > CACHE_MAX_OBJECT_BYTES) {
-        return -1;
-    }
+// Charge val will have once stored, from the announced length while it still fills
+static uint64_t value_charge_estimate(const cache_value_t *val) {
+    return sizeof(cache_entry_t) + sizeof(cache_value_t) + val->header_len + cache_body_bytes(val->gz_body) +
+           (val->body_len ? cache_body_bytes(val->body) :
+            (val->content_length > 0 ? (uint64_t)val->content_length : 0));
+}
 
-    char key_buf[2048];
-    if (build_cache_key(method, scheme, host, path, query, vary_header,
-                       key_buf, sizeof(key_buf)) != 0) {
-        return -1;
+// Keeps a status rule's entries under its cap by evicting the shard's oldest ones
+// with the same status. Caller holds the shard lock. Returns -1 if val does not fit.
+static int status_cap_make_room_locked(cache_shard_t *shard, const cache_value_t *val) {
+    int rule = val->status_code != 200 ? status_rule_index(val->status_code) : -1;
+    if (rule < 0 || g_cache.status_rules[rule].max_bytes == 0) return 0;
+
+    uint64_t cap = g_cache.status_rules[rule].max_bytes;
+    uint64_t size = value_charge_estimate(val);
+    if (size > cap) return -1;
+
+    cache_entry_t *entry = shard->lru_tail;
+    for (int scanned = 0; entry && scanned < CACHE_STATUS_EVICT_SCAN; scanned++) {
+        if (status_bytes_used(rule) + size <= cap) return 0;
+        cache_entry_t *prev = entry->lru_prev;
+        if (entry->val && entry->val->status_code == val->status_code) {
+            hash_table_remove(shard, entry);
+            lru_unlink(shard, entry);
+            shard_uncharge(shard, entry);
+            cache_tenant_count_eviction(entry->tenant);
+            free_entry(entry);
+            shard->evictions++;
+        }
+        entry = prev;
     }
+    return status_bytes_used(rule) + size <= cap ? 0 : -1;
+}
 
-    uint64_t key_hash;
-    char fingerprint[16];
-    cache_key_hash(key_buf, &key_hash, fingerprint);
+// Makes room under val's tenant quota from the tenant's oldest entries in this shard
+// and leaves the rest to the evictor. Caller holds the shard lock. Returns -1 if val
+// alone is over the quota.
+static int tenant_quota_make_room_locked(cache_shard_t *shard, const cache_value_t *val) {
+    uint64_t quota = cache_tenant_quota(val->tenant);
+    if (quota == 0) return 0;
+    uint64_t size = value_charge_estimate(val);
+    if (size > quota) return -1;
+
+    cache_entry_t *entry = shard->tenant_lru[val->tenant].tail;
+    for (int n = 0; entry && n < CACHE_EVICT_BATCH && cache_tenant_quota_excess(val->tenant, size) > 0; n++) {
+        cache_entry_t *prev = entry->tenant_prev;
+        hash_table_remove(shard, entry);
+        lru_unlink(shard, entry);
+        shard_uncharge(shard, entry);
+        cache_tenant_count_eviction(entry->tenant);
+        free_entry(entry);
+        shard->evictions++;
+        entry = prev;
+    }
+    if (cache_tenant_quota_excess(val->tenant, size) > 0 && g_cache.evictor_wake) SetEvent(g_cache.evictor_wake);
+    return 0;
+}
 
-    uint32_t shard_idx = cache_key_to_shard(key_hash);
-    cache_shard_t *shard = &g_cache.shards[shard_idx];
-    
-    AcquireSRWLockExclusive(&shard->lock);
+// Inserts val under the key (taking a cache reference), replacing any previous value.
+// Caller holds the shard lock. Returns the entry, or NULL on allocation failure or
+// when val's status is at its cap or val is larger than its tenant's quota.
+static cache_entry_t *shard_insert_locked(cache_shard_t *shard, uint64_t key_hash,
+                                          const char *fingerprint, cache_value_t *val) {
+    if (status_cap_make_room_locked(shard, val) != 0) return NULL;
+    if (tenant_quota_make_room_locked(shard, val) != 0) return NULL;
 
-    cache_entry_t *existing = hash_table_find(shard, key_hash, fingerprint);
-    if (existing) {
-        uint32_t old_body_len = existing->val ? existing->val->body_len : 0;
-        
-        if (existing->val && existing->val->body) {
-            free(existing->val->body);
-        }
-        
-        uint32_t now = get_current_time();
-        existing->val->body = (uint8_t *)malloc(body_len);
-        if (!existing->val->body) {
+    uint32_t now = get_current_time();
+    cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
+    if (entry) {
+        shard_uncharge(shard, entry);
+        entry_unlink_tags(shard, entry);
+        cache_value_release(entry->val);
+        // Moves to the new value's tenant (a restored entry has none)
+        lru_unlink(shard, entry);
+        entry->tenant = val->tenant;
+        lru_add_to_head(shard, entry);
+        cache_l1_invalidate(cache_key_to_shard(key_hash));
+    } else {
+        entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+        if (!entry) return NULL;
+        entry->key_hash = key_hash;
+        memcpy(entry->key_fingerprint, fingerprint, 16);
+        entry->tenant = val->tenant;
+        if (hash_table_add(shard, entry) != 0) {
+            free(entry);
+            return NULL;
+        }
+        lru_add_to_head(shard, entry);
+    }
+
+    cache_value_acquire(val);
+    entry->val = val;
+    entry->created_at = now;
+    entry_link_tags(shard, entry);
+    shard_charge(shard, entry);
+    expiry_schedule(shard, entry, value_sweep_at(val));
+    return entry;
+}
+
+// Caller holds the shard lock; victims are demoted after it is released.
+// Eviction is the background evictor's job; the writer only wakes it, and
+// evicts from its own shard itself only if the evictor fell behind the hard limit.
+static void shard_enforce_limit_locked(cache_shard_t *shard, cache_entry_t **victims) {
+    uint64_t used = global_bytes_used();
+    if (used <= g_cache.high_watermark) return;
+
+    if (g_cache.evictor_wake) SetEvent(g_cache.evictor_wake);
+    if (used > g_cache.max_bytes || !g_cache.evictor_thread) {
+        if (!g_cache.evictor_thread) cache_tenant_rebalance(g_cache.max_bytes);
+        uint64_t excess = used - g_cache.low_watermark;
+        uint64_t target = shard->bytes_used > excess ? shard->bytes_used - excess : 0;
+        evict_shard_until_under(shard, target, CACHE_EVICT_BATCH, victims);
+    }
+}
+
+// Shard whose LRU tail has gone longest without a hit, among a random sample
+static cache_shard_t *pick_coldest_shard(uint32_t *rng) {
+    DWORD now = GetTickCount();
+    cache_shard_t *coldest = NULL;
+    DWORD coldest_age = 0;
+
+    for (int i = 0; i < CACHE_EVICT_SAMPLE_SHARDS; i++) {
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 17;
+        *rng ^= *rng << 5;
+        cache_shard_t *shard = &g_cache.shards[*rng & (CACHE_NUM_SHARDS - 1)];
+
+        AcquireSRWLockShared(&shard->lock);
+        if (shard->lru_tail) {
+            DWORD age = now - shard->lru_tail->last_access;
+            if (!coldest || age > coldest_age) {
+                coldest = shard;
+                coldest_age = age;
+            }
+        }
+        ReleaseSRWLockShared(&shard->lock);
+    }
+    return coldest;
+}
+
+// Evicts batches from the coldest sampled shards until the global total is at target
+static uint64_t evict_global_until_under(uint64_t target, uint32_t *rng) {
+    uint64_t evicted = 0;
+    int idle_rounds = 0;
+    while (global_bytes_used() > target && idle_rounds < CACHE_NUM_SHARDS) {
+        cache_shard_t *shard = pick_coldest_shard(rng);
+        if (!shard) {
+            idle_rounds++;
+            continue;
+        }
+
+        cache_entry_t *victims = NULL;
+        AcquireSRWLockExclusive(&shard->lock);
+        // Other threads free bytes too: by now the cache may already be under target
+        uint64_t used = global_bytes_used();
+        if (used <= target) {
             ReleaseSRWLockExclusive(&shard->lock);
-            return -1;
+            break;
         }
-        memcpy(existing->val->body, body, body_len);
-        existing->val->body_len = body_len;
-        existing->val->status_code = status_code;
-        existing->val->expires_at = now + (ttl_seconds > 0 ? ttl_seconds : g_cache.default_ttl_sec);
-        strncpy(existing->val->content_type, content_type ? content_type : "text/plain", 
-                sizeof(existing->val->content_type) - 1);
-        existing->val->content_type[sizeof(existing->val->content_type) - 1] = '\0';
+        uint64_t before = shard->bytes_used;
+        uint64_t excess = used - target;
+        uint64_t shard_target = before > excess ? before - excess : 0;
+        evict_shard_until_under(shard, shard_target, CACHE_EVICT_BATCH, &victims);
+        uint64_t freed = before - shard->bytes_used;
+        ReleaseSRWLockExclusive(&shard->lock);
+        demote_and_free(victims);
 
-        shard->bytes_used += (body_len - old_body_len);
-        
-        lru_promote(shard, existing);
+        evicted += freed;
+        idle_rounds = freed ? 0 : idle_rounds + 1;
+    }
+    return evicted;
+}
+
+static int tenant_must_shrink(uint16_t tenant, uint64_t target) {
+    return cache_tenant_quota_excess(tenant, 0) > 0 ||
+           (global_bytes_used() > target && cache_tenant_over_share(tenant));
+}
+
+// Tenants over their quota go back under it, and while the cache is over target the
+// ones over their fair share give up their oldest entries next, so one tenant's surge
+// is paid for by that tenant. Entries come off the tenant's own LRU tail, a batch
+// per shard lock hold, round-robin over the shards from *next_shard.
+static uint64_t evict_tenants(uint64_t target, uint32_t *next_shard) {
+    uint64_t evicted = 0;
+    for (uint64_t victims = cache_tenant_victims(); victims; victims >>= 16) {
+        uint16_t tenant = (uint16_t)((victims & 0xFFFF) - 1);
+        int idle = 0;
+        while (idle < CACHE_NUM_SHARDS && tenant_must_shrink(tenant, target)) {
+            cache_shard_t *shard = &g_cache.shards[*next_shard % CACHE_NUM_SHARDS];
+            *next_shard = (*next_shard + 1) % CACHE_NUM_SHARDS;
+
+            cache_entry_t *victims_list = NULL;
+            AcquireSRWLockExclusive(&shard->lock);
+            uint64_t before = shard->bytes_used;
+            for (int n = 0; n < CACHE_EVICT_BATCH && tenant_must_shrink(tenant, target); n++) {
+                cache_entry_t *entry = shard->tenant_lru[tenant].tail;
+                if (!entry) break;
+                lru_unlink(shard, entry);
+                hash_table_remove(shard, entry);
+                shard_uncharge(shard, entry);
+                cache_tenant_count_eviction(tenant);
+                shard->evictions++;
+                entry->hnext = victims_list;
+                victims_list = entry;
+            }
+            uint64_t freed = before - shard->bytes_used;
+            ReleaseSRWLockExclusive(&shard->lock);
+            demote_and_free(victims_list);
+
+            evicted += freed;
+            idle = freed ? 0 : idle + 1;
+        }
+    }
+    return evicted;
+}
+
+static volatile LONG sweep_log_counter = 0;
+
+// Frees entries past their stale grace, oldest first and a batch per shard lock
+// hold, until no shard has any due or CACHE_SWEEP_BUDGET_US is spent. *next_shard
+// carries the round-robin position over to the next sweep.
+static uint64_t sweep_expired(uint32_t *next_shard) {
+    LARGE_INTEGER freq, start, now_qpc;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    LONGLONG budget = freq.QuadPart * CACHE_SWEEP_BUDGET_US / 1000000;
+
+    uint32_t now = get_current_time();
+    uint64_t swept = 0, freed = 0;
+    int idle = 0;
+    while (idle < CACHE_NUM_SHARDS) {
+        cache_shard_t *shard = &g_cache.shards[*next_shard % CACHE_NUM_SHARDS];
+        cache_entry_t *expired = NULL;
+        int n = 0;
+
+        AcquireSRWLockExclusive(&shard->lock);
+        uint64_t before = shard->bytes_used;
+        while (n < CACHE_SWEEP_BATCH && shard->expiry_count > 0 && shard->expiry_heap[0]->sweep_at <= now) {
+            cache_entry_t *entry = shard->expiry_heap[0];
+            n++;
+            // Its filler still streams it and will commit or abort it
+            if (entry->val && entry->val->body_len == 0 && !cache_body_is_complete(entry->val->body)) {
+                expiry_schedule(shard, entry, now + CACHE_SWEEP_RETRY_SEC);
+                continue;
+            }
+            hash_table_remove(shard, entry);
+            lru_unlink(shard, entry);
+            shard_uncharge(shard, entry);
+            // A commit still pending must not store it again
+            if (entry->val) InterlockedExchange(&entry->val->purged, 1);
+            entry->hnext = expired;
+            expired = entry;
+            shard->expired++;
+            swept++;
+        }
+        int more = shard->expiry_count > 0 && shard->expiry_heap[0]->sweep_at <= now;
+        freed += before - shard->bytes_used;
         ReleaseSRWLockExclusive(&shard->lock);
-        return 0;
+
+        while (expired) {
+            cache_entry_t *next = expired->hnext;
+            free_entry(expired);
+            expired = next;
+        }
+
+        idle = n ? 0 : idle + 1;
+        if (!more) *next_shard = (*next_shard + 1) % CACHE_NUM_SHARDS;
+
+        QueryPerformanceCounter(&now_qpc);
+        if (now_qpc.QuadPart - start.QuadPart >= budget) break;
+    }
+
+    if (swept > 0 && InterlockedIncrement(&sweep_log_counter) % 60 == 0) {
+        char log_buf[128];
+        snprintf(log_buf, sizeof(log_buf), "Swept %llu expired entries (%llu bytes), bytes_used now: %llu",
+                 swept, freed, global_bytes_used());
+        log_cache_operation("SWEEP", log_buf);
     }
+    return swept;
+}
 
-    cache_entry_t *entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+static unsigned __stdcall evictor_thread_func(void *arg) {
+    (void)arg;
+    uint32_t rng = GetTickCount() | 1;
+    uint32_t sweep_shard = 0;
+    uint32_t tenant_shard = 0;
+    DWORD last_sweep = GetTickCount();
+    while (!InterlockedCompareExchange(&g_cache.evictor_stop, 0, 0)) {
+        WaitForSingleObject(g_cache.evictor_wake, CACHE_SWEEP_INTERVAL_MS);
+
+        // Expired entries go first, so eviction only has to take live ones when it must
+        int over = global_bytes_used() > g_cache.high_watermark;
+        if (over || GetTickCount() - last_sweep >= CACHE_SWEEP_INTERVAL_MS) {
+            last_sweep = GetTickCount();
+            sweep_expired(&sweep_shard);
+        }
+        // Shares follow who holds bytes now; quotas are enforced even below the watermark
+        cache_tenant_rebalance(g_cache.max_bytes);
+        evict_tenants(over ? g_cache.low_watermark : UINT64_MAX, &tenant_shard);
+        if (over && global_bytes_used() > g_cache.high_watermark) {
+            evict_global_until_under(g_cache.low_watermark, &rng);
+        }
+    }
+    return 0;
+}
+
+// Stores a complete value: RAM if it fits, otherwise the disk tier
+static int store_complete_value(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+    cache_body_account(val->body, NULL);
+
+    if (val->body_len > CACHE_MAX_OBJECT_BYTES) {
+        // Too large for RAM: goes straight to the disk tier (if enabled)
+        cache_invalidate_key(key_hash, fingerprint);
+        if (!cache_disk_is_enabled() || !disk_eligible(val)) return -1;
+        return cache_disk_put(key_hash, fingerprint, val);
+    }
+
+    uint64_t content_hash;
+    char content_fp[16];
+    cache_value_t *stored = dedup_prepare(val, &content_hash, content_fp) == 0 ?
+                            dedup_value(val, content_hash, content_fp) : val;
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = shard_insert_locked(shard, key_hash, fingerprint, stored);
+    if (stored != val) cache_value_release_refs(stored, 1);
     if (!entry) {
         ReleaseSRWLockExclusive(&shard->lock);
         return -1;
     }
-    
-    cache_value_t *val = (cache_value_t *)calloc(1, sizeof(cache_value_t));
-    if (!val) {
-        free(entry);
-        ReleaseSRWLockExclusive(&shard->lock);
+
+    static volatile LONG put_log_counter = 0;
+    if (InterlockedIncrement(&put_log_counter) % 50 == 0) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf), "Cached entry: %u bytes, bytes_used: %llu/%llu",
+                 val->body_len, global_bytes_used(), g_cache.max_bytes);
+        log_cache_operation("PUT", log_buf);
+    }
+
+    cache_entry_t *victims = NULL;
+    shard_enforce_limit_locked(shard, &victims);
+    ReleaseSRWLockExclusive(&shard->lock);
+    demote_and_free(victims);
+    return 0;
+}
+
+int cache_put(const char *method, const char *scheme,
+              const char *host, const char *path, const char *query,
+              const char *vary_header, uint32_t status_code,
+              const uint8_t *body, uint32_t body_len,
+              const char *content_type, uint32_t ttl_seconds) {
+    if (!g_cache_initialized || !g_cache.enabled) {
         return -1;
     }
-    
-    val->body = (uint8_t *)malloc(body_len);
-    if (!val->body) {
-        free(val);
-        free(entry);
-        ReleaseSRWLockExclusive(&shard->lock);
+
+    if (!body || body_len == 0) {
         return -1;
     }
-    
-    memcpy(val->body, body, body_len);
+
+    uint64_t key_hash;
+    char fingerprint[16];
+    if (cache_key_compute(method, scheme, host, path, query, vary_header, &key_hash, fingerprint) != 0) {
+        return -1;
+    }
+
+    cache_value_t *val = cache_value_create(status_code, content_type, body_len);
+    if (!val) return -1;
+    val->tenant = cache_tenant_find(cache_tag_scope(host));
+    if (cache_body_append(val->body, body, body_len) != 0) {
+        cache_value_release(val);
+        return -1;
+    }
+    cache_body_finish(val->body);
     val->body_len = body_len;
-    val->status_code = status_code;
-    
     uint32_t now = get_current_time();
     val->expires_at = now + (ttl_seconds > 0 ? ttl_seconds : g_cache.default_ttl_sec);
-    
-    strncpy(val->content_type, content_type ? content_type : "text/plain",
-            sizeof(val->content_type) - 1);
-    val->content_type[sizeof(val->content_type) - 1] = '\0';
-    
-    entry->key_hash = key_hash;
-    memcpy(entry->key_fingerprint, fingerprint, 16);
-    entry->val = val;
-    entry->refcnt = 0;
-    entry->created_at = now;
+    val->age_base = now;
 
-    hash_table_add(shard, entry);
-    lru_add_to_head(shard, entry);
+    int rc = store_complete_value(key_hash, fingerprint, val);
+    cache_value_release(val);
+    return rc;
+}
 
-    uint64_t entry_size = body_len + sizeof(cache_entry_t) + sizeof(cache_value_t);
-    shard->bytes_used += entry_size;
+int cache_restore_value(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    if (!g_cache_initialized || !g_cache.enabled || !fingerprint || !val || !val->body) return -1;
+    if (!cache_body_is_complete(val->body)) return -1;
+    return store_complete_value(key_hash, fingerprint, val);
+}
 
-    static volatile LONG put_log_counter = 0;
-    if (InterlockedIncrement(&put_log_counter) % 50 == 0) {
-        char log_buf[256];
-        snprintf(log_buf, sizeof(log_buf), "Cached entry: %u bytes, shard bytes_used: %llu/%llu",
-                 body_len, shard->bytes_used, g_cache.max_bytes / CACHE_NUM_SHARDS);
-        log_cache_operation("PUT", log_buf);
+int cache_collect_hot(cache_hot_item_t **items_out, size_t *count_out, uint64_t max_bytes) {
+    if (!items_out || !count_out) return -1;
+    *items_out = NULL;
+    *count_out = 0;
+    if (!g_cache_initialized) return -1;
+
+    size_t cap = 256, count = 0;
+    cache_hot_item_t *items = (cache_hot_item_t *)malloc(cap * sizeof(cache_hot_item_t));
+    if (!items) return -1;
+
+    // Each shard contributes its most recently used entries, up to an even share of the budget
+    uint64_t shard_budget = max_bytes / CACHE_NUM_SHARDS;
+    uint32_t now = get_current_time();
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        cache_shard_t *shard = &g_cache.shards[i];
+        uint64_t used = 0;
+
+        AcquireSRWLockShared(&shard->lock);
+        for (cache_entry_t *e = shard->lru_head; e; e = e->lru_next) {
+            cache_value_t *val = e->val;
+            // Range slices are refetched on demand; restored ones would be unknown to purges
+            if (!val || val->body_len == 0 || val->range_total || now >= val->expires_at) continue;
+            uint64_t size = (uint64_t)val->body_len + val->header_len + val->gz_len;
+            if (used + size > shard_budget) break;
+
+            if (count == cap) {
+                cache_hot_item_t *grown = (cache_hot_item_t *)realloc(items, cap * 2 * sizeof(cache_hot_item_t));
+                if (!grown) break;
+                items = grown;
+                cap *= 2;
+            }
+            items[count].key_hash = e->key_hash;
+            memcpy(items[count].key_fingerprint, e->key_fingerprint, 16);
+            cache_value_acquire(val);
+            items[count].val = val;
+            count++;
+            used += size;
+        }
+        ReleaseSRWLockShared(&shard->lock);
     }
 
-    uint64_t max_bytes_per_shard = g_cache.max_bytes / CACHE_NUM_SHARDS;
-    if (shard->bytes_used > max_bytes_per_shard) {
-        uint64_t target_bytes = max_bytes_per_shard * 90 / 100;
-        evict_shard_until_under(shard, target_bytes, 10);
-        if (shard->bytes_used > max_bytes_per_shard) {
-            target_bytes = max_bytes_per_shard * 80 / 100;
-            evict_shard_until_under(shard, target_bytes, 20);
+    *items_out = items;
+    *count_out = count;
+    return 0;
+}
+
+int cache_publish_fill(uint64_t key_hash, const char *fingerprint,
+                       cache_value_t *val, uint32_t ttl_seconds) {
+    if (!g_cache_initialized || !g_cache.enabled || !fingerprint || !val) return -1;
+
+    uint32_t now = get_current_time();
+    val->expires_at = now + (ttl_seconds > 0 ? ttl_seconds : g_cache.default_ttl_sec);
+    val->age_base = now;
+
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = shard_insert_locked(shard, key_hash, fingerprint, val);
+    ReleaseSRWLockExclusive(&shard->lock);
+    return entry ? 0 : -1;
+}
+
+int cache_commit_fill(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    if (!g_cache_initialized || !fingerprint || !val || !val->body) return -1;
+    if (!cache_body_is_complete(val->body)) return -1;
+    cache_body_account(val->body, NULL);
+
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+    uint32_t final_len = (uint32_t)val->body->len;
+    uint64_t content_hash;
+    char content_fp[16];
+    int dedup = dedup_prepare(val, &content_hash, content_fp) == 0;
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
+    if (entry && entry->val == val) {
+        if (final_len > CACHE_MAX_OBJECT_BYTES) {
+            // Filled through RAM so readers could attach; the copy that stays goes to disk
+            hash_table_remove(shard, entry);
+            lru_unlink(shard, entry);
+            shard_uncharge(shard, entry);
+            free_entry(entry);
+            val->body_len = final_len;
+            ReleaseSRWLockExclusive(&shard->lock);
+            if (!cache_disk_is_enabled() || !disk_eligible(val)) return -1;
+            return cache_disk_put(key_hash, fingerprint, val);
+        }
+
+        shard_uncharge(shard, entry);
+        val->body_len = final_len;
+        cache_value_t *stored = dedup ? dedup_value(val, content_hash, content_fp) : val;
+        if (stored != val) {
+            // Same bytes already cached: the entry moves to the shared copy
+            entry->val = stored;
+            cache_value_release(val);
+            cache_l1_invalidate(shard_idx);
         }
+        shard_charge(shard, entry);
+
+        cache_entry_t *victims = NULL;
+        shard_enforce_limit_locked(shard, &victims);
+        ReleaseSRWLockExclusive(&shard->lock);
+        demote_and_free(victims);
+        return 0;
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    // Evicted or replaced while filling: store it again if it is still the newest
+    if (entry || InterlockedCompareExchange(&val->purged, 0, 0)) return -1;
+    val->body_len = final_len;
+    return store_complete_value(key_hash, fingerprint, val);
+}
+
+int cache_refresh_ttl(uint64_t key_hash, const char *fingerprint, cache_value_t *val,
+                      uint32_t ttl_seconds) {
+    if (!g_cache_initialized || !fingerprint || !val) return -1;
+
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+    int rc = -1;
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
+    if (entry && entry->val == val) {
+        // no-store, max-age=0 or an Age past max-age on the 304 extend nothing
+        if (ttl_seconds > 0) {
+            uint32_t now = get_current_time();
+            val->expires_at = now + ttl_seconds;
+            val->age_base = now;
+            expiry_schedule(shard, entry, value_sweep_at(val));
+        }
+        lru_promote(shard, entry);
+        rc = 0;
     }
-    
     ReleaseSRWLockExclusive(&shard->lock);
+    return rc;
+}
+
+int cache_attach_gzip(uint64_t key_hash, const char *fingerprint, cache_value_t *val,
+                      cache_body_t *gz) {
+    if (!g_cache_initialized || !fingerprint || !val || !gz) return -1;
+
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
+    // A value deduplicated at commit was replaced by a copy sharing its bytes
+    cache_value_t *cur = entry ? entry->val : NULL;
+    if (cur && cur != val && (!val->content || cur->content != val->content)) cur = NULL;
+    if (!cur || cur->gz_body) {
+        ReleaseSRWLockExclusive(&shard->lock);
+        return -1;
+    }
+
+    shard_uncharge(shard, entry);
+    cur->gz_body = gz;
+    cur->gz_len = gz->len;
+    shard_charge(shard, entry);
+    // Readers only look at gz_body once they see READY
+    InterlockedExchange(&cur->gz_state, CACHE_VARIANT_READY);
+
+    cache_entry_t *victims = NULL;
+    shard_enforce_limit_locked(shard, &victims);
+    ReleaseSRWLockExclusive(&shard->lock);
+    demote_and_free(victims);
     return 0;
 }
 
+void cache_abort_fill(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    if (!g_cache_initialized || !fingerprint || !val) return;
+
+    if (val->body) cache_body_abort(val->body);
+
+    uint32_t shard_idx = cache_key_to_shard(key_hash);
+    cache_shard_t *shard = &g_cache.shards[shard_idx];
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
+    if (entry && entry->val == val) {
+        hash_table_remove(shard, entry);
+        lru_unlink(shard, entry);
+        shard_uncharge(shard, entry);
+        free_entry(entry);
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+}
+
 void cache_evict_until_under(uint64_t max_bytes) {
     if (!g_cache_initialized || max_bytes == 0) return;
-    
-    uint64_t target_bytes = max_bytes;
-    uint64_t max_bytes_per_shard = target_bytes / CACHE_NUM_SHARDS;
-    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
-        cache_shard_t *shard = &g_cache.shards[i];
-        
-        AcquireSRWLockExclusive(&shard->lock);
-        
-        if (shard->bytes_used > max_bytes_per_shard) {
-            uint64_t shard_target = max_bytes_per_shard * 90 / 100;
-            int max_evictions = 10;
-            evict_shard_until_under(shard, shard_target, max_evictions);
-        }
-        
-        ReleaseSRWLockExclusive(&shard->lock);
+
+    uint32_t rng = GetTickCount() | 1;
+    evict_global_until_under(max_bytes, &rng);
+}
+
+void cache_set_max_bytes(uint64_t max_bytes) {
+    if (!g_cache_initialized || max_bytes == 0) return;
+
+    // Written in the order that keeps low <= high <= max for concurrent writers
+    uint64_t high = max_bytes / 100 * CACHE_EVICT_HIGH_PCT;
+    uint64_t low = max_bytes / 100 * CACHE_EVICT_LOW_PCT;
+    if (max_bytes < g_cache.max_bytes) {
+        g_cache.low_watermark = low;
+        g_cache.high_watermark = high;
+        g_cache.max_bytes = max_bytes;
+    } else {
+        g_cache.max_bytes = max_bytes;
+        g_cache.high_watermark = high;
+        g_cache.low_watermark = low;
     }
+    if (global_bytes_used() > high && g_cache.evictor_wake) SetEvent(g_cache.evictor_wake);
+}
+
+void cache_get_budget(uint64_t *max_bytes, uint64_t *bytes_used) {
+    if (max_bytes) *max_bytes = g_cache_initialized ? g_cache.max_bytes : 0;
+    if (bytes_used) *bytes_used = g_cache_initialized ? global_bytes_used() : 0;
 }
 
 int cache_check_admission(uint64_t key_hash, const char *key_fingerprint) {
@@ -676,6 +1637,102 @@ int cache_check_admission(uint64_t key_hash, const char *key_fingerprint) {
     return should_cache;
 }
 
+static inflight_fill_t *inflight_find(inflight_shard_t *shard, uint64_t key_hash,
+                                      const char *key_fingerprint) {
+    for (inflight_fill_t *fill = shard->fills; fill; fill = fill->next) {
+        if (fill->key_hash == key_hash &&
+            memcmp(fill->key_fingerprint, key_fingerprint, 16) == 0) {
+            return fill;
+        }
+    }
+    return NULL;
+}
+
+int cache_fill_begin(uint64_t key_hash, const char *key_fingerprint) {
+    if (!g_cache_initialized || !g_cache.enabled || !key_fingerprint) return 1;
+
+    inflight_shard_t *shard = &g_cache.inflight[cache_key_to_shard(key_hash)];
+    AcquireSRWLockExclusive(&shard->lock);
+    if (inflight_find(shard, key_hash, key_fingerprint)) {
+        shard->collapsed++;
+        ReleaseSRWLockExclusive(&shard->lock);
+        return 0;
+    }
+
+    inflight_fill_t *fill = (inflight_fill_t *)calloc(1, sizeof(inflight_fill_t));
+    if (fill) {
+        fill->key_hash = key_hash;
+        memcpy(fill->key_fingerprint, key_fingerprint, 16);
+        fill->next = shard->fills;
+        shard->fills = fill;
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+    return 1;
+}
+
+int cache_fill_wait(uint64_t key_hash, const char *key_fingerprint, uint32_t timeout_ms) {
+    if (!g_cache_initialized || !key_fingerprint) return 0;
+
+    inflight_shard_t *shard = &g_cache.inflight[cache_key_to_shard(key_hash)];
+    DWORD start = GetTickCount();
+    int rc = 0;
+
+    AcquireSRWLockExclusive(&shard->lock);
+    while (inflight_find(shard, key_hash, key_fingerprint)) {
+        DWORD elapsed = GetTickCount() - start;
+        if (elapsed >= timeout_ms ||
+            !SleepConditionVariableSRW(&shard->done, &shard->lock, timeout_ms - elapsed, 0)) {
+            rc = -1;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+    return rc;
+}
+
+void cache_fill_end(uint64_t key_hash, const char *key_fingerprint) {
+    if (!g_cache_initialized || !key_fingerprint) return;
+
+    inflight_shard_t *shard = &g_cache.inflight[cache_key_to_shard(key_hash)];
+    AcquireSRWLockExclusive(&shard->lock);
+    inflight_fill_t **pp = &shard->fills;
+    while (*pp) {
+        inflight_fill_t *fill = *pp;
+        if (fill->key_hash == key_hash && memcmp(fill->key_fingerprint, key_fingerprint, 16) == 0) {
+            *pp = fill->next;
+            free(fill);
+            break;
+        }
+        pp = &fill->next;
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+    WakeAllConditionVariable(&shard->done);
+}
+
+int cache_large_fill_begin(void) {
+    if (InterlockedIncrement(&g_cache.large_fills) > CACHE_LARGE_FILLS_MAX) {
+        InterlockedDecrement(&g_cache.large_fills);
+        return -1;
+    }
+    return 0;
+}
+
+void cache_large_fill_end(void) {
+    InterlockedDecrement(&g_cache.large_fills);
+}
+
+uint64_t cache_get_collapsed_count(void) {
+    if (!g_cache_initialized) return 0;
+
+    uint64_t total = 0;
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        AcquireSRWLockShared(&g_cache.inflight[i].lock);
+        total += g_cache.inflight[i].collapsed;
+        ReleaseSRWLockShared(&g_cache.inflight[i].lock);
+    }
+    return total;
+}
+
 void cache_get_metrics(uint64_t *hits, uint64_t *misses, uint64_t *evictions, uint64_t *bytes_used) {
     if (!hits || !misses || !evictions || !bytes_used) return;
     
@@ -695,6 +1752,26 @@ void cache_get_metrics(uint64_t *hits, uint64_t *misses, uint64_t *evictions, ui
         *bytes_used += shard->bytes_used;
         ReleaseSRWLockShared(&shard->lock);
     }
+
+    uint64_t l1_hits = 0;
+    cache_l1_get_stats(&l1_hits, NULL);
+    *hits += l1_hits;
+
+    uint64_t content_bytes = 0;
+    cache_content_get_metrics(NULL, &content_bytes, NULL, NULL);
+    *bytes_used += content_bytes;
+}
+
+uint64_t cache_get_expired_count(void) {
+    if (!g_cache_initialized) return 0;
+
+    uint64_t total = 0;
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        AcquireSRWLockShared(&g_cache.shards[i].lock);
+        total += g_cache.shards[i].expired;
+        ReleaseSRWLockShared(&g_cache.shards[i].lock);
+    }
+    return total;
 }
 
 double cache_get_hit_rate(void) {
@@ -710,6 +1787,9 @@ double cache_get_hit_rate(void) {
         total_misses += shard->misses;
         ReleaseSRWLockShared(&shard->lock);
     }
+    uint64_t l1_hits = 0;
+    cache_l1_get_stats(&l1_hits, NULL);
+    total_hits += l1_hits;
     
     uint64_t total_requests = total_hits + total_misses;
     if (total_requests == 0) {
@@ -734,6 +1814,10 @@ void cache_get_egress_bytes(uint64_t *cached_bytes, uint64_t *missed_bytes) {
         *missed_bytes += shard->byte_misses;
         ReleaseSRWLockShared(&shard->lock);
     }
+
+    uint64_t l1_byte_hits = 0;
+    cache_l1_get_stats(NULL, &l1_byte_hits);
+    *cached_bytes += l1_byte_hits;
 }
 
 double cache_get_byte_hit_rate(void) {
@@ -766,6 +1850,9 @@ double cache_get_offload_percent(uint64_t total_requests) {
         total_misses += shard->misses;
         ReleaseSRWLockShared(&shard->lock);
     }
+    uint64_t l1_hits = 0;
+    cache_l1_get_stats(&l1_hits, NULL);
+    total_hits += l1_hits;
 
     return ((double)total_hits / (double)total_requests) * 100.0;
 }
@@ -781,22 +1868,11 @@ void cache_track_byte_miss(uint64_t bytes) {
     ReleaseSRWLockExclusive(&shard->lock);
 }
 
-int cache_invalidate(const char *method, const char *scheme,
-                     const char *host, const char *path,
-                     const char *query, const char *vary_header) {
-    if (!g_cache_initialized || !g_cache.enabled) return -1;
-    if (!method || !scheme || !host || !path) return -1;
-    
-    char key_buf[2048];
-    if (build_cache_key(method, scheme, host, path, query, vary_header,
-                       key_buf, sizeof(key_buf)) != 0) {
-        return -1;
-    }
-    
-    uint64_t key_hash;
-    char fingerprint[16];
-    cache_key_hash(key_buf, &key_hash, fingerprint);
-    
+int cache_invalidate_key(uint64_t key_hash, const char *fingerprint) {
+    if (!g_cache_initialized || !fingerprint) return -1;
+
+    cache_disk_invalidate(key_hash, fingerprint);
+
     uint32_t shard_idx = cache_key_to_shard(key_hash);
     cache_shard_t *shard = &g_cache.shards[shard_idx];
     
@@ -805,29 +1881,18 @@ int cache_invalidate(const char *method, const char *scheme,
     cache_entry_t *entry = hash_table_find(shard, key_hash, fingerprint);
     
     if (entry) {
+        // A fill still streaming into this value must not store it again
+        InterlockedExchange(&entry->val->purged, 1);
         // Remove from hash table
         hash_table_remove(shard, entry);
         // Remove from LRU
         lru_unlink(shard, entry);
         
         // Update metrics
-        uint64_t entry_size = sizeof(cache_entry_t) + sizeof(cache_value_t);
-        if (entry->val && entry->val->body) {
-            entry_size += entry->val->body_len;
-        }
-        
-        if (shard->bytes_used >= entry_size) {
-            shard->bytes_used -= entry_size;
-        } else {
-            shard->bytes_used = 0;
-        }
+        shard_uncharge(shard, entry);
         
         // Free memory
-        if (entry->val) {
-            if (entry->val->body) free(entry->val->body);
-            free(entry->val);
-        }
-        free(entry);
+        free_entry(entry);
         
         ReleaseSRWLockExclusive(&shard->lock);
         return 0;
@@ -837,6 +1902,122 @@ int cache_invalidate(const char *method, const char *scheme,
     return -1; // Entry not found
 }
 
+int cache_purge_tag(uint64_t tag_hash) {
+    if (!g_cache_initialized) return 0;
+
+    int purged = 0;
+    for (int i = 0; i < CACHE_NUM_SHARDS; i++) {
+        cache_shard_t *shard = &g_cache.shards[i];
+        cache_entry_t *removed = NULL;
+
+        AcquireSRWLockExclusive(&shard->lock);
+        cache_tag_t *tag;
+        // Removing the last member frees the tag, so look it up again each round
+        while ((tag = tag_find(shard, tag_hash, 0)) != NULL) {
+            cache_entry_t *entry = tag->members->entry;
+            InterlockedExchange(&entry->val->purged, 1);
+            shard_uncharge(shard, entry);
+            hash_table_remove(shard, entry);
+            lru_unlink(shard, entry);
+            entry->hnext = removed;
+            removed = entry;
+            purged++;
+        }
+        ReleaseSRWLockExclusive(&shard->lock);
+
+        while (removed) {
+            cache_entry_t *next = removed->hnext;
+            cache_disk_invalidate(removed->key_hash, removed->key_fingerprint);
+            free_entry(removed);
+            removed = next;
+        }
+    }
+    return purged;
+}
+
+static uint32_t slice_parent_bucket(uint64_t key_hash) {
+    return (uint32_t)(key_hash >> 20) & (CACHE_SLICE_PARENT_BUCKETS - 1);
+}
+
+void cache_note_slice(uint64_t key_hash, const char *fingerprint, uint32_t slice, uint32_t expires_at) {
+    if (!fingerprint || slice >= CACHE_RANGE_MAX_SLICES) return;
+
+    uint32_t b = slice_parent_bucket(key_hash);
+    SRWLOCK *lock = &g_slice_parent_locks[b & (CACHE_SLICE_PARENT_LOCKS - 1)];
+    uint32_t now = get_current_time();
+    slice_parent_t *found = NULL;
+
+    AcquireSRWLockExclusive(lock);
+    // Records whose slices have all expired go as the bucket is walked
+    for (slice_parent_t **pp = &g_slice_parents[b]; *pp; ) {
+        slice_parent_t *p = *pp;
+        if (p->key_hash == key_hash && memcmp(p->key_fingerprint, fingerprint, 16) == 0) {
+            found = p;
+        } else if (now >= p->expires_at) {
+            *pp = p->next;
+            free(p);
+            continue;
+        }
+        pp = &p->next;
+    }
+    if (!found && (found = (slice_parent_t *)calloc(1, sizeof(slice_parent_t))) != NULL) {
+        found->key_hash = key_hash;
+        memcpy(found->key_fingerprint, fingerprint, 16);
+        found->next = g_slice_parents[b];
+        g_slice_parents[b] = found;
+    }
+    if (found) {
+        if (slice + 1 > found->nslices) found->nslices = slice + 1;
+        if (expires_at > found->expires_at) found->expires_at = expires_at;
+    }
+    ReleaseSRWLockExclusive(lock);
+}
+
+int cache_invalidate_slices(uint64_t key_hash, const char *fingerprint) {
+    if (!g_cache_initialized || !fingerprint) return 0;
+
+    uint32_t b = slice_parent_bucket(key_hash);
+    SRWLOCK *lock = &g_slice_parent_locks[b & (CACHE_SLICE_PARENT_LOCKS - 1)];
+    uint32_t nslices = 0;
+
+    AcquireSRWLockExclusive(lock);
+    for (slice_parent_t **pp = &g_slice_parents[b]; *pp; pp = &(*pp)->next) {
+        slice_parent_t *p = *pp;
+        if (p->key_hash == key_hash && memcmp(p->key_fingerprint, fingerprint, 16) == 0) {
+            nslices = p->nslices;
+            *pp = p->next;
+            free(p);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(lock);
+
+    // cache_invalidate_key drops the disk copy too
+    int removed = 0;
+    for (uint32_t i = 0; i < nslices; i++) {
+        uint64_t slice_hash;
+        char slice_fp[16];
+        cache_slice_key(key_hash, fingerprint, i, &slice_hash, slice_fp);
+        if (cache_invalidate_key(slice_hash, slice_fp) == 0) removed++;
+    }
+    return removed;
+}
+
+int cache_invalidate(const char *method, const char *scheme,
+                     const char *host, const char *path,
+                     const char *query, const char *vary_header) {
+    if (!g_cache_initialized || !g_cache.enabled) return -1;
+    if (!method || !scheme || !host || !path) return -1;
+    
+    uint64_t key_hash;
+    char fingerprint[16];
+    if (cache_key_compute(method, scheme, host, path, query, vary_header, &key_hash, fingerprint) != 0) {
+        return -1;
+    }
+    
+    return cache_invalidate_key(key_hash, fingerprint);
+}
+
 static void log_cache_operation(const char *operation, const char *details) {
     char log_buf[256];
     snprintf(log_buf, sizeof(log_buf), "[CACHE %s] %s", operation, details);
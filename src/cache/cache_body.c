@@ -0,0 +1,214 @@
+#include "../include/cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Response bodies are kept as a chain of segments so they can be filled while
+// streaming without knowing the final size. Segments are sized from the announced
+// length, or start small and double up to CACHE_SEGMENT_BYTES, so a pixel or a
+// cached 404 does not hold a full segment. Bytes below body->len never change,
+// which lets readers send them without holding the lock.
+
+cache_body_t *cache_body_create(void) {
+    cache_body_t *body = (cache_body_t *)calloc(1, sizeof(cache_body_t));
+    if (!body) return NULL;
+
+    InitializeSRWLock(&body->lock);
+    InitializeConditionVariable(&body->more);
+    return body;
+}
+
+void cache_body_free(cache_body_t *body) {
+    if (!body) return;
+
+    cache_segment_t *seg = body->head;
+    while (seg) {
+        cache_segment_t *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+    free(body);
+}
+
+void cache_body_expect(cache_body_t *body, uint64_t len) {
+    if (body) body->expected = len;
+}
+
+uint64_t cache_body_bytes(const cache_body_t *body) {
+    return body ? sizeof(cache_body_t) + body->alloc_bytes : 0;
+}
+
+void cache_body_account(cache_body_t *body, volatile LONG64 *counter) {
+    if (!body) return;
+    AcquireSRWLockExclusive(&body->lock);
+    if (body->account != counter) {
+        LONG64 bytes = (LONG64)cache_body_bytes(body);
+        if (body->account) InterlockedExchangeAdd64(body->account, -bytes);
+        if (counter) InterlockedExchangeAdd64(counter, bytes);
+        body->account = counter;
+    }
+    ReleaseSRWLockExclusive(&body->lock);
+}
+
+// Capacity of the next segment: what is still expected, else double the last one
+static uint32_t segment_capacity(const cache_body_t *body, size_t len) {
+    uint64_t cap;
+    if (body->expected > body->len) {
+        cap = body->expected - body->len;
+    } else {
+        cap = body->tail ? (uint64_t)body->tail->cap * 2 : CACHE_SEGMENT_MIN_BYTES;
+        if (cap < len) cap = len;
+    }
+    if (cap < CACHE_SEGMENT_MIN_BYTES) cap = CACHE_SEGMENT_MIN_BYTES;
+    if (cap > CACHE_SEGMENT_BYTES) cap = CACHE_SEGMENT_BYTES;
+    return (uint32_t)cap;
+}
+
+int cache_body_append(cache_body_t *body, const uint8_t *data, size_t len) {
+    if (!body || (!data && len > 0)) return -1;
+
+    while (len > 0) {
+        cache_segment_t *tail = body->tail;
+        if (!tail || tail->len == tail->cap) {
+            uint32_t cap = segment_capacity(body, len);
+            cache_segment_t *seg = (cache_segment_t *)malloc(sizeof(cache_segment_t) + cap);
+            if (!seg) return -1;
+            seg->next = NULL;
+            seg->len = 0;
+            seg->cap = cap;
+
+            AcquireSRWLockExclusive(&body->lock);
+            if (tail) {
+                tail->next = seg;
+            } else {
+                body->head = seg;
+            }
+            body->tail = seg;
+            body->alloc_bytes += sizeof(cache_segment_t) + cap;
+            if (body->account) InterlockedExchangeAdd64(body->account, (LONG64)(sizeof(cache_segment_t) + cap));
+            ReleaseSRWLockExclusive(&body->lock);
+            tail = seg;
+        }
+
+        size_t room = tail->cap - tail->len;
+        size_t n = len < room ? len : room;
+        memcpy(tail->data + tail->len, data, n);
+
+        // Publish the new bytes only after they are fully written
+        AcquireSRWLockExclusive(&body->lock);
+        tail->len += (uint32_t)n;
+        body->len += n;
+        ReleaseSRWLockExclusive(&body->lock);
+        WakeAllConditionVariable(&body->more);
+
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int cache_body_append_from(cache_body_t *dst, const cache_body_t *src) {
+    if (!dst || !src) return -1;
+    for (const cache_segment_t *seg = src->head; seg; seg = seg->next) {
+        if (cache_body_append(dst, seg->data, seg->len) != 0) return -1;
+    }
+    return 0;
+}
+
+void cache_body_finish(cache_body_t *body) {
+    if (!body) return;
+    AcquireSRWLockExclusive(&body->lock);
+    body->complete = 1;
+    ReleaseSRWLockExclusive(&body->lock);
+    WakeAllConditionVariable(&body->more);
+}
+
+void cache_body_abort(cache_body_t *body) {
+    if (!body) return;
+    AcquireSRWLockExclusive(&body->lock);
+    if (!body->complete) body->aborted = 1;
+    ReleaseSRWLockExclusive(&body->lock);
+    WakeAllConditionVariable(&body->more);
+}
+
+int cache_body_is_complete(cache_body_t *body) {
+    if (!body) return 0;
+    AcquireSRWLockShared(&body->lock);
+    int complete = body->complete;
+    ReleaseSRWLockShared(&body->lock);
+    return complete;
+}
+
+uint64_t cache_body_available(cache_body_t *body) {
+    if (!body) return 0;
+    AcquireSRWLockShared(&body->lock);
+    uint64_t len = body->len;
+    ReleaseSRWLockShared(&body->lock);
+    return len;
+}
+
+int cache_body_wait_complete(cache_body_t *body, uint32_t timeout_ms) {
+    if (!body) return -1;
+
+    int rc = 0;
+    AcquireSRWLockExclusive(&body->lock);
+    while (!body->complete && !body->aborted) {
+        if (!SleepConditionVariableSRW(&body->more, &body->lock, timeout_ms, 0)) {
+            rc = -1;
+            break;
+        }
+    }
+    if (body->aborted) rc = -1;
+    ReleaseSRWLockExclusive(&body->lock);
+    return rc;
+}
+
+void cache_body_cursor_init(cache_body_cursor_t *cur) {
+    if (!cur) return;
+    cur->seg = NULL;
+    cur->seg_off = 0;
+    cur->pos = 0;
+}
+
+int cache_body_read(cache_body_t *body, cache_body_cursor_t *cur,
+                    const uint8_t **data_out, size_t *len_out, uint32_t timeout_ms) {
+    if (!body || !cur || !data_out || !len_out) return -1;
+
+    *data_out = NULL;
+    *len_out = 0;
+
+    AcquireSRWLockExclusive(&body->lock);
+    while (cur->pos >= body->len && !body->complete && !body->aborted) {
+        if (!SleepConditionVariableSRW(&body->more, &body->lock, timeout_ms, 0)) {
+            ReleaseSRWLockExclusive(&body->lock);
+            return -1;
+        }
+    }
+
+    if (body->aborted) {
+        ReleaseSRWLockExclusive(&body->lock);
+        return -1;
+    }
+    if (cur->pos >= body->len) {
+        // complete and fully consumed
+        ReleaseSRWLockExclusive(&body->lock);
+        return 0;
+    }
+
+    if (!cur->seg) {
+        cur->seg = body->head;
+        cur->seg_off = 0;
+    } else if (cur->seg_off == cur->seg->len && cur->seg->len == cur->seg->cap) {
+        cur->seg = cur->seg->next;
+        cur->seg_off = 0;
+    }
+
+    const cache_segment_t *seg = cur->seg;
+    size_t avail = seg->len - cur->seg_off;
+    ReleaseSRWLockExclusive(&body->lock);
+
+    *data_out = seg->data + cur->seg_off;
+    *len_out = avail;
+    cur->seg_off += (uint32_t)avail;
+    cur->pos += avail;
+    return 1;
+}
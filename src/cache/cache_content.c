@@ -0,0 +1,131 @@
+#include "../include/cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Content-addressed store of committed bodies. Values whose bytes are the same
+// point at one shared segment chain, so shared libraries, fonts or pixels served
+// under many hosts and paths are kept once. The 128-bit hash only finds the
+// candidate: origins choose these bytes, so a match is confirmed byte for byte
+// before one tenant's body is served under another's URLs.
+
+typedef struct {
+    SRWLOCK lock;
+    cache_content_t *buckets[CACHE_CONTENT_BUCKETS_PER_SHARD];
+} content_shard_t;
+
+static content_shard_t g_content[CACHE_NUM_SHARDS];
+
+static volatile LONG64 g_contents = 0;
+static volatile LONG64 g_unique_bytes = 0;
+static volatile LONG64 g_dedup_hits = 0;
+static volatile LONG64 g_bytes_saved = 0;
+
+static content_shard_t *content_shard(uint64_t hash) {
+    return &g_content[hash & (CACHE_NUM_SHARDS - 1)];
+}
+
+static cache_content_t **content_bucket(content_shard_t *shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 6) % CACHE_CONTENT_BUCKETS_PER_SHARD];
+}
+
+// Both bodies are complete, so their segments no longer change
+static int body_equal(const cache_body_t *a, const cache_body_t *b) {
+    const cache_segment_t *sa = a->head, *sb = b->head;
+    uint32_t oa = 0, ob = 0;
+    while (sa && sb) {
+        uint32_t n = sa->len - oa;
+        if (sb->len - ob < n) n = sb->len - ob;
+        if (memcmp(sa->data + oa, sb->data + ob, n) != 0) return 0;
+        oa += n;
+        ob += n;
+        if (oa == sa->len) {
+            sa = sa->next;
+            oa = 0;
+        }
+        if (ob == sb->len) {
+            sb = sb->next;
+            ob = 0;
+        }
+    }
+    return !sa && !sb;
+}
+
+cache_content_t *cache_content_intern(uint64_t hash, const char *fingerprint, cache_body_t *body,
+                                      uint64_t len, int *adopted) {
+    if (adopted) *adopted = 0;
+    if (!fingerprint || !body || len == 0) return NULL;
+
+    content_shard_t *shard = content_shard(hash);
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_content_t **bucket = content_bucket(shard, hash);
+    for (cache_content_t *c = *bucket; c; c = c->hnext) {
+        if (c->hash == hash && c->len == len && memcmp(c->fingerprint, fingerprint, 16) == 0 &&
+            body_equal(c->body, body)) {
+            InterlockedIncrement(&c->refcnt);
+            ReleaseSRWLockExclusive(&shard->lock);
+            InterlockedIncrement64(&g_dedup_hits);
+            InterlockedExchangeAdd64(&g_bytes_saved, (LONG64)len);
+            return c;
+        }
+    }
+
+    cache_content_t *c = (cache_content_t *)calloc(1, sizeof(cache_content_t));
+    if (!c) {
+        ReleaseSRWLockExclusive(&shard->lock);
+        return NULL;
+    }
+    c->hash = hash;
+    memcpy(c->fingerprint, fingerprint, 16);
+    c->body = body;
+    c->len = len;
+    c->refcnt = 1;
+    c->hnext = *bucket;
+    *bucket = c;
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    InterlockedIncrement64(&g_contents);
+    InterlockedExchangeAdd64(&g_unique_bytes, (LONG64)len);
+    if (adopted) *adopted = 1;
+    return c;
+}
+
+// Only a holder of a reference may take another
+void cache_content_acquire(cache_content_t *content) {
+    if (!content) return;
+    InterlockedIncrement(&content->refcnt);
+    InterlockedExchangeAdd64(&g_bytes_saved, (LONG64)content->len);
+}
+
+uint64_t cache_content_release(cache_content_t *content) {
+    if (!content) return 0;
+
+    // The last reference is dropped under the lock so intern never finds a dying record
+    content_shard_t *shard = content_shard(content->hash);
+    AcquireSRWLockExclusive(&shard->lock);
+    if (InterlockedDecrement(&content->refcnt) > 0) {
+        ReleaseSRWLockExclusive(&shard->lock);
+        InterlockedExchangeAdd64(&g_bytes_saved, -(LONG64)content->len);
+        return 0;
+    }
+    cache_content_t **pp = content_bucket(shard, content->hash);
+    while (*pp && *pp != content) pp = &(*pp)->hnext;
+    if (*pp) *pp = content->hnext;
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    uint64_t len = content->len;
+    uint64_t charged = cache_body_bytes(content->body);
+    InterlockedDecrement64(&g_contents);
+    InterlockedExchangeAdd64(&g_unique_bytes, -(LONG64)len);
+    cache_body_free(content->body);
+    free(content);
+    return charged;
+}
+
+void cache_content_get_metrics(uint64_t *contents, uint64_t *unique_bytes,
+                               uint64_t *dedup_hits, uint64_t *bytes_saved) {
+    LONG64 saved = InterlockedCompareExchange64(&g_bytes_saved, 0, 0);
+    if (contents) *contents = (uint64_t)InterlockedCompareExchange64(&g_contents, 0, 0);
+    if (unique_bytes) *unique_bytes = (uint64_t)InterlockedCompareExchange64(&g_unique_bytes, 0, 0);
+    if (dedup_hits) *dedup_hits = (uint64_t)InterlockedCompareExchange64(&g_dedup_hits, 0, 0);
+    if (bytes_saved) *bytes_saved = saved > 0 ? (uint64_t)saved : 0;
+}
@@ -0,0 +1,632 @@
+#include <winsock2.h>
+#include <mswsock.h>
+#include <openssl/ssl.h>
+#include "../include/cache_disk.h"
+#include "../include/cache.h"
+#include "../include/logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DISK_SEND_CHUNK 65536
+
+// Disk tier: a ring of fixed-size segment files written as an append-only log.
+// The index lives in memory only; when the writer wraps onto a segment its
+// generation is bumped, which invalidates every index item pointing into it.
+// A segment a send is still reading from, or a writer is still filling, is skipped,
+// never waited for.
+typedef struct {
+    cache_disk_index_shard_t index[CACHE_DISK_INDEX_SHARDS];
+    cache_disk_segment_t *segments;
+    uint32_t nsegments;
+    uint32_t current;
+    uint32_t max_object_bytes;
+    char dir[MAX_PATH];
+    CRITICAL_SECTION write_lock;
+    volatile LONG64 hits;
+    volatile LONG64 misses;
+    volatile LONG64 bytes_written;
+} cache_disk_t;
+
+static cache_disk_t g_disk;
+static int g_disk_initialized = 0;
+
+static void segment_path(uint32_t seg, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s\\seg_%04u.dat", g_disk.dir, seg);
+}
+
+static HANDLE open_segment(uint32_t seg, DWORD disposition) {
+    char path[MAX_PATH + 32];
+    segment_path(seg, path, sizeof(path));
+    return CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                       disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static cache_disk_index_shard_t *index_shard(uint64_t key_hash) {
+    return &g_disk.index[key_hash & (CACHE_DISK_INDEX_SHARDS - 1)];
+}
+
+static cache_disk_node_t **index_slot(cache_disk_index_shard_t *shard, uint64_t key_hash) {
+    return &shard->buckets[(key_hash >> 6) % shard->nbuckets];
+}
+
+static int item_is_live(const cache_disk_item_t *item) {
+    if (item->segment >= g_disk.nsegments) return 0;
+    return (uint32_t)g_disk.segments[item->segment].generation == item->generation;
+}
+
+// Caller holds write_lock; a key that can't be recorded is left to lazy removal on lookup
+static void segment_record_key(cache_disk_segment_t *seg, uint64_t key_hash, const char *fingerprint) {
+    if (seg->nkeys == seg->keys_cap) {
+        uint32_t cap = seg->keys_cap ? seg->keys_cap * 2 : 256;
+        cache_disk_key_t *keys = (cache_disk_key_t *)realloc(seg->keys, cap * sizeof(cache_disk_key_t));
+        if (!keys) return;
+        seg->keys = keys;
+        seg->keys_cap = cap;
+    }
+    seg->keys[seg->nkeys].key_hash = key_hash;
+    memcpy(seg->keys[seg->nkeys].key_fingerprint, fingerprint, 16);
+    seg->nkeys++;
+}
+
+// Drop the index nodes of keys written into a reused segment that still point into it.
+// Runs without write_lock; one index shard lock at a time.
+static void index_drop_keys(cache_disk_key_t *keys, uint32_t nkeys) {
+    for (uint32_t i = 0; i < nkeys; i++) {
+        cache_disk_index_shard_t *shard = index_shard(keys[i].key_hash);
+        AcquireSRWLockExclusive(&shard->lock);
+        cache_disk_node_t **pp = index_slot(shard, keys[i].key_hash);
+        while (*pp) {
+            cache_disk_node_t *node = *pp;
+            if (node->key_hash == keys[i].key_hash &&
+                memcmp(node->key_fingerprint, keys[i].key_fingerprint, 16) == 0) {
+                // Rewritten elsewhere since: that copy stays
+                if (!item_is_live(&node->item)) {
+                    *pp = node->hnext;
+                    free(node);
+                    if (shard->items > 0) shard->items--;
+                }
+                break;
+            }
+            pp = &node->hnext;
+        }
+        ReleaseSRWLockExclusive(&shard->lock);
+    }
+    free(keys);
+}
+
+// Move the writer onto the next segment no send is reading from. Caller holds write_lock
+// and drops the keys handed back in *dropped after releasing it.
+static int advance_segment(cache_disk_key_t **dropped, uint32_t *ndropped) {
+    for (uint32_t step = 1; step < g_disk.nsegments; step++) {
+        uint32_t next = (g_disk.current + step) % g_disk.nsegments;
+        cache_disk_segment_t *seg = &g_disk.segments[next];
+        if (InterlockedCompareExchange(&seg->readers, 0, 0) != 0) continue;
+
+        // A send checks the generation after raising readers: once readers is seen at
+        // zero past the bump, no send can still be reading the old contents
+        InterlockedIncrement(&seg->generation);
+        if (InterlockedCompareExchange(&seg->readers, 0, 0) != 0) continue;
+
+        if (seg->handle == INVALID_HANDLE_VALUE || seg->handle == NULL) {
+            seg->handle = open_segment(next, CREATE_ALWAYS);
+            if (seg->handle == INVALID_HANDLE_VALUE) {
+                log_message("ERROR", "[CACHE_DISK] Failed to open segment file");
+                return -1;
+            }
+        }
+
+        *dropped = seg->keys;
+        *ndropped = seg->nkeys;
+        seg->keys = NULL;
+        seg->nkeys = 0;
+        seg->keys_cap = 0;
+        seg->write_offset = 0;
+        g_disk.current = next;
+        return 0;
+    }
+    // Every other segment is being sent from; this put is dropped rather than waiting
+    return -1;
+}
+
+int cache_disk_init(const char *dir, uint64_t max_bytes, uint32_t max_object_bytes) {
+    if (g_disk_initialized) return 0;
+    if (!dir || !dir[0]) return -1;
+
+    memset(&g_disk, 0, sizeof(g_disk));
+    snprintf(g_disk.dir, sizeof(g_disk.dir), "%s", dir);
+
+    if (!CreateDirectoryA(g_disk.dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        log_message("ERROR", "[CACHE_DISK] Cannot create cache directory");
+        return -1;
+    }
+
+    uint64_t nseg = max_bytes / CACHE_DISK_SEGMENT_BYTES;
+    if (nseg < CACHE_DISK_MIN_SEGMENTS) nseg = CACHE_DISK_MIN_SEGMENTS;
+    if (nseg > CACHE_DISK_MAX_SEGMENTS) nseg = CACHE_DISK_MAX_SEGMENTS;
+    g_disk.nsegments = (uint32_t)nseg;
+
+    uint64_t max_obj = max_object_bytes > 0 ? max_object_bytes : CACHE_DISK_DEFAULT_MAX_OBJECT_BYTES;
+    uint64_t max_fit = CACHE_DISK_SEGMENT_BYTES - sizeof(cache_disk_record_t) - CACHE_DISK_MAX_HEADER_BYTES;
+    if (max_obj > max_fit) max_obj = max_fit;
+    g_disk.max_object_bytes = (uint32_t)max_obj;
+
+    g_disk.segments = (cache_disk_segment_t *)calloc(g_disk.nsegments, sizeof(cache_disk_segment_t));
+    if (!g_disk.segments) return -1;
+    for (uint32_t i = 0; i < g_disk.nsegments; i++) {
+        g_disk.segments[i].handle = INVALID_HANDLE_VALUE;
+    }
+
+    for (int i = 0; i < CACHE_DISK_INDEX_SHARDS; i++) {
+        cache_disk_index_shard_t *shard = &g_disk.index[i];
+        InitializeSRWLock(&shard->lock);
+        shard->nbuckets = CACHE_DISK_BUCKETS_PER_SHARD;
+        shard->buckets = (cache_disk_node_t **)calloc(shard->nbuckets, sizeof(cache_disk_node_t *));
+        if (!shard->buckets) {
+            for (int j = 0; j < i; j++) free(g_disk.index[j].buckets);
+            free(g_disk.segments);
+            return -1;
+        }
+    }
+
+    // The index is not persisted, so old segment contents are unreachable: start over
+    g_disk.segments[0].handle = open_segment(0, CREATE_ALWAYS);
+    if (g_disk.segments[0].handle == INVALID_HANDLE_VALUE) {
+        log_message("ERROR", "[CACHE_DISK] Failed to open first segment");
+        for (int i = 0; i < CACHE_DISK_INDEX_SHARDS; i++) free(g_disk.index[i].buckets);
+        free(g_disk.segments);
+        return -1;
+    }
+    g_disk.current = 0;
+
+    InitializeCriticalSection(&g_disk.write_lock);
+    g_disk_initialized = 1;
+
+    char log_buf[512];
+    snprintf(log_buf, sizeof(log_buf),
+             "[CACHE_DISK] Initialized: dir=%s, segments=%u x %llu bytes, max_object=%u",
+             g_disk.dir, g_disk.nsegments, (unsigned long long)CACHE_DISK_SEGMENT_BYTES,
+             g_disk.max_object_bytes);
+    log_message("INFO", log_buf);
+    return 0;
+}
+
+void cache_disk_shutdown(void) {
+    if (!g_disk_initialized) return;
+
+    EnterCriticalSection(&g_disk.write_lock);
+    g_disk_initialized = 0;
+
+    for (int i = 0; i < CACHE_DISK_INDEX_SHARDS; i++) {
+        cache_disk_index_shard_t *shard = &g_disk.index[i];
+        AcquireSRWLockExclusive(&shard->lock);
+        for (uint32_t b = 0; b < shard->nbuckets; b++) {
+            cache_disk_node_t *node = shard->buckets[b];
+            while (node) {
+                cache_disk_node_t *next = node->hnext;
+                free(node);
+                node = next;
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        ReleaseSRWLockExclusive(&shard->lock);
+    }
+
+    for (uint32_t i = 0; i < g_disk.nsegments; i++) {
+        if (g_disk.segments[i].handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(g_disk.segments[i].handle);
+        }
+        free(g_disk.segments[i].keys);
+    }
+    free(g_disk.segments);
+    g_disk.segments = NULL;
+
+    LeaveCriticalSection(&g_disk.write_lock);
+    DeleteCriticalSection(&g_disk.write_lock);
+    log_message("INFO", "[CACHE_DISK] Shutdown complete");
+}
+
+int cache_disk_is_enabled(void) {
+    return g_disk_initialized;
+}
+
+uint32_t cache_disk_max_object_bytes(void) {
+    return g_disk_initialized ? g_disk.max_object_bytes : 0;
+}
+
+static int write_at(HANDLE h, uint64_t offset, const void *data, uint32_t len) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(offset & 0xFFFFFFFFULL);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD written = 0;
+    if (!WriteFile(h, data, len, &written, &ov) || written != len) return -1;
+    return 0;
+}
+
+static int read_at(HANDLE h, uint64_t offset, void *data, uint32_t len) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(offset & 0xFFFFFFFFULL);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD got = 0;
+    if (!ReadFile(h, data, len, &got, &ov) || got != len) return -1;
+    return 0;
+}
+
+int cache_disk_begin(cache_disk_writer_t *w, uint64_t key_hash, const char *fingerprint,
+                     const cache_value_t *val, uint32_t body_len) {
+    if (!w) return -1;
+    memset(w, 0, sizeof(*w));
+    if (!g_disk_initialized || !fingerprint || !val || body_len == 0) return -1;
+    if (body_len > g_disk.max_object_bytes) return -1;
+    if (val->expires_at <= (uint32_t)time(NULL)) return -1;
+
+    cache_disk_record_t *rec = &w->rec;
+    rec->magic = CACHE_DISK_RECORD_MAGIC;
+    rec->status_code = val->status_code;
+    rec->key_hash = key_hash;
+    memcpy(rec->key_fingerprint, fingerprint, 16);
+    rec->expires_at = val->expires_at;
+    rec->body_len = body_len;
+    rec->range_total = val->range_total;
+    snprintf(rec->content_type, sizeof(rec->content_type), "%s",
+             val->content_type[0] ? val->content_type : "text/html");
+    // An oversized header is dropped: hits then get the synthesized one
+    rec->header_len = val->header && val->header_len <= CACHE_DISK_MAX_HEADER_BYTES ? val->header_len : 0;
+    rec->age_base = val->age_base;
+    rec->compressible = (uint32_t)val->compressible;
+    memcpy(rec->etag, val->etag, sizeof(rec->etag));
+    memcpy(rec->last_modified, val->last_modified, sizeof(rec->last_modified));
+
+    uint64_t record_len = sizeof(*rec) + (uint64_t)rec->header_len + (uint64_t)body_len;
+
+    EnterCriticalSection(&g_disk.write_lock);
+    if (!g_disk_initialized) {
+        LeaveCriticalSection(&g_disk.write_lock);
+        return -1;
+    }
+
+    cache_disk_segment_t *seg = &g_disk.segments[g_disk.current];
+    cache_disk_key_t *dropped = NULL;
+    uint32_t ndropped = 0;
+    if (seg->write_offset + record_len > CACHE_DISK_SEGMENT_BYTES) {
+        if (advance_segment(&dropped, &ndropped) != 0) {
+            LeaveCriticalSection(&g_disk.write_lock);
+            return -1;
+        }
+        seg = &g_disk.segments[g_disk.current];
+    }
+
+    // The span is the writer's from here on; the data goes in without write_lock
+    w->segment = g_disk.current;
+    w->generation = (uint32_t)seg->generation;
+    w->offset = seg->write_offset;
+    seg->write_offset += record_len;
+    segment_record_key(seg, key_hash, fingerprint);
+    InterlockedIncrement(&seg->readers);
+    w->active = 1;
+
+    LeaveCriticalSection(&g_disk.write_lock);
+    index_drop_keys(dropped, ndropped);
+
+    if (rec->header_len &&
+        write_at(seg->handle, w->offset + sizeof(*rec), val->header, rec->header_len) != 0) {
+        log_message("WARN", "[CACHE_DISK] Segment write failed");
+        cache_disk_abandon(w);
+        return -1;
+    }
+    return 0;
+}
+
+int cache_disk_write(cache_disk_writer_t *w, const void *data, size_t len) {
+    if (!w || !w->active || (!data && len > 0)) return -1;
+    if (w->written + len > w->rec.body_len) return -1;
+    if (len == 0) return 0;
+
+    HANDLE h = g_disk.segments[w->segment].handle;
+    if (write_at(h, w->offset + sizeof(w->rec) + w->rec.header_len + w->written, data, (uint32_t)len) != 0) {
+        log_message("WARN", "[CACHE_DISK] Segment write failed");
+        return -1;
+    }
+    w->written += len;
+    return 0;
+}
+
+void cache_disk_abandon(cache_disk_writer_t *w) {
+    if (!w || !w->active) return;
+    w->active = 0;
+    InterlockedDecrement(&g_disk.segments[w->segment].readers);
+}
+
+int cache_disk_commit(cache_disk_writer_t *w) {
+    if (!w || !w->active) return -1;
+    cache_disk_segment_t *seg = &g_disk.segments[w->segment];
+
+    // The header goes last: the span only holds an object once all of it is there
+    if (w->written != w->rec.body_len || write_at(seg->handle, w->offset, &w->rec, sizeof(w->rec)) != 0) {
+        cache_disk_abandon(w);
+        return -1;
+    }
+
+    cache_disk_item_t item;
+    item.segment = w->segment;
+    item.generation = w->generation;
+    item.offset = w->offset + sizeof(w->rec) + w->rec.header_len;
+    item.body_len = w->rec.body_len;
+    item.header_len = w->rec.header_len;
+    item.status_code = w->rec.status_code;
+    item.expires_at = w->rec.expires_at;
+    item.age_base = w->rec.age_base;
+    item.compressible = (int)w->rec.compressible;
+    item.range_total = w->rec.range_total;
+    memcpy(item.content_type, w->rec.content_type, sizeof(item.content_type));
+    memcpy(item.etag, w->rec.etag, sizeof(item.etag));
+    memcpy(item.last_modified, w->rec.last_modified, sizeof(item.last_modified));
+    uint64_t key_hash = w->rec.key_hash;
+    const char *fingerprint = w->rec.key_fingerprint;
+
+    cache_disk_abandon(w);
+    InterlockedExchangeAdd64(&g_disk.bytes_written, (LONG64)(sizeof(w->rec) + w->rec.header_len + w->written));
+
+    cache_disk_index_shard_t *shard = index_shard(key_hash);
+    AcquireSRWLockExclusive(&shard->lock);
+
+    cache_disk_node_t **slot = index_slot(shard, key_hash);
+    cache_disk_node_t *node = *slot;
+    while (node) {
+        if (node->key_hash == key_hash && memcmp(node->key_fingerprint, fingerprint, 16) == 0) break;
+        node = node->hnext;
+    }
+
+    if (!node) {
+        node = (cache_disk_node_t *)calloc(1, sizeof(cache_disk_node_t));
+        if (!node) {
+            ReleaseSRWLockExclusive(&shard->lock);
+            return -1;
+        }
+        node->key_hash = key_hash;
+        memcpy(node->key_fingerprint, fingerprint, 16);
+        node->hnext = *slot;
+        *slot = node;
+        shard->items++;
+    }
+    node->item = item;
+
+    ReleaseSRWLockExclusive(&shard->lock);
+    return 0;
+}
+
+int cache_disk_put(uint64_t key_hash, const char *fingerprint, const cache_value_t *val) {
+    if (!val) return -1;
+    const cache_body_t *body = val->body;
+    if (!body || !body->complete || body->len == 0 || body->len > UINT32_MAX) return -1;
+
+    cache_disk_writer_t w;
+    if (cache_disk_begin(&w, key_hash, fingerprint, val, (uint32_t)body->len) != 0) {
+        return -1;
+    }
+    for (const cache_segment_t *bs = body->head; bs; bs = bs->next) {
+        if (cache_disk_write(&w, bs->data, bs->len) != 0) {
+            cache_disk_abandon(&w);
+            return -1;
+        }
+    }
+    return cache_disk_commit(&w);
+}
+
+int cache_disk_lookup(uint64_t key_hash, const char *fingerprint, cache_disk_item_t *out) {
+    if (!g_disk_initialized || !fingerprint || !out) return -1;
+
+    cache_disk_index_shard_t *shard = index_shard(key_hash);
+    uint32_t now = (uint32_t)time(NULL);
+    int found = 0;
+
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_disk_node_t **pp = index_slot(shard, key_hash);
+    while (*pp) {
+        cache_disk_node_t *node = *pp;
+        if (node->key_hash == key_hash && memcmp(node->key_fingerprint, fingerprint, 16) == 0) {
+            if (now < node->item.expires_at && item_is_live(&node->item)) {
+                *out = node->item;
+                found = 1;
+            } else {
+                *pp = node->hnext;
+                free(node);
+                if (shard->items > 0) shard->items--;
+            }
+            break;
+        }
+        pp = &node->hnext;
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+
+    if (found) {
+        InterlockedIncrement64(&g_disk.hits);
+        return 0;
+    }
+    InterlockedIncrement64(&g_disk.misses);
+    return -1;
+}
+
+int cache_disk_invalidate(uint64_t key_hash, const char *fingerprint) {
+    if (!g_disk_initialized || !fingerprint) return -1;
+
+    int rc = -1;
+    cache_disk_index_shard_t *shard = index_shard(key_hash);
+    AcquireSRWLockExclusive(&shard->lock);
+    cache_disk_node_t **pp = index_slot(shard, key_hash);
+    while (*pp) {
+        cache_disk_node_t *node = *pp;
+        if (node->key_hash == key_hash && memcmp(node->key_fingerprint, fingerprint, 16) == 0) {
+            *pp = node->hnext;
+            free(node);
+            if (shard->items > 0) shard->items--;
+            rc = 0;
+            break;
+        }
+        pp = &node->hnext;
+    }
+    ReleaseSRWLockExclusive(&shard->lock);
+    return rc;
+}
+
+static int send_tls(SSL *ssl, const char *buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int n = SSL_write(ssl, buf + sent, len - sent);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+int cache_disk_send_span(void *client_fd, void *ssl, const cache_disk_item_t *item,
+                         const char *head, int head_len, uint64_t offset, uint64_t len,
+                         const char *tail, int tail_len) {
+    if (!g_disk_initialized || !client_fd || !item) return -1;
+    if (item->segment >= g_disk.nsegments || offset + len > item->body_len) return -1;
+
+    cache_disk_segment_t *seg = &g_disk.segments[item->segment];
+    InterlockedIncrement(&seg->readers);
+    if ((uint32_t)seg->generation != item->generation) {
+        InterlockedDecrement(&seg->readers);
+        return -1;
+    }
+
+    SOCKET fd = (SOCKET)(uintptr_t)client_fd;
+    int rc = 0;
+
+    if (!ssl) {
+        // Plain socket: head, body and tail go out in one kernel call, no user-space copy
+        char path[MAX_PATH + 32];
+        segment_path(item->segment, path, sizeof(path));
+        HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            InterlockedDecrement(&seg->readers);
+            return -1;
+        }
+
+        LARGE_INTEGER pos;
+        pos.QuadPart = (LONGLONG)(item->offset + offset);
+        TRANSMIT_FILE_BUFFERS tfb;
+        memset(&tfb, 0, sizeof(tfb));
+        tfb.Head = (LPVOID)head;
+        tfb.HeadLength = head ? (DWORD)head_len : 0;
+        tfb.Tail = (LPVOID)tail;
+        tfb.TailLength = tail ? (DWORD)tail_len : 0;
+
+        if (!SetFilePointerEx(h, pos, NULL, FILE_BEGIN) ||
+            !TransmitFile(fd, h, (DWORD)len, 0, NULL, &tfb, 0)) {
+            rc = -1;
+        }
+        CloseHandle(h);
+    } else {
+        // TLS needs the plaintext in user space: stream the body in fixed chunks
+        SSL *ssl_ptr = (SSL *)ssl;
+        char *chunk = (char *)malloc(DISK_SEND_CHUNK);
+        if (!chunk || (head && send_tls(ssl_ptr, head, head_len) != 0)) {
+            rc = -1;
+        } else {
+            uint64_t done = 0;
+            while (done < len) {
+                uint32_t n = (uint32_t)(len - done);
+                if (n > DISK_SEND_CHUNK) n = DISK_SEND_CHUNK;
+                if (read_at(seg->handle, item->offset + offset + done, chunk, n) != 0 ||
+                    send_tls(ssl_ptr, chunk, (int)n) != 0) {
+                    rc = -1;
+                    break;
+                }
+                done += n;
+            }
+            if (rc == 0 && tail && send_tls(ssl_ptr, tail, tail_len) != 0) rc = -1;
+        }
+        free(chunk);
+    }
+
+    InterlockedDecrement(&seg->readers);
+    return rc;
+}
+
+int cache_disk_read_header(const cache_disk_item_t *item, char *out, size_t out_size) {
+    if (!g_disk_initialized || !item || !out || item->header_len == 0) return -1;
+    if (item->segment >= g_disk.nsegments || item->header_len > out_size) return -1;
+
+    cache_disk_segment_t *seg = &g_disk.segments[item->segment];
+    InterlockedIncrement(&seg->readers);
+    int rc = -1;
+    if ((uint32_t)seg->generation == item->generation) {
+        rc = read_at(seg->handle, item->offset - item->header_len, out, item->header_len);
+    }
+    InterlockedDecrement(&seg->readers);
+    return rc;
+}
+
+int cache_disk_send(void *client_fd, void *ssl, const cache_disk_item_t *item) {
+    if (!g_disk_initialized || !client_fd || !item) return -1;
+
+    if (item->header_len == 0) {
+        char header[1024];
+        int hlen = cache_build_hit_header(header, sizeof(header), item->status_code,
+                                          item->content_type, item->body_len, item->expires_at,
+                                          item->etag, item->last_modified);
+        if (hlen <= 0) return -1;
+        return cache_disk_send_span(client_fd, ssl, item, header, hlen, 0, item->body_len, NULL, 0);
+    }
+
+    // Stored origin header; only the per-hit lines are formatted here
+    uint32_t now = (uint32_t)time(NULL);
+    if (now >= item->expires_at) return -1;
+    size_t cap = (size_t)item->header_len + 512;
+    char *head = (char *)malloc(cap);
+    if (!head) return -1;
+    if (cache_disk_read_header(item, head, cap) != 0) {
+        free(head);
+        return -1;
+    }
+    uint32_t age = now > item->age_base ? now - item->age_base : 0;
+    int n = snprintf(head + item->header_len, cap - item->header_len,
+                     "Content-Length: %u\r\n"
+                     "Age: %u\r\n"
+                     "%s%s%s"
+                     "%s"
+                     "%s"
+                     "X-Cache: HIT\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     item->body_len, age,
+                     item->etag[0] ? "ETag: " : "", item->etag, item->etag[0] ? "\r\n" : "",
+                     item->compressible ? "Vary: Accept-Encoding\r\n" : "",
+                     item->status_code == 200 ? "Accept-Ranges: bytes\r\n" : "");
+    int rc = -1;
+    if (n > 0 && (size_t)n < cap - item->header_len) {
+        rc = cache_disk_send_span(client_fd, ssl, item, head, (int)item->header_len + n,
+                                  0, item->body_len, NULL, 0);
+    }
+    free(head);
+    return rc;
+}
+
+void cache_disk_get_metrics(uint64_t *hits, uint64_t *misses, uint64_t *items, uint64_t *bytes_written) {
+    if (hits) *hits = 0;
+    if (misses) *misses = 0;
+    if (items) *items = 0;
+    if (bytes_written) *bytes_written = 0;
+    if (!g_disk_initialized) return;
+
+    if (hits) *hits = (uint64_t)g_disk.hits;
+    if (misses) *misses = (uint64_t)g_disk.misses;
+    if (bytes_written) *bytes_written = (uint64_t)g_disk.bytes_written;
+    if (items) {
+        for (int i = 0; i < CACHE_DISK_INDEX_SHARDS; i++) {
+            cache_disk_index_shard_t *shard = &g_disk.index[i];
+            AcquireSRWLockShared(&shard->lock);
+            *items += shard->items;
+            ReleaseSRWLockShared(&shard->lock);
+        }
+    }
+}
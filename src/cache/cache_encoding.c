@@ -0,0 +1,212 @@
+#include <winsock2.h>
+#include <zlib.h>
+#include "../include/cache_encoding.h"
+#include "../include/threadpool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Origins are always fetched with Accept-Encoding: identity, so one cache
+// entry holds the identity body and, for compressible content, a gzip
+// variant built off the request path. Hits pick the variant per request.
+
+extern ThreadPool pool;
+
+typedef struct {
+    uint64_t key_hash;
+    char fingerprint[16];
+    cache_value_t *val;   // own reference
+} gzip_job_t;
+
+static volatile LONG64 g_variants = 0;
+static volatile LONG64 g_compressed_hits = 0;
+static volatile LONG64 g_bytes_saved = 0;
+
+// Finds the Accept-Encoding value in the request header; returns its length or -1
+static int find_accept_encoding(const char *req, const char **value_out) {
+    const char *hdr_end = strstr(req, "\r\n\r\n");
+    if (!hdr_end) return -1;
+
+    const char *line = strstr(req, "\r\n");
+    while (line && line < hdr_end) {
+        line += 2;
+        if (_strnicmp(line, "Accept-Encoding:", 16) == 0) {
+            const char *v = line + 16;
+            while (*v == ' ' || *v == '\t') v++;
+            const char *eol = strstr(v, "\r\n");
+            if (!eol || eol > hdr_end) eol = hdr_end;
+            *value_out = v;
+            return (int)(eol - v);
+        }
+        line = strstr(line, "\r\n");
+    }
+    return -1;
+}
+
+uint32_t cache_parse_accept_encoding(const char *request_buffer) {
+    if (!request_buffer) return CACHE_ENCODING_IDENTITY;
+
+    const char *v;
+    int len = find_accept_encoding(request_buffer, &v);
+    if (len <= 0) return CACHE_ENCODING_IDENTITY;
+
+    int gzip = -1, star = -1;
+    const char *end = v + len;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *tok = v;
+        while (v < end && *v != ',') v++;
+
+        const char *semi = memchr(tok, ';', (size_t)(v - tok));
+        const char *name_end = semi ? semi : v;
+        while (name_end > tok && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+        size_t name_len = (size_t)(name_end - tok);
+
+        // q=0 (any number of zero decimals) refuses the coding
+        int accepted = 1;
+        if (semi) {
+            const char *q = semi + 1;
+            while (q < v && (*q == ' ' || *q == '\t')) q++;
+            if (q + 1 < v && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                accepted = strtod(q + 2, NULL) > 0.0;
+            }
+        }
+
+        if ((name_len == 4 && _strnicmp(tok, "gzip", 4) == 0) ||
+            (name_len == 6 && _strnicmp(tok, "x-gzip", 6) == 0)) {
+            gzip = accepted;
+        } else if (name_len == 1 && tok[0] == '*') {
+            star = accepted;
+        }
+    }
+
+    if (gzip == 1 || (gzip == -1 && star == 1)) return CACHE_ENCODING_GZIP;
+    return CACHE_ENCODING_IDENTITY;
+}
+
+int cache_content_type_compressible(const char *content_type) {
+    if (!content_type || !content_type[0]) return 0;
+    if (_strnicmp(content_type, "text/", 5) == 0) return 1;
+
+    static const char *types[] = {
+        "application/json", "application/javascript", "application/x-javascript",
+        "application/xml", "application/xhtml+xml", "application/rss+xml",
+        "application/atom+xml", "application/ld+json", "application/manifest+json",
+        "application/wasm", "image/svg+xml", "font/ttf", "font/otf",
+        "application/vnd.ms-fontobject", NULL
+    };
+    for (int i = 0; types[i]; i++) {
+        size_t n = strlen(types[i]);
+        if (_strnicmp(content_type, types[i], n) == 0 &&
+            (content_type[n] == '\0' || content_type[n] == ';' || content_type[n] == ' ')) {
+            return 1;
+        }
+    }
+    // application/problem+json, application/vnd.api+json, ...
+    const char *semi = strchr(content_type, ';');
+    size_t len = semi ? (size_t)(semi - content_type) : strlen(content_type);
+    return (len > 5 && _strnicmp(content_type + len - 5, "+json", 5) == 0) ||
+           (len > 4 && _strnicmp(content_type + len - 4, "+xml", 4) == 0);
+}
+
+static int deflate_into(z_stream *zs, int flush, cache_body_t *out) {
+    uint8_t buf[CACHE_SEGMENT_BYTES];
+    int rc;
+    do {
+        zs->next_out = buf;
+        zs->avail_out = sizeof(buf);
+        rc = deflate(zs, flush);
+        if (rc == Z_STREAM_ERROR) return -1;
+        size_t produced = sizeof(buf) - zs->avail_out;
+        if (produced > 0 && cache_body_append(out, buf, produced) != 0) return -1;
+    } while (zs->avail_out == 0);
+    return flush == Z_FINISH && rc != Z_STREAM_END ? -1 : 0;
+}
+
+// The body is complete, so its segments no longer change and need no lock
+static cache_body_t *gzip_body(const cache_body_t *body) {
+    cache_body_t *gz = cache_body_create();
+    if (!gz) return NULL;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, CACHE_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        cache_body_free(gz);
+        return NULL;
+    }
+
+    int rc = 0;
+    for (const cache_segment_t *seg = body->head; seg && rc == 0; seg = seg->next) {
+        zs.next_in = (Bytef *)seg->data;
+        zs.avail_in = seg->len;
+        rc = deflate_into(&zs, Z_NO_FLUSH, gz);
+    }
+    if (rc == 0) rc = deflate_into(&zs, Z_FINISH, gz);
+    deflateEnd(&zs);
+
+    if (rc != 0) {
+        cache_body_free(gz);
+        return NULL;
+    }
+    cache_body_finish(gz);
+    return gz;
+}
+
+static void gzip_task(void *arg) {
+    gzip_job_t *job = (gzip_job_t *)arg;
+    cache_value_t *val = job->val;
+
+    cache_body_t *gz = gzip_body(val->body);
+    if (gz && gz->len * CACHE_GZIP_MIN_SAVING < (uint64_t)val->body_len * (CACHE_GZIP_MIN_SAVING - 1)) {
+        if (cache_attach_gzip(job->key_hash, job->fingerprint, val, gz) == 0) {
+            InterlockedIncrement64(&g_variants);
+            gz = NULL;
+        } else {
+            // Replaced or evicted meanwhile; let a later fill try again
+            InterlockedExchange(&val->gz_state, CACHE_VARIANT_NONE);
+        }
+    } else {
+        InterlockedExchange(&val->gz_state, CACHE_VARIANT_SKIPPED);
+    }
+
+    cache_body_free(gz);
+    cache_value_release(val);
+    free(job);
+}
+
+int cache_gzip_schedule(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    if (!fingerprint || !val || !val->body || !val->compressible) return -1;
+    if (val->body_len < CACHE_GZIP_MIN_BYTES || val->body_len > CACHE_MAX_OBJECT_BYTES) return -1;
+    if (!cache_body_is_complete(val->body)) return -1;
+    if (InterlockedCompareExchange(&val->gz_state, CACHE_VARIANT_PENDING, CACHE_VARIANT_NONE) != CACHE_VARIANT_NONE) {
+        return -1;
+    }
+
+    gzip_job_t *job = (gzip_job_t *)malloc(sizeof(gzip_job_t));
+    if (!job) {
+        InterlockedExchange(&val->gz_state, CACHE_VARIANT_NONE);
+        return -1;
+    }
+    job->key_hash = key_hash;
+    memcpy(job->fingerprint, fingerprint, 16);
+    cache_value_acquire(val);
+    job->val = val;
+
+    if (enqueueThreadPool(&pool, gzip_task, job) != 0) {
+        InterlockedExchange(&val->gz_state, CACHE_VARIANT_NONE);
+        cache_value_release(val);
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+void cache_encoding_record_hit(uint64_t saved) {
+    InterlockedIncrement64(&g_compressed_hits);
+    InterlockedExchangeAdd64(&g_bytes_saved, (LONG64)saved);
+}
+
+void cache_encoding_get_metrics(uint64_t *variants, uint64_t *compressed_hits, uint64_t *bytes_saved) {
+    if (variants) *variants = (uint64_t)g_variants;
+    if (compressed_hits) *compressed_hits = (uint64_t)g_compressed_hits;
+    if (bytes_saved) *bytes_saved = (uint64_t)g_bytes_saved;
+}
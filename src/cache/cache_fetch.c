@@ -0,0 +1,482 @@
+#include <winsock2.h>
+#include <openssl/ssl.h>
+#include "../include/cache_fetch.h"
+#include "../include/cache_disk.h"
+#include "../include/client.h"
+#include "../include/config.h"
+#include "../include/http_processor.h"
+#include "../include/logger.h"
+#include "../include/threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FETCH_HEADER_MAX 65536
+#define FETCH_READ_CHUNK 16384
+
+extern SSL_CTX *global_ssl_ctx;
+
+static ThreadPool g_background;
+static volatile LONG g_background_running = 0;
+
+void cache_fetch_start(void) {
+    if (InterlockedCompareExchange(&g_background_running, 1, 0) != 0) return;
+    initThreadPoolBounded(&g_background, CACHE_FETCH_WORKERS, CACHE_FETCH_QUEUE_MAX);
+}
+
+void cache_fetch_stop(void) {
+    if (InterlockedCompareExchange(&g_background_running, 0, 1) != 1) return;
+    shutdownThreadPool(&g_background);
+}
+
+int cache_fetch_submit(void (*task)(void *), void *arg) {
+    if (!task || !g_background_running) return -1;
+    return enqueueThreadPool(&g_background, task, arg);
+}
+
+static int fetch_send_all(SOCKET fd, SSL *ssl, const char *buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int n = ssl ? SSL_write(ssl, buf + sent, len - sent)
+                    : send(fd, buf + sent, len - sent, 0);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static int fetch_recv(SOCKET fd, SSL *ssl, char *buf, int len) {
+    return ssl ? SSL_read(ssl, buf, len) : recv(fd, buf, len, 0);
+}
+
+static int fetch_connect(const cache_fetch_req_t *req, SOCKET *fd, SSL **ssl) {
+    *fd = INVALID_SOCKET;
+    *ssl = NULL;
+    if (req->is_https) {
+        BackendConnection c;
+        if (connect_to_backend_https(req->backend_host, req->backend_port, &c, global_ssl_ctx) != 0) return -1;
+        *fd = c.sock;
+        *ssl = c.ssl;
+        return 0;
+    }
+    return connect_to_backend(req->backend_host, req->backend_port, fd) != 0 ? -1 : 0;
+}
+
+static void fetch_close(SOCKET fd, SSL *ssl) {
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    if (fd != INVALID_SOCKET) closesocket(fd);
+}
+
+// Reads up to the end of the response header; returns its length or -1.
+// *buffered counts every byte read, including body bytes past the header
+static int fetch_read_header(SOCKET fd, SSL *ssl, char *buf, int *buffered) {
+    *buffered = 0;
+    char *hdr_end = NULL;
+    while (!hdr_end) {
+        if (*buffered >= FETCH_HEADER_MAX) return -1;
+        int n = fetch_recv(fd, ssl, buf + *buffered, FETCH_HEADER_MAX - *buffered);
+        if (n <= 0) return -1;
+        *buffered += n;
+        buf[*buffered] = '\0';
+        hdr_end = strstr(buf, "\r\n\r\n");
+    }
+    return (int)(hdr_end - buf) + 4;
+}
+
+int cache_fetch_run(cache_fetch_req_t *req) {
+    if (!req || !req->backend_host[0]) return -1;
+
+    SOCKET fd;
+    SSL *ssl;
+    if (fetch_connect(req, &fd, &ssl) != 0) return -1;
+
+    int rc = -1;
+    char *header_buf = NULL;
+    cache_buffer_t buf;
+    memset(&buf, 0, sizeof(buf));
+    cache_key_info_t *key_info = &req->key_info;
+    key_info->should_cache = 1;
+
+    // Revalidate with the stale copy's validators so an unchanged object costs a 304
+    char validators[256] = "";
+    if (req->stale) {
+        cache_build_revalidation_headers(req->stale, validators, sizeof(validators));
+        key_info->has_stale = 1;
+    }
+
+    char request[2048];
+    int req_len = snprintf(request, sizeof(request),
+                           "GET %s%s%s HTTP/1.1\r\n"
+                           "Host: %s\r\n"
+                           "Accept-Encoding: identity\r\n"
+                           "%s"
+                           "Connection: close\r\n"
+                           "\r\n",
+                           req->path[0] ? req->path : "/",
+                           req->query[0] ? "?" : "", req->query,
+                           req->host, validators);
+    if (req_len <= 0 || req_len >= (int)sizeof(request)) goto done;
+    if (fetch_send_all(fd, ssl, request, req_len) != 0) goto done;
+
+    header_buf = (char *)malloc(FETCH_HEADER_MAX + 1);
+    if (!header_buf) goto done;
+
+    int buffered = 0;
+    int header_len = fetch_read_header(fd, ssl, header_buf, &buffered);
+    if (header_len < 0) goto done;
+    int body_len = buffered - header_len;
+
+    // Store the same rewritten headers a client-driven fill would
+    Proxy_Config *config = get_config();
+    char *modified = (char *)malloc(FETCH_HEADER_MAX + 1);
+    int new_len = -1;
+    if (modified && config) {
+        new_len = modify_response_headers(header_buf, header_len, modified, FETCH_HEADER_MAX,
+                                          req->backend_host, req->backend_port,
+                                          config->listen_host, config->listen_port);
+        if (new_len > 0) modified[new_len] = '\0';
+    }
+
+    uint32_t status = 0;
+    long long content_length = -1;
+    int is_chunked = 0;
+    int parsed = cache_process_response_headers(new_len > 0 ? modified : header_buf,
+                                                new_len > 0 ? new_len : header_len,
+                                                body_len, "GET", key_info, &buf,
+                                                req->max_object_bytes, req->ttl_seconds,
+                                                &status, &content_length, &is_chunked);
+    free(modified);
+    if (parsed != 0) {
+        goto done;
+    }
+    if (status == 304 && req->stale) {
+        rc = cache_refresh_ttl(key_info->key_hash, key_info->key_fingerprint,
+                               req->stale, key_info->response_ttl);
+        goto done;
+    }
+    if (!key_info->should_cache) {
+        goto done;
+    }
+
+    if (body_len > 0 &&
+        cache_buffer_append(&buf, (const uint8_t *)header_buf + header_len, (size_t)body_len) != 0) {
+        goto done;
+    }
+
+    while (!buf.complete) {
+        int n = fetch_recv(fd, ssl, header_buf, FETCH_READ_CHUNK);
+        if (n <= 0) break;
+        if (cache_buffer_append(&buf, (const uint8_t *)header_buf, (size_t)n) != 0) goto done;
+    }
+
+    rc = cache_try_store(key_info, &buf, req->host, req->path, req->query[0] ? req->query : NULL);
+
+done:
+    cache_release_fill_leader(key_info);
+    cache_buffer_free(&buf, key_info);
+    free(header_buf);
+    fetch_close(fd, ssl);
+    return rc;
+}
+
+cache_value_t *cache_fetch_slice(const cache_fetch_req_t *req, uint32_t slice,
+                                 uint64_t slice_hash, const char *slice_fp) {
+    if (!req || !req->backend_host[0] || !slice_fp) return NULL;
+
+    SOCKET fd;
+    SSL *ssl;
+    if (fetch_connect(req, &fd, &ssl) != 0) return NULL;
+
+    cache_value_t *val = NULL;
+    char *header_buf = NULL;
+    uint64_t first = (uint64_t)slice * CACHE_RANGE_SLICE_BYTES;
+
+    char request[2048];
+    int req_len = snprintf(request, sizeof(request),
+                           "GET %s%s%s HTTP/1.1\r\n"
+                           "Host: %s\r\n"
+                           "Accept-Encoding: identity\r\n"
+                           "Range: bytes=%llu-%llu\r\n"
+                           "Connection: close\r\n"
+                           "\r\n",
+                           req->path[0] ? req->path : "/",
+                           req->query[0] ? "?" : "", req->query, req->host,
+                           (unsigned long long)first,
+                           (unsigned long long)(first + CACHE_RANGE_SLICE_BYTES - 1));
+    if (req_len <= 0 || req_len >= (int)sizeof(request)) goto done;
+    if (fetch_send_all(fd, ssl, request, req_len) != 0) goto done;
+
+    header_buf = (char *)malloc(FETCH_HEADER_MAX + 1);
+    if (!header_buf) goto done;
+    int buffered = 0;
+    int header_len = fetch_read_header(fd, ssl, header_buf, &buffered);
+    if (header_len < 0) goto done;
+    const char *hdr_end = header_buf + header_len - 4;
+
+    // Only a 206 for exactly this slice will do; origins without range support send 200
+    const char *sp = strchr(header_buf, ' ');
+    char value[128];
+    unsigned long long r_first, r_last, r_total;
+    if (!sp || sp > hdr_end || atoi(sp + 1) != 206 ||
+        cache_header_value(header_buf, hdr_end, "Content-Range", value, sizeof(value)) < 0 ||
+        sscanf(value, "bytes %llu-%llu/%llu", &r_first, &r_last, &r_total) != 3 ||
+        r_first != first || r_last < r_first || r_last >= r_total ||
+        r_last - r_first >= CACHE_RANGE_SLICE_BYTES ||
+        cache_header_value(header_buf, hdr_end, "Transfer-Encoding", value, sizeof(value)) >= 0) {
+        goto done;
+    }
+    uint64_t len = r_last - r_first + 1;
+    int body_len = buffered - header_len;
+    if ((uint64_t)body_len > len) goto done;
+
+    char content_type[64] = "application/octet-stream";
+    cache_header_value(header_buf, hdr_end, "Content-Type", content_type, sizeof(content_type));
+
+    cache_freshness_t fresh;
+    cache_parse_freshness(header_buf, hdr_end, &fresh);
+    uint32_t ttl = cache_freshness_ttl(&fresh, &req->key_info, req->ttl_seconds);
+
+    val = cache_value_create(206, content_type, (long long)len);
+    if (!val) goto done;
+    val->tenant = req->key_info.tenant;
+    if (body_len > 0 &&
+        cache_body_append(val->body, (const uint8_t *)header_buf + header_len, (size_t)body_len) != 0) {
+        goto fail;
+    }
+    for (uint64_t got = (uint64_t)body_len; got < len; ) {
+        int n = fetch_recv(fd, ssl, header_buf, FETCH_READ_CHUNK);
+        if (n <= 0) goto fail;
+        if ((uint64_t)n > len - got) n = (int)(len - got);
+        if (cache_body_append(val->body, (const uint8_t *)header_buf, (size_t)n) != 0) goto fail;
+        got += (uint64_t)n;
+    }
+    cache_body_finish(val->body);
+    val->body_len = (uint32_t)len;
+    val->range_total = r_total;
+    uint32_t now = (uint32_t)time(NULL);
+    val->age_base = now - (uint32_t)fresh.age;
+    val->expires_at = now + ttl;
+
+    // Prefix purges reach slices kept in RAM like any other entry
+    if (req->key_info.npath_tags > 0) {
+        val->tags = (uint64_t *)malloc(req->key_info.npath_tags * sizeof(uint64_t));
+        if (val->tags) {
+            memcpy(val->tags, req->key_info.path_tags, req->key_info.npath_tags * sizeof(uint64_t));
+            val->ntags = req->key_info.npath_tags;
+        }
+    }
+
+    // Not storable (no-store, private, ...): still good for this response
+    if (ttl > 0) {
+        cache_note_slice(req->key_info.key_hash, req->key_info.key_fingerprint, slice, val->expires_at);
+        cache_restore_value(slice_hash, slice_fp, val);
+    }
+    goto done;
+
+fail:
+    cache_value_release(val);
+    val = NULL;
+done:
+    free(header_buf);
+    fetch_close(fd, ssl);
+    return val;
+}
+
+// One slice, either in RAM or on disk
+typedef struct {
+    cache_value_t *val;          // RAM copy (own reference), NULL for a disk copy
+    cache_disk_item_t item;
+    uint64_t total;
+    uint64_t len;
+    uint32_t expires_at;
+    char content_type[64];
+    int from_origin;
+} slice_ref_t;
+
+static int lookup_slice(uint64_t slice_hash, const char *slice_fp, slice_ref_t *ref) {
+    cache_value_t *val = NULL;
+    if (cache_get_key(slice_hash, slice_fp, &val) == CACHE_RESULT_HIT && val->range_total && val->body_len) {
+        ref->val = val;
+        ref->total = val->range_total;
+        ref->len = val->body_len;
+        ref->expires_at = val->expires_at;
+        snprintf(ref->content_type, sizeof(ref->content_type), "%s", val->content_type);
+        return 0;
+    }
+    cache_value_release(val);
+
+    if (cache_disk_lookup(slice_hash, slice_fp, &ref->item) == 0 && ref->item.range_total) {
+        ref->total = ref->item.range_total;
+        ref->len = ref->item.body_len;
+        ref->expires_at = ref->item.expires_at;
+        snprintf(ref->content_type, sizeof(ref->content_type), "%s", ref->item.content_type);
+        return 0;
+    }
+    return -1;
+}
+
+static int get_slice(const cache_fetch_req_t *req, uint32_t slice, slice_ref_t *ref) {
+    uint64_t slice_hash;
+    char slice_fp[16];
+    cache_slice_key(req->key_info.key_hash, req->key_info.key_fingerprint, slice, &slice_hash, slice_fp);
+    memset(ref, 0, sizeof(*ref));
+    if (lookup_slice(slice_hash, slice_fp, ref) == 0) return 0;
+
+    // Concurrent seeks into the same slice share one origin fetch
+    int leader = cache_fill_begin(slice_hash, slice_fp);
+    if (!leader && cache_fill_wait(slice_hash, slice_fp, CACHE_FILL_WAIT_MS) == 0 &&
+        lookup_slice(slice_hash, slice_fp, ref) == 0) {
+        return 0;
+    }
+    cache_value_t *val = cache_fetch_slice(req, slice, slice_hash, slice_fp);
+    if (leader) cache_fill_end(slice_hash, slice_fp);
+    if (!val) return -1;
+
+    ref->val = val;
+    ref->total = val->range_total;
+    ref->len = val->body_len;
+    ref->expires_at = val->expires_at;
+    snprintf(ref->content_type, sizeof(ref->content_type), "%s", val->content_type);
+    ref->from_origin = 1;
+    return 0;
+}
+
+int cache_fetch_serve_range(void *client_fd, void *ssl, const cache_fetch_req_t *req,
+                            const cache_range_t *range, const char *method,
+                            uint64_t bytes_in, uint64_t *bytes_out) {
+    if (!client_fd || !req || !range || !bytes_out) return 0;
+    // One unconditional "N-" or "N-M" range; slices are above the RAM limit, so the disk tier holds them
+    if (range->count != 1 || range->first[0] < 0 || range->if_range[0]) return 0;
+    if (cache_disk_max_object_bytes() < CACHE_RANGE_SLICE_BYTES) return 0;
+
+    uint64_t first = (uint64_t)range->first[0];
+    if (first / CACHE_RANGE_SLICE_BYTES >= CACHE_RANGE_MAX_SLICES) return 0;
+    uint32_t slice = (uint32_t)(first / CACHE_RANGE_SLICE_BYTES);
+
+    uint64_t pos = first, last = 0, total = 0, sent = 0;
+    int attempted = 0, all_cached = 1, rc = 1;
+    for (;;) {
+        slice_ref_t ref;
+        if (get_slice(req, slice, &ref) != 0) {
+            rc = attempted ? -1 : 0;
+            break;
+        }
+        if (ref.from_origin) all_cached = 0;
+
+        if (!attempted) {
+            total = ref.total;
+            last = range->last[0] < 0 || (uint64_t)range->last[0] >= total ? total - 1 : (uint64_t)range->last[0];
+        }
+        // The object changed at origin between slices, or a slice came up short
+        uint64_t slice_start = (uint64_t)slice * CACHE_RANGE_SLICE_BYTES;
+        if (ref.total != total || pos < slice_start || pos - slice_start >= ref.len) {
+            cache_value_release(ref.val);
+            rc = attempted ? -1 : 0;
+            break;
+        }
+        uint64_t off = pos - slice_start;
+        uint64_t len = ref.len - off;
+        if (len > last - pos + 1) len = last - pos + 1;
+
+        char head[512];
+        int head_len = 0;
+        if (!attempted) {
+            uint32_t now = (uint32_t)time(NULL);
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 206 Partial Content\r\n"
+                                "Content-Type: %s\r\n"
+                                "Content-Length: %llu\r\n"
+                                "Content-Range: bytes %llu-%llu/%llu\r\n"
+                                "Cache-Control: public, max-age=%u\r\n"
+                                "Accept-Ranges: bytes\r\n"
+                                "X-Cache: %s\r\n"
+                                "Connection: close\r\n"
+                                "\r\n",
+                                ref.content_type,
+                                (unsigned long long)(last - first + 1),
+                                (unsigned long long)first, (unsigned long long)last,
+                                (unsigned long long)total,
+                                ref.expires_at > now ? ref.expires_at - now : 0,
+                                ref.from_origin ? "MISS" : "HIT");
+            if (head_len <= 0 || head_len >= (int)sizeof(head)) {
+                cache_value_release(ref.val);
+                rc = 0;
+                break;
+            }
+        }
+
+        attempted = 1;
+        int send_rc = ref.val ?
+            cache_send_body_span(client_fd, ssl, ref.val->body, head_len ? head : NULL, head_len, off, len) :
+            cache_disk_send_span(client_fd, ssl, &ref.item, head_len ? head : NULL, head_len, off, len, NULL, 0);
+        cache_value_release(ref.val);
+        if (send_rc != 0) {
+            rc = -1;
+            break;
+        }
+        sent += len;
+        pos += len;
+        if (pos > last) break;
+        if (++slice >= CACHE_RANGE_MAX_SLICES) {
+            rc = -1;
+            break;
+        }
+    }
+    if (!attempted) return 0;
+
+    *bytes_out = sent;
+    cache_record_metrics(req->path, req->query[0] ? req->query : NULL, method, 206, req->host,
+                         bytes_in, sent, all_cached, 1);
+    return rc;
+}
+
+static void refresh_task(void *arg) {
+    cache_fetch_req_t *req = (cache_fetch_req_t *)arg;
+
+    // Join collapsing so foreground misses wait on the refresh instead of racing it;
+    // a fill of the key already in flight refreshes it for us
+    cache_key_info_t *ki = &req->key_info;
+    if (cache_fill_begin(ki->key_hash, ki->key_fingerprint)) {
+        ki->fill_leader = 1;
+        if (cache_fetch_run(req) != 0) {
+            char log_buf[640];
+            snprintf(log_buf, sizeof(log_buf), "[CACHE] Background refresh failed: %s%.500s",
+                     req->host, req->path);
+            log_message("WARN", log_buf);
+        }
+    }
+
+    if (req->stale) {
+        InterlockedExchange(&req->stale->refreshing, 0);
+        cache_value_release(req->stale);
+    }
+    free(req);
+}
+
+int cache_fetch_refresh_async(const cache_fetch_req_t *req, cache_value_t *stale) {
+    if (!req || !stale) return -1;
+    if (InterlockedCompareExchange(&stale->refreshing, 1, 0) != 0) return -1;
+
+    cache_fetch_req_t *copy = (cache_fetch_req_t *)malloc(sizeof(cache_fetch_req_t));
+    if (!copy) {
+        InterlockedExchange(&stale->refreshing, 0);
+        return -1;
+    }
+    memcpy(copy, req, sizeof(cache_fetch_req_t));
+    copy->key_info.fill_leader = 0;
+    copy->key_info.bypass_admission = 1;
+
+    cache_value_acquire(stale);
+    copy->stale = stale;
+    if (cache_fetch_submit(refresh_task, copy) != 0) {
+        InterlockedExchange(&stale->refreshing, 0);
+        cache_value_release(stale);
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
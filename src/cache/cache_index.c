@@ -0,0 +1,234 @@
+#include "../include/cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define INDEX_SSE2 1
+#endif
+
+// Swiss-table style index of a shard's entries. The low 6 key hash bits pick the
+// shard, bits 6.. the home group and the top 7 bits go in the control byte, so a
+// probe compares 16 control bytes at once and dereferences only entries whose
+// byte matches. Empty is 0 so calloc'ed tables need no initialisation pass.
+
+#define CTRL_EMPTY   0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL    0x80
+
+static inline uint8_t ctrl_tag(uint64_t key_hash) {
+    return (uint8_t)(CTRL_FULL | (key_hash >> 57));
+}
+
+static inline uint32_t home_group(uint64_t key_hash, uint32_t group_mask) {
+    return (uint32_t)(key_hash >> 6) & group_mask;
+}
+
+static inline uint32_t lowest_bit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (uint32_t)i;
+#else
+    return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+// Bit i set when control byte i of the group equals b
+static inline uint32_t group_match(const uint8_t *group, uint8_t b) {
+#ifdef INDEX_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < CACHE_INDEX_GROUP; i++) {
+        if (group[i] == b) mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i set when slot i of the group is empty or deleted
+static inline uint32_t group_match_free(const uint8_t *group) {
+#ifdef INDEX_SSE2
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group)) & 0xFFFFU;
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < CACHE_INDEX_GROUP; i++) {
+        if (!(group[i] & CTRL_FULL)) mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+static int table_alloc(cache_index_table_t *t, uint32_t capacity) {
+    memset(t, 0, sizeof(*t));
+    t->ctrl = (uint8_t *)calloc(capacity, 1);
+    t->slots = (cache_entry_t **)calloc(capacity, sizeof(cache_entry_t *));
+    if (!t->ctrl || !t->slots) {
+        free(t->ctrl);
+        free(t->slots);
+        t->ctrl = NULL;
+        t->slots = NULL;
+        return -1;
+    }
+    t->capacity = capacity;
+    return 0;
+}
+
+static void table_free(cache_index_table_t *t) {
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+// Triangular probing over groups visits every group once when their count is a power of two
+static cache_entry_t *table_find(const cache_index_table_t *t, uint64_t key_hash,
+                                 const char *fingerprint, uint32_t *slot_out) {
+    if (t->capacity == 0) return NULL;
+    uint32_t group_mask = t->capacity / CACHE_INDEX_GROUP - 1;
+    uint32_t g = home_group(key_hash, group_mask);
+    uint8_t tag = ctrl_tag(key_hash);
+
+    for (uint32_t step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *group = t->ctrl + (size_t)g * CACHE_INDEX_GROUP;
+        for (uint32_t m = group_match(group, tag); m; m &= m - 1) {
+            uint32_t slot = g * CACHE_INDEX_GROUP + lowest_bit(m);
+            cache_entry_t *entry = t->slots[slot];
+            if (entry->key_hash == key_hash && memcmp(entry->key_fingerprint, fingerprint, 16) == 0) {
+                if (slot_out) *slot_out = slot;
+                return entry;
+            }
+        }
+        // An empty slot ends every probe sequence that reaches this group
+        if (group_match(group, CTRL_EMPTY)) return NULL;
+        g = (g + step) & group_mask;
+    }
+    return NULL;
+}
+
+static void table_put(cache_index_table_t *t, cache_entry_t *entry) {
+    uint32_t group_mask = t->capacity / CACHE_INDEX_GROUP - 1;
+    uint32_t g = home_group(entry->key_hash, group_mask);
+
+    for (uint32_t step = 1; step <= group_mask + 1; step++) {
+        uint8_t *group = t->ctrl + (size_t)g * CACHE_INDEX_GROUP;
+        uint32_t m = group_match_free(group);
+        if (m) {
+            uint32_t i = lowest_bit(m);
+            if (group[i] == CTRL_DELETED) t->tombstones--;
+            group[i] = ctrl_tag(entry->key_hash);
+            t->slots[g * CACHE_INDEX_GROUP + i] = entry;
+            t->used++;
+            return;
+        }
+        g = (g + step) & group_mask;
+    }
+}
+
+static void table_erase(cache_index_table_t *t, uint32_t slot) {
+    uint8_t *group = t->ctrl + (size_t)(slot / CACHE_INDEX_GROUP) * CACHE_INDEX_GROUP;
+    // Probes stop at this group anyway if it still has an empty slot
+    if (group_match(group, CTRL_EMPTY)) {
+        t->ctrl[slot] = CTRL_EMPTY;
+    } else {
+        t->ctrl[slot] = CTRL_DELETED;
+        t->tombstones++;
+    }
+    t->slots[slot] = NULL;
+    t->used--;
+}
+
+static void migrate_groups(cache_index_t *idx, uint32_t groups) {
+    cache_index_table_t *old = &idx->old;
+    uint32_t ngroups = old->capacity / CACHE_INDEX_GROUP;
+
+    while (groups-- > 0 && idx->migrate_group < ngroups) {
+        uint32_t base = idx->migrate_group++ * CACHE_INDEX_GROUP;
+        for (uint32_t i = 0; i < CACHE_INDEX_GROUP; i++) {
+            if (!(old->ctrl[base + i] & CTRL_FULL)) continue;
+            table_put(&idx->cur, old->slots[base + i]);
+            // Deleted, not empty: entries further along their probe are still in old
+            old->ctrl[base + i] = CTRL_DELETED;
+            old->slots[base + i] = NULL;
+            old->used--;
+        }
+    }
+    if (idx->migrate_group >= ngroups) {
+        table_free(old);
+        idx->migrate_group = 0;
+    }
+}
+
+// Starts moving cur into a fresh table: twice the size if it is really full,
+// the same size if the load is mostly tombstones
+static int start_resize(cache_index_t *idx) {
+    if (idx->old.capacity) migrate_groups(idx, idx->old.capacity / CACHE_INDEX_GROUP);
+
+    uint32_t capacity = idx->cur.capacity;
+    if (idx->cur.used >= capacity / 16 * 7) {
+        if (capacity > 0x40000000U) return -1;
+        capacity *= 2;
+    }
+
+    cache_index_table_t fresh;
+    if (table_alloc(&fresh, capacity) != 0) return -1;
+    idx->old = idx->cur;
+    idx->cur = fresh;
+    idx->migrate_group = 0;
+    return 0;
+}
+
+int cache_index_init(cache_index_t *idx, uint32_t capacity) {
+    if (!idx) return -1;
+    memset(idx, 0, sizeof(*idx));
+
+    uint32_t cap = CACHE_INDEX_GROUP;
+    while (cap < capacity && cap < 0x40000000U) cap *= 2;
+    return table_alloc(&idx->cur, cap);
+}
+
+void cache_index_free(cache_index_t *idx) {
+    if (!idx) return;
+    table_free(&idx->cur);
+    table_free(&idx->old);
+    idx->migrate_group = 0;
+}
+
+cache_entry_t *cache_index_find(const cache_index_t *idx, uint64_t key_hash, const char *fingerprint) {
+    if (!idx || !fingerprint) return NULL;
+    cache_entry_t *entry = table_find(&idx->cur, key_hash, fingerprint, NULL);
+    if (!entry && idx->old.capacity) entry = table_find(&idx->old, key_hash, fingerprint, NULL);
+    return entry;
+}
+
+int cache_index_insert(cache_index_t *idx, cache_entry_t *entry) {
+    if (!idx || !entry) return -1;
+
+    // Keep at least one empty slot per probe and the load under 7/8
+    cache_index_table_t *t = &idx->cur;
+    if (t->used + t->tombstones + 1 > t->capacity / 8 * 7 && start_resize(idx) != 0 &&
+        t->used + t->tombstones + 1 >= t->capacity) {
+        return -1;
+    }
+
+    if (idx->old.capacity) migrate_groups(idx, CACHE_INDEX_MIGRATE_GROUPS);
+    table_put(&idx->cur, entry);
+    return 0;
+}
+
+void cache_index_remove(cache_index_t *idx, const cache_entry_t *entry) {
+    if (!idx || !entry) return;
+
+    uint32_t slot;
+    if (table_find(&idx->cur, entry->key_hash, entry->key_fingerprint, &slot) == entry) {
+        table_erase(&idx->cur, slot);
+    } else if (idx->old.capacity &&
+               table_find(&idx->old, entry->key_hash, entry->key_fingerprint, &slot) == entry) {
+        table_erase(&idx->old, slot);
+    }
+}
+
+uint32_t cache_index_count(const cache_index_t *idx) {
+    return idx ? idx->cur.used + idx->old.used : 0;
+}
@@ -0,0 +1,266 @@
+#include "../include/cache.h"
+#include <stdio.h>
+#include <string.h>
+
+// Cache keys are "METHOD:scheme://host/path?sorted-query|vary:...". The hot
+// path never builds that string: the parts are fed through a 128-bit
+// wyhash-style streaming hash, with the query sorted in place on the stack.
+
+#define KEY_MAX_PARAMS 64
+#define KEY_MAX_SORTED_QUERY 1024
+
+#define KH_P0 0xa0761d6478bd642fULL
+#define KH_P1 0xe7037ed1a0b428dbULL
+#define KH_P2 0x8ebc6af09c88c6e3ULL
+#define KH_P3 0x589965cc75374cc3ULL
+
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+    uint64_t total;
+    uint8_t buf[16];
+    size_t buf_len;
+} key_hasher_t;
+
+// One query parameter inside the original query string
+typedef struct {
+    const char *p;
+    uint16_t key_len;
+    uint16_t len;       // "k=v", or just "k" when the value is empty
+} query_param_t;
+
+uint64_t fnv1a_hash(const char *key, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t kh_mix(uint64_t x, uint64_t y) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)x * y;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t hi;
+    uint64_t lo = _umul128(x, y, &hi);
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t kh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline void kh_block(key_hasher_t *h, const uint8_t *p) {
+    uint64_t x = kh_read64(p);
+    uint64_t y = kh_read64(p + 8);
+    h->a = kh_mix(x ^ KH_P1, y ^ h->a);
+    h->b = kh_mix(y ^ KH_P2, x ^ h->b);
+}
+
+static void kh_init(key_hasher_t *h) {
+    h->a = KH_P0;
+    h->b = KH_P3;
+    h->total = 0;
+    h->buf_len = 0;
+}
+
+static void kh_update(key_hasher_t *h, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    h->total += len;
+
+    if (h->buf_len) {
+        size_t n = 16 - h->buf_len;
+        if (n > len) n = len;
+        memcpy(h->buf + h->buf_len, p, n);
+        h->buf_len += n;
+        p += n;
+        len -= n;
+        if (h->buf_len < 16) return;
+        kh_block(h, h->buf);
+        h->buf_len = 0;
+    }
+    for (; len >= 16; p += 16, len -= 16) {
+        kh_block(h, p);
+    }
+    if (len) {
+        memcpy(h->buf, p, len);
+        h->buf_len = len;
+    }
+}
+
+static inline void kh_str(key_hasher_t *h, const char *s) {
+    kh_update(h, s, strlen(s));
+}
+
+static void kh_final(key_hasher_t *h, uint64_t *hash_out, char *fingerprint_out) {
+    uint8_t tail[16] = {0};
+    memcpy(tail, h->buf, h->buf_len);
+    uint64_t a = kh_mix(kh_read64(tail) ^ KH_P1, h->a ^ h->total);
+    uint64_t b = kh_mix(kh_read64(tail + 8) ^ KH_P2, h->b ^ ~h->total);
+
+    // Both halves depend on both lanes
+    uint64_t lo = kh_mix(a ^ KH_P0, b ^ KH_P3);
+    uint64_t hi = kh_mix(b ^ KH_P1, a ^ KH_P2);
+    *hash_out = lo;
+    memcpy(fingerprint_out, &lo, 8);
+    memcpy(fingerprint_out + 8, &hi, 8);
+}
+
+static int param_less(const query_param_t *a, const query_param_t *b) {
+    size_t n = a->key_len < b->key_len ? a->key_len : b->key_len;
+    int cmp = memcmp(a->p, b->p, n);
+    return cmp < 0 || (cmp == 0 && a->key_len < b->key_len);
+}
+
+// Splits the query into parameters sorted by name (stable, so repeated
+// names keep their order). Returns the count, or -1 if the query is too
+// long or has too many parameters to reorder; such queries are used verbatim.
+static int split_query(const char *query, query_param_t *params) {
+    size_t query_len = strlen(query);
+    if (query_len > KEY_MAX_SORTED_QUERY) return -1;
+
+    int count = 0;
+    const char *p = query;
+    const char *end = query + query_len;
+    while (p < end) {
+        const char *amp = memchr(p, '&', (size_t)(end - p));
+        if (!amp) amp = end;
+        if (amp > p) {
+            if (count == KEY_MAX_PARAMS) return -1;
+            const char *eq = memchr(p, '=', (size_t)(amp - p));
+            query_param_t param;
+            param.p = p;
+            param.key_len = (uint16_t)((eq ? eq : amp) - p);
+            param.len = (eq && eq + 1 < amp) ? (uint16_t)(amp - p) : param.key_len;
+
+            // Insertion sort: queries are short and usually nearly sorted
+            int i = count++;
+            while (i > 0 && param_less(&param, &params[i - 1])) {
+                params[i] = params[i - 1];
+                i--;
+            }
+            params[i] = param;
+        }
+        p = amp + 1;
+    }
+    return count;
+}
+
+int cache_key_compute(const char *method, const char *scheme,
+                      const char *host, const char *path,
+                      const char *query, const char *vary_header,
+                      uint64_t *hash_out, char *fingerprint_out) {
+    if (!hash_out || !fingerprint_out) return -1;
+
+    key_hasher_t h;
+    kh_init(&h);
+    kh_str(&h, method ? method : "GET");
+    kh_update(&h, ":", 1);
+    kh_str(&h, scheme ? scheme : "http");
+    kh_update(&h, "://", 3);
+    kh_str(&h, host ? host : "");
+    kh_str(&h, path ? path : "/");
+
+    if (query && query[0]) {
+        query_param_t params[KEY_MAX_PARAMS];
+        int count = split_query(query, params);
+        if (count < 0) {
+            kh_update(&h, "?", 1);
+            kh_str(&h, query);
+        }
+        for (int i = 0; i < count; i++) {
+            kh_update(&h, i == 0 ? "?" : "&", 1);
+            kh_update(&h, params[i].p, params[i].len);
+        }
+    }
+
+    kh_update(&h, "|vary:", 6);
+    kh_str(&h, vary_header ? vary_header : "");
+    kh_final(&h, hash_out, fingerprint_out);
+    return 0;
+}
+
+int build_cache_key(const char *method, const char *scheme,
+                   const char *host, const char *path,
+                   const char *query, const char *vary_header,
+                   char *key_buf, size_t key_buf_size) {
+    if (!key_buf || key_buf_size == 0) return -1;
+
+    int n = _snprintf(key_buf, key_buf_size, "%s:%s://%s%s",
+                      method ? method : "GET", scheme ? scheme : "http",
+                      host ? host : "", path ? path : "/");
+    if (n < 0 || (size_t)n >= key_buf_size) {
+        key_buf[key_buf_size - 1] = '\0';
+        return -1;
+    }
+    size_t pos = (size_t)n;
+
+    if (query && query[0]) {
+        query_param_t params[KEY_MAX_PARAMS];
+        int count = split_query(query, params);
+        if (count < 0) {
+            n = _snprintf(key_buf + pos, key_buf_size - pos, "?%s", query);
+            if (n < 0 || (size_t)n >= key_buf_size - pos) {
+                key_buf[key_buf_size - 1] = '\0';
+                return -1;
+            }
+            pos += (size_t)n;
+        }
+        for (int i = 0; i < count; i++) {
+            n = _snprintf(key_buf + pos, key_buf_size - pos, "%c%.*s",
+                          i == 0 ? '?' : '&', (int)params[i].len, params[i].p);
+            if (n < 0 || (size_t)n >= key_buf_size - pos) {
+                key_buf[key_buf_size - 1] = '\0';
+                return -1;
+            }
+            pos += (size_t)n;
+        }
+    }
+
+    n = _snprintf(key_buf + pos, key_buf_size - pos, "|vary:%s", vary_header ? vary_header : "");
+    if (n < 0 || (size_t)n >= key_buf_size - pos) {
+        key_buf[key_buf_size - 1] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+void cache_key_hash(const char *key, uint64_t *hash_out, char *fingerprint_out) {
+    if (!key || !hash_out || !fingerprint_out) return;
+
+    key_hasher_t h;
+    kh_init(&h);
+    kh_str(&h, key);
+    kh_final(&h, hash_out, fingerprint_out);
+}
+
+void cache_slice_key(uint64_t key_hash, const char *fingerprint, uint32_t slice,
+                     uint64_t *hash_out, char *fingerprint_out) {
+    if (!fingerprint || !hash_out || !fingerprint_out) return;
+
+    key_hasher_t h;
+    kh_init(&h);
+    kh_update(&h, &key_hash, sizeof(key_hash));
+    kh_update(&h, fingerprint, 16);
+    kh_update(&h, "|slice:", 7);
+    kh_update(&h, &slice, sizeof(slice));
+    kh_final(&h, hash_out, fingerprint_out);
+}
+
+void cache_content_hash(const cache_body_t *body, uint64_t *hash_out, char *fingerprint_out) {
+    if (!body || !hash_out || !fingerprint_out) return;
+
+    // Only called on complete bodies, whose segments no longer change
+    key_hasher_t h;
+    kh_init(&h);
+    kh_update(&h, "content:", 8);
+    for (const cache_segment_t *seg = body->head; seg; seg = seg->next) {
+        kh_update(&h, seg->data, seg->len);
+    }
+    kh_final(&h, hash_out, fingerprint_out);
+}
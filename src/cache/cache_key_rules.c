@@ -0,0 +1,251 @@
+#include "../include/cache_key_rules.h"
+#include "../include/cache.h"
+#include <stdio.h>
+#include <string.h>
+
+// Per-policy cache key normalisation. Name lists are compiled into one packed
+// buffer when the routes load; a request only walks its query, Cookie header
+// and the configured headers once each.
+
+#define KEY_PREFIX_MATCHES 16       // header lines one "x-foo-*" may add to a key
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} header_field_t;
+
+static int compile_list(cache_key_rules_t *rules, cache_key_list_t *list, const char *src, int lower) {
+    int rc = 0;
+    list->count = 0;
+    for (const char *p = src; p && *p; ) {
+        while (*p == ',' || *p == ' ') p++;
+        const char *tok = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+        size_t len = (size_t)(p - tok);
+        if (len == 0) continue;
+
+        int prefix = tok[len - 1] == '*';
+        if (prefix) len--;
+        if (len > 255 || list->count == CACHE_KEY_MAX_NAMES || rules->names_len + len > CACHE_KEY_NAMES_BYTES) {
+            rc = -1;
+            continue;
+        }
+        cache_key_name_t *name = &list->names[list->count++];
+        name->off = (uint16_t)rules->names_len;
+        name->len = (uint8_t)len;
+        name->prefix = (uint8_t)prefix;
+        for (size_t i = 0; i < len; i++) {
+            char c = tok[i];
+            if (lower && c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+            rules->names[rules->names_len++] = c;
+        }
+    }
+    return rc;
+}
+
+int cache_key_rules_compile(cache_key_rules_t *rules, const char *drop_params, const char *keep_params,
+                            const char *headers, const char *cookies, int fold_path, int device_class) {
+    if (!rules) return -1;
+    memset(rules, 0, sizeof(*rules));
+
+    int rc = 0;
+    if (compile_list(rules, &rules->drop_params, drop_params, 0) != 0) rc = -1;
+    if (compile_list(rules, &rules->keep_params, keep_params, 0) != 0) rc = -1;
+    if (compile_list(rules, &rules->headers, headers, 1) != 0) rc = -1;
+    if (compile_list(rules, &rules->cookies, cookies, 0) != 0) rc = -1;
+    rules->fold_path = fold_path != 0;
+    rules->device_class = device_class != 0;
+    rules->active = rules->drop_params.count || rules->keep_params.count || rules->headers.count ||
+                    rules->cookies.count || rules->fold_path || rules->device_class;
+    return rc;
+}
+
+static int name_matches(const cache_key_rules_t *rules, const cache_key_name_t *name,
+                        const char *s, size_t len) {
+    if (name->prefix ? len < name->len : len != name->len) return 0;
+    return memcmp(rules->names + name->off, s, name->len) == 0;
+}
+
+static int list_matches(const cache_key_rules_t *rules, const cache_key_list_t *list,
+                        const char *s, size_t len) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (name_matches(rules, &list->names[i], s, len)) return 1;
+    }
+    return 0;
+}
+
+static int param_kept(const cache_key_rules_t *rules, const char *name, size_t len) {
+    if (rules->keep_params.count && !list_matches(rules, &rules->keep_params, name, len)) return 0;
+    return !list_matches(rules, &rules->drop_params, name, len);
+}
+
+static int vary_append(char *out, size_t size, size_t *pos, char kind, const char *name, size_t name_len,
+                       const char *value, size_t value_len) {
+    int n = snprintf(out + *pos, size - *pos, "%s%c:%.*s%s%.*s", *pos ? "|" : "", kind,
+                     (int)name_len, name, name_len ? "=" : "", (int)value_len, value);
+    if (n < 0 || (size_t)n >= size - *pos) return -1;
+    *pos += (size_t)n;
+    return 0;
+}
+
+// Cookies matching each configured name, in configuration order
+static int vary_cookies(const cache_key_rules_t *rules, const char *cookie_header,
+                        char *out, size_t size, size_t *pos) {
+    for (uint32_t i = 0; i < rules->cookies.count; i++) {
+        const cache_key_name_t *name = &rules->cookies.names[i];
+        for (const char *p = cookie_header; *p; ) {
+            while (*p == ' ' || *p == ';') p++;
+            const char *pair = p;
+            while (*p && *p != ';') p++;
+            const char *eq = memchr(pair, '=', (size_t)(p - pair));
+            if (!eq) continue;
+            if (name_matches(rules, name, pair, (size_t)(eq - pair)) &&
+                vary_append(out, size, pos, 'c', pair, (size_t)(eq - pair), eq + 1, (size_t)(p - eq - 1)) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int field_cmp(const header_field_t *a, const header_field_t *b) {
+    size_t n = a->name_len < b->name_len ? a->name_len : b->name_len;
+    int c = _strnicmp(a->name, b->name, n);
+    if (c == 0 && a->name_len != b->name_len) c = a->name_len < b->name_len ? -1 : 1;
+    if (c != 0) return c;
+    n = a->value_len < b->value_len ? a->value_len : b->value_len;
+    c = memcmp(a->value, b->value, n);
+    if (c == 0 && a->value_len != b->value_len) c = a->value_len < b->value_len ? -1 : 1;
+    return c;
+}
+
+// Every request header whose name starts with the prefix, sorted by name so the key
+// does not depend on the order a client sends them in. More than KEY_PREFIX_MATCHES
+// of them can't be keyed and fail the request like a too small output
+static int vary_header_prefix(const cache_key_rules_t *rules, const cache_key_name_t *h,
+                              const char *request_buffer, const char *hdr_end,
+                              char *out, size_t size, size_t *pos) {
+    header_field_t found[KEY_PREFIX_MATCHES];
+    uint32_t count = 0;
+
+    const char *line = strstr(request_buffer, "\r\n");
+    while (line && line < hdr_end) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > hdr_end) eol = hdr_end;
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        size_t name_len = colon ? (size_t)(colon - line) : 0;
+        if (name_len >= h->len && name_len < 256 &&
+            _strnicmp(line, rules->names + h->off, h->len) == 0) {
+            if (count == KEY_PREFIX_MATCHES) return -1;
+            const char *v = colon + 1;
+            const char *v_end = eol;
+            while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+            header_field_t *f = &found[count++];
+            f->name = line;
+            f->name_len = name_len;
+            f->value = v;
+            f->value_len = (size_t)(v_end - v);
+            for (uint32_t i = count - 1; i > 0 && field_cmp(&found[i], &found[i - 1]) < 0; i--) {
+                header_field_t tmp = found[i];
+                found[i] = found[i - 1];
+                found[i - 1] = tmp;
+            }
+        }
+        line = eol;
+    }
+
+    char name[256];
+    for (uint32_t i = 0; i < count; i++) {
+        for (size_t k = 0; k < found[i].name_len; k++) {
+            char c = found[i].name[k];
+            name[k] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+        }
+        if (vary_append(out, size, pos, 'h', name, found[i].name_len,
+                        found[i].value, found[i].value_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int cache_device_class(const char *user_agent) {
+    if (!user_agent || !user_agent[0]) return CACHE_DEVICE_DESKTOP;
+    if (strstr(user_agent, "iPad") || strstr(user_agent, "Tablet") ||
+        (strstr(user_agent, "Android") && !strstr(user_agent, "Mobile"))) {
+        return CACHE_DEVICE_TABLET;
+    }
+    if (strstr(user_agent, "Mobi") || strstr(user_agent, "iPhone") || strstr(user_agent, "iPod") ||
+        strstr(user_agent, "Windows Phone")) {
+        return CACHE_DEVICE_MOBILE;
+    }
+    return CACHE_DEVICE_DESKTOP;
+}
+
+int cache_key_rules_apply(const cache_key_rules_t *rules, const char *request_buffer,
+                          const char *path, const char *query,
+                          char *path_out, size_t path_size, char *query_out, size_t query_size,
+                          char *vary_out, size_t vary_size) {
+    if (!path_out || path_size == 0 || !query_out || query_size == 0 || !vary_out || vary_size == 0) return -1;
+    path_out[0] = '\0';
+    query_out[0] = '\0';
+    vary_out[0] = '\0';
+    if (rules && !rules->active) rules = NULL;
+
+    if (!path || !path[0]) path = "/";
+    size_t path_len = strlen(path);
+    if (path_len >= path_size) return -1;
+    for (size_t i = 0; i <= path_len; i++) {
+        char c = path[i];
+        if (rules && rules->fold_path && c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        path_out[i] = c;
+    }
+
+    size_t pos = 0;
+    for (const char *p = query ? query : ""; *p; ) {
+        const char *amp = strchr(p, '&');
+        if (!amp) amp = p + strlen(p);
+        const char *eq = memchr(p, '=', (size_t)(amp - p));
+        size_t len = (size_t)(amp - p);
+        if (len > 0 && (!rules || param_kept(rules, p, (size_t)((eq ? eq : amp) - p)))) {
+            if (pos + len + 2 > query_size) return -1;
+            if (pos > 0) query_out[pos++] = '&';
+            memcpy(query_out + pos, p, len);
+            pos += len;
+        }
+        p = *amp ? amp + 1 : amp;
+    }
+    query_out[pos] = '\0';
+
+    if (!rules || !request_buffer) return 0;
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    if (!hdr_end) return 0;
+
+    pos = 0;
+    char name[256];
+    char value[1024];
+    for (uint32_t i = 0; i < rules->headers.count; i++) {
+        const cache_key_name_t *h = &rules->headers.names[i];
+        if (h->prefix) {
+            if (vary_header_prefix(rules, h, request_buffer, hdr_end, vary_out, vary_size, &pos) != 0) return -1;
+            continue;
+        }
+        memcpy(name, rules->names + h->off, h->len);
+        name[h->len] = '\0';
+        int n = cache_header_value(request_buffer, hdr_end, name, value, sizeof(value));
+        if (n >= 0 && vary_append(vary_out, vary_size, &pos, 'h', name, h->len, value, (size_t)n) != 0) return -1;
+    }
+    if (rules->cookies.count && cache_header_value(request_buffer, hdr_end, "Cookie", value, sizeof(value)) >= 0 &&
+        vary_cookies(rules, value, vary_out, vary_size, &pos) != 0) {
+        return -1;
+    }
+    if (rules->device_class) {
+        if (cache_header_value(request_buffer, hdr_end, "User-Agent", value, sizeof(value)) < 0) value[0] = '\0';
+        char device = (char)('0' + cache_device_class(value));
+        if (vary_append(vary_out, vary_size, &pos, 'd', "", 0, &device, 1) != 0) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "../include/cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#define L1_THREAD __declspec(thread)
+#else
+#define L1_THREAD __thread
+#endif
+
+// Per-thread L1 in front of the shards. Hits on locked lookups are sampled into
+// a small per-thread candidate table; keys sampled often enough get a slot that
+// holds a batch of value references, so an L1 hit hands one out (and a release
+// on the same thread takes it back) without touching the shard or the refcount.
+// A slot is valid while its shard's generation is unchanged: every removal or
+// replacement in a shard bumps it, and the thread drops the slot on its next lookup
+// so a removed value is freed rather than kept alive by some thread's L1.
+
+typedef struct {
+    uint64_t key_hash;
+    char key_fingerprint[16];
+    cache_value_t *val;
+    LONG gen;               // shard generation the slot was validated at
+    DWORD validated_at;     // GetTickCount() of the last locked lookup
+    uint32_t credits;       // references held beyond the slot's own
+    uint32_t hits;
+} l1_slot_t;
+
+typedef struct {
+    uint64_t key_hash;
+    uint32_t samples;
+} l1_candidate_t;
+
+typedef struct cache_l1_s {
+    l1_slot_t slots[CACHE_L1_SLOTS];
+    l1_candidate_t candidates[CACHE_L1_CANDIDATES];
+    uint32_t sample_tick;
+    LONG epoch;             // g_l1_epoch when the slots were last checked
+    uint64_t hits;          // written only by the owning thread
+    uint64_t byte_hits;
+    struct cache_l1_s *next;
+} cache_l1_t;
+
+// Own cache line each, so bumping one shard does not disturb readers of another
+typedef struct {
+    volatile LONG gen;
+    char pad[64 - sizeof(LONG)];
+} l1_generation_t;
+
+static l1_generation_t g_l1_gen[CACHE_NUM_SHARDS];
+static volatile LONG g_l1_epoch;   // bumped after any shard generation
+static L1_THREAD cache_l1_t *t_l1;
+
+// Every thread's L1, for the metrics; threads are never unregistered
+static cache_l1_t *g_l1_list;
+static SRWLOCK g_l1_list_lock = SRWLOCK_INIT;
+
+static LONG shard_gen(uint64_t key_hash) {
+    return g_l1_gen[cache_key_to_shard(key_hash)].gen;
+}
+
+static l1_slot_t *slot_find(cache_l1_t *l1, uint64_t key_hash, const char *fingerprint) {
+    for (int i = 0; i < CACHE_L1_SLOTS; i++) {
+        l1_slot_t *s = &l1->slots[i];
+        if (s->val && s->key_hash == key_hash && memcmp(s->key_fingerprint, fingerprint, 16) == 0) return s;
+    }
+    return NULL;
+}
+
+static void slot_drop(l1_slot_t *s) {
+    cache_value_t *val = s->val;
+    LONG refs = (LONG)s->credits + 1;
+    memset(s, 0, sizeof(*s));
+    cache_value_release_refs(val, refs);
+}
+
+// Drops every slot whose shard changed since it was validated; nothing to do unless
+// some shard did since the last check
+static void l1_prune(cache_l1_t *l1) {
+    LONG epoch = g_l1_epoch;
+    if (epoch == l1->epoch) return;
+    l1->epoch = epoch;
+    for (int i = 0; i < CACHE_L1_SLOTS; i++) {
+        l1_slot_t *s = &l1->slots[i];
+        if (s->val && s->gen != shard_gen(s->key_hash)) slot_drop(s);
+    }
+}
+
+static cache_l1_t *l1_self(void) {
+    if (t_l1) return t_l1;
+    cache_l1_t *l1 = (cache_l1_t *)calloc(1, sizeof(cache_l1_t));
+    if (!l1) return NULL;
+    AcquireSRWLockExclusive(&g_l1_list_lock);
+    l1->next = g_l1_list;
+    g_l1_list = l1;
+    ReleaseSRWLockExclusive(&g_l1_list_lock);
+    t_l1 = l1;
+    return l1;
+}
+
+int cache_l1_get(uint64_t key_hash, const char *fingerprint, cache_value_t **out) {
+    cache_l1_t *l1 = t_l1;
+    if (!l1 || !fingerprint || !out) return 0;
+    l1_prune(l1);
+
+    l1_slot_t *s = slot_find(l1, key_hash, fingerprint);
+    if (!s) return 0;
+
+    cache_value_t *val = s->val;
+    if ((uint32_t)time(NULL) >= val->expires_at || s->gen != shard_gen(key_hash)) {
+        slot_drop(s);
+        return 0;
+    }
+    // Due to keep the entry warm in the shard LRU: the locked lookup revalidates the
+    // slot (cache_l1_sample) or drops it (cache_l1_forget)
+    if (GetTickCount() - s->validated_at >= CACHE_L1_REVALIDATE_MS) return 0;
+
+    if (s->credits == 0) {
+        InterlockedExchangeAdd(&val->refcnt, CACHE_L1_REF_BATCH);
+        s->credits = CACHE_L1_REF_BATCH;
+    }
+    s->credits--;
+    s->hits++;
+    l1->hits++;
+    l1->byte_hits += val->body_len;
+    *out = val;
+    return 1;
+}
+
+void cache_l1_sample(uint64_t key_hash, const char *fingerprint, cache_value_t *val) {
+    if (!fingerprint || !val) return;
+    cache_l1_t *l1 = t_l1;
+    if (l1) l1_prune(l1);
+
+    l1_slot_t *s = l1 ? slot_find(l1, key_hash, fingerprint) : NULL;
+    if (s) {
+        if (s->val == val) {
+            s->gen = shard_gen(key_hash);
+            s->validated_at = GetTickCount();
+            return;
+        }
+        slot_drop(s);
+    }
+
+    // Only complete bodies, and one locked hit in CACHE_L1_SAMPLE_EVERY
+    if (val->body_len == 0) return;
+    if (!l1 && !(l1 = l1_self())) return;
+    if (++l1->sample_tick % CACHE_L1_SAMPLE_EVERY != 0) return;
+
+    l1_candidate_t *c = &l1->candidates[(key_hash >> 6) % CACHE_L1_CANDIDATES];
+    if (c->key_hash != key_hash) {
+        c->key_hash = key_hash;
+        c->samples = 0;
+    }
+    if (++c->samples < CACHE_L1_ADMIT_SAMPLES) return;
+    c->samples = 0;
+
+    // Replace the slot with the fewest hits; halving the counts lets old favourites age out
+    l1_slot_t *victim = &l1->slots[0];
+    for (int i = 0; i < CACHE_L1_SLOTS; i++) {
+        l1_slot_t *cand = &l1->slots[i];
+        if (!cand->val) {
+            victim = cand;
+            break;
+        }
+        if (cand->hits < victim->hits) victim = cand;
+    }
+    for (int i = 0; i < CACHE_L1_SLOTS; i++) l1->slots[i].hits /= 2;
+    if (victim->val) slot_drop(victim);
+
+    InterlockedExchangeAdd(&val->refcnt, 1 + CACHE_L1_REF_BATCH);
+    victim->key_hash = key_hash;
+    memcpy(victim->key_fingerprint, fingerprint, 16);
+    victim->val = val;
+    victim->gen = shard_gen(key_hash);
+    victim->validated_at = GetTickCount();
+    victim->credits = CACHE_L1_REF_BATCH;
+    victim->hits = 0;
+}
+
+void cache_l1_forget(uint64_t key_hash, const char *fingerprint) {
+    cache_l1_t *l1 = t_l1;
+    if (!l1 || !fingerprint) return;
+    l1_slot_t *s = slot_find(l1, key_hash, fingerprint);
+    if (s) slot_drop(s);
+}
+
+void cache_l1_invalidate(uint32_t shard_idx) {
+    InterlockedIncrement(&g_l1_gen[shard_idx & (CACHE_NUM_SHARDS - 1)].gen);
+    InterlockedIncrement(&g_l1_epoch);
+}
+
+int cache_l1_absorb(cache_value_t *val) {
+    cache_l1_t *l1 = t_l1;
+    if (!l1 || !val) return 0;
+    for (int i = 0; i < CACHE_L1_SLOTS; i++) {
+        if (l1->slots[i].val == val) {
+            l1->slots[i].credits++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void cache_l1_get_stats(uint64_t *hits, uint64_t *byte_hits) {
+    uint64_t h = 0, b = 0;
+    AcquireSRWLockShared(&g_l1_list_lock);
+    for (cache_l1_t *l1 = g_l1_list; l1; l1 = l1->next) {
+        h += l1->hits;
+        b += l1->byte_hits;
+    }
+    ReleaseSRWLockShared(&g_l1_list_lock);
+    if (hits) *hits = h;
+    if (byte_hits) *byte_hits = b;
+}
@@ -0,0 +1,169 @@
+#include <windows.h>
+#include <psapi.h>
+#include <process.h>
+#include "../include/cache_memory.h"
+#include "../include/cache.h"
+#include "../include/logger.h"
+#include <stdio.h>
+#include <string.h>
+
+// Memory governor: the cache budget is the part of the memory limit the rest of the
+// process leaves over. Shrinks apply at once (the evictor trims to the new watermarks);
+// growth is paced so a brief dip in other usage does not refill and re-evict the cache.
+
+static HANDLE g_memory_thread = NULL;
+static HANDLE g_memory_stop = NULL;
+static HANDLE g_low_memory = NULL;       // signalled by the OS while physical memory is low
+static uint64_t g_limit_bytes = 0;       // configured; 0 = job object limit
+static uint32_t g_target_pct = 85;
+static uint64_t g_min_bytes = 0;
+static uint64_t g_ceiling = 0;           // cache_max_bytes at start
+static volatile LONG64 g_commit = 0;
+static volatile LONG64 g_limit = 0;
+static volatile LONG64 g_shrinks = 0;
+
+// Memory limit of the job object the process runs in, the tighter of its per-process
+// and whole-job limits; 0 outside a job or without one
+static uint64_t job_memory_limit(void) {
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info;
+    memset(&info, 0, sizeof(info));
+    if (!QueryInformationJobObject(NULL, JobObjectExtendedLimitInformation, &info, sizeof(info), NULL)) {
+        return 0;
+    }
+    uint64_t limit = 0;
+    DWORD flags = info.BasicLimitInformation.LimitFlags;
+    if (flags & JOB_OBJECT_LIMIT_PROCESS_MEMORY) limit = info.ProcessMemoryLimit;
+    if ((flags & JOB_OBJECT_LIMIT_JOB_MEMORY) && (!limit || info.JobMemoryLimit < limit)) {
+        limit = info.JobMemoryLimit;
+    }
+    return limit;
+}
+
+// Budget the cache may have now, or 0 to leave it alone
+static uint64_t memory_target(uint64_t budget, uint64_t used, int *pressure) {
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    memset(&pmc, 0, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc))) return 0;
+
+    // Job limits count committed memory, so commit is what has to fit
+    uint64_t commit = pmc.PrivateUsage;
+    uint64_t limit = g_limit_bytes ? g_limit_bytes : job_memory_limit();
+    InterlockedExchange64(&g_commit, (LONG64)commit);
+    InterlockedExchange64(&g_limit, (LONG64)limit);
+
+    uint64_t target = g_ceiling;
+    if (limit) {
+        uint64_t allowed = limit / 100 * g_target_pct;
+        uint64_t other = commit > used ? commit - used : 0;
+        uint64_t room = allowed > other ? allowed - other : 0;
+        if (room < target) target = room;
+    }
+
+    MEMORYSTATUSEX ms;
+    memset(&ms, 0, sizeof(ms));
+    ms.dwLength = sizeof(ms);
+    BOOL low = FALSE;
+    if (g_low_memory) QueryMemoryResourceNotification(g_low_memory, &low);
+    *pressure = low || (GlobalMemoryStatusEx(&ms) && ms.dwMemoryLoad >= CACHE_MEMORY_LOAD_PCT);
+    if (*pressure) {
+        uint64_t backoff = budget / 100 * CACHE_MEMORY_BACKOFF_PCT;
+        if (backoff < target) target = backoff;
+    }
+
+    return target < g_min_bytes ? g_min_bytes : target;
+}
+
+static void memory_adjust(void) {
+    uint64_t budget, used;
+    cache_get_budget(&budget, &used);
+    if (budget == 0) return;
+
+    int pressure = 0;
+    uint64_t target = memory_target(budget, used, &pressure);
+    if (target == 0 || target == budget) return;
+
+    uint64_t step = g_ceiling / 100 * CACHE_MEMORY_GROW_PCT;
+    uint64_t next = target;
+    if (target > budget) {
+        if (target - budget > step) next = budget + step;
+        // Small moves are not worth an evictor pass unless they finish the climb back
+        if (next - budget < g_ceiling / 100 && next != g_ceiling) return;
+    } else if (budget - target < g_ceiling / 100 && target != g_min_bytes && !pressure) {
+        return;
+    }
+    cache_set_max_bytes(next);
+    if (next < budget) InterlockedIncrement64(&g_shrinks);
+
+    // Every shrink is worth a line; growth only when it gets back to the configured size
+    if (next < budget || next == g_ceiling) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "[CACHE] Memory budget %llu -> %llu bytes (cache %llu, commit %llu, limit %llu%s)",
+                 (unsigned long long)budget, (unsigned long long)next, (unsigned long long)used,
+                 (unsigned long long)g_commit, (unsigned long long)g_limit,
+                 pressure ? ", system memory low" : "");
+        log_message(next < budget ? "WARN" : "INFO", log_buf);
+    }
+}
+
+static unsigned __stdcall memory_thread_func(void *arg) {
+    (void)arg;
+    while (WaitForSingleObject(g_memory_stop, CACHE_MEMORY_INTERVAL_MS) == WAIT_TIMEOUT) {
+        memory_adjust();
+    }
+    return 0;
+}
+
+int cache_memory_start(uint64_t limit_bytes, uint32_t target_pct, uint64_t min_bytes) {
+    if (g_memory_thread) return -1;
+
+    cache_get_budget(&g_ceiling, NULL);
+    if (g_ceiling == 0) return -1;
+    g_limit_bytes = limit_bytes;
+    g_target_pct = target_pct > 0 && target_pct <= 100 ? target_pct : 85;
+    g_min_bytes = min_bytes ? min_bytes : g_ceiling / CACHE_MEMORY_MIN_DIV;
+    if (g_min_bytes > g_ceiling) g_min_bytes = g_ceiling;
+
+    g_low_memory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    g_memory_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!g_memory_stop) return -1;
+
+    g_memory_thread = (HANDLE)_beginthreadex(NULL, 0, memory_thread_func, NULL, 0, NULL);
+    if (!g_memory_thread) {
+        CloseHandle(g_memory_stop);
+        g_memory_stop = NULL;
+        log_message("ERROR", "Failed to create cache memory governor thread");
+        return -1;
+    }
+
+    char log_buf[256];
+    snprintf(log_buf, sizeof(log_buf),
+             "[CACHE] Memory governor: budget %llu..%llu bytes, target %u%% of limit %llu (job %llu)",
+             (unsigned long long)g_min_bytes, (unsigned long long)g_ceiling, g_target_pct,
+             (unsigned long long)g_limit_bytes, (unsigned long long)job_memory_limit());
+    log_message("INFO", log_buf);
+    return 0;
+}
+
+void cache_memory_stop(void) {
+    if (!g_memory_thread) return;
+
+    SetEvent(g_memory_stop);
+    WaitForSingleObject(g_memory_thread, INFINITE);
+    CloseHandle(g_memory_thread);
+    CloseHandle(g_memory_stop);
+    if (g_low_memory) CloseHandle(g_low_memory);
+    g_memory_thread = NULL;
+    g_memory_stop = NULL;
+    g_low_memory = NULL;
+}
+
+void cache_memory_get_metrics(uint64_t *budget, uint64_t *ceiling, uint64_t *commit,
+                              uint64_t *limit, uint64_t *shrinks) {
+    if (budget) cache_get_budget(budget, NULL);
+    if (ceiling) *ceiling = g_ceiling;
+    if (commit) *commit = (uint64_t)g_commit;
+    if (limit) *limit = (uint64_t)g_limit;
+    if (shrinks) *shrinks = (uint64_t)g_shrinks;
+}
@@ -0,0 +1,329 @@
+#include "../include/cache_prefetch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Learns which sub-resources each page pulls in, from the Referer of the requests
+// that follow it and from the rel=preload links its responses announce, so a miss
+// on the page can warm them while the browser is still parsing it. Fetches run on
+// the background fetch pool, bounded in number and rate.
+
+typedef struct {
+    char target[CACHE_PREFETCH_TARGET_MAX];   // path?query
+    uint16_t hits;
+} prefetch_link_t;
+
+typedef struct {
+    uint64_t page_hash;         // 0: free
+    uint32_t weight;            // claim on the slot; other pages mapping here wear it down
+    uint32_t decayed_at;
+    prefetch_link_t links[CACHE_PREFETCH_LINKS];
+} prefetch_page_t;
+
+static prefetch_page_t g_pages[CACHE_PREFETCH_PAGES];
+static SRWLOCK g_page_locks[CACHE_PREFETCH_LOCKS];
+
+static volatile LONG g_max_inflight = 0;
+static volatile LONG g_per_sec = 0;
+static volatile LONG g_inflight = 0;
+static volatile LONG g_window = 0;          // second of the current rate window
+static volatile LONG g_window_count = 0;
+
+static volatile LONG64 g_queued = 0;
+static volatile LONG64 g_stored = 0;
+static volatile LONG64 g_dropped = 0;
+
+void cache_prefetch_configure(uint32_t max_inflight, uint32_t per_sec) {
+    InterlockedExchange(&g_per_sec, (LONG)per_sec);
+    InterlockedExchange(&g_max_inflight, (LONG)max_inflight);
+}
+
+// FNV-1a of host and the page path up to its query or fragment
+static uint64_t page_hash(const char *host, const char *page) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = host; *p; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    h = (h ^ '/') * 1099511628211ULL;
+    for (const char *p = page; *p && *p != '?' && *p != '#'; p++) h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    return h | 1;
+}
+
+static SRWLOCK *page_lock(uint64_t h) {
+    return &g_page_locks[(h % CACHE_PREFETCH_PAGES) % CACHE_PREFETCH_LOCKS];
+}
+
+// Caller holds the page lock; NULL while another page still holds the slot
+static prefetch_page_t *page_claim(uint64_t h, uint32_t now) {
+    prefetch_page_t *pg = &g_pages[h % CACHE_PREFETCH_PAGES];
+    if (pg->page_hash == h) {
+        if (pg->weight < UINT32_MAX) pg->weight++;
+    } else if (pg->weight > 0) {
+        pg->weight--;
+        return NULL;
+    } else {
+        memset(pg, 0, sizeof(*pg));
+        pg->page_hash = h;
+        pg->weight = 1;
+        pg->decayed_at = now;
+    }
+
+    if (now - pg->decayed_at >= CACHE_PREFETCH_DECAY_SEC) {
+        pg->decayed_at = now;
+        for (int i = 0; i < CACHE_PREFETCH_LINKS; i++) pg->links[i].hits /= 2;
+    }
+    return pg;
+}
+
+static int learn(const char *host, const char *page, const char *target, uint16_t hits) {
+    uint64_t h = page_hash(host, page);
+    uint32_t now = (uint32_t)time(NULL);
+    int rc = 0;
+
+    SRWLOCK *lock = page_lock(h);
+    AcquireSRWLockExclusive(lock);
+    prefetch_page_t *pg = page_claim(h, now);
+    if (pg) {
+        // Known link, else a free one; a full page wears its least used link down first
+        prefetch_link_t *slot = NULL, *least = &pg->links[0];
+        for (int i = 0; i < CACHE_PREFETCH_LINKS && !slot; i++) {
+            prefetch_link_t *l = &pg->links[i];
+            if (l->hits > 0 && strcmp(l->target, target) == 0) {
+                slot = l;
+            } else if (l->hits < least->hits) {
+                least = l;
+            }
+        }
+        if (!slot && least->hits > 0) {
+            least->hits--;
+        } else {
+            if (!slot) {
+                slot = least;
+                snprintf(slot->target, sizeof(slot->target), "%s", target);
+            }
+            uint32_t sum = (uint32_t)slot->hits + (hits > 1 && slot->hits < hits ? hits - slot->hits : 1);
+            slot->hits = (uint16_t)(sum > UINT16_MAX ? UINT16_MAX : sum);
+            rc = 1;
+        }
+    }
+    ReleaseSRWLockExclusive(lock);
+    return rc;
+}
+
+// Path of url (absolute on host, or already a path), or NULL for another host
+static const char *url_path(const char *url, size_t len, const char *host, size_t *path_len) {
+    const char *end = url + len;
+    const char *p = url;
+    if (len >= 7 && _strnicmp(p, "http://", 7) == 0) p += 7;
+    else if (len >= 8 && _strnicmp(p, "https://", 8) == 0) p += 8;
+    else if (len >= 2 && p[0] == '/' && p[1] == '/') p += 2;
+
+    if (p != url) {
+        const char *slash = memchr(p, '/', (size_t)(end - p));
+        if (!slash) return NULL;
+        size_t host_len = strlen(host);
+        if ((size_t)(slash - p) != host_len || _strnicmp(p, host, host_len) != 0) return NULL;
+        p = slash;
+    }
+    if (p >= end || *p != '/') return NULL;
+
+    const char *frag = memchr(p, '#', (size_t)(end - p));
+    *path_len = (size_t)((frag ? frag : end) - p);
+    return p;
+}
+
+int cache_prefetch_is_navigation(const char *request_buffer) {
+    if (!request_buffer) return 0;
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    if (!hdr_end) return 0;
+
+    char value[256];
+    if (cache_header_value(request_buffer, hdr_end, "Sec-Fetch-Mode", value, sizeof(value)) >= 0) {
+        return strcmp(value, "navigate") == 0;
+    }
+    if (cache_header_value(request_buffer, hdr_end, "Sec-Fetch-Dest", value, sizeof(value)) >= 0) {
+        return strcmp(value, "document") == 0 || strcmp(value, "iframe") == 0;
+    }
+    return cache_header_value(request_buffer, hdr_end, "Accept", value, sizeof(value)) >= 0 &&
+           strncmp(value, "text/html", 9) == 0;
+}
+
+int cache_prefetch_referer(const char *request_buffer, const char *host,
+                           char *page_out, size_t page_size) {
+    if (g_max_inflight == 0 || !request_buffer || !host || !host[0] || !page_out || page_size == 0) return -1;
+    page_out[0] = '\0';
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    if (!hdr_end) return -1;
+
+    // Navigations and frames are pages of their own, not sub-resources
+    char value[1024];
+    if (cache_header_value(request_buffer, hdr_end, "Sec-Fetch-Dest", value, sizeof(value)) >= 0 &&
+        (strcmp(value, "document") == 0 || strcmp(value, "iframe") == 0)) {
+        return -1;
+    }
+    if (cache_header_value(request_buffer, hdr_end, "Accept", value, sizeof(value)) >= 0 &&
+        strncmp(value, "text/html", 9) == 0) {
+        return -1;
+    }
+
+    int n = cache_header_value(request_buffer, hdr_end, "Referer", value, sizeof(value));
+    size_t page_len;
+    const char *page = n > 0 ? url_path(value, (size_t)n, host, &page_len) : NULL;
+    if (!page || page_len >= page_size) return -1;
+    memcpy(page_out, page, page_len);
+    page_out[page_len] = '\0';
+    return 0;
+}
+
+void cache_prefetch_observe(const char *host, const char *page, const char *path, const char *query) {
+    if (g_max_inflight == 0 || !host || !host[0] || !page || !page[0] || !path) return;
+
+    char target[CACHE_PREFETCH_TARGET_MAX];
+    int n = snprintf(target, sizeof(target), "%s%s%s", path, query && query[0] ? "?" : "", query ? query : "");
+    if (n <= 0 || n >= (int)sizeof(target)) return;
+    learn(host, page, target, 1);
+}
+
+// Whether the parameters of one Link value include rel=preload (or modulepreload)
+static int link_is_preload(const char *p, const char *end) {
+    for (; p + 4 <= end; p++) {
+        if (_strnicmp(p, "rel=", 4) != 0) continue;
+        const char *v = p + 4;
+        const char *v_end = v;
+        while (v_end < end && *v_end != ';' && *v_end != ',') v_end++;
+        for (; v + 7 <= v_end; v++) {
+            if (_strnicmp(v, "preload", 7) == 0) return 1;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int cache_prefetch_learn_links(const char *host, const char *page,
+                               const char *header, const char *hdr_end) {
+    if (g_max_inflight == 0 || !host || !host[0] || !page || !header || !hdr_end) return 0;
+
+    int learned = 0;
+    for (const char *line = header; line < hdr_end; ) {
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > hdr_end) eol = hdr_end;
+
+        // Link: </app.css>; rel=preload; as=style, <https://host/app.js>; rel="preload"
+        if (eol - line > 5 && _strnicmp(line, "Link:", 5) == 0) {
+            const char *p = line + 5;
+            while (p < eol && (p = memchr(p, '<', (size_t)(eol - p))) != NULL) {
+                const char *url = p + 1;
+                const char *gt = memchr(url, '>', (size_t)(eol - url));
+                if (!gt) break;
+                const char *next = memchr(gt, '<', (size_t)(eol - gt));
+                if (!next) next = eol;
+
+                size_t len;
+                const char *target = url_path(url, (size_t)(gt - url), host, &len);
+                if (target && len < CACHE_PREFETCH_TARGET_MAX && link_is_preload(gt + 1, next)) {
+                    char buf[CACHE_PREFETCH_TARGET_MAX];
+                    memcpy(buf, target, len);
+                    buf[len] = '\0';
+                    learned += learn(host, page, buf, CACHE_PREFETCH_MIN_HITS);
+                }
+                p = next;
+            }
+        }
+        line = eol + 2;
+    }
+    return learned;
+}
+
+int cache_prefetch_links(const char *host, const char *page,
+                         char out[][CACHE_PREFETCH_TARGET_MAX], int max_out) {
+    if (g_max_inflight == 0 || !host || !page || !out || max_out <= 0) return 0;
+
+    uint64_t h = page_hash(host, page);
+    uint16_t hits[CACHE_PREFETCH_LINKS];
+    int n = 0;
+
+    SRWLOCK *lock = page_lock(h);
+    AcquireSRWLockShared(lock);
+    const prefetch_page_t *pg = &g_pages[h % CACHE_PREFETCH_PAGES];
+    for (int i = 0; pg->page_hash == h && i < CACHE_PREFETCH_LINKS; i++) {
+        const prefetch_link_t *l = &pg->links[i];
+        if (l->hits < CACHE_PREFETCH_MIN_HITS) continue;
+
+        int pos = n < max_out ? n++ : max_out;
+        while (pos > 0 && hits[pos - 1] < l->hits) {
+            if (pos < max_out) {
+                hits[pos] = hits[pos - 1];
+                memcpy(out[pos], out[pos - 1], CACHE_PREFETCH_TARGET_MAX);
+            }
+            pos--;
+        }
+        if (pos < max_out) {
+            hits[pos] = l->hits;
+            memcpy(out[pos], l->target, CACHE_PREFETCH_TARGET_MAX);
+        }
+    }
+    ReleaseSRWLockShared(lock);
+    return n;
+}
+
+static int rate_take(void) {
+    LONG now = (LONG)(GetTickCount() / 1000);
+    LONG window = g_window;
+    if (window != now && InterlockedCompareExchange(&g_window, now, window) == window) {
+        InterlockedExchange(&g_window_count, 0);
+    }
+    return g_per_sec == 0 || InterlockedIncrement(&g_window_count) <= g_per_sec;
+}
+
+static void prefetch_task(void *arg) {
+    cache_fetch_req_t *req = (cache_fetch_req_t *)arg;
+
+    // Filled while queued, or a client is filling it now: that fetch wins.
+    // Its followers wait on us otherwise
+    cache_key_info_t *ki = &req->key_info;
+    if (cache_contains_key(ki->key_hash, ki->key_fingerprint) ||
+        !cache_fill_begin(ki->key_hash, ki->key_fingerprint)) {
+        InterlockedIncrement64(&g_dropped);
+    } else {
+        ki->fill_leader = 1;
+        if (cache_fetch_run(req) == 0) InterlockedIncrement64(&g_stored);
+    }
+    InterlockedDecrement(&g_inflight);
+    free(req);
+}
+
+int cache_prefetch_submit(const cache_fetch_req_t *req) {
+    if (!req || g_max_inflight == 0) return -1;
+    if (cache_contains_key(req->key_info.key_hash, req->key_info.key_fingerprint)) return -1;
+
+    if (InterlockedIncrement(&g_inflight) > g_max_inflight || !rate_take()) {
+        InterlockedDecrement(&g_inflight);
+        InterlockedIncrement64(&g_dropped);
+        return -1;
+    }
+
+    cache_fetch_req_t *copy = (cache_fetch_req_t *)malloc(sizeof(cache_fetch_req_t));
+    if (!copy) {
+        InterlockedDecrement(&g_inflight);
+        return -1;
+    }
+    memcpy(copy, req, sizeof(cache_fetch_req_t));
+    copy->stale = NULL;
+    copy->key_info.fill_leader = 0;
+    // Learned from repeated references already, so it skips second-hit admission
+    copy->key_info.bypass_admission = 1;
+
+    if (cache_fetch_submit(prefetch_task, copy) != 0) {
+        InterlockedDecrement(&g_inflight);
+        InterlockedIncrement64(&g_dropped);
+        free(copy);
+        return -1;
+    }
+    InterlockedIncrement64(&g_queued);
+    return 0;
+}
+
+void cache_prefetch_get_metrics(uint64_t *queued, uint64_t *stored, uint64_t *dropped) {
+    if (queued) *queued = (uint64_t)InterlockedCompareExchange64(&g_queued, 0, 0);
+    if (stored) *stored = (uint64_t)InterlockedCompareExchange64(&g_stored, 0, 0);
+    if (dropped) *dropped = (uint64_t)InterlockedCompareExchange64(&g_dropped, 0, 0);
+}
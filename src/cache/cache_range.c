@@ -0,0 +1,131 @@
+#include "../include/cache.h"
+#include <stdio.h>
+#include <string.h>
+
+// Range requests (RFC 9110 14): parsed once per request, resolved per object
+// when a hit, stale hit or disk hit is answered with 206 / 416.
+
+static volatile LONG g_boundary_seq = 0;
+
+static const char *parse_pos(const char *p, int64_t *out) {
+    if (*p < '0' || *p > '9') return NULL;
+    int64_t v = 0;
+    while (*p >= '0' && *p <= '9') {
+        if (v > (INT64_MAX - 9) / 10) return NULL;
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    *out = v;
+    return p;
+}
+
+uint32_t cache_parse_range(const char *request_buffer, cache_range_t *range) {
+    if (!range) return 0;
+    range->count = 0;
+    range->if_range[0] = '\0';
+    if (!request_buffer) return 0;
+
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    char spec[512];
+    if (!hdr_end || cache_header_value(request_buffer, hdr_end, "Range", spec, sizeof(spec)) < 0) return 0;
+    if (_strnicmp(spec, "bytes=", 6) != 0) return 0;
+
+    // Malformed or too many ranges: the header is ignored and the whole object sent
+    uint32_t count = 0;
+    const char *p = spec + 6;
+    while (*p) {
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+            continue;
+        }
+        if (count == CACHE_MAX_RANGES) return 0;
+
+        int64_t first = -1, last = -1;
+        if (*p == '-') {
+            if (!(p = parse_pos(p + 1, &last))) return 0;
+        } else {
+            if (!(p = parse_pos(p, &first)) || *p++ != '-') return 0;
+            if (*p >= '0' && *p <= '9' && (!(p = parse_pos(p, &last)) || last < first)) return 0;
+        }
+        range->first[count] = first;
+        range->last[count] = last;
+        count++;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p && *p != ',') return 0;
+    }
+
+    char if_range[256];
+    int n = cache_header_value(request_buffer, hdr_end, "If-Range", if_range, sizeof(if_range));
+    if (n >= (int)sizeof(range->if_range)) return 0;
+    if (n > 0) memcpy(range->if_range, if_range, (size_t)n + 1);
+
+    range->count = count;
+    return count;
+}
+
+int cache_range_applies(const cache_range_t *range, const char *etag, const char *last_modified) {
+    if (!range || !range->if_range[0]) return 1;
+
+    // Entity tags compare strongly, so a weak one never matches (RFC 9110 13.1.5)
+    const char *v = range->if_range;
+    if (v[0] == '"' || strncmp(v, "W/", 2) == 0) {
+        return v[0] == '"' && etag && etag[0] == '"' && strcmp(v, etag) == 0;
+    }
+    return last_modified && last_modified[0] && strcmp(v, last_modified) == 0;
+}
+
+uint32_t cache_range_plan(const cache_range_t *range, uint64_t total, const char *content_type,
+                          cache_range_plan_t *plan) {
+    if (!range || !plan) return 0;
+    plan->count = 0;
+    plan->total = total;
+    plan->body_len = 0;
+    plan->content_type[0] = '\0';
+    plan->trailer_len = 0;
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < range->count && i < CACHE_MAX_RANGES; i++) {
+        uint64_t first, last;
+        if (range->first[i] < 0) {
+            uint64_t suffix = (uint64_t)range->last[i];
+            if (suffix == 0 || total == 0) continue;
+            first = suffix < total ? total - suffix : 0;
+            last = total - 1;
+        } else {
+            if ((uint64_t)range->first[i] >= total) continue;
+            first = (uint64_t)range->first[i];
+            last = range->last[i] < 0 || (uint64_t)range->last[i] >= total ? total - 1 : (uint64_t)range->last[i];
+        }
+        plan->first[count] = first;
+        plan->last[count] = last;
+        count++;
+    }
+    plan->count = count;
+    if (count == 0) return 0;
+    if (count == 1) {
+        plan->body_len = plan->last[0] - plan->first[0] + 1;
+        return 1;
+    }
+
+    char boundary[24];
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx", (unsigned long)GetTickCount(),
+             (unsigned long)InterlockedIncrement(&g_boundary_seq));
+    snprintf(plan->content_type, sizeof(plan->content_type), "multipart/byteranges; boundary=%s", boundary);
+
+    for (uint32_t i = 0; i < count; i++) {
+        int n = snprintf(plan->part_head[i], sizeof(plan->part_head[i]),
+                         "\r\n--%s\r\n"
+                         "Content-Type: %.63s\r\n"
+                         "Content-Range: bytes %llu-%llu/%llu\r\n"
+                         "\r\n",
+                         boundary, content_type && content_type[0] ? content_type : "application/octet-stream",
+                         (unsigned long long)plan->first[i], (unsigned long long)plan->last[i],
+                         (unsigned long long)total);
+        plan->part_len[i] = (uint32_t)n;
+        plan->body_len += (uint64_t)n + plan->last[i] - plan->first[i] + 1;
+    }
+    plan->trailer_len = (uint32_t)snprintf(plan->trailer, sizeof(plan->trailer), "\r\n--%s--\r\n", boundary);
+    plan->body_len += plan->trailer_len;
+    return count;
+}
@@ -0,0 +1,352 @@
+#include <windows.h>
+#include <process.h>
+#include "../include/cache_snapshot.h"
+#include "../include/cache.h"
+#include "../include/logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Warm restart: the hottest fresh entries of every shard are written to a
+// single file (to a temp name, then renamed over the old one) so a restart
+// can refill RAM before listeners open instead of sending a miss storm to origins.
+
+static HANDLE g_snapshot_thread = NULL;
+static HANDLE g_snapshot_stop = NULL;
+static char g_snapshot_path[MAX_PATH];
+static uint32_t g_snapshot_interval_sec = 0;
+static uint64_t g_snapshot_max_bytes = 0;
+
+static int write_body(FILE *f, const cache_body_t *body, uint64_t len) {
+    uint64_t written = 0;
+    for (const cache_segment_t *seg = body->head; seg && written < len; seg = seg->next) {
+        size_t n = seg->len;
+        if (n > len - written) n = (size_t)(len - written);
+        if (fwrite(seg->data, 1, n, f) != n) return -1;
+        written += n;
+    }
+    return written == len ? 0 : -1;
+}
+
+static int write_entry(FILE *f, const cache_hot_item_t *item) {
+    cache_value_t *val = item->val;
+    int has_gz = InterlockedCompareExchange(&val->gz_state, 0, 0) == CACHE_VARIANT_READY;
+
+    cache_snapshot_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = CACHE_SNAPSHOT_RECORD_MAGIC;
+    rec.status_code = val->status_code;
+    rec.key_hash = item->key_hash;
+    memcpy(rec.key_fingerprint, item->key_fingerprint, 16);
+    rec.expires_at = val->expires_at;
+    rec.age_base = val->age_base;
+    rec.stale_while_revalidate = val->stale_while_revalidate;
+    rec.stale_if_error = val->stale_if_error;
+    rec.compressible = (uint32_t)val->compressible;
+    rec.header_len = val->header ? val->header_len : 0;
+    rec.body_len = val->body_len;
+    rec.gz_len = has_gz ? (uint32_t)val->gz_len : 0;
+    rec.ntags = val->tags ? val->ntags : 0;
+    rec.url_len = val->url ? (uint32_t)strlen(val->url) : 0;
+    if (rec.url_len > CACHE_SNAPSHOT_MAX_URL_BYTES) rec.url_len = 0;
+    rec.range_total = val->range_total;
+    memcpy(rec.content_type, val->content_type, sizeof(rec.content_type));
+    memcpy(rec.etag, val->etag, sizeof(rec.etag));
+    memcpy(rec.last_modified, val->last_modified, sizeof(rec.last_modified));
+
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1) return -1;
+    if (rec.ntags && fwrite(val->tags, sizeof(uint64_t), rec.ntags, f) != rec.ntags) return -1;
+    if (rec.url_len && fwrite(val->url, 1, rec.url_len, f) != rec.url_len) return -1;
+    if (rec.header_len && fwrite(val->header, 1, rec.header_len, f) != rec.header_len) return -1;
+    if (write_body(f, val->body, rec.body_len) != 0) return -1;
+    if (rec.gz_len && write_body(f, val->gz_body, rec.gz_len) != 0) return -1;
+    return 0;
+}
+
+int cache_snapshot_save(const char *path, uint64_t max_bytes) {
+    if (!path || !path[0]) return -1;
+
+    cache_hot_item_t *items = NULL;
+    size_t count = 0;
+    if (cache_collect_hot(&items, &count, max_bytes) != 0) return -1;
+
+    char tmp_path[MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int rc = -1;
+    FILE *f = fopen(tmp_path, "wb");
+    if (f) {
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+        cache_snapshot_file_header_t hdr;
+        hdr.magic = CACHE_SNAPSHOT_MAGIC;
+        hdr.version = CACHE_SNAPSHOT_VERSION;
+        hdr.created_at = (uint32_t)time(NULL);
+        hdr.count = (uint32_t)count;
+
+        rc = fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+        for (size_t i = 0; i < count && rc == 0; i++) {
+            rc = write_entry(f, &items[i]);
+        }
+        if (fclose(f) != 0) rc = -1;
+
+        if (rc == 0 && !MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) rc = -1;
+        if (rc != 0) DeleteFileA(tmp_path);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        cache_value_release(items[i].val);
+    }
+    free(items);
+
+    char log_buf[MAX_PATH + 96];
+    if (rc == 0) {
+        snprintf(log_buf, sizeof(log_buf), "[CACHE] Snapshot written: %zu entries to %s", count, path);
+        log_message("INFO", log_buf);
+    } else {
+        snprintf(log_buf, sizeof(log_buf), "[CACHE] Snapshot write failed: %s", path);
+        log_message("WARN", log_buf);
+    }
+    return rc;
+}
+
+static int read_body(FILE *f, cache_body_t *body, uint32_t len) {
+    uint8_t buf[CACHE_SEGMENT_BYTES];
+    cache_body_expect(body, len);
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, n, f) != n) return -1;
+        if (cache_body_append(body, buf, n) != 0) return -1;
+        len -= (uint32_t)n;
+    }
+    cache_body_finish(body);
+    return 0;
+}
+
+static cache_value_t *read_value(FILE *f, const cache_snapshot_record_t *rec) {
+    char content_type[sizeof(rec->content_type)];
+    memcpy(content_type, rec->content_type, sizeof(content_type));
+    content_type[sizeof(content_type) - 1] = '\0';
+
+    cache_value_t *val = cache_value_create(rec->status_code, content_type, rec->body_len);
+    if (!val) return NULL;
+
+    val->expires_at = rec->expires_at;
+    val->age_base = rec->age_base;
+    val->stale_while_revalidate = rec->stale_while_revalidate;
+    val->stale_if_error = rec->stale_if_error;
+    val->compressible = (int)rec->compressible;
+    val->range_total = rec->range_total;
+    memcpy(val->etag, rec->etag, sizeof(val->etag));
+    val->etag[sizeof(val->etag) - 1] = '\0';
+    memcpy(val->last_modified, rec->last_modified, sizeof(val->last_modified));
+    val->last_modified[sizeof(val->last_modified) - 1] = '\0';
+
+    if (rec->ntags) {
+        val->tags = (uint64_t *)malloc(rec->ntags * sizeof(uint64_t));
+        if (!val->tags || fread(val->tags, sizeof(uint64_t), rec->ntags, f) != rec->ntags) goto fail;
+        val->ntags = rec->ntags;
+    }
+    if (rec->url_len) {
+        val->url = (char *)malloc(rec->url_len + 1);
+        if (!val->url || fread(val->url, 1, rec->url_len, f) != rec->url_len) goto fail;
+        val->url[rec->url_len] = '\0';
+    }
+    if (rec->header_len) {
+        val->header = (char *)malloc(rec->header_len);
+        if (!val->header || fread(val->header, 1, rec->header_len, f) != rec->header_len) goto fail;
+        val->header_len = rec->header_len;
+    }
+    if (read_body(f, val->body, rec->body_len) != 0) goto fail;
+    val->body_len = rec->body_len;
+
+    if (rec->gz_len) {
+        val->gz_body = cache_body_create();
+        if (!val->gz_body || read_body(f, val->gz_body, rec->gz_len) != 0) goto fail;
+        val->gz_len = rec->gz_len;
+        val->gz_state = CACHE_VARIANT_READY;
+    }
+    return val;
+
+fail:
+    cache_value_release(val);
+    return NULL;
+}
+
+int cache_snapshot_load(const char *path) {
+    if (!path || !path[0]) return -1;
+
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    char log_buf[MAX_PATH + 96];
+    cache_snapshot_file_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != CACHE_SNAPSHOT_MAGIC || hdr.version != CACHE_SNAPSHOT_VERSION) {
+        fclose(f);
+        snprintf(log_buf, sizeof(log_buf), "[CACHE] Ignoring snapshot %s: unknown format or version", path);
+        log_message("WARN", log_buf);
+        return -1;
+    }
+
+    uint32_t now = (uint32_t)time(NULL);
+    int loaded = 0, skipped = 0;
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        cache_snapshot_record_t rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.magic != CACHE_SNAPSHOT_RECORD_MAGIC ||
+            rec.header_len > CACHE_SNAPSHOT_MAX_HEADER_BYTES || rec.url_len > CACHE_SNAPSHOT_MAX_URL_BYTES ||
+            rec.body_len == 0 || rec.body_len > CACHE_MAX_OBJECT_BYTES ||
+            rec.gz_len > rec.body_len || rec.ntags > CACHE_MAX_TAGS) {
+            log_message("WARN", "[CACHE] Snapshot truncated or corrupt, stopping load");
+            break;
+        }
+
+        if (now >= rec.expires_at) {
+            long payload = (long)(rec.ntags * sizeof(uint64_t)) + (long)rec.url_len + (long)rec.header_len +
+                           (long)rec.body_len + (long)rec.gz_len;
+            if (fseek(f, payload, SEEK_CUR) != 0) break;
+            skipped++;
+            continue;
+        }
+
+        cache_value_t *val = read_value(f, &rec);
+        if (!val) break;
+        if (cache_restore_value(rec.key_hash, rec.key_fingerprint, val) == 0) loaded++;
+        cache_value_release(val);
+    }
+    fclose(f);
+
+    snprintf(log_buf, sizeof(log_buf), "[CACHE] Snapshot loaded: %d entries restored, %d expired skipped",
+             loaded, skipped);
+    log_message("INFO", log_buf);
+    return loaded;
+}
+
+typedef struct {
+    uint32_t rank;      // position among its shard's entries, which are saved hottest first
+    uint32_t order;
+    char *url;
+} snapshot_url_t;
+
+static int url_rank_cmp(const void *a, const void *b) {
+    const snapshot_url_t *x = (const snapshot_url_t *)a;
+    const snapshot_url_t *y = (const snapshot_url_t *)b;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int url_on_host(const char *url, const char *host) {
+    const char *p = strstr(url, "://");
+    size_t len = strlen(host);
+    return p && _strnicmp(p + 3, host, len) == 0 && p[3 + len] == '/';
+}
+
+int cache_snapshot_urls(const char *path, const char *host, uint32_t max_urls, char ***urls_out) {
+    if (!path || !path[0] || !host || !host[0] || !urls_out) return -1;
+    *urls_out = NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    cache_snapshot_file_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != CACHE_SNAPSHOT_MAGIC || hdr.version != CACHE_SNAPSHOT_VERSION) {
+        fclose(f);
+        return -1;
+    }
+
+    // Expired entries count too: their URLs were hot when the snapshot was taken
+    uint32_t shard_seen[CACHE_NUM_SHARDS] = {0};
+    snapshot_url_t *found = NULL;
+    size_t count = 0, cap = 0;
+    char url[CACHE_SNAPSHOT_MAX_URL_BYTES + 1];
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        cache_snapshot_record_t rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.magic != CACHE_SNAPSHOT_RECORD_MAGIC ||
+            rec.url_len > CACHE_SNAPSHOT_MAX_URL_BYTES || rec.ntags > CACHE_MAX_TAGS ||
+            fseek(f, (long)(rec.ntags * sizeof(uint64_t)), SEEK_CUR) != 0) {
+            break;
+        }
+        uint32_t rank = shard_seen[cache_key_to_shard(rec.key_hash)]++;
+
+        if (rec.url_len) {
+            if (fread(url, 1, rec.url_len, f) != rec.url_len) break;
+            url[rec.url_len] = '\0';
+            if (url_on_host(url, host)) {
+                if (count == cap) {
+                    size_t grown_cap = cap ? cap * 2 : 256;
+                    snapshot_url_t *grown = (snapshot_url_t *)realloc(found, grown_cap * sizeof(snapshot_url_t));
+                    if (!grown) break;
+                    found = grown;
+                    cap = grown_cap;
+                }
+                found[count].url = strdup(url);
+                if (!found[count].url) break;
+                found[count].rank = rank;
+                found[count].order = (uint32_t)count;
+                count++;
+            }
+        }
+        long payload = (long)rec.header_len + (long)rec.body_len + (long)rec.gz_len;
+        if (fseek(f, payload, SEEK_CUR) != 0) break;
+    }
+    fclose(f);
+
+    // Interleave the shards' hottest-first runs into one ranking
+    if (count > 1) qsort(found, count, sizeof(snapshot_url_t), url_rank_cmp);
+    size_t n = count < max_urls ? count : max_urls;
+    char **urls = n ? (char **)malloc(n * sizeof(char *)) : NULL;
+    if (!urls) n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i < n) urls[i] = found[i].url;
+        else free(found[i].url);
+    }
+    free(found);
+
+    *urls_out = urls;
+    return (int)n;
+}
+
+static unsigned __stdcall snapshot_thread_func(void *arg) {
+    (void)arg;
+    while (WaitForSingleObject(g_snapshot_stop, g_snapshot_interval_sec * 1000) == WAIT_TIMEOUT) {
+        cache_snapshot_save(g_snapshot_path, g_snapshot_max_bytes);
+    }
+    return 0;
+}
+
+int cache_snapshot_start(const char *path, uint32_t interval_sec, uint64_t max_bytes) {
+    if (!path || !path[0] || interval_sec == 0 || g_snapshot_thread) return -1;
+
+    snprintf(g_snapshot_path, sizeof(g_snapshot_path), "%s", path);
+    g_snapshot_interval_sec = interval_sec;
+    g_snapshot_max_bytes = max_bytes;
+
+    g_snapshot_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!g_snapshot_stop) return -1;
+
+    g_snapshot_thread = (HANDLE)_beginthreadex(NULL, 0, snapshot_thread_func, NULL, 0, NULL);
+    if (!g_snapshot_thread) {
+        CloseHandle(g_snapshot_stop);
+        g_snapshot_stop = NULL;
+        log_message("ERROR", "Failed to create cache snapshot thread");
+        return -1;
+    }
+    return 0;
+}
+
+void cache_snapshot_stop(void) {
+    if (!g_snapshot_thread) return;
+
+    SetEvent(g_snapshot_stop);
+    WaitForSingleObject(g_snapshot_thread, INFINITE);
+    CloseHandle(g_snapshot_thread);
+    CloseHandle(g_snapshot_stop);
+    g_snapshot_thread = NULL;
+    g_snapshot_stop = NULL;
+
+    // Final snapshot so the next start picks up where this one stopped
+    cache_snapshot_save(g_snapshot_path, g_snapshot_max_bytes);
+}
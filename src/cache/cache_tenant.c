@@ -0,0 +1,180 @@
+#include "../include/cache.h"
+#include "../include/logger.h"
+#include <stdio.h>
+#include <string.h>
+
+// Per-domain partitions of the one shared cache. Every entry is charged to its
+// tenant; the evictor recomputes each tenant's share (its quota, or capacity left
+// by quotas split by weight among tenants holding bytes) and publishes the ones
+// furthest over it, whose own LRU tails are evicted before anyone else's.
+
+#define TENANT_SLOTS (CACHE_MAX_TENANTS * 2)
+
+typedef struct {
+    uint64_t scope;
+    volatile uint64_t quota_bytes;
+    volatile LONG weight;
+    volatile LONG64 bytes_used;
+    volatile LONG64 entries;
+    volatile LONG64 evictions;
+    volatile LONG64 share_bytes;
+    LONG64 evictions_reported;    // flush thread only
+} tenant_t;
+
+static tenant_t g_tenants[CACHE_MAX_TENANTS];
+static volatile LONG g_tenant_count = 1;            // tenant 0 is never in the table
+static volatile LONG g_tenant_slots[TENANT_SLOTS];  // scope -> id, 0 empty
+static SRWLOCK g_tenant_lock = SRWLOCK_INIT;         // serializes configure
+static volatile LONG64 g_victims = 0;
+static int g_full_logged = 0;
+
+static tenant_t *tenant_get(uint16_t tenant) {
+    return tenant < (uint16_t)g_tenant_count ? &g_tenants[tenant] : NULL;
+}
+
+static uint64_t tenant_bytes(const tenant_t *t) {
+    LONG64 used = InterlockedCompareExchange64((volatile LONG64 *)&t->bytes_used, 0, 0);
+    return used > 0 ? (uint64_t)used : 0;
+}
+
+// Lock-free: slots only ever go from empty to an id, published after the record
+uint16_t cache_tenant_find(uint64_t scope) {
+    uint32_t s = (uint32_t)scope & (TENANT_SLOTS - 1);
+    LONG id;
+    while ((id = g_tenant_slots[s]) != 0) {
+        if (g_tenants[id].scope == scope) return (uint16_t)id;
+        s = (s + 1) & (TENANT_SLOTS - 1);
+    }
+    return 0;
+}
+
+uint16_t cache_tenant_configure(const char *host, uint64_t quota_bytes, uint32_t weight) {
+    if (!host || !host[0]) return 0;
+    uint64_t scope = cache_tag_scope(host);
+    if (weight == 0) weight = CACHE_TENANT_DEFAULT_WEIGHT;
+
+    AcquireSRWLockExclusive(&g_tenant_lock);
+    if (g_tenants[0].weight == 0) g_tenants[0].weight = CACHE_TENANT_DEFAULT_WEIGHT;
+    uint16_t id = cache_tenant_find(scope);
+    if (id == 0 && g_tenant_count < CACHE_MAX_TENANTS) {
+        id = (uint16_t)g_tenant_count;
+        g_tenants[id].scope = scope;
+        uint32_t s = (uint32_t)scope & (TENANT_SLOTS - 1);
+        while (g_tenant_slots[s] != 0) s = (s + 1) & (TENANT_SLOTS - 1);
+        InterlockedExchange(&g_tenant_count, (LONG)id + 1);
+        InterlockedExchange(&g_tenant_slots[s], (LONG)id);
+    }
+    if (id != 0) {
+        g_tenants[id].quota_bytes = quota_bytes;
+        g_tenants[id].weight = (LONG)weight;
+    }
+    ReleaseSRWLockExclusive(&g_tenant_lock);
+
+    if (id == 0 && !g_full_logged) {
+        g_full_logged = 1;
+        char log_buf[384];
+        snprintf(log_buf, sizeof(log_buf), "[cache] tenant table full (%d), '%s' shares tenant 0",
+                 CACHE_MAX_TENANTS, host);
+        log_message("WARN", log_buf);
+    }
+    return id;
+}
+
+void cache_tenant_charge(uint16_t tenant, int64_t bytes, int64_t entries) {
+    tenant_t *t = tenant_get(tenant);
+    if (!t) return;
+    InterlockedExchangeAdd64(&t->bytes_used, (LONG64)bytes);
+    InterlockedExchangeAdd64(&t->entries, (LONG64)entries);
+}
+
+void cache_tenant_count_eviction(uint16_t tenant) {
+    tenant_t *t = tenant_get(tenant);
+    if (t) InterlockedIncrement64(&t->evictions);
+}
+
+void cache_tenant_rebalance(uint64_t capacity) {
+    LONG n = g_tenant_count;
+    if (g_tenants[0].weight == 0) g_tenants[0].weight = CACHE_TENANT_DEFAULT_WEIGHT;
+
+    // Quotas are taken off the top; only tenants holding bytes split the rest
+    uint64_t quota_sum = 0, weight_sum = 0;
+    for (LONG i = 0; i < n; i++) {
+        tenant_t *t = &g_tenants[i];
+        if (t->quota_bytes) {
+            quota_sum += t->quota_bytes;
+        } else if (tenant_bytes(t) > 0) {
+            weight_sum += (uint64_t)t->weight;
+        }
+    }
+    uint64_t pool = capacity > quota_sum ? capacity - quota_sum : 0;
+
+    uint16_t top[CACHE_TENANT_VICTIMS];
+    double top_pressure[CACHE_TENANT_VICTIMS];
+    int ntop = 0;
+    for (LONG i = 0; i < n; i++) {
+        tenant_t *t = &g_tenants[i];
+        uint64_t share = t->quota_bytes ? t->quota_bytes :
+                         weight_sum ? pool / weight_sum * (uint64_t)t->weight : pool;
+        InterlockedExchange64(&t->share_bytes, (LONG64)share);
+
+        uint64_t used = tenant_bytes(t);
+        if (used <= share) continue;
+        // Over a hard quota ranks ahead of over a fair share
+        double pressure = (double)used / (double)(share ? share : 1);
+        if (t->quota_bytes) pressure += 1e9;
+        int pos = ntop < CACHE_TENANT_VICTIMS ? ntop++ : CACHE_TENANT_VICTIMS;
+        while (pos > 0 && top_pressure[pos - 1] < pressure) {
+            if (pos < CACHE_TENANT_VICTIMS) {
+                top[pos] = top[pos - 1];
+                top_pressure[pos] = top_pressure[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < CACHE_TENANT_VICTIMS) {
+            top[pos] = (uint16_t)i;
+            top_pressure[pos] = pressure;
+        }
+    }
+
+    uint64_t packed = 0;
+    for (int i = ntop - 1; i >= 0; i--) packed = (packed << 16) | (uint64_t)(top[i] + 1);
+    InterlockedExchange64(&g_victims, (LONG64)packed);
+}
+
+uint64_t cache_tenant_victims(void) {
+    return (uint64_t)InterlockedCompareExchange64(&g_victims, 0, 0);
+}
+
+int cache_tenant_over_share(uint16_t tenant) {
+    tenant_t *t = tenant_get(tenant);
+    if (!t) return 0;
+    return tenant_bytes(t) > (uint64_t)InterlockedCompareExchange64(&t->share_bytes, 0, 0);
+}
+
+uint64_t cache_tenant_quota(uint16_t tenant) {
+    tenant_t *t = tenant_get(tenant);
+    return t ? t->quota_bytes : 0;
+}
+
+uint64_t cache_tenant_quota_excess(uint16_t tenant, uint64_t extra) {
+    tenant_t *t = tenant_get(tenant);
+    if (!t || t->quota_bytes == 0) return 0;
+    uint64_t used = tenant_bytes(t) + extra;
+    return used > t->quota_bytes ? used - t->quota_bytes : 0;
+}
+
+int cache_tenant_take_stats(const char *host, cache_tenant_stats_t *out) {
+    uint16_t id = host && host[0] ? cache_tenant_find(cache_tag_scope(host)) : 0;
+    if (id == 0 || !out) return -1;
+
+    tenant_t *t = &g_tenants[id];
+    LONG64 entries = InterlockedCompareExchange64(&t->entries, 0, 0);
+    LONG64 evictions = InterlockedCompareExchange64(&t->evictions, 0, 0);
+    out->bytes_used = tenant_bytes(t);
+    out->entries = entries > 0 ? (uint64_t)entries : 0;
+    out->quota_bytes = t->quota_bytes;
+    out->share_bytes = (uint64_t)InterlockedCompareExchange64(&t->share_bytes, 0, 0);
+    out->evictions = (uint64_t)(evictions - t->evictions_reported);
+    t->evictions_reported = evictions;
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <winsock2.h>
 #include <openssl/ssl.h>
 #include "../include/cache.h"
+#include "../include/cache_disk.h"
+#include "../include/cache_encoding.h"
 #include "../include/logger.h"
 #include "../include/request_metrics.h"
 #include <stdio.h>
@@ -9,190 +11,45 @@
 #include <stddef.h>
 #include <time.h>
 
-uint64_t fnv1a_hash(const char *key, size_t len) {
-    uint64_t hash = 0xcbf29ce484222325ULL;
-    for (size_t i = 0; i < len; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 0x100000001b3ULL;
-    }
-    return hash;
-}
-
-static void generate_fingerprint(const char *key, size_t len, char *fp_out) {
-    uint64_t hash1 = fnv1a_hash(key, len);
-
-    uint64_t hash2 = 0x811c9dc5ULL;  
-    for (size_t i = 0; i < len; i++) {
-        hash2 ^= (uint8_t)key[i];
-        hash2 *= 0x01000193ULL;
-    }
-
-    memcpy(fp_out, &hash1, 8);
-    memcpy(fp_out + 8, &hash2, 8);
-}
-
 static inline uint32_t hash_to_shard(uint64_t hash) {
     return (uint32_t)(hash & (CACHE_NUM_SHARDS - 1));
 }
 
-typedef struct {
-    char *key;
-    char *value;
-    size_t key_len;
-    size_t value_len;
-} query_param_t;
-
-static int compare_params(const void *a, const void *b) {
-    const query_param_t *pa = (const query_param_t *)a;
-    const query_param_t *pb = (const query_param_t *)b;
-    size_t min_len = pa->key_len < pb->key_len ? pa->key_len : pb->key_len;
-    int cmp = memcmp(pa->key, pb->key, min_len);
-    if (cmp != 0) return cmp;
-    return (int)(pa->key_len - pb->key_len);
+uint32_t cache_key_to_shard(uint64_t key_hash) {
+    return hash_to_shard(key_hash);
 }
 
-static int normalize_query(const char *query, char *out, size_t out_size) {
-    if (!query || out_size == 0) {
-        if (out && out_size > 0) out[0] = '\0';
-        return 0;
-    }
-    
-    size_t query_len = strlen(query);
-    if (query_len == 0) {
-        if (out && out_size > 0) out[0] = '\0';
-        return 0;
-    }
-
-    if (query_len >= out_size || query_len > 1024) {
-        size_t copy_len = out_size - 1;
-        if (query_len < copy_len) copy_len = query_len;
-        memcpy(out, query, copy_len);
-        out[copy_len] = '\0';
-        return 0;
-    }
-
-    query_param_t params[64];
-    int param_count = 0;
-    char *query_copy = (char *)malloc(query_len + 1);
-    if (!query_copy) {
-
-        memcpy(out, query, query_len < (out_size - 1) ? query_len : (out_size - 1));
-        out[query_len < (out_size - 1) ? query_len : (out_size - 1)] = '\0';
-        return 0;
-    }
-    memcpy(query_copy, query, query_len + 1);
-
-    char *saveptr = NULL;
-    char *delim = "&";
-    
-    char *param = strtok_s(query_copy, delim, &saveptr);
-    while (param_count < 64 && param) {
-
-        char *eq = strchr(param, '=');
-        if (eq) {
-            *eq = '\0';
-            params[param_count].key = param;
-            params[param_count].key_len = strlen(param);
-            params[param_count].value = eq + 1;
-            params[param_count].value_len = strlen(params[param_count].value);
-        } else {
-
-            params[param_count].key = param;
-            params[param_count].key_len = strlen(param);
-            params[param_count].value = NULL;
-            params[param_count].value_len = 0;
-        }
-        param_count++;
-        param = strtok_s(NULL, delim, &saveptr);
-    }
-
-    if (param_count > 1) {
-        qsort(params, param_count, sizeof(query_param_t), compare_params);
-    }
-
-    size_t pos = 0;
-    for (int i = 0; i < param_count && pos < out_size - 1; i++) {
-        if (i > 0) {
-            if (pos < out_size - 1) out[pos++] = '&';
-        }
-
-        size_t key_copy = params[i].key_len;
-        if (pos + key_copy >= out_size - 1) {
-            key_copy = out_size - 1 - pos - 1;  
-        }
-        memcpy(out + pos, params[i].key, key_copy);
-        pos += key_copy;
-
-        if (params[i].value && params[i].value_len > 0) {
-            if (pos < out_size - 1) out[pos++] = '=';
-            size_t val_copy = params[i].value_len;
-            if (pos + val_copy >= out_size - 1) {
-                val_copy = out_size - 1 - pos;
-            }
-            memcpy(out + pos, params[i].value, val_copy);
-            pos += val_copy;
-        }
-    }
-
-    if (pos < out_size) {
-        out[pos] = '\0';
-    } else if (out_size > 0) {
-        out[out_size - 1] = '\0';
+uint64_t cache_tag_scope(const char *host) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = host ? host : ""; *p && *p != ':'; p++) {
+        char c = *p;
+        if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3ULL;
     }
-    
-    free(query_copy);
-    return 0;
+    return hash;
 }
 
-int build_cache_key(const char *method, const char *scheme,
-                   const char *host, const char *path, 
-                   const char *query, const char *vary_header,
-                   char *key_buf, size_t key_buf_size) {
-    if (!key_buf || key_buf_size == 0) return -1;
-    
-    char norm_query[512] = {0};
-    if (query && strlen(query) > 0) {
-        normalize_query(query, norm_query, sizeof(norm_query));
-    }
-    
-    const char *method_str = method ? method : "GET";
-    const char *scheme_str = scheme ? scheme : "http";
-    const char *host_str = host ? host : "";
-    const char *path_str = path ? path : "/";
-    const char *vary_str = vary_header ? vary_header : "";
-
-    char query_part[513] = {0};
-    if (norm_query[0]) {
-        _snprintf(query_part, sizeof(query_part), "?%s", norm_query);
-    }
-    
-    int n = _snprintf(key_buf, key_buf_size,
-                     "%s:%s://%s%s%s|vary:%s",
-                     method_str,
-                     scheme_str,
-                     host_str,
-                     path_str,
-                     query_part,
-                     vary_str);
-    
-    if (n < 0 || (size_t)n >= key_buf_size) {
-        key_buf[key_buf_size - 1] = '\0';
-        return -1;
+uint64_t cache_tag_hash(uint64_t scope, char kind, const char *tag, size_t len) {
+    uint64_t hash = scope;
+    hash ^= (uint8_t)kind;
+    hash *= 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)tag[i];
+        hash *= 0x100000001b3ULL;
     }
-    
-    return 0;
-}
-
-void cache_key_hash(const char *key, uint64_t *hash_out, char *fingerprint_out) {
-    if (!key || !hash_out || !fingerprint_out) return;
-    
-    size_t key_len = strlen(key);
-    *hash_out = fnv1a_hash(key, key_len);
-    generate_fingerprint(key, key_len, fingerprint_out);
+    return hash;
 }
 
-uint32_t cache_key_to_shard(uint64_t key_hash) {
-    return hash_to_shard(key_hash);
+// "/", "/a/", "/a/b/", ... for prefix purges; the last segment is the object itself
+static void build_path_tags(const char *path, cache_key_info_t *key_info) {
+    if (!path || path[0] != '/') return;
+    for (const char *p = path; *p && key_info->npath_tags < CACHE_MAX_PATH_TAGS; p++) {
+        if (*p == '/') {
+            key_info->path_tags[key_info->npath_tags++] =
+                cache_tag_hash(key_info->tag_scope, CACHE_TAG_PREFIX, path, (size_t)(p - path) + 1);
+        }
+    }
 }
 int cache_prepare_key(const char *method, const char *scheme,
                       const char *host, const char *path,
@@ -202,13 +59,14 @@ int cache_prepare_key(const char *method, const char *scheme,
     
     memset(key_info, 0, sizeof(cache_key_info_t));
     
-    char key_buf[2048];
-    if (build_cache_key(method, scheme, host, path, query, vary_header,
-                       key_buf, sizeof(key_buf)) != 0) {
+    if (cache_key_compute(method, scheme, host, path, query, vary_header,
+                          &key_info->key_hash, key_info->key_fingerprint) != 0) {
         return -1;
     }
-    
-    cache_key_hash(key_buf, &key_info->key_hash, key_info->key_fingerprint);
+    key_info->https = scheme && strcmp(scheme, "https") == 0;
+    key_info->tag_scope = cache_tag_scope(host);
+    key_info->tenant = cache_tenant_find(key_info->tag_scope);
+    build_path_tags(path, key_info);
     key_info->should_cache = 1;
     
     return 0;
@@ -216,20 +74,36 @@ int cache_prepare_key(const char *method, const char *scheme,
 
 int cache_should_cache_response(const char *method, uint32_t status_code,
                                 int is_chunked, long long content_length,
-                                uint32_t max_object_bytes) {
+                                uint32_t max_object_bytes, const cache_key_info_t *policy) {
     if (!method || strcmp(method, "GET") != 0) {
         return 0;
     }
+
+    // A partial response never stands in for the whole object
+    if (status_code == 206) {
+        return 0;
+    }
+
+    // An error never replaces the expired copy that may still stand in for origin
+    if (status_code >= 500 && policy && policy->has_stale) {
+        return 0;
+    }
     
-    if (status_code != 200) {
+    if (policy && policy->ncacheable_statuses > 0) {
+        uint32_t i = 0;
+        while (i < policy->ncacheable_statuses && policy->cacheable_statuses[i] != status_code) i++;
+        if (i == policy->ncacheable_statuses) return 0;
+    } else if (status_code != 200 && !cache_status_rule(status_code)) {
         return 0;
     }
     
+    // Chunked bodies are de-chunked while filling; the size limit is enforced as they grow
     if (is_chunked) {
-        return 0;
+        return 1;
     }
     
-    if (content_length < 0) {
+    // Redirects and 404s often have no body at all
+    if (content_length < 0 || (content_length == 0 && status_code == 200)) {
         return 0;
     }
     
@@ -240,65 +114,213 @@ int cache_should_cache_response(const char *method, uint32_t status_code,
     return 1;
 }
 
-int cache_buffer_init(cache_buffer_t *buf, size_t capacity) {
-    if (!buf || capacity == 0) return -1;
-    
-    memset(buf, 0, sizeof(cache_buffer_t));
-    buf->capacity = capacity;
-    
-    if (capacity > 0) {
-        buf->buffer = (uint8_t *)malloc(capacity);
-        if (!buf->buffer) {
-            return -1;
+enum {
+    CHUNK_SIZE = 0,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_DONE
+};
+
+int cache_buffer_init(cache_buffer_t *buf, long long content_length, int is_chunked, size_t max_bytes) {
+    if (!buf || max_bytes == 0) return -1;
+    if (!is_chunked && (content_length < 0 || (unsigned long long)content_length > max_bytes)) return -1;
+
+    // status_code/content_type are parsed from the headers before init
+    buf->value = cache_value_create(buf->status_code,
+                                    buf->content_type[0] ? buf->content_type : "text/html",
+                                    is_chunked ? -1 : content_length);
+    if (!buf->value) return -1;
+
+    buf->size = 0;
+    buf->max_bytes = max_bytes;
+    buf->content_length = is_chunked ? -1 : content_length;
+    buf->complete = 0;
+    buf->published = 0;
+    buf->is_chunked = is_chunked;
+    cache_dechunk_init(&buf->dechunk, max_bytes);
+    if (content_length == 0) {
+        buf->complete = 1;
+        cache_body_finish(buf->value->body);
+    }
+    return 0;
+}
+
+static int buffer_store(cache_buffer_t *buf, const uint8_t *data, size_t len) {
+    if (len == 0) return 0;
+    if (buf->size + len > buf->max_bytes) return -1;
+    if (buf->disk) {
+        if (cache_disk_write(buf->disk, data, len) != 0) return -1;
+    } else {
+        // A chunked body outgrowing RAM entries keeps filling in RAM for the readers
+        // attached to it, but only as one of the few large fills allowed at once
+        if (!buf->large && buf->size + len > CACHE_MAX_OBJECT_BYTES) {
+            if (cache_large_fill_begin() != 0) return -1;
+            buf->large = 1;
         }
+        if (cache_body_append(buf->value->body, data, len) != 0) return -1;
     }
-    
+    buf->size += len;
     return 0;
 }
 
-int cache_buffer_append(cache_buffer_t *buf, const uint8_t *data, size_t len) {
-    if (!buf || !data || len == 0) return -1;
-    if (!buf->buffer) return -1;
-    
-    if (buf->size + len > buf->capacity) {
+// Known to be too large for RAM: the body goes straight into a span of the disk log
+static int buffer_begin_disk(cache_buffer_t *buf, const cache_key_info_t *key_info, uint32_t ttl) {
+    if (!cache_disk_is_enabled() || buf->status_code != 200 ||
+        buf->content_length > (long long)cache_disk_max_object_bytes()) {
+        return -1;
+    }
+    if (cache_large_fill_begin() != 0) return -1;
+    buf->large = 1;
+
+    buf->value->expires_at = (uint32_t)time(NULL) + ttl;
+    buf->disk = (cache_disk_writer_t *)malloc(sizeof(cache_disk_writer_t));
+    if (!buf->disk) return -1;
+    if (cache_disk_begin(buf->disk, key_info->key_hash, key_info->key_fingerprint, buf->value,
+                         (uint32_t)buf->content_length) != 0) {
+        free(buf->disk);
+        buf->disk = NULL;
         return -1;
     }
-    
-    memcpy(buf->buffer + buf->size, data, len);
-    buf->size += len;
-    
     return 0;
 }
 
-int cache_buffer_is_complete(cache_buffer_t *buf, long long content_length) {
-    if (!buf) return 0;
-    if (content_length < 0) return 0;
-    
-    if (buf->size == (size_t)content_length && buf->size == buf->capacity) {
-        buf->complete = 1;
-        return 1;
+static int hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void cache_dechunk_init(cache_dechunk_t *d, uint64_t max_chunk) {
+    if (!d) return;
+    d->state = CHUNK_SIZE;
+    d->remaining = 0;
+    d->max_chunk = max_chunk;
+}
+
+int cache_dechunk(cache_dechunk_t *d, const uint8_t *data, size_t len,
+                  cache_dechunk_sink_t sink, void *ctx) {
+    if (!d || (!data && len > 0) || !sink) return -1;
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t c = data[i];
+        switch (d->state) {
+        case CHUNK_SIZE: {
+            int h = hex_digit(c);
+            if (h >= 0) {
+                d->remaining = (d->remaining << 4) | (uint64_t)h;
+                if (d->max_chunk && d->remaining > d->max_chunk) return -1;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                d->state = CHUNK_EXT;
+            } else if (c == '\n') {
+                d->state = d->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            } else if (c != '\r') {
+                return -1;
+            }
+            i++;
+            break;
+        }
+        case CHUNK_EXT:
+            if (c == '\n') {
+                d->state = d->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i;
+            if ((uint64_t)n > d->remaining) n = (size_t)d->remaining;
+            if (sink(ctx, data + i, n) != 0) return -1;
+            d->remaining -= n;
+            i += n;
+            if (d->remaining == 0) d->state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (c == '\n') {
+                d->state = CHUNK_SIZE;
+            } else if (c != '\r') {
+                return -1;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\n') {
+                d->state = CHUNK_DONE;
+            } else if (c != '\r') {
+                d->state = CHUNK_TRAILER_LINE;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') d->state = CHUNK_TRAILER;
+            i++;
+            break;
+        default:
+            // Bytes after the terminating chunk
+            return -1;
+        }
+    }
+    return d->state == CHUNK_DONE ? 1 : 0;
+}
+
+static int buffer_sink(void *ctx, const uint8_t *data, size_t len) {
+    return buffer_store((cache_buffer_t *)ctx, data, len);
+}
+
+int cache_buffer_append(cache_buffer_t *buf, const uint8_t *data, size_t len) {
+    if (!buf || !data || len == 0) return -1;
+    if (!buf->value || buf->complete) return -1;
+
+    if (buf->is_chunked) {
+        int rc = cache_dechunk(&buf->dechunk, data, len, buffer_sink, buf);
+        if (rc < 0) return -1;
+        if (rc == 1) buf->complete = 1;
+    } else {
+        if ((long long)(buf->size + len) > buf->content_length) return -1;
+        if (buffer_store(buf, data, len) != 0) return -1;
+        if ((long long)buf->size == buf->content_length) buf->complete = 1;
+    }
+
+    if (buf->complete) {
+        cache_body_finish(buf->value->body);
     }
-    
     return 0;
 }
 
-void cache_buffer_free(cache_buffer_t *buf) {
+int cache_buffer_is_complete(cache_buffer_t *buf, long long content_length) {
+    if (!buf || !buf->value) return 0;
+    if (content_length >= 0 && buf->size != (size_t)content_length) return 0;
+    return buf->complete;
+}
+
+void cache_buffer_free(cache_buffer_t *buf, const cache_key_info_t *key_info) {
     if (!buf) return;
     
-    if (buf->buffer) {
-        free(buf->buffer);
-        buf->buffer = NULL;
+    if (buf->value) {
+        if (buf->published && key_info) {
+            cache_abort_fill(key_info->key_hash, key_info->key_fingerprint, buf->value);
+        } else if (!buf->complete) {
+            cache_body_abort(buf->value->body);
+        }
+        cache_value_release(buf->value);
+        buf->value = NULL;
     }
+    if (buf->disk) {
+        cache_disk_abandon(buf->disk);
+        free(buf->disk);
+    }
+    if (buf->large) cache_large_fill_end();
     
     memset(buf, 0, sizeof(cache_buffer_t));
 }
 
 int cache_try_store(const cache_key_info_t *key_info,
-                   const cache_buffer_t *buf,
-                   const char *method, const char *scheme,
-                   const char *host, const char *path,
-                   const char *query, const char *vary_header,
-                   uint32_t ttl_seconds) {
+                   cache_buffer_t *buf, const char *host,
+                   const char *path, const char *query) {
     if (!key_info || !buf) {
         char debug_buf[256];
         snprintf(debug_buf, sizeof(debug_buf), 
@@ -307,20 +329,18 @@ int cache_try_store(const cache_key_info_t *key_info,
         log_message("WARN", debug_buf);
         return -1;
     }
-    if (!key_info->should_cache) {
+    size_t path_len = strlen(path ? path : "");
+    if (path_len > 150) path_len = 150;
+    if (!key_info->should_cache || !buf->value) {
         char debug_buf[512];
-        size_t path_len = strlen(path ? path : "");
-        if (path_len > 150) path_len = 150;
         snprintf(debug_buf, sizeof(debug_buf), 
-                "[CACHE_DEBUG] NOT cached: path=%.*s (should_cache=0)", 
-                (int)path_len, path ? path : "");
+                "[CACHE_DEBUG] NOT cached: path=%.*s (should_cache=%d)", 
+                (int)path_len, path ? path : "", key_info->should_cache);
         log_message("INFO", debug_buf);
         return -1;
     }
-    if (!buf->complete || buf->size == 0) {
+    if (!buf->complete || (buf->size == 0 && buf->status_code == 200)) {
         char debug_buf[512];
-        size_t path_len = strlen(path ? path : "");
-        if (path_len > 150) path_len = 150;
         snprintf(debug_buf, sizeof(debug_buf), 
                 "[CACHE_DEBUG] NOT cached: path=%.*s (buffer incomplete: complete=%d, size=%zu)", 
                 (int)path_len, path ? path : "", buf->complete, buf->size);
@@ -328,50 +348,43 @@ int cache_try_store(const cache_key_info_t *key_info,
         return -1;
     }
 
-    int should_cache = cache_check_admission(key_info->key_hash, key_info->key_fingerprint);
-    if (!should_cache) {
-        static int debug_count = 0;
-        if (debug_count < 10) {
-            char debug_buf[512];
-            size_t path_len = strlen(path ? path : "");
-            if (path_len > 150) path_len = 150;
-            snprintf(debug_buf, sizeof(debug_buf), 
-                    "[CACHE_DEBUG] NOT cached: path=%.*s, admission=%d (need 2nd hit in window)", 
-                    (int)path_len, path ? path : "", should_cache);
-            log_message("INFO", debug_buf);
-            debug_count++;
+    // Kept for warming from snapshots; written before the commit publishes body_len
+    if (!buf->value->url && host && path) {
+        size_t url_len = strlen(host) + strlen(path) + (query ? strlen(query) : 0) + 16;
+        char *url = (char *)malloc(url_len);
+        if (url) {
+            snprintf(url, url_len, "%s://%s%s%s%s", key_info->https ? "https" : "http",
+                     host, path, query ? "?" : "", query ? query : "");
+            buf->value->url = url;
         }
-        return -1;
     }
 
-    char debug_buf[512];
-    size_t path_len = strlen(path ? path : "");
-    if (path_len > 150) path_len = 150;
-    snprintf(debug_buf, sizeof(debug_buf), 
-            "[CACHE_DEBUG] Attempting to store: path=%.*s, status=%u, size=%zu, ttl=%u", 
-            (int)path_len, path ? path : "", buf->status_code, buf->size, ttl_seconds);
-    log_message("INFO", debug_buf);
-
-    int result = cache_put(method, scheme, host, path, query, vary_header,
-                          buf->status_code,
-                          buf->buffer, (uint32_t)buf->size,
-                          buf->content_type[0] ? buf->content_type : "text/html",
-                          ttl_seconds);
+    // Admission already passed at header time; the value is published and only needs committing.
+    // A body streamed to disk is indexed there, replacing any older copy of the key
+    int result;
+    if (buf->disk) {
+        cache_invalidate_key(key_info->key_hash, key_info->key_fingerprint);
+        result = cache_disk_commit(buf->disk);
+    } else {
+        result = cache_commit_fill(key_info->key_hash, key_info->key_fingerprint, buf->value);
+    }
+    buf->published = 0;
     
     if (result == 0) {
         char log_buf[512];
         size_t query_len = query ? strlen(query) : 0;
         if (query_len > 50) query_len = 50;
-        snprintf(log_buf, sizeof(log_buf), "[CACHE_DEBUG] Successfully cached: path=%.*s%.*s (status=%u, size=%llu, ttl=%u)", 
+        snprintf(log_buf, sizeof(log_buf), "[CACHE_DEBUG] Successfully cached: path=%.*s%.*s (status=%u, size=%llu)", 
                 (int)path_len, path ? path : "", 
                 (int)query_len, query ? query : "",
                 buf->status_code,
-                (unsigned long long)buf->size, ttl_seconds);
+                (unsigned long long)buf->size);
         log_message("INFO", log_buf);
+        if (!buf->disk) cache_gzip_schedule(key_info->key_hash, key_info->key_fingerprint, buf->value);
     } else {
         char log_buf[512];
         snprintf(log_buf, sizeof(log_buf), 
-                "[CACHE_DEBUG] Failed to cache: path=%.*s (cache_put returned %d)", 
+                "[CACHE_DEBUG] Failed to cache: path=%.*s (commit returned %d)", 
                 (int)path_len, path ? path : "", result);
         log_message("WARN", log_buf);
     }
@@ -393,49 +406,474 @@ static int send_all_data(void *sock, const char *buf, int len, void *ssl) {
     return 0;
 }
 
-int cache_send_response(void *client_fd, void *ssl, cache_value_t *cached_value) {
-    if (!cached_value || !client_fd) return -1;
-    
+// Copies the value of header `name` (without colon) found before hdr_end; returns its length or -1
+static int copy_header_value(const char *buf, const char *hdr_end, const char *name,
+                             char *out, size_t out_size) {
+    size_t name_len = strlen(name);
+    for (const char *line = buf; line && line < hdr_end; ) {
+        if (_strnicmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            const char *e = strstr(v, "\r\n");
+            if (!e || e > hdr_end) e = hdr_end;
+            size_t len = (size_t)(e - v);
+            if (len >= out_size) return -1;
+            memcpy(out, v, len);
+            out[len] = '\0';
+            return (int)len;
+        }
+        line = strstr(line, "\r\n");
+        if (line) line += 2;
+    }
+    return -1;
+}
+
+int cache_header_value(const char *buf, const char *hdr_end, const char *name,
+                       char *out, size_t out_size) {
+    if (!buf || !hdr_end || !name || !out || out_size == 0) return -1;
+    return copy_header_value(buf, hdr_end, name, out, out_size);
+}
+
+const char *cache_status_reason(uint32_t status_code) {
+    switch (status_code) {
+    case 200: return "OK";
+    case 203: return "Non-Authoritative Information";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 300: return "Multiple Choices";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 410: return "Gone";
+    case 414: return "URI Too Long";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default:  return "";    // the reason phrase is optional (RFC 9112 4)
+    }
+}
+
+// How a value past expires_at is sent
+enum {
+    SEND_FRESH = 0,         // not at all
+    SEND_STALE,             // marked stale
+    SEND_REVALIDATED        // as a hit: origin has just confirmed it with a 304
+};
+
+static int build_hit_header(char *out, size_t out_size, uint32_t status_code,
+                            const char *content_type, uint64_t body_len, uint32_t expires_at,
+                            const char *etag, const char *last_modified,
+                            const char *extra, int mode) {
+    if (!out || out_size == 0) return -1;
+
     uint32_t now = (uint32_t)time(NULL);
-    if (now >= cached_value->expires_at) {
+    if (now >= expires_at && mode == SEND_FRESH) {
         return -1;
     }
     
-    uint32_t max_age = cached_value->expires_at - now;
-    uint32_t age = max_age;
+    uint32_t max_age = now < expires_at ? expires_at - now : 0;
+    uint32_t age = mode == SEND_STALE ? now - expires_at : max_age;
 
-    char response_header[4096];
-    int n = snprintf(response_header, sizeof(response_header),
+    int n = snprintf(out, out_size,
         "HTTP/1.1 %u %s\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %u\r\n"
+        "Content-Length: %llu\r\n"
         "Cache-Control: public, max-age=%u\r\n"
         "Age: %u\r\n"
-        "X-Cache: HIT\r\n"
+        "%s%s%s"
+        "%s%s%s"
+        "%s"
+        "%s"
+        "%s"
         "Connection: close\r\n"
         "\r\n",
-        cached_value->status_code,
-        cached_value->status_code == 200 ? "OK" : 
-        cached_value->status_code == 404 ? "Not Found" :
-        cached_value->status_code == 304 ? "Not Modified" : "OK",
-        cached_value->content_type[0] ? cached_value->content_type : "text/html",
-        cached_value->body_len,
+        status_code, cache_status_reason(status_code),
+        content_type && content_type[0] ? content_type : "text/html",
+        (unsigned long long)body_len,
         max_age,
-        age);
-    
-    if (n > 0 && n < (int)sizeof(response_header)) {
-        if (send_all_data(client_fd, response_header, n, ssl) != 0) {
-            return -1;
+        age,
+        etag && etag[0] ? "ETag: " : "", etag && etag[0] ? etag : "", etag && etag[0] ? "\r\n" : "",
+        last_modified && last_modified[0] ? "Last-Modified: " : "",
+        last_modified && last_modified[0] ? last_modified : "",
+        last_modified && last_modified[0] ? "\r\n" : "",
+        extra ? extra : "",
+        status_code == 200 || status_code == 206 ? "Accept-Ranges: bytes\r\n" : "",
+        mode == SEND_STALE ? "X-Cache: STALE\r\nWarning: 110 - \"Response is Stale\"\r\n" : "X-Cache: HIT\r\n");
+
+    if (n <= 0 || n >= (int)out_size) return -1;
+    return n;
+}
+
+int cache_build_hit_header(char *out, size_t out_size, uint32_t status_code,
+                           const char *content_type, uint64_t body_len, uint32_t expires_at,
+                           const char *etag, const char *last_modified) {
+    return build_hit_header(out, out_size, status_code, content_type, body_len, expires_at,
+                            etag, last_modified, NULL, SEND_FRESH);
+}
+
+// Returns 0 on success, -1 if nothing was sent, -2 if the body broke off after the header
+// Header + body runs in one WSASend; TLS has no gather write, so runs go out one by one
+static int send_gather(void *sock, void *ssl, WSABUF *bufs, DWORD nbufs) {
+    if (ssl) {
+        for (DWORD i = 0; i < nbufs; i++) {
+            if (send_all_data(sock, bufs[i].buf, (int)bufs[i].len, ssl) != 0) return -1;
         }
-        if (cached_value->body && cached_value->body_len > 0) {
-            if (send_all_data(client_fd, (const char *)cached_value->body, cached_value->body_len, ssl) != 0) {
-                return -1;
+        return 0;
+    }
+
+    SOCKET fd = (SOCKET)(uintptr_t)sock;
+    DWORD total = 0, sent = 0;
+    for (DWORD i = 0; i < nbufs; i++) total += bufs[i].len;
+    if (WSASend(fd, bufs, nbufs, &sent, 0, NULL, NULL) != 0) return -1;
+    if (sent == total) return 0;
+
+    // Short write: finish the remainder piecewise
+    for (DWORD i = 0; i < nbufs; i++) {
+        if (sent >= bufs[i].len) {
+            sent -= bufs[i].len;
+            continue;
+        }
+        if (send_all_data(sock, bufs[i].buf + sent, (int)(bufs[i].len - sent), NULL) != 0) return -1;
+        sent = 0;
+    }
+    return 0;
+}
+
+// Queues the part of the run at *pos that falls inside [start, end)
+static void queue_run(WSABUF *bufs, DWORD *nbufs, const uint8_t *data, size_t len,
+                      uint64_t *pos, uint64_t start, uint64_t end) {
+    uint64_t run_start = *pos;
+    uint64_t run_end = run_start + len;
+    *pos = run_end;
+    if (run_end <= start || run_start >= end) return;
+    if (run_start < start) {
+        data += start - run_start;
+        run_start = start;
+    }
+    if (run_end > end) run_end = end;
+    bufs[*nbufs].buf = (char *)data;
+    bufs[*nbufs].len = (ULONG)(run_end - run_start);
+    (*nbufs)++;
+}
+
+// Sends body bytes [start, start + len) behind the nbufs pieces already queued
+// Returns 0 on success, -1 if nothing was sent, -2 if it broke off once *started
+static int send_body_range(void *client_fd, void *ssl, cache_body_t *body,
+                           uint64_t start, uint64_t len,
+                           WSABUF *bufs, DWORD nbufs, int *started) {
+    cache_body_cursor_t cur;
+    cache_body_cursor_init(&cur);
+    uint64_t pos = 0;
+    uint64_t end = start + len;
+    for (;;) {
+        // Queue every run that is already filled without blocking
+        uint64_t avail = cache_body_available(body);
+        if (avail > end) avail = end;
+        while (nbufs < CACHE_SEND_GATHER_MAX && pos < avail) {
+            const uint8_t *data;
+            size_t n;
+            if (cache_body_read(body, &cur, &data, &n, 0) <= 0) break;
+            queue_run(bufs, &nbufs, data, n, &pos, start, end);
+        }
+
+        if (nbufs == 0) {
+            if (pos >= end) break;
+            // Caught up with the fill: wait for its next bytes
+            const uint8_t *data;
+            size_t n;
+            if (cache_body_read(body, &cur, &data, &n, CACHE_FILL_WAIT_MS) <= 0) {
+                return *started ? -2 : -1;
+            }
+            queue_run(bufs, &nbufs, data, n, &pos, start, end);
+            if (nbufs == 0) continue;
+        }
+
+        if (send_gather(client_fd, ssl, bufs, nbufs) != 0) {
+            return *started ? -2 : -1;
+        }
+        *started = 1;
+        nbufs = 0;
+        if (pos >= end) break;
+    }
+    return 0;
+}
+
+int cache_send_body_span(void *client_fd, void *ssl, cache_body_t *body,
+                         const char *head, int head_len, uint64_t offset, uint64_t len) {
+    if (!client_fd || !body) return -1;
+
+    WSABUF bufs[CACHE_SEND_GATHER_MAX];
+    DWORD nbufs = 0;
+    if (head && head_len > 0) {
+        bufs[0].buf = (char *)head;
+        bufs[0].len = (ULONG)head_len;
+        nbufs = 1;
+    }
+    int started = 0;
+    return send_body_range(client_fd, ssl, body, offset, len, bufs, nbufs, &started);
+}
+
+int cache_send_range_not_satisfiable(void *client_fd, void *ssl, uint64_t total) {
+    char resp[256];
+    int n = snprintf(resp, sizeof(resp),
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%llu\r\n"
+                     "Content-Length: 0\r\n"
+                     "X-Cache: HIT\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     (unsigned long long)total);
+    if (n <= 0 || n >= (int)sizeof(resp)) return -1;
+    return send_all_data(client_fd, resp, n, ssl);
+}
+
+// Line of header `name` inside [p, end); *line_end is set past its line break
+static const char *find_header_line(const char *p, const char *end, const char *name,
+                                    const char **line_end) {
+    size_t name_len = strlen(name);
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        eol = eol ? eol + 1 : end;
+        if ((size_t)(eol - p) > name_len && _strnicmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            *line_end = eol;
+            return p;
+        }
+        p = eol;
+    }
+    return NULL;
+}
+
+// 206 from the identity body (multipart/byteranges for several ranges), or 416
+static int send_value_ranges(void *client_fd, void *ssl, cache_value_t *val, cache_body_t *body,
+                             uint64_t body_len, int mode, const cache_range_t *range,
+                             uint32_t *status_sent, uint64_t *body_sent) {
+    uint32_t now = (uint32_t)time(NULL);
+    if (now >= val->expires_at && mode == SEND_FRESH) return -1;
+
+    cache_range_plan_t plan;
+    if (cache_range_plan(range, body_len, val->content_type, &plan) == 0) {
+        if (cache_send_range_not_satisfiable(client_fd, ssl, body_len) != 0) return -1;
+        *status_sent = 416;
+        *body_sent = 0;
+        return 0;
+    }
+
+    char range_line[96] = "";
+    if (plan.count == 1) {
+        snprintf(range_line, sizeof(range_line), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                 (unsigned long long)plan.first[0], (unsigned long long)plan.last[0],
+                 (unsigned long long)plan.total);
+    }
+
+    WSABUF bufs[CACHE_SEND_GATHER_MAX];
+    DWORD nbufs = 0;
+    char head[4096];
+    int n;
+    if (val->header) {
+        // Stored origin header behind a new status line; multipart replaces its Content-Type
+        static const char status_line[] = "HTTP/1.1 206 Partial Content\r\n";
+        const char *hdr_end = val->header + val->header_len;
+        const char *p = memchr(val->header, '\n', val->header_len);
+        p = p ? p + 1 : hdr_end;
+        const char *ct_end = NULL;
+        const char *ct = plan.count > 1 ? find_header_line(p, hdr_end, "Content-Type", &ct_end) : NULL;
+
+        bufs[nbufs].buf = (char *)status_line;
+        bufs[nbufs].len = sizeof(status_line) - 1;
+        nbufs++;
+        if (ct) {
+            if (ct > p) {
+                bufs[nbufs].buf = (char *)p;
+                bufs[nbufs].len = (ULONG)(ct - p);
+                nbufs++;
             }
+            p = ct_end;
         }
+        if (hdr_end > p) {
+            bufs[nbufs].buf = (char *)p;
+            bufs[nbufs].len = (ULONG)(hdr_end - p);
+            nbufs++;
+        }
+
+        uint32_t age = now > val->age_base ? now - val->age_base : 0;
+        n = snprintf(head, sizeof(head),
+                     "%s%s%s"
+                     "%s"
+                     "Content-Length: %llu\r\n"
+                     "Age: %u\r\n"
+                     "%s%s%s"
+                     "%s"
+                     "Accept-Ranges: bytes\r\n"
+                     "%s"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     plan.count > 1 ? "Content-Type: " : "",
+                     plan.count > 1 ? plan.content_type : "",
+                     plan.count > 1 ? "\r\n" : "",
+                     range_line,
+                     (unsigned long long)plan.body_len, age,
+                     val->etag[0] ? "ETag: " : "", val->etag, val->etag[0] ? "\r\n" : "",
+                     val->compressible ? "Vary: Accept-Encoding\r\n" : "",
+                     mode == SEND_STALE ? "X-Cache: STALE\r\nWarning: 110 - \"Response is Stale\"\r\n" : "X-Cache: HIT\r\n");
+    } else {
+        char extra[160];
+        snprintf(extra, sizeof(extra), "%s%s", range_line,
+                 val->compressible ? "Vary: Accept-Encoding\r\n" : "");
+        n = build_hit_header(head, sizeof(head), 206,
+                             plan.count > 1 ? plan.content_type : val->content_type,
+                             plan.body_len, val->expires_at, val->etag, val->last_modified,
+                             extra, mode);
+    }
+    if (n <= 0 || n >= (int)sizeof(head)) return -1;
+    bufs[nbufs].buf = head;
+    bufs[nbufs].len = (ULONG)n;
+    nbufs++;
+
+    int started = 0;
+    uint64_t sent = 0;
+    for (uint32_t i = 0; i < plan.count; i++) {
+        if (plan.count > 1) {
+            bufs[nbufs].buf = plan.part_head[i];
+            bufs[nbufs].len = plan.part_len[i];
+            nbufs++;
+        }
+        uint64_t len = plan.last[i] - plan.first[i] + 1;
+        int rc = send_body_range(client_fd, ssl, body, plan.first[i], len, bufs, nbufs, &started);
+        if (rc != 0) return rc;
+        nbufs = 0;
+        sent += len;
+    }
+    if (plan.count > 1 && send_all_data(client_fd, plan.trailer, (int)plan.trailer_len, ssl) != 0) {
+        return -2;
+    }
+
+    *status_sent = 206;
+    *body_sent = sent;
+    return 0;
+}
+
+// Returns 0 on success, -1 if nothing was sent, -2 if the body broke off after the header
+static int send_value(void *client_fd, void *ssl, cache_value_t *cached_value, int mode,
+                      uint32_t accept_encoding, const cache_range_t *range,
+                      uint32_t *status_sent, uint64_t *body_sent) {
+    if (!cached_value || !client_fd || !cached_value->body) return -1;
+
+    // Ranges are served from the identity body only
+    int ranged = range && range->count > 0 && cached_value->status_code == 200 &&
+                 cache_range_applies(range, cached_value->etag, cached_value->last_modified);
+    cache_body_t *body = cached_value->body;
+    uint64_t body_len = cached_value->body_len;
+    int gzip = !ranged && (accept_encoding & CACHE_ENCODING_GZIP) &&
+               InterlockedCompareExchange(&cached_value->gz_state, 0, 0) == CACHE_VARIANT_READY;
+    if (gzip) {
+        body = cached_value->gz_body;
+        body_len = cached_value->gz_len;
+    } else if (body_len == 0) {
+        // Still filling: the announced length lets us stream right away,
+        // otherwise wait for the fill to finish to learn it
+        if (cached_value->content_length >= 0) {
+            body_len = (uint64_t)cached_value->content_length;
+        } else {
+            if (cache_body_wait_complete(body, CACHE_FILL_WAIT_MS) != 0) return -1;
+            body_len = body->len;
+        }
+    }
+
+    uint32_t status = 0;
+    uint64_t sent = 0;
+    if (ranged) {
+        int rc = send_value_ranges(client_fd, ssl, cached_value, body, body_len, mode, range,
+                                   &status, &sent);
+        if (rc != 0) return rc;
+        if (status_sent) *status_sent = status;
+        if (body_sent) *body_sent = sent;
         return 0;
     }
-    
-    return -1;
+
+    // The variants are different representations: a strong ETag must not be shared
+    char etag[80];
+    const char *tag = cached_value->etag;
+    if (gzip && tag[0] && strncmp(tag, "W/", 2) != 0) {
+        snprintf(etag, sizeof(etag), "W/%s", tag);
+        tag = etag;
+    }
+    char extra[160];
+    snprintf(extra, sizeof(extra), "%s%s",
+             gzip ? "Content-Encoding: gzip\r\n" : "",
+             cached_value->compressible ? "Vary: Accept-Encoding\r\n" : "");
+
+    WSABUF bufs[CACHE_SEND_GATHER_MAX];
+    DWORD nbufs = 0;
+    char head[4096];
+    int n;
+    if (cached_value->header) {
+        // Stored origin header; only the per-hit lines are formatted here
+        uint32_t now = (uint32_t)time(NULL);
+        if (now >= cached_value->expires_at && mode == SEND_FRESH) return -1;
+        uint32_t age = now > cached_value->age_base ? now - cached_value->age_base : 0;
+        n = snprintf(head, sizeof(head),
+                     "Content-Length: %llu\r\n"
+                     "Age: %u\r\n"
+                     "%s%s%s"
+                     "%s"
+                     "%s"
+                     "%s"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     (unsigned long long)body_len, age,
+                     tag[0] ? "ETag: " : "", tag, tag[0] ? "\r\n" : "",
+                     extra,
+                     cached_value->status_code == 200 ? "Accept-Ranges: bytes\r\n" : "",
+                     mode == SEND_STALE ? "X-Cache: STALE\r\nWarning: 110 - \"Response is Stale\"\r\n" : "X-Cache: HIT\r\n");
+        bufs[nbufs].buf = cached_value->header;
+        bufs[nbufs].len = cached_value->header_len;
+        nbufs++;
+    } else {
+        n = build_hit_header(head, sizeof(head),
+                             cached_value->status_code, cached_value->content_type,
+                             body_len, cached_value->expires_at,
+                             tag, cached_value->last_modified, extra, mode);
+    }
+    if (n <= 0 || n >= (int)sizeof(head)) return -1;
+    bufs[nbufs].buf = head;
+    bufs[nbufs].len = (ULONG)n;
+    nbufs++;
+
+    int started = 0;
+    int rc = send_body_range(client_fd, ssl, body, 0, body_len, bufs, nbufs, &started);
+    if (rc != 0) return rc;
+
+    if (gzip) cache_encoding_record_hit(cached_value->body_len - body_len);
+    if (status_sent) *status_sent = cached_value->status_code;
+    if (body_sent) *body_sent = body_len;
+    return 0;
+}
+
+int cache_send_response(void *client_fd, void *ssl, cache_value_t *cached_value) {
+    return send_value(client_fd, ssl, cached_value, SEND_FRESH, CACHE_ENCODING_IDENTITY, NULL, NULL, NULL);
+}
+
+int cache_stale_while_revalidate_ok(const cache_value_t *val) {
+    if (!val) return 0;
+    uint32_t now = (uint32_t)time(NULL);
+    return now < val->expires_at + val->stale_while_revalidate;
+}
+
+int cache_stale_if_error_ok(const cache_value_t *val) {
+    if (!val) return 0;
+    uint32_t now = (uint32_t)time(NULL);
+    return now < val->expires_at + val->stale_if_error;
 }
 
 static void build_route_string(const char *path, const char *query, char *route_out, size_t route_size) {
@@ -459,30 +897,472 @@ static void build_route_string(const char *path, const char *query, char *route_
     route_out[route_size - 1] = '\0';
 }
 
+static int serve_value(void *client_fd, void *ssl, cache_value_t *cached_value, int mode,
+                       const char *path, const char *query, const char *method,
+                       const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                       uint64_t bytes_in, uint64_t *bytes_out) {
+    uint32_t status = cached_value->status_code;
+    int rc = send_value(client_fd, ssl, cached_value, mode, accept_encoding, range, &status, bytes_out);
+    if (rc == -1) {
+        return 0;
+    }
+    if (rc != 0) {
+        return -1;
+    }
+
+    char route[512];
+    build_route_string(path, query, route, sizeof(route));
+    request_tracker_record(route, method ? method : "GET", 
+                          status, 
+                          host ? host : "", 
+                          bytes_in, *bytes_out, 1);
+    
+    return 1; 
+}
+
 int cache_handle_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
                     const char *path, const char *query, const char *method,
-                    const char *host, uint64_t bytes_in, uint64_t *bytes_out) {
+                    const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                    uint64_t bytes_in, uint64_t *bytes_out) {
     if (!cached_value || !client_fd || !bytes_out) return 0;
-    
+
     uint32_t now = (uint32_t)time(NULL);
     if (now >= cached_value->expires_at) {
         return 0;
     }
+    return serve_value(client_fd, ssl, cached_value, SEND_FRESH, path, query, method, host,
+                       accept_encoding, range, bytes_in, bytes_out);
+}
+
+int cache_handle_revalidated_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
+                                 const char *path, const char *query, const char *method,
+                                 const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                                 uint64_t bytes_in, uint64_t *bytes_out) {
+    if (!cached_value || !client_fd || !bytes_out) return 0;
+    return serve_value(client_fd, ssl, cached_value, SEND_REVALIDATED, path, query, method, host,
+                       accept_encoding, range, bytes_in, bytes_out);
+}
+
+int cache_request_is_conditional(const char *request_buffer) {
+    if (!request_buffer) return 0;
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    if (!hdr_end) return 0;
+
+    char tmp[256];
+    return copy_header_value(request_buffer, hdr_end, "If-None-Match", tmp, sizeof(tmp)) >= 0 ||
+           copy_header_value(request_buffer, hdr_end, "If-Modified-Since", tmp, sizeof(tmp)) >= 0;
+}
+
+// True if the If-None-Match list contains etag (weak comparison) or "*"
+static int etag_list_matches(const char *list, const char *etag) {
+    const char *e = etag;
+    if (strncmp(e, "W/", 2) == 0) e += 2;
+    size_t elen = strlen(e);
+
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        while (len > 0 && p[len - 1] == ' ') len--;
+        if (len == elen && memcmp(p, e, len) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+// True if the request's conditional matches the stored validators
+static int validators_match(const char *request_buffer, const char *etag, const char *last_modified) {
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    if (!hdr_end) return 0;
+
+    // If-None-Match takes precedence over If-Modified-Since (RFC 9110 13.2.2)
+    char cond[512];
+    if (copy_header_value(request_buffer, hdr_end, "If-None-Match", cond, sizeof(cond)) >= 0) {
+        return etag[0] && etag_list_matches(cond, etag);
+    }
+    if (copy_header_value(request_buffer, hdr_end, "If-Modified-Since", cond, sizeof(cond)) >= 0) {
+        return last_modified[0] && strcmp(cond, last_modified) == 0;
+    }
+    return 0;
+}
+
+static int send_not_modified(void *client_fd, void *ssl, uint32_t max_age, const char *tag,
+                             const char *path, const char *query, const char *method,
+                             const char *host, uint64_t bytes_in) {
+    char resp[512];
+    int n = snprintf(resp, sizeof(resp),
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Cache-Control: public, max-age=%u\r\n"
+        "%s%s%s"
+        "X-Cache: HIT\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        max_age,
+        tag[0] ? "ETag: " : "", tag,
+        tag[0] ? "\r\n" : "");
+    if (n <= 0 || n >= (int)sizeof(resp)) return 0;
+    if (send_all_data(client_fd, resp, n, ssl) != 0) return -1;
+
+    char route[512];
+    build_route_string(path, query, route, sizeof(route));
+    request_tracker_record(route, method ? method : "GET", 304, host ? host : "",
+                          bytes_in, 0, 1);
+    return 1;
+}
+
+int cache_handle_not_modified(void *client_fd, void *ssl, cache_value_t *cached_value,
+                              const char *request_buffer, const char *path, const char *query,
+                              const char *method, const char *host, uint64_t bytes_in) {
+    if (!cached_value || !client_fd || !request_buffer) return 0;
+    if (cached_value->status_code != 200) return 0;
+    if (!validators_match(request_buffer, cached_value->etag, cached_value->last_modified)) return 0;
+
+    uint32_t now = (uint32_t)time(NULL);
+    if (now >= cached_value->expires_at) return 0;
+
+    // Same validator the client would get with a full response (weak for the gzip variant)
+    char etag[80];
+    const char *tag = cached_value->etag;
+    if (tag[0] && strncmp(tag, "W/", 2) != 0 &&
+        (cache_parse_accept_encoding(request_buffer) & CACHE_ENCODING_GZIP) &&
+        InterlockedCompareExchange(&cached_value->gz_state, 0, 0) == CACHE_VARIANT_READY) {
+        snprintf(etag, sizeof(etag), "W/%s", tag);
+        tag = etag;
+    }
+    return send_not_modified(client_fd, ssl, cached_value->expires_at - now, tag,
+                             path, query, method, host, bytes_in);
+}
+
+int cache_build_revalidation_headers(const cache_value_t *val, char *out, size_t out_size) {
+    if (!val || !out || out_size == 0) return -1;
+    out[0] = '\0';
+
+    int n = snprintf(out, out_size, "%s%s%s%s%s%s",
+                     val->etag[0] ? "If-None-Match: " : "", val->etag,
+                     val->etag[0] ? "\r\n" : "",
+                     val->last_modified[0] ? "If-Modified-Since: " : "", val->last_modified,
+                     val->last_modified[0] ? "\r\n" : "");
+    if (n < 0 || n >= (int)out_size) {
+        out[0] = '\0';
+        return -1;
+    }
+    return n;
+}
+
+int cache_handle_stale_hit(void *client_fd, void *ssl, cache_value_t *cached_value,
+                           const char *path, const char *query, const char *method,
+                           const char *host, uint32_t accept_encoding, const cache_range_t *range,
+                           uint64_t bytes_in, uint64_t *bytes_out) {
+    if (!cached_value || !client_fd || !bytes_out) return 0;
+    return serve_value(client_fd, ssl, cached_value, SEND_STALE, path, query, method, host,
+                       accept_encoding, range, bytes_in, bytes_out);
+}
+
+// 206/416 straight from the segment file; one TransmitFile per part
+static int send_disk_ranges(void *client_fd, void *ssl, const cache_disk_item_t *item,
+                            const cache_range_t *range, uint32_t *status_sent, uint64_t *body_sent) {
+    cache_range_plan_t plan;
+    if (cache_range_plan(range, item->body_len, item->content_type, &plan) == 0) {
+        if (cache_send_range_not_satisfiable(client_fd, ssl, item->body_len) != 0) return -1;
+        *status_sent = 416;
+        *body_sent = 0;
+        return 0;
+    }
+
+    char extra[160] = "";
+    if (plan.count == 1) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes %llu-%llu/%llu\r\n",
+                 (unsigned long long)plan.first[0], (unsigned long long)plan.last[0],
+                 (unsigned long long)plan.total);
+    }
+    // Room for the first part's heading behind the response header
+    size_t cap = (size_t)item->header_len + 1024;
+    char *head = (char *)malloc(cap + sizeof(plan.part_head[0]));
+    if (!head) return -1;
+    int n = -1;
+    char *stored = item->header_len ? (char *)malloc(item->header_len) : NULL;
+    if (stored && cache_disk_read_header(item, stored, item->header_len) == 0) {
+        // Stored origin header behind a new status line; multipart replaces its Content-Type
+        const char *hdr_end = stored + item->header_len;
+        const char *p = memchr(stored, '\n', item->header_len);
+        p = p ? p + 1 : hdr_end;
+        const char *ct_end = NULL;
+        const char *ct = plan.count > 1 ? find_header_line(p, hdr_end, "Content-Type", &ct_end) : NULL;
+        int before = (int)((ct ? ct : hdr_end) - p);
+        int after = ct ? (int)(hdr_end - ct_end) : 0;
+
+        uint32_t now = (uint32_t)time(NULL);
+        uint32_t age = now > item->age_base ? now - item->age_base : 0;
+        int m = snprintf(head, cap,
+                         "HTTP/1.1 206 Partial Content\r\n"
+                         "%.*s%.*s"
+                         "%s%s%s"
+                         "%s"
+                         "Content-Length: %llu\r\n"
+                         "Age: %u\r\n"
+                         "%s%s%s"
+                         "%s"
+                         "Accept-Ranges: bytes\r\n"
+                         "X-Cache: HIT\r\n"
+                         "Connection: close\r\n"
+                         "\r\n",
+                         before, p, after, ct ? ct_end : "",
+                         plan.count > 1 ? "Content-Type: " : "",
+                         plan.count > 1 ? plan.content_type : "",
+                         plan.count > 1 ? "\r\n" : "",
+                         extra,
+                         (unsigned long long)plan.body_len, age,
+                         item->etag[0] ? "ETag: " : "", item->etag, item->etag[0] ? "\r\n" : "",
+                         item->compressible ? "Vary: Accept-Encoding\r\n" : "");
+        if (m > 0 && (size_t)m < cap) n = m;
+    } else if (!item->header_len) {
+        if (item->compressible) strcat(extra, "Vary: Accept-Encoding\r\n");
+        n = build_hit_header(head, 1024, 206,
+                             plan.count > 1 ? plan.content_type : item->content_type,
+                             plan.body_len, item->expires_at, item->etag, item->last_modified,
+                             extra, SEND_FRESH);
+    }
+    free(stored);
+    if (n <= 0) {
+        free(head);
+        return -1;
+    }
+
+    uint64_t sent = 0;
+    for (uint32_t i = 0; i < plan.count; i++) {
+        if (plan.count > 1) {
+            if (i > 0) n = 0;
+            memcpy(head + n, plan.part_head[i], plan.part_len[i]);
+            n += (int)plan.part_len[i];
+        }
+        int last = i + 1 == plan.count && plan.count > 1;
+        uint64_t len = plan.last[i] - plan.first[i] + 1;
+        if (cache_disk_send_span(client_fd, ssl, item, head, n, plan.first[i], len,
+                                 last ? plan.trailer : NULL, last ? (int)plan.trailer_len : 0) != 0) {
+            free(head);
+            return i == 0 ? -1 : -2;
+        }
+        sent += len;
+    }
+    free(head);
+
+    *status_sent = 206;
+    *body_sent = sent;
+    return 0;
+}
+
+int cache_handle_disk_hit(void *client_fd, void *ssl, const cache_key_info_t *key_info,
+                          const char *request_buffer, const char *path, const char *query,
+                          const char *method, const char *host, const cache_range_t *range,
+                          uint64_t bytes_in, uint64_t *bytes_out) {
+    if (!key_info || !client_fd || !bytes_out || !cache_disk_is_enabled()) return 0;
 
-    if (cache_send_response(client_fd, ssl, cached_value) != 0) {
+    cache_disk_item_t item;
+    if (cache_disk_lookup(key_info->key_hash, key_info->key_fingerprint, &item) != 0) {
         return 0;
     }
 
-    *bytes_out = (uint64_t)cached_value->body_len;
+    uint32_t now = (uint32_t)time(NULL);
+    if (request_buffer && item.status_code == 200 && now < item.expires_at &&
+        validators_match(request_buffer, item.etag, item.last_modified)) {
+        int nm_rc = send_not_modified(client_fd, ssl, item.expires_at - now, item.etag,
+                                      path, query, method, host, bytes_in);
+        if (nm_rc != 0) return 1;
+    }
+
+    uint32_t status = item.status_code;
+    if (range && range->count > 0 && item.status_code == 200 &&
+        cache_range_applies(range, item.etag, item.last_modified)) {
+        int rc = send_disk_ranges(client_fd, ssl, &item, range, &status, bytes_out);
+        if (rc == -1) return 0;
+        if (rc != 0) return 1;
+    } else {
+        if (cache_disk_send(client_fd, ssl, &item) != 0) {
+            return 0;
+        }
+        *bytes_out = (uint64_t)item.body_len;
+    }
 
     char route[512];
     build_route_string(path, query, route, sizeof(route));
-    request_tracker_record(route, method ? method : "GET", 
-                          cached_value->status_code, 
-                          host ? host : "", 
+    request_tracker_record(route, method ? method : "GET",
+                          status,
+                          host ? host : "",
                           bytes_in, *bytes_out, 1);
-    
-    return 1; 
+
+    return 1;
+}
+
+static volatile LONG g_admin_trust_loopback = 0;
+
+void cache_admin_configure(int trust_loopback) {
+    InterlockedExchange(&g_admin_trust_loopback, trust_loopback ? 1 : 0);
+}
+
+// Looks at every byte of the longer string, so the time taken says nothing about
+// how much of the token matched
+static int token_equal(const char *given, const char *token) {
+    size_t given_len = strlen(given);
+    size_t token_len = strlen(token);
+    size_t n = given_len > token_len ? given_len : token_len;
+    volatile unsigned char diff = (unsigned char)(given_len != token_len);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char a = i < given_len ? (unsigned char)given[i] : 0;
+        unsigned char b = i < token_len ? (unsigned char)token[i] : 0;
+        diff |= (unsigned char)(a ^ b);
+    }
+    return diff == 0;
+}
+
+int cache_admin_authorized(const char *request_buffer, const char *client_ip, const char *token) {
+    if (g_admin_trust_loopback && client_ip &&
+        (strncmp(client_ip, "127.", 4) == 0 || strcmp(client_ip, "::1") == 0)) {
+        return 1;
+    }
+    if (!request_buffer || !token || !token[0]) return 0;
+
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    char given[128];
+    return hdr_end && copy_header_value(request_buffer, hdr_end, "X-Purge-Token", given, sizeof(given)) >= 0 &&
+           token_equal(given, token);
+}
+
+static int purge_surrogate_keys(const char *request_buffer, uint64_t scope) {
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    char keys[1024];
+    if (!hdr_end || copy_header_value(request_buffer, hdr_end, "Surrogate-Key", keys, sizeof(keys)) < 0) {
+        return -1;
+    }
+
+    int purged = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_s(keys, " \t", &saveptr); tok; tok = strtok_s(NULL, " \t", &saveptr)) {
+        purged += cache_purge_tag(cache_tag_hash(scope, CACHE_TAG_KEY, tok, strlen(tok)));
+    }
+    return purged;
+}
+
+int cache_handle_purge(void *client_fd, void *ssl, const char *request_buffer,
+                       const char *host, const char *path, const char *query,
+                       const cache_key_rules_t *rules, const char *client_ip, const char *token) {
+    if (!client_fd || !request_buffer || !path) return 0;
+
+    const char *status = "200 OK";
+    int purged = 0;
+    uint64_t scope = cache_tag_scope(host);
+    size_t path_len = strlen(path);
+
+    if (!cache_admin_authorized(request_buffer, client_ip, token)) {
+        status = "403 Forbidden";
+    } else if ((purged = purge_surrogate_keys(request_buffer, scope)) >= 0) {
+        // Tag purge
+    } else if (path_len > 0 && path[path_len - 1] == '*') {
+        // Only whole path segments are indexed: "/a/b/*"
+        purged = 0;
+        if (path_len < 2 || path[path_len - 2] != '/') {
+            status = "400 Bad Request";
+        } else {
+            // Prefix tags are built from the key path, lowercased under fold_path
+            char key_path[512], key_query[8], key_vary[8];
+            if (cache_key_rules_apply(rules, NULL, path, NULL, key_path, sizeof(key_path),
+                                      key_query, sizeof(key_query), key_vary, sizeof(key_vary)) == 0) {
+                purged = cache_purge_tag(cache_tag_hash(scope, CACHE_TAG_PREFIX, key_path, path_len - 1));
+            }
+        }
+    } else {
+        // The object under both schemes, with any range slices filled for it
+        static const char *schemes[] = {"http", "https"};
+        char key_path[512], key_query[512], key_vary[512];
+        purged = 0;
+        if (cache_key_rules_apply(rules, request_buffer, path, query, key_path, sizeof(key_path),
+                                  key_query, sizeof(key_query), key_vary, sizeof(key_vary)) != 0) {
+            status = "414 URI Too Long";
+        }
+        for (int i = 0; i < 2 && strcmp(status, "200 OK") == 0; i++) {
+            uint64_t key_hash;
+            char fingerprint[16];
+            if (cache_key_compute("GET", schemes[i], host, key_path, key_query[0] ? key_query : NULL,
+                                  key_vary[0] ? key_vary : NULL, &key_hash, fingerprint) != 0) {
+                continue;
+            }
+            if (cache_invalidate_key(key_hash, fingerprint) == 0) purged++;
+            purged += cache_invalidate_slices(key_hash, fingerprint);
+        }
+    }
+
+    char body[64];
+    int body_len = strcmp(status, "200 OK") == 0 ?
+        snprintf(body, sizeof(body), "{\"purged\":%d}", purged) :
+        snprintf(body, sizeof(body), "{\"error\":\"%s\"}", status);
+
+    char resp[256];
+    int len = snprintf(resp, sizeof(resp),
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %d\r\n"
+                       "Cache-Control: no-store\r\n"
+                       "Connection: close\r\n"
+                       "\r\n%s",
+                       status, body_len, body);
+    send_all_data(client_fd, resp, len, ssl);
+
+    char log_buf[768];
+    snprintf(log_buf, sizeof(log_buf), "[CACHE] Purge %s%s from %s: %s, %d entries",
+             host ? host : "", path, client_ip ? client_ip : "?", status, purged);
+    log_message("INFO", log_buf);
+    return 1;
+}
+
+int cache_collapse_miss(void *client_fd, void *ssl, cache_key_info_t *key_info,
+                        const char *path, const char *query, const char *method,
+                        const char *host, const cache_range_t *range,
+                        uint64_t bytes_in, uint64_t *bytes_out,
+                        uint32_t *status_code_out) {
+    if (!key_info || !key_info->should_cache) return 0;
+
+    // A ranged request goes to origin as is and gets a 206, which fills nothing: it never leads
+    int ranged = range && range->count > 0;
+    if (!ranged && cache_fill_begin(key_info->key_hash, key_info->key_fingerprint)) {
+        key_info->fill_leader = 1;
+        return 0;
+    }
+
+    // Timed out behind a slow origin: fetch it ourselves
+    if (cache_fill_wait(key_info->key_hash, key_info->key_fingerprint, CACHE_FILL_WAIT_MS) != 0) {
+        return 0;
+    }
+
+    cache_value_t *val = NULL;
+    cache_result_t result = cache_get_key(key_info->key_hash, key_info->key_fingerprint, &val);
+    if (result == CACHE_RESULT_HIT && val) {
+        int rc = cache_handle_hit(client_fd, ssl, val, path, query, method, host,
+                                  key_info->accept_encoding, range, bytes_in, bytes_out);
+        if (status_code_out) *status_code_out = val->status_code;
+        cache_value_release(val);
+        if (rc != 0) return rc;
+    } else if (result == CACHE_RESULT_STALE) {
+        // Leader failed to refresh it; the caller still holds its own stale copy
+        cache_value_release(val);
+    } else if (cache_handle_disk_hit(client_fd, ssl, key_info, NULL, path, query, method,
+                                     host, range, bytes_in, bytes_out)) {
+        return 1;
+    }
+
+    // The leader's response was not cacheable; lead the next fetch if nobody else does
+    if (!ranged && cache_fill_begin(key_info->key_hash, key_info->key_fingerprint)) {
+        key_info->fill_leader = 1;
+    }
+    return 0;
+}
+
+void cache_release_fill_leader(cache_key_info_t *key_info) {
+    if (!key_info || !key_info->fill_leader) return;
+    key_info->fill_leader = 0;
+    cache_fill_end(key_info->key_hash, key_info->key_fingerprint);
 }
 
 void cache_record_metrics(const char *path, const char *query, const char *method,
@@ -561,38 +1441,280 @@ int cache_extract_request_info(const char *request_buffer, char *method_out, siz
         path_out[path_size - 1] = '\0';
     }
 
+    // Origins are fetched as identity and encodings are variants of one entry
+    // (see cache_encoding.c), so Accept-Encoding no longer splits the key
     vary_header_out[0] = '\0';
-    const char *header_end = strstr(request_buffer, "\r\n\r\n");
-    if (header_end) {
-        const char *ae = strstr(request_buffer, "Accept-Encoding:");
-        if (!ae) {
-            ae = strstr(request_buffer, "accept-encoding:");
-        }
-        if (ae && ae < header_end) {
-            ae += 15;
-            while (*ae == ' ' || *ae == '\t') ae++;
-            const char *line_end = strstr(ae, "\r\n");
-            if (!line_end) line_end = header_end;
-            size_t len = line_end - ae;
-            if (len > 0 && len < vary_size) {
-                memcpy(vary_header_out, ae, len);
-                vary_header_out[len] = '\0';
-                // Trim trailing whitespace
-                while (len > 0 && (vary_header_out[len - 1] == ' ' || 
-                                  vary_header_out[len - 1] == '\t' || 
-                                  vary_header_out[len - 1] == '\r')) {
-                    vary_header_out[--len] = '\0';
-                }
+    
+    return 0;
+}
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); returns -1 if malformed
+static long long parse_http_date(const char *s) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char wday[4], mon[4];
+    int day, year, hh, mm, ss;
+    if (sscanf(s, "%3s %d %3s %d %d:%d:%d", wday, &day, mon, &year, &hh, &mm, &ss) != 7) return -1;
+
+    const char *m = strstr(months, mon);
+    if (!m || strlen(mon) != 3 || (m - months) % 3 != 0) return -1;
+
+    struct tm tmv;
+    memset(&tmv, 0, sizeof(tmv));
+    tmv.tm_year = year - 1900;
+    tmv.tm_mon = (int)((m - months) / 3);
+    tmv.tm_mday = day;
+    tmv.tm_hour = hh;
+    tmv.tm_min = mm;
+    tmv.tm_sec = ss;
+    time_t t = _mkgmtime(&tmv);
+    return t == (time_t)-1 ? -1 : (long long)t;
+}
+
+static void parse_cache_control(const char *v, const char *end, cache_freshness_t *f) {
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *tok = v;
+        while (v < end && *v != ',') v++;
+        size_t len = (size_t)(v - tok);
+        while (len > 0 && (tok[len - 1] == ' ' || tok[len - 1] == '\t')) len--;
+        if (len == 0) continue;
+
+        const char *eq = memchr(tok, '=', len);
+        size_t name_len = eq ? (size_t)(eq - tok) : len;
+        long arg = eq ? strtol(eq + 1 + (eq[1] == '"'), NULL, 10) : -1;
+
+#define CC_IS(lit) (name_len == sizeof(lit) - 1 && _strnicmp(tok, lit, name_len) == 0)
+        if (CC_IS("no-store") || CC_IS("private") || CC_IS("no-cache")) {
+            f->no_store = 1;
+        } else if (CC_IS("max-age") && arg >= 0) {
+            f->max_age = arg;
+        } else if (CC_IS("s-maxage") && arg >= 0) {
+            f->s_maxage = arg;
+        } else if (CC_IS("stale-while-revalidate") && arg >= 0) {
+            f->stale_while_revalidate = arg;
+        } else if (CC_IS("stale-if-error") && arg >= 0) {
+            f->stale_if_error = arg;
+        } else if (CC_IS("must-revalidate") || CC_IS("proxy-revalidate")) {
+            f->must_revalidate = 1;
+        }
+#undef CC_IS
+    }
+}
+
+void cache_parse_freshness(const char *header_buf, const char *hdr_end, cache_freshness_t *f) {
+    if (!f) return;
+    memset(f, 0, sizeof(*f));
+    f->max_age = -1;
+    f->s_maxage = -1;
+    f->stale_while_revalidate = -1;
+    f->stale_if_error = -1;
+    f->expires_ttl = -1;
+    if (!header_buf || !hdr_end) return;
+
+    long long date = -1, expires = -1;
+    int has_expires = 0;
+
+    // Single pass over the header lines; Cache-Control may be split over several lines
+    const char *line = strstr(header_buf, "\r\n");
+    while (line && line < hdr_end) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > hdr_end) eol = hdr_end;
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        if (colon) {
+            size_t name_len = (size_t)(colon - line);
+            const char *v = colon + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) v++;
+
+            if (name_len == 13 && _strnicmp(line, "Cache-Control", 13) == 0) {
+                parse_cache_control(v, eol, f);
+            } else if (name_len == 7 && _strnicmp(line, "Expires", 7) == 0) {
+                has_expires = 1;
+                expires = parse_http_date(v);
+            } else if (name_len == 4 && _strnicmp(line, "Date", 4) == 0) {
+                date = parse_http_date(v);
+            } else if (name_len == 3 && _strnicmp(line, "Age", 3) == 0) {
+                f->age = strtol(v, NULL, 10);
+                if (f->age < 0) f->age = 0;
+            } else if (name_len == 10 && _strnicmp(line, "Set-Cookie", 10) == 0) {
+                f->no_store = 1;
+            } else if (name_len == 4 && _strnicmp(line, "Vary", 4) == 0 && *v == '*') {
+                f->no_store = 1;
             }
         }
+        line = eol;
     }
-    
+
+    if (has_expires) {
+        // An invalid Expires (e.g. "0") means already expired
+        if (expires < 0) {
+            f->expires_ttl = 0;
+        } else {
+            long long base = date >= 0 ? date : (long long)time(NULL);
+            f->expires_ttl = expires > base ? (long)(expires - base) : 0;
+        }
+    }
+}
+
+uint32_t cache_freshness_ttl(const cache_freshness_t *f, const cache_key_info_t *policy,
+                             uint32_t default_ttl) {
+    if (!f || f->no_store) return 0;
+
+    // Route override beats anything the origin says
+    if (policy && policy->ttl_override > 0) return policy->ttl_override;
+
+    long ttl;
+    if (f->s_maxage >= 0) {
+        ttl = f->s_maxage;
+    } else if (f->max_age >= 0) {
+        ttl = f->max_age;
+    } else if (f->expires_ttl >= 0) {
+        ttl = f->expires_ttl;
+    } else {
+        ttl = (long)default_ttl;
+    }
+    ttl -= f->age;
+    if (ttl <= 0) return 0;
+
+    if (policy) {
+        if (policy->min_ttl > 0 && (uint32_t)ttl < policy->min_ttl) ttl = (long)policy->min_ttl;
+        if (policy->max_ttl > 0 && (uint32_t)ttl > policy->max_ttl) ttl = (long)policy->max_ttl;
+    }
+    return (uint32_t)ttl;
+}
+
+// Hop-by-hop and per-response headers that are regenerated on every hit
+static int header_is_per_hit(const char *name, size_t len) {
+    static const char *skip[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "TE",
+        "Trailer", "Upgrade", "Content-Length", "Age", "Date", "Set-Cookie", "X-Cache",
+        "ETag", "Surrogate-Key", "Accept-Ranges", NULL
+    };
+    for (int i = 0; skip[i]; i++) {
+        if (strlen(skip[i]) == len && _strnicmp(name, skip[i], len) == 0) return 1;
+    }
+    return 0;
+}
+
+static void add_tag(cache_value_t *val, uint64_t tag) {
+    for (uint32_t i = 0; i < val->ntags; i++) {
+        if (val->tags[i] == tag) return;
+    }
+    if (val->ntags < CACHE_MAX_TAGS) val->tags[val->ntags++] = tag;
+}
+
+// Path prefixes plus Surrogate-Key (space separated) and Cache-Tag (comma separated)
+static void store_tags(cache_value_t *val, const cache_key_info_t *key_info,
+                       const char *header_buf, const char *hdr_end) {
+    val->tags = (uint64_t *)malloc(CACHE_MAX_TAGS * sizeof(uint64_t));
+    if (!val->tags) return;
+
+    for (uint32_t i = 0; i < key_info->npath_tags; i++) {
+        add_tag(val, key_info->path_tags[i]);
+    }
+
+    const char *line = strstr(header_buf, "\r\n");
+    while (line && line < hdr_end) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > hdr_end) eol = hdr_end;
+
+        const char *v = NULL;
+        char sep = ' ';
+        if (_strnicmp(line, "Surrogate-Key:", 14) == 0) {
+            v = line + 14;
+        } else if (_strnicmp(line, "Cache-Tag:", 10) == 0) {
+            v = line + 10;
+            sep = ',';
+        }
+        while (v && v < eol) {
+            while (v < eol && (*v == ' ' || *v == '\t' || *v == sep)) v++;
+            const char *tok = v;
+            while (v < eol && *v != sep) v++;
+            const char *tok_end = v;
+            while (tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\t')) tok_end--;
+            if (tok_end > tok) {
+                add_tag(val, cache_tag_hash(key_info->tag_scope, CACHE_TAG_KEY, tok, (size_t)(tok_end - tok)));
+            }
+        }
+        line = eol;
+    }
+
+    if (val->ntags == 0) {
+        free(val->tags);
+        val->tags = NULL;
+    }
+}
+
+static int header_name_is(const char *name, size_t len, const char *want) {
+    return strlen(want) == len && _strnicmp(name, want, len) == 0;
+}
+
+// Vary line without its Accept-Encoding token, which hits add themselves; 0 if nothing is left
+static size_t copy_vary_without_encoding(char *out, const char *value, const char *eol) {
+    size_t len = 0;
+    for (const char *v = value; v < eol; ) {
+        while (v < eol && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *tok = v;
+        while (v < eol && *v != ',') v++;
+        const char *tok_end = v;
+        while (tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\t')) tok_end--;
+        if (tok_end == tok || header_name_is(tok, (size_t)(tok_end - tok), "Accept-Encoding")) continue;
+        if (len == 0) {
+            memcpy(out, "Vary: ", 6);
+            len = 6;
+        } else {
+            memcpy(out + len, ", ", 2);
+            len += 2;
+        }
+        memcpy(out + len, tok, (size_t)(tok_end - tok));
+        len += (size_t)(tok_end - tok);
+    }
+    if (len) {
+        memcpy(out + len, "\r\n", 2);
+        len += 2;
+    }
+    return len;
+}
+
+// Keep the status line and origin headers once, so hits don't rebuild them. For
+// compressible values the hit adds Vary: Accept-Encoding and Content-Encoding itself
+static int store_origin_header(cache_value_t *val, const char *header_buf, const char *hdr_end) {
+    // A rewritten Vary line may be longer than the original ("Vary:a,b" -> "Vary: a, b")
+    size_t cap = (size_t)(hdr_end - header_buf) * 2 + 2;
+    char *out = (char *)malloc(cap);
+    if (!out) return -1;
+
+    size_t len = 0;
+    const char *line = header_buf;
+    int first = 1;
+    while (line < hdr_end) {
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > hdr_end) eol = hdr_end;
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        size_t name_len = colon ? (size_t)(colon - line) : 0;
+        if (!first && val->compressible && colon && header_name_is(line, name_len, "Vary")) {
+            len += copy_vary_without_encoding(out + len, colon + 1, eol);
+        } else if (first || (colon && !header_is_per_hit(line, name_len) &&
+                             !(val->compressible && header_name_is(line, name_len, "Content-Encoding")))) {
+            size_t n = (size_t)(eol - line);
+            memcpy(out + len, line, n);
+            memcpy(out + len + n, "\r\n", 2);
+            len += n + 2;
+        }
+        first = 0;
+        line = eol + 2;
+    }
+
+    val->header = out;
+    val->header_len = (uint32_t)len;
     return 0;
 }
 
 int cache_process_response_headers(const char *header_buf, int header_len, int body_len,
                                  const char *method, cache_key_info_t *key_info,
                                  cache_buffer_t *buf, uint32_t max_object_bytes,
+                                 uint32_t default_ttl,
                                  uint32_t *status_code_out, long long *content_length_out,
                                  int *is_chunked_out) {
     if (!header_buf || !buf || !status_code_out || !content_length_out || !is_chunked_out) {
@@ -640,16 +1762,69 @@ int cache_process_response_headers(const char *header_buf, int header_len, int b
         buf->content_type[sizeof(buf->content_type) - 1] = '\0';
     }
 
+    cache_freshness_t fresh;
+    cache_parse_freshness(header_buf, hdr_end, &fresh);
+    const cache_status_rule_t *rule = cache_status_rule(*status_code_out);
+    uint32_t ttl = cache_freshness_ttl(&fresh, key_info, rule ? rule->ttl_sec : default_ttl);
+    // Redirects, negatives and errors live at most their status TTL
+    if (rule && ttl > rule->ttl_sec) ttl = rule->ttl_sec;
+    if (key_info) key_info->response_ttl = ttl;
+
     if (key_info && key_info->should_cache && method) {
-        if (cache_should_cache_response(method, *status_code_out, *is_chunked_out,
-                                       *content_length_out, max_object_bytes)) {
-            if (cache_buffer_init(buf, (size_t)(*content_length_out > 0 ? *content_length_out : 0)) != 0) {
+        if (ttl == 0 ||
+            !cache_should_cache_response(method, *status_code_out, *is_chunked_out,
+                                        *content_length_out, max_object_bytes, key_info) ||
+            (!key_info->bypass_admission &&
+             !cache_check_admission(key_info->key_hash, key_info->key_fingerprint)) ||
+            cache_buffer_init(buf, *content_length_out, *is_chunked_out, max_object_bytes) != 0) {
+            key_info->should_cache = 0;
+        } else {
+            buf->value->tenant = key_info->tenant;
+            // An error response is served only while fresh
+            if (fresh.must_revalidate || buf->status_code >= 500) {
+                buf->value->stale_while_revalidate = 0;
+                buf->value->stale_if_error = 0;
+            } else {
+                buf->value->stale_while_revalidate = fresh.stale_while_revalidate >= 0 ?
+                    (uint32_t)fresh.stale_while_revalidate : key_info->stale_while_revalidate;
+                buf->value->stale_if_error = fresh.stale_if_error >= 0 ?
+                    (uint32_t)fresh.stale_if_error : key_info->stale_if_error;
+            }
+            if (copy_header_value(header_buf, hdr_end, "ETag",
+                                  buf->value->etag, sizeof(buf->value->etag)) < 0) {
+                buf->value->etag[0] = '\0';
+            }
+            if (copy_header_value(header_buf, hdr_end, "Last-Modified",
+                                  buf->value->last_modified, sizeof(buf->value->last_modified)) < 0) {
+                buf->value->last_modified[0] = '\0';
+            }
+            buf->value->age_base = (uint32_t)time(NULL) - (uint32_t)fresh.age;
+            char coding[64];
+            int coded = copy_header_value(header_buf, hdr_end, "Content-Encoding", coding, sizeof(coding));
+            buf->value->compressible = buf->status_code == 200 &&
+                                       cache_content_type_compressible(buf->value->content_type) &&
+                                       (coded < 0 || _stricmp(coding, "identity") == 0);
+            store_origin_header(buf->value, header_buf, hdr_end);
+            store_tags(buf->value, key_info, header_buf, hdr_end);
+        }
+
+        if (key_info->should_cache && buf->content_length > CACHE_MAX_OBJECT_BYTES) {
+            if (buffer_begin_disk(buf, key_info, ttl) != 0) {
                 key_info->should_cache = 0;
+                cache_buffer_free(buf, NULL);
+            } else {
+                // Waiters stay parked until the disk copy is there instead of each
+                // reading the object from origin; leadership ends with the fill
+                return 0;
             }
-        } else {
-            key_info->should_cache = 0;
+        } else if (key_info->should_cache && cache_publish_fill(key_info->key_hash, key_info->key_fingerprint,
+                                                                buf->value, ttl) == 0) {
+            buf->published = 1;
         }
     }
+
+    // Waiters can now attach to the published fill, or go to origin themselves
+    cache_release_fill_leader(key_info);
     
     return 0;
 }
@@ -669,8 +1844,12 @@ int cache_forward_response_chunk(void *client_fd, void *ssl, const uint8_t *data
         sent += n;
     }
 
-    if (key_info && key_info->should_cache && buf && buf->buffer) {
-        cache_buffer_append(buf, data, len);
+    if (key_info && key_info->should_cache && buf && buf->value && !buf->complete) {
+        if (cache_buffer_append(buf, data, len) != 0) {
+            // Readers attached to the fill are released right away
+            key_info->should_cache = 0;
+            cache_buffer_free(buf, key_info);
+        }
     }
     
     return sent;
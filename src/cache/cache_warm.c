@@ -0,0 +1,419 @@
+#include <winsock2.h>
+#include <openssl/ssl.h>
+#include <process.h>
+#include "../include/cache_warm.h"
+#include "../include/cache_snapshot.h"
+#include "../include/logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Admin-triggered warming: a WARM request hands over a list of URLs (or asks for
+// the hottest ones of the last snapshot) and the warmer thread feeds them through
+// the background fill path at a fixed rate with a few fetches per origin in flight,
+// so refilling after a purge or deploy does not spike the origins.
+
+typedef struct {
+    LONG id;
+    char host[256];
+    char **urls;                // "https://host/path?query"
+    uint32_t count;
+    uint32_t next;              // next URL to start; warmer thread only
+    volatile LONG done;         // finished, however they ended
+    volatile LONG stored;
+    volatile LONG failed;       // not routable, or the fetch stored nothing
+    volatile LONG skipped;      // already cached or being filled
+    uint32_t started_at;
+    volatile LONG finished_at;  // 0 while running; set last, after which the job may be freed
+} warm_job_t;
+
+typedef struct {
+    char name[300];             // backend host:port
+    volatile LONG inflight;
+} warm_origin_t;
+
+typedef struct {
+    cache_fetch_req_t req;
+    warm_job_t *job;
+    warm_origin_t *origin;
+} warm_task_t;
+
+static SRWLOCK g_warm_lock = SRWLOCK_INIT;      // job table; held shared for a warmer pass
+static SRWLOCK g_origin_lock = SRWLOCK_INIT;
+static warm_job_t *g_jobs[CACHE_WARM_MAX_JOBS];
+static warm_origin_t g_origins[CACHE_WARM_MAX_ORIGINS];
+static volatile LONG g_next_job_id = 0;
+static HANDLE g_warm_thread = NULL;
+static HANDLE g_warm_wake = NULL;               // a job arrived or a fetch finished
+static volatile LONG g_warm_stopping = 0;
+static uint32_t g_per_sec = 10;
+static uint32_t g_per_origin = 2;
+static cache_warm_build_fn g_build = NULL;
+
+void cache_warm_configure(uint32_t per_sec, uint32_t per_origin, cache_warm_build_fn build) {
+    g_per_sec = per_sec;
+    g_per_origin = per_origin ? per_origin : 1;
+    g_build = build;
+}
+
+static void job_free(warm_job_t *job) {
+    for (uint32_t i = 0; i < job->count; i++) free(job->urls[i]);
+    free(job->urls);
+    free(job);
+}
+
+static void job_finish_one(warm_job_t *job) {
+    if (InterlockedIncrement(&job->done) != (LONG)job->count) return;
+
+    char log_buf[512];
+    snprintf(log_buf, sizeof(log_buf), "[CACHE] Warm job %ld for %s done: %u URLs, %ld stored, %ld skipped, %ld failed in %us",
+             job->id, job->host, job->count, job->stored, job->skipped, job->failed,
+             (uint32_t)time(NULL) - job->started_at);
+    log_message("INFO", log_buf);
+    InterlockedExchange(&job->finished_at, (LONG)time(NULL));
+}
+
+// An origin slot with a fetch taken, or NULL while the origin is at its cap
+static warm_origin_t *origin_acquire(const char *backend_host, int backend_port) {
+    char name[300];
+    snprintf(name, sizeof(name), "%s:%d", backend_host, backend_port);
+
+    warm_origin_t *origin = NULL, *unused = NULL;
+    AcquireSRWLockExclusive(&g_origin_lock);
+    for (int i = 0; i < CACHE_WARM_MAX_ORIGINS && !origin; i++) {
+        warm_origin_t *o = &g_origins[i];
+        if (strcmp(o->name, name) == 0) origin = o;
+        else if (!unused && o->inflight == 0) unused = o;
+    }
+    if (!origin && unused) {
+        origin = unused;
+        snprintf(origin->name, sizeof(origin->name), "%s", name);
+    }
+    if (origin && (uint32_t)origin->inflight >= g_per_origin) origin = NULL;
+    if (origin) InterlockedIncrement(&origin->inflight);
+    ReleaseSRWLockExclusive(&g_origin_lock);
+    return origin;
+}
+
+static void warm_task(void *arg) {
+    warm_task_t *task = (warm_task_t *)arg;
+
+    // Filled while queued, or a fill of it is in flight: nothing to warm
+    cache_key_info_t *ki = &task->req.key_info;
+    if (cache_contains_key(ki->key_hash, ki->key_fingerprint) ||
+        !cache_fill_begin(ki->key_hash, ki->key_fingerprint)) {
+        InterlockedIncrement(&task->job->skipped);
+    } else {
+        ki->fill_leader = 1;
+        int rc = cache_fetch_run(&task->req);
+        InterlockedIncrement(rc == 0 ? &task->job->stored : &task->job->failed);
+    }
+    InterlockedDecrement(&task->origin->inflight);
+    job_finish_one(task->job);
+    free(task);
+    SetEvent(g_warm_wake);
+}
+
+// Path of an "https://host/path" URL, and its scheme
+static const char *url_path(const char *url, int *https) {
+    *https = _strnicmp(url, "https://", 8) == 0;
+    const char *p = strstr(url, "://");
+    return p ? strchr(p + 3, '/') : NULL;
+}
+
+// 1: fetch started, 0: its origin is at the cap, -1: the URL was skipped or failed
+static int job_start_next(warm_job_t *job) {
+    int https;
+    const char *path = url_path(job->urls[job->next], &https);
+    cache_fetch_req_t req;
+    if (!path || !g_build || g_build(job->host, path, https, &req) != 0) {
+        job->next++;
+        InterlockedIncrement(&job->failed);
+        job_finish_one(job);
+        return -1;
+    }
+    if (cache_contains_key(req.key_info.key_hash, req.key_info.key_fingerprint)) {
+        job->next++;
+        InterlockedIncrement(&job->skipped);
+        job_finish_one(job);
+        return -1;
+    }
+
+    warm_origin_t *origin = origin_acquire(req.backend_host, req.backend_port);
+    if (!origin) return 0;
+
+    job->next++;
+    warm_task_t *task = (warm_task_t *)malloc(sizeof(warm_task_t));
+    if (!task) {
+        InterlockedIncrement(&job->failed);
+    } else {
+        task->req = req;
+        task->req.stale = NULL;
+        task->req.key_info.fill_leader = 0;
+        // Asked for by an operator: second-hit admission does not apply
+        task->req.key_info.bypass_admission = 1;
+        task->job = job;
+        task->origin = origin;
+        if (cache_fetch_submit(warm_task, task) == 0) return 1;
+        InterlockedIncrement(&job->failed);
+        free(task);
+    }
+    InterlockedDecrement(&origin->inflight);
+    job_finish_one(job);
+    return -1;
+}
+
+static unsigned __stdcall warm_thread_func(void *arg) {
+    (void)arg;
+    DWORD window = 0;
+    uint32_t started = 0;
+    while (!g_warm_stopping) {
+        DWORD now = GetTickCount() / 1000;
+        if (now != window) {
+            window = now;
+            started = 0;
+        }
+
+        // One URL per job per pass, so jobs share the rate
+        int progressed = 0, pending = 0;
+        AcquireSRWLockShared(&g_warm_lock);
+        for (int i = 0; i < CACHE_WARM_MAX_JOBS; i++) {
+            warm_job_t *job = g_jobs[i];
+            if (!job || job->next >= job->count) continue;
+            pending = 1;
+            if (g_per_sec && started >= g_per_sec) continue;
+            int rc = job_start_next(job);
+            if (rc != 0) progressed = 1;
+            if (rc == 1) started++;
+        }
+        ReleaseSRWLockShared(&g_warm_lock);
+
+        if (!progressed) WaitForSingleObject(g_warm_wake, pending ? CACHE_WARM_IDLE_MS : INFINITE);
+    }
+    return 0;
+}
+
+int cache_warm_start(const char *host, char **urls, uint32_t count) {
+    warm_job_t *job = (warm_job_t *)calloc(1, sizeof(warm_job_t));
+    if (!job || !host || !urls || count == 0) {
+        for (uint32_t i = 0; urls && i < count; i++) free(urls[i]);
+        free(urls);
+        free(job);
+        return -1;
+    }
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    job->urls = urls;
+    job->count = count;
+    job->started_at = (uint32_t)time(NULL);
+    job->id = InterlockedIncrement(&g_next_job_id);
+
+    // A free slot, else the one of the job that finished longest ago
+    int slot = -1;
+    AcquireSRWLockExclusive(&g_warm_lock);
+    for (int i = 0; i < CACHE_WARM_MAX_JOBS; i++) {
+        warm_job_t *j = g_jobs[i];
+        if (!j) {
+            slot = i;
+            break;
+        }
+        if (j->finished_at && (slot < 0 || j->finished_at < g_jobs[slot]->finished_at)) slot = i;
+    }
+    if (slot >= 0) {
+        if (g_jobs[slot]) job_free(g_jobs[slot]);
+        g_jobs[slot] = job;
+        if (!g_warm_thread) {
+            g_warm_wake = CreateEventA(NULL, FALSE, FALSE, NULL);
+            if (g_warm_wake) g_warm_thread = (HANDLE)_beginthreadex(NULL, 0, warm_thread_func, NULL, 0, NULL);
+            if (!g_warm_thread) log_message("ERROR", "Failed to create cache warm thread");
+        }
+    }
+    ReleaseSRWLockExclusive(&g_warm_lock);
+
+    if (slot < 0) {
+        job_free(job);
+        return -1;
+    }
+    SetEvent(g_warm_wake);
+
+    char log_buf[384];
+    snprintf(log_buf, sizeof(log_buf), "[CACHE] Warm job %ld for %s: %u URLs queued", job->id, host, count);
+    log_message("INFO", log_buf);
+    return (int)job->id;
+}
+
+static int warm_status_json(const char *host, char *out, size_t size) {
+    uint32_t now = (uint32_t)time(NULL);
+    int len = snprintf(out, size, "{\"jobs\":[");
+    AcquireSRWLockShared(&g_warm_lock);
+    for (int i = 0, n = 0; i < CACHE_WARM_MAX_JOBS && len > 0 && (size_t)len < size; i++) {
+        const warm_job_t *job = g_jobs[i];
+        if (!job || _stricmp(job->host, host) != 0) continue;
+        LONG finished_at = job->finished_at;
+        len += snprintf(out + len, size - (size_t)len,
+                        "%s{\"id\":%ld,\"urls\":%u,\"done\":%ld,\"stored\":%ld,\"skipped\":%ld,"
+                        "\"failed\":%ld,\"running\":%s,\"seconds\":%u}",
+                        n++ ? "," : "", job->id, job->count, job->done, job->stored, job->skipped,
+                        job->failed, finished_at ? "false" : "true",
+                        (finished_at ? (uint32_t)finished_at : now) - job->started_at);
+    }
+    ReleaseSRWLockShared(&g_warm_lock);
+    if (len > 0 && (size_t)len < size) len += snprintf(out + len, size - (size_t)len, "]}");
+    return len > 0 && (size_t)len < size ? len : -1;
+}
+
+// Body of the request up to its Content-Length, the part past request_buffer read from the client
+static char *read_request_body(void *client_fd, void *ssl, const char *request_buffer, int received,
+                               size_t *len_out) {
+    *len_out = 0;
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    char value[32];
+    if (!hdr_end || cache_header_value(request_buffer, hdr_end, "Content-Length", value, sizeof(value)) < 0) {
+        return NULL;
+    }
+    long long want = atoll(value);
+    if (want <= 0 || want > CACHE_WARM_MAX_BODY) return NULL;
+
+    char *body = (char *)malloc((size_t)want + 1);
+    if (!body) return NULL;
+    size_t have = (size_t)(received - (int)(hdr_end + 4 - request_buffer));
+    if (have > (size_t)want) have = (size_t)want;
+    memcpy(body, hdr_end + 4, have);
+    while (have < (size_t)want) {
+        int chunk = (int)((size_t)want - have);
+        int n = ssl ? SSL_read((SSL *)ssl, body + have, chunk)
+                    : recv((SOCKET)(uintptr_t)client_fd, body + have, chunk, 0);
+        if (n <= 0) break;
+        have += (size_t)n;
+    }
+    body[have] = '\0';
+    *len_out = have;
+    return body;
+}
+
+// One URL per line: a path on host, or an absolute URL on host
+static uint32_t parse_url_list(char *body, const char *host, int is_https, char ***urls_out,
+                               uint32_t *rejected) {
+    uint32_t count = 0, cap = 0;
+    char **urls = NULL;
+    size_t host_len = strlen(host);
+    char *saveptr = NULL;
+    for (char *line = strtok_s(body, "\r\n", &saveptr); line; line = strtok_s(NULL, "\r\n", &saveptr)) {
+        while (*line == ' ' || *line == '\t') line++;
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+
+        char url[CACHE_WARM_MAX_URL_LEN];
+        int n = -1;
+        if (line[0] == '/') {
+            n = snprintf(url, sizeof(url), "%s://%s%s", is_https ? "https" : "http", host, line);
+        } else {
+            const char *p = strstr(line, "://");
+            if (p && (_strnicmp(line, "http://", 7) == 0 || _strnicmp(line, "https://", 8) == 0) &&
+                _strnicmp(p + 3, host, host_len) == 0 && p[3 + host_len] == '/') {
+                n = snprintf(url, sizeof(url), "%s", line);
+            }
+        }
+        if (n <= 0 || n >= (int)sizeof(url) || count >= CACHE_WARM_MAX_URLS) {
+            (*rejected)++;
+            continue;
+        }
+
+        if (count == cap) {
+            uint32_t grown_cap = cap ? cap * 2 : 64;
+            char **grown = (char **)realloc(urls, grown_cap * sizeof(char *));
+            if (!grown) break;
+            urls = grown;
+            cap = grown_cap;
+        }
+        if (!(urls[count] = strdup(url))) break;
+        count++;
+    }
+    *urls_out = urls;
+    return count;
+}
+
+static void send_response(void *client_fd, void *ssl, const char *status, const char *body) {
+    char resp[4352];
+    int len = snprintf(resp, sizeof(resp),
+                       "HTTP/1.1 %s\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: %d\r\n"
+                       "Cache-Control: no-store\r\n"
+                       "Connection: close\r\n"
+                       "\r\n%s",
+                       status, (int)strlen(body), body);
+    if (len <= 0 || len >= (int)sizeof(resp)) return;
+    for (int sent = 0; sent < len; ) {
+        int n = ssl ? SSL_write((SSL *)ssl, resp + sent, len - sent)
+                    : send((SOCKET)(uintptr_t)client_fd, resp + sent, len - sent, 0);
+        if (n <= 0) return;
+        sent += n;
+    }
+}
+
+int cache_handle_warm(void *client_fd, void *ssl, const char *request_buffer, int received,
+                      const char *host, const char *path, int is_https,
+                      const char *client_ip, const char *token, const char *snapshot_path) {
+    if (!client_fd || !request_buffer || !host || !path) return 0;
+
+    const char *status = "202 Accepted";
+    char body[4096];
+    const char *hdr_end = strstr(request_buffer, "\r\n\r\n");
+    char top[16];
+
+    if (!cache_admin_authorized(request_buffer, client_ip, token)) {
+        status = "403 Forbidden";
+    } else if (strcmp(path, "/status") == 0) {
+        status = "200 OK";
+        if (warm_status_json(host, body, sizeof(body)) < 0) snprintf(body, sizeof(body), "{\"jobs\":[]}");
+    } else {
+        char **urls = NULL;
+        int count = 0;
+        uint32_t rejected = 0;
+        if (hdr_end && cache_header_value(request_buffer, hdr_end, "X-Warm-Top", top, sizeof(top)) >= 0) {
+            long n = atol(top);
+            if (n <= 0 || n > CACHE_WARM_MAX_URLS) n = CACHE_WARM_MAX_URLS;
+            count = cache_snapshot_urls(snapshot_path, host, (uint32_t)n, &urls);
+            if (count < 0) status = "404 Not Found";
+        } else {
+            size_t body_len;
+            char *list = read_request_body(client_fd, ssl, request_buffer, received, &body_len);
+            if (list) count = (int)parse_url_list(list, host, is_https, &urls, &rejected);
+            free(list);
+        }
+
+        int job = -1;
+        if (count > 0) {
+            job = cache_warm_start(host, urls, (uint32_t)count);
+            if (job < 0) status = "503 Service Unavailable";
+        } else {
+            free(urls);
+            if (count == 0) status = "400 Bad Request";
+        }
+        if (job > 0) {
+            snprintf(body, sizeof(body), "{\"job\":%d,\"urls\":%d,\"rejected\":%u}", job, count, rejected);
+        }
+    }
+    if (status[0] != '2') snprintf(body, sizeof(body), "{\"error\":\"%s\"}", status);
+
+    send_response(client_fd, ssl, status, body);
+
+    char log_buf[768];
+    snprintf(log_buf, sizeof(log_buf), "[CACHE] Warm %s%s from %s: %s",
+             host, path, client_ip ? client_ip : "?", status);
+    log_message("INFO", log_buf);
+    return 1;
+}
+
+void cache_warm_stop(void) {
+    if (!g_warm_thread) return;
+
+    InterlockedExchange(&g_warm_stopping, 1);
+    SetEvent(g_warm_wake);
+    WaitForSingleObject(g_warm_thread, INFINITE);
+    CloseHandle(g_warm_thread);
+    g_warm_thread = NULL;
+    // Fetches already queued still finish and update their jobs, which stay allocated
+}
@@ -4,6 +4,12 @@
 #include "../include/logger.h"
 #include "../include/config.h"
 #include "../include/cache.h"
+#include "../include/cache_disk.h"
+#include "../include/cache_encoding.h"
+#include "../include/http_compress.h"
+#include "../include/cache_fetch.h"
+#include "../include/cache_prefetch.h"
+#include "../include/cache_warm.h"
 #include "../include/request_metrics.h"
 #include <ws2tcpip.h>
 #include "../include/ssl_utils.h"
@@ -107,6 +113,112 @@ static int connect_backend_auto(const ProxyRoute *rec, const char *host, int por
     return 0;
 }
 
+// Chèn thêm header (mỗi dòng kết thúc CRLF) ngay trước dòng trống cuối header
+static int insert_request_headers(char *req, size_t req_size, const char *extra) {
+    char *end = strstr(req, "\r\n\r\n");
+    size_t extra_len = strlen(extra);
+    if (!end || extra_len == 0) return -1;
+
+    char *at = end + 2;
+    size_t tail_len = strlen(at);
+    if ((size_t)(at - req) + extra_len + tail_len + 1 > req_size) return -1;
+
+    memmove(at + extra_len, at, tail_len + 1);
+    memcpy(at, extra, extra_len);
+    return 0;
+}
+
+// Route-level cache policy, falling back to the global config
+static void apply_route_cache_policy(cache_key_info_t *ki, const ProxyRoute *rec,
+                                     const CachePolicy *policy, const Proxy_Config *config) {
+    ki->stale_while_revalidate = rec->stale_while_revalidate_sec >= 0 ?
+                                 (uint32_t)rec->stale_while_revalidate_sec : config->cache_stale_while_revalidate_sec;
+    ki->stale_if_error = rec->stale_if_error_sec >= 0 ?
+                         (uint32_t)rec->stale_if_error_sec : config->cache_stale_if_error_sec;
+    ki->ttl_override = rec->cache_ttl_sec > 0 ? (uint32_t)rec->cache_ttl_sec : 0;
+    ki->min_ttl = config->cache_min_ttl_sec;
+    ki->max_ttl = config->cache_max_ttl_sec;
+    if (!policy) return;
+
+    if (policy->ttl_sec > 0) ki->ttl_override = (uint32_t)policy->ttl_sec;
+    if (policy->admission == 0) ki->bypass_admission = 1;
+    ki->ncacheable_statuses = 0;
+    for (int i = 0; i < policy->status_count && i < CACHE_MAX_POLICY_STATUSES; i++) {
+        ki->cacheable_statuses[ki->ncacheable_statuses++] = (uint16_t)policy->statuses[i];
+    }
+}
+
+static uint32_t route_max_object_bytes(const CachePolicy *policy, uint32_t limit) {
+    if (policy && policy->max_object_bytes > 0 && (uint32_t)policy->max_object_bytes < limit) {
+        return (uint32_t)policy->max_object_bytes;
+    }
+    return limit;
+}
+
+static void build_fetch_req(cache_fetch_req_t *req, const ProxyRoute *rec, const CachePolicy *policy,
+                            const Proxy_Config *config, const char *backend_host, int backend_port,
+                            const char *host, const char *path, const char *query,
+                            const cache_key_info_t *key_info) {
+    memset(req, 0, sizeof(*req));
+    snprintf(req->backend_host, sizeof(req->backend_host), "%s", backend_host);
+    req->backend_port = backend_port;
+    req->is_https = rec->is_https == 1;
+    snprintf(req->host, sizeof(req->host), "%s", host);
+    snprintf(req->path, sizeof(req->path), "%s", path);
+    snprintf(req->query, sizeof(req->query), "%s", query);
+    req->key_info = *key_info;
+    req->ttl_seconds = config->cache_default_ttl_sec;
+    req->max_object_bytes = route_max_object_bytes(policy, config->cache_max_object_bytes);
+}
+
+// Background fetch of url ("/path?query") on host, keyed as a client on scheme https would
+// key it. Keys split by client headers can't be built for a fetch that has none
+static int build_url_fetch_req(cache_fetch_req_t *req, const ProxyRoute *rec, const Proxy_Config *config,
+                               const char *host, const char *url, int is_https) {
+    char path[512];
+    if (snprintf(path, sizeof(path), "%s", url) >= (int)sizeof(path)) return -1;
+    char *query = strchr(path, '?');
+    if (query) *query++ = '\0';
+
+    const CachePolicy *policy = find_cache_policy(rec, path);
+    const cache_key_rules_t *rules = policy ? &policy->key_rules : NULL;
+    if (rules && (rules->headers.count || rules->cookies.count || rules->device_class)) return -1;
+
+    char key_path[512], key_query[512], key_vary[8];
+    cache_key_info_t ki;
+    if (cache_key_rules_apply(rules, NULL, path, query, key_path, sizeof(key_path),
+                              key_query, sizeof(key_query), key_vary, sizeof(key_vary)) != 0 ||
+        cache_prepare_key("GET", is_https ? "https" : "http", host, key_path,
+                          key_query[0] ? key_query : NULL, NULL, &ki) != 0) {
+        return -1;
+    }
+    apply_route_cache_policy(&ki, rec, policy, config);
+    build_fetch_req(req, rec, policy, config, rec->backend_host, rec->backend_port, host,
+                    path, query ? query : "", &ki);
+    return 0;
+}
+
+int proxy_build_fetch_req(const char *host, const char *url, int https, struct cache_fetch_req_s *req) {
+    const ProxyRoute *rec = host ? find_proxy_routes(host) : NULL;
+    const Proxy_Config *config = get_config();
+    if (!rec || !config || !url || !req) return -1;
+    detect_backend_protocol((ProxyRoute *)rec);
+    return build_url_fetch_req(req, rec, config, host, url, https);
+}
+
+// Warm what this page pulled in before while the page itself goes to origin
+static void prefetch_linked(const ProxyRoute *rec, const Proxy_Config *config,
+                            const char *host, const char *page, int is_https) {
+    char links[CACHE_PREFETCH_LINKS][CACHE_PREFETCH_TARGET_MAX];
+    int n = cache_prefetch_links(host, page, links, CACHE_PREFETCH_LINKS);
+    for (int i = 0; i < n; i++) {
+        cache_fetch_req_t req;
+        if (build_url_fetch_req(&req, rec, config, host, links[i], is_https) == 0) {
+            cache_prefetch_submit(&req);
+        }
+    }
+}
+
 static void send_quick_error(SOCKET cfd, SSL *ssl, const char *status) {
     char resp[128];
     int n = snprintf(resp, sizeof(resp), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
@@ -143,6 +255,14 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
     SOCKET backend_fd = INVALID_SOCKET;
     SSL *backend_ssl = NULL;
 
+    // Declared up front: cleanup runs these down on every path
+    cache_key_info_t cache_key_info = {0};
+    cache_buffer_t cache_buf = {0};
+    cache_value_t *stale_value = NULL;  // expired copy that may stand in for origin errors
+    http_compress_t compressor = {0};   // gzip for uncached responses
+    char prefetch_page[512] = {0};      // Referer page of a sub-resource, learned once it proves cacheable
+    int prefetch_learn = 0;
+
     set_tcp_nodelay(client_fd);
 
     // Doc headers tu client
@@ -245,54 +365,149 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
         send_quick_error(client_fd, ssl, "400 Bad Request");
         goto cleanup;
     }
+
+    const CachePolicy *cache_policy = find_cache_policy(rec, path);
+    const cache_key_rules_t *key_rules = cache_policy ? &cache_policy->key_rules : NULL;
+
+    if (config->cache_enabled && (strcmp(method, "PURGE") == 0 || strcmp(method, "BAN") == 0)) {
+        cache_handle_purge((void *)(uintptr_t)client_fd, ssl, recv_buffer, host_from_request,
+                           path, query[0] ? query : NULL, key_rules, cip, config->cache_purge_token);
+        goto cleanup;
+    }
+
+    if (config->cache_enabled && strcmp(method, "WARM") == 0) {
+        cache_handle_warm((void *)(uintptr_t)client_fd, ssl, recv_buffer, total, host_from_request,
+                          path, ssl != NULL, cip, config->cache_purge_token, config->cache_snapshot_path);
+        goto cleanup;
+    }
+
+    // The key is computed once and serves the invalidation, the lookup and the fill
+    int key_rc = -1;
+    if (config->cache_enabled && strcmp(method, "GET") == 0) {
+        char key_path[512], key_query[512], key_vary[512];
+        if (cache_key_rules_apply(key_rules, recv_buffer, path, query, key_path, sizeof(key_path),
+                                  key_query, sizeof(key_query), key_vary, sizeof(key_vary)) == 0) {
+            key_rc = cache_prepare_key(method, ssl ? "https" : "http",
+                                       host_from_request, key_path, key_query[0] ? key_query : NULL,
+                                       key_vary[0] ? key_vary : NULL,
+                                       &cache_key_info);
+        }
+    }
+
     int has_authorization = cache_check_has_authorization(recv_buffer);
+    int is_navigation = cache_prefetch_is_navigation(recv_buffer);
+    if (key_rc == 0 && !has_authorization) {
+        cache_prefetch_referer(recv_buffer, host_from_request, prefetch_page, sizeof(prefetch_page));
+    }
     if (has_authorization) {
         cache_debug_log_auth_detected(path);
 
-        if (config->cache_enabled && strcmp(method, "GET") == 0) {
-            cache_invalidate(method, ssl ? "https" : "http",
-                           host_from_request, path,
-                           query[0] ? query : NULL,
-                           vary_header[0] ? vary_header : NULL);
+        if (key_rc == 0) {
+            cache_invalidate_key(cache_key_info.key_hash, cache_key_info.key_fingerprint);
         }
     }
 
-    cache_key_info_t cache_key_info = {0};
-    cache_buffer_t cache_buf = {0};
     int was_cache_hit = 0;
+    uint32_t accept_encoding = cache_parse_accept_encoding(recv_buffer);
+    cache_range_t range;
+    cache_parse_range(recv_buffer, &range);
+
     uint32_t final_status_code = 0; 
     uint64_t bytes_in = (uint64_t)total; 
     uint64_t bytes_out = 0;
 
     if (config->cache_enabled && strcmp(method, "GET") == 0 && !has_authorization) {
         cache_value_t *cached_value = NULL;
-        cache_result_t cache_result = cache_get(method, ssl ? "https" : "http",
-                                                host_from_request, path, 
-                                                query[0] ? query : NULL, 
-                                                vary_header[0] ? vary_header : NULL,
-                                                &cached_value);
+        cache_result_t cache_result = key_rc == 0 ?
+            cache_get_key(cache_key_info.key_hash, cache_key_info.key_fingerprint, &cached_value) :
+            CACHE_RESULT_ERROR;
         
         if (cache_result == CACHE_RESULT_HIT && cached_value) {
             cache_debug_log_cache_hit(path, cached_value->status_code, cached_value->body_len);
+            prefetch_learn = 1;
+
+            int nm_rc = cache_handle_not_modified((void *)(uintptr_t)client_fd, ssl, cached_value,
+                                                  recv_buffer, path, query[0] ? query : NULL,
+                                                  method, host_from_request, bytes_in);
+            if (nm_rc != 0) {
+                cache_value_release(cached_value);
+                was_cache_hit = (nm_rc == 1);
+                goto cleanup;
+            }
             
-            if (cache_handle_hit((void *)(uintptr_t)client_fd, ssl, cached_value,
-                                path, query[0] ? query : NULL, method,
-                                host_from_request, bytes_in, &bytes_out)) {
-                was_cache_hit = 1;
-                final_status_code = cached_value->status_code;
+            int hit_rc = cache_handle_hit((void *)(uintptr_t)client_fd, ssl, cached_value,
+                                          path, query[0] ? query : NULL, method,
+                                          host_from_request, accept_encoding, &range, bytes_in, &bytes_out);
+            final_status_code = cached_value->status_code;
+            cache_value_release(cached_value);
+            if (hit_rc != 0) {
+                // -1: the fill we were streaming from broke off, the client can't be resumed
+                was_cache_hit = (hit_rc == 1);
                 goto cleanup;
             }
+        } else if (cache_result == CACHE_RESULT_STALE && cached_value) {
+            stale_value = cached_value;
         } else {
             cache_debug_log_cache_miss(path, cache_result);
         }
 
-        if (cache_prepare_key(method, ssl ? "https" : "http",
-                             host_from_request, path,
-                             query[0] ? query : NULL,
-                             vary_header[0] ? vary_header : NULL,
-                             &cache_key_info) != 0) {
+        cache_key_info.accept_encoding = accept_encoding;
+        if (key_rc != 0) {
             cache_key_info.should_cache = 0;
             cache_debug_log_prepare_key_failed(path);
+        } else if (stale_value && cache_stale_while_revalidate_ok(stale_value)) {
+            // Serve the stale copy now and refresh it in the background
+            apply_route_cache_policy(&cache_key_info, rec, cache_policy, config);
+            cache_fetch_req_t refresh;
+            build_fetch_req(&refresh, rec, cache_policy, config, target_backend_host, target_backend_port,
+                            host_from_request, path, query, &cache_key_info);
+            cache_fetch_refresh_async(&refresh, stale_value);
+
+            int stale_rc = cache_handle_stale_hit((void *)(uintptr_t)client_fd, ssl, stale_value,
+                                                  path, query[0] ? query : NULL, method,
+                                                  host_from_request, accept_encoding, &range, bytes_in, &bytes_out);
+            prefetch_learn = 1;
+            if (stale_rc != 0) {
+                was_cache_hit = (stale_rc == 1);
+                goto cleanup;
+            }
+        } else if (cache_handle_disk_hit((void *)(uintptr_t)client_fd, ssl, &cache_key_info,
+                                         recv_buffer, path, query[0] ? query : NULL, method,
+                                         host_from_request, &range, bytes_in, &bytes_out)) {
+            was_cache_hit = 1;
+            prefetch_learn = 1;
+            goto cleanup;
+        } else {
+            if (is_navigation) prefetch_linked(rec, config, host_from_request, path, ssl != NULL);
+
+            // Large objects asked for by range are fetched and cached slice by slice
+            if (range.count > 0) {
+                apply_route_cache_policy(&cache_key_info, rec, cache_policy, config);
+                cache_fetch_req_t slice_req;
+                build_fetch_req(&slice_req, rec, cache_policy, config, target_backend_host, target_backend_port,
+                                host_from_request, path, query, &cache_key_info);
+                int range_rc = cache_fetch_serve_range((void *)(uintptr_t)client_fd, ssl, &slice_req, &range,
+                                                       method, bytes_in, &bytes_out);
+                if (range_rc != 0) {
+                    was_cache_hit = (range_rc == 1);
+                    goto cleanup;
+                }
+            }
+
+            int collapse_rc = cache_collapse_miss((void *)(uintptr_t)client_fd, ssl, &cache_key_info,
+                                                  path, query[0] ? query : NULL, method,
+                                                  host_from_request, &range, bytes_in, &bytes_out,
+                                                  &final_status_code);
+            if (collapse_rc != 0) {
+                was_cache_hit = (collapse_rc == 1);
+                goto cleanup;
+            }
+        }
+        apply_route_cache_policy(&cache_key_info, rec, cache_policy, config);
+        // An expired copy proves the key is popular: its refetch skips second-hit admission
+        if (stale_value) {
+            cache_key_info.bypass_admission = 1;
+            cache_key_info.has_stale = 1;
         }
     } else {
         if (has_authorization) {
@@ -307,11 +522,27 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
         strncpy(send_buffer, recv_buffer, sizeof(send_buffer) - 1);
         send_buffer[sizeof(send_buffer) - 1] = '\0';
     }
+
+    // Revalidate our expired copy unless the client is already asking conditionally
+    int revalidating = 0;
+    if (stale_value && cache_key_info.should_cache && !cache_request_is_conditional(recv_buffer)) {
+        char validators[256];
+        if (cache_build_revalidation_headers(stale_value, validators, sizeof(validators)) > 0 &&
+            insert_request_headers(send_buffer, sizeof(send_buffer), validators) == 0) {
+            revalidating = 1;
+        }
+    }
     int send_len = (int)strlen(send_buffer);
 
     //Ket noi den backend
     if (connect_backend_auto(rec, target_backend_host, target_backend_port, &backend_fd, &backend_ssl) != 0) {
         log_message("ERROR", "Failed to connect to backend");
+        if (stale_value && cache_stale_if_error_ok(stale_value) &&
+            cache_handle_stale_hit((void *)(uintptr_t)client_fd, ssl, stale_value,
+                                   path, query[0] ? query : NULL, method,
+                                   host_from_request, accept_encoding, &range, bytes_in, &bytes_out) != 0) {
+            goto cleanup;
+        }
         send_quick_error(client_fd, ssl, "502 Bad Gateway");
         goto cleanup;
     }
@@ -341,6 +572,13 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
     long long bytes_sent_body = 0;
     final_status_code = 200;
 
+    // Objects above the RAM limit can still be cached when the disk tier is on
+    uint32_t max_cacheable_bytes = config->cache_max_object_bytes;
+    if (cache_disk_max_object_bytes() > max_cacheable_bytes) {
+        max_cacheable_bytes = cache_disk_max_object_bytes();
+    }
+    max_cacheable_bytes = route_max_object_bytes(cache_policy, max_cacheable_bytes);
+
     while (1) {
         int n;
         if (use_ssl && backend_ssl && SSL_pending(backend_ssl) > 0) {
@@ -393,25 +631,88 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
                     int header_len = (int)(hdr_end - header_buf) + 4;
                     int body_len   = buffered - header_len;
 
+                    // Rewrite first so the cache stores the headers clients actually see
+                    char modified[HEADER_BUFFER_SIZE + 1];
+                    int new_len = modify_response_headers(header_buf, header_len, modified, HEADER_BUFFER_SIZE, target_backend_host, target_backend_port, config->listen_host, config->listen_port);
+                    if (new_len > 0) modified[new_len] = '\0';
+
                     uint32_t parsed_status = 0;
-                    if (cache_process_response_headers(header_buf, header_len, body_len,
+                    if (cache_process_response_headers(new_len > 0 ? modified : header_buf,
+                                                     new_len > 0 ? new_len : header_len, body_len,
                                                      method, &cache_key_info, &cache_buf,
-                                                     config->cache_max_object_bytes,
+                                                     max_cacheable_bytes,
+                                                     config->cache_default_ttl_sec,
                                                      &parsed_status, &content_length, &is_chunked) == 0) {
                         final_status_code = parsed_status;
                     }
 
-                    char modified[HEADER_BUFFER_SIZE];
-                    int new_len = modify_response_headers(header_buf, header_len, modified, sizeof(modified), target_backend_host, target_backend_port, config->listen_host, config->listen_port);
-                    if (new_len > 0)
-                        send_all(client_fd, modified, new_len, ssl);
+                    // Origin confirmed our copy: refresh it and answer from cache
+                    if (revalidating && final_status_code == 304) {
+                        cache_refresh_ttl(cache_key_info.key_hash, cache_key_info.key_fingerprint,
+                                          stale_value, cache_key_info.response_ttl);
+                        int hit_rc = cache_handle_revalidated_hit((void *)(uintptr_t)client_fd, ssl, stale_value,
+                                                                  path, query[0] ? query : NULL, method,
+                                                                  host_from_request, accept_encoding, &range,
+                                                                  bytes_in, &bytes_out);
+                        if (hit_rc != 0) {
+                            was_cache_hit = (hit_rc == 1);
+                            final_status_code = stale_value->status_code;
+                            goto cleanup;
+                        }
+                        // The 304 answers our validators, not the client's: never relay it
+                        log_message("WARN", "Revalidated copy could not be served");
+                        send_quick_error(client_fd, ssl, "502 Bad Gateway");
+                        final_status_code = 502;
+                        goto cleanup;
+                    }
+
+                    // Origin error with a usable stale copy: serve that instead
+                    if (final_status_code >= 500 && stale_value && cache_stale_if_error_ok(stale_value)) {
+                        int stale_rc = cache_handle_stale_hit((void *)(uintptr_t)client_fd, ssl, stale_value,
+                                                              path, query[0] ? query : NULL, method,
+                                                              host_from_request, accept_encoding, &range, bytes_in, &bytes_out);
+                        if (stale_rc != 0) {
+                            was_cache_hit = (stale_rc == 1);
+                            goto cleanup;
+                        }
+                    }
+
+                    const char *out_hdr = new_len > 0 ? modified : header_buf;
+                    int out_len = new_len > 0 ? new_len : header_len;
+
+                    // Uncached responses are gzipped on the way when the client takes it
+                    char gz_hdr[HEADER_BUFFER_SIZE + 64];
+                    int gz_len = -1;
+                    if (!cache_key_info.should_cache && strcmp(method, "HEAD") != 0 &&
+                        http_compress_begin(&compressor, accept_encoding, out_hdr, out_len,
+                                            final_status_code, content_length, is_chunked,
+                                            (void *)(uintptr_t)client_fd, ssl)) {
+                        gz_len = http_compress_rewrite_header(out_hdr, out_len, gz_hdr, sizeof(gz_hdr));
+                        if (gz_len <= 0) http_compress_free(&compressor);
+                    }
+                    if (gz_len > 0)
+                        send_all(client_fd, gz_hdr, gz_len, ssl);
                     else
-                        send_all(client_fd, header_buf, header_len, ssl);
+                        send_all(client_fd, out_hdr, out_len, ssl);
+
+                    // Preloads the page announces are warmed while its body streams
+                    if (config->cache_enabled && final_status_code == 200 && strcmp(method, "GET") == 0 &&
+                        is_navigation && cache_prefetch_learn_links(host_from_request, path, out_hdr, out_hdr + out_len) > 0) {
+                        prefetch_linked(rec, config, host_from_request, path, ssl != NULL);
+                    }
 
+                    int body_done = 0;
                     if (body_len > 0) {
-                        cache_forward_response_chunk((void *)(uintptr_t)client_fd, ssl,
-                                                     (const uint8_t *)(header_buf + header_len),
-                                                     (size_t)body_len, &cache_key_info, &cache_buf);
+                        if (compressor.active) {
+                            body_done = http_compress_write(&compressor,
+                                                            (const uint8_t *)(header_buf + header_len),
+                                                            (size_t)body_len);
+                            if (body_done < 0) break;
+                        } else {
+                            cache_forward_response_chunk((void *)(uintptr_t)client_fd, ssl,
+                                                         (const uint8_t *)(header_buf + header_len),
+                                                         (size_t)body_len, &cache_key_info, &cache_buf);
+                        }
                     }
 
                     header_done = 1;
@@ -419,26 +720,36 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
                     bytes_sent_body = body_len;
 
                     if (content_length >= 0 && bytes_sent_body >= content_length) {
-                        if (cache_key_info.should_cache && cache_buf.buffer) {
+                        if (cache_key_info.should_cache && cache_buf.value) {
                             if (!cache_buffer_is_complete(&cache_buf, content_length)) {
                                 cache_key_info.should_cache = 0;
                             }
                         }
                         break;
                     }
+                    if (is_chunked && ((cache_buf.value && cache_buf.complete) || body_done == 1)) {
+                        bytes_out = (uint64_t)bytes_sent_body;
+                        break;
+                    }
                 }
             } else {
-                int sent = cache_forward_response_chunk((void *)(uintptr_t)client_fd, ssl,
-                                                        (const uint8_t *)recv_buffer, (size_t)n,
-                                                        &cache_key_info, &cache_buf);
-                if (sent < 0) break;
+                int body_done = 0;
+                if (compressor.active) {
+                    body_done = http_compress_write(&compressor, (const uint8_t *)recv_buffer, (size_t)n);
+                    if (body_done < 0) break;
+                } else {
+                    int sent = cache_forward_response_chunk((void *)(uintptr_t)client_fd, ssl,
+                                                            (const uint8_t *)recv_buffer, (size_t)n,
+                                                            &cache_key_info, &cache_buf);
+                    if (sent < 0) break;
+                }
 
                 bytes_sent_body += n;
                 bytes_out = (uint64_t)bytes_sent_body; 
 
                 if (content_length >= 0) {
                     if (bytes_sent_body >= content_length) {
-                        if (cache_key_info.should_cache && cache_buf.buffer) {
+                        if (cache_key_info.should_cache && cache_buf.value) {
                             if (!cache_buffer_is_complete(&cache_buf, content_length)) {
                                 cache_key_info.should_cache = 0;
                             }
@@ -446,7 +757,9 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
                         break;
                     }
                 } else if (is_chunked) {
-                    if (strstr(recv_buffer, "\r\n0\r\n\r\n")) {
+                    // The de-chunker knows exactly where the body ends when we are filling
+                    if ((cache_buf.value && cache_buf.complete) || body_done == 1 ||
+                        (!compressor.active && strstr(recv_buffer, "\r\n0\r\n\r\n"))) {
                         bytes_out = (uint64_t)bytes_sent_body; 
                         break;
                     }
@@ -456,18 +769,22 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
             }
     }
 
-    if (cache_key_info.should_cache && cache_buf.complete && cache_buf.size > 0) {
+    if (compressor.active) {
+        http_compress_finish(&compressor);
+        bytes_out = compressor.bytes_out;
+    }
+
+    if (cache_key_info.should_cache && cache_buf.complete &&
+        (cache_buf.size > 0 || cache_buf.status_code != 200)) {
         cache_debug_log_storing(path, cache_buf.status_code, cache_buf.size);
         
-        int store_result = cache_try_store(&cache_key_info, &cache_buf,
-                       method, ssl ? "https" : "http",
-                       host_from_request, path,
-                       query[0] ? query : NULL,
-                       vary_header[0] ? vary_header : NULL,
-                       config->cache_default_ttl_sec);
+        int store_result = cache_try_store(&cache_key_info, &cache_buf, host_from_request,
+                       path, query[0] ? query : NULL);
         
         if (store_result != 0) {
             cache_debug_log_store_failed(path, store_result);
+        } else {
+            prefetch_learn = 1;
         }
     } else if (cache_key_info.should_cache) {
         cache_debug_log_not_storing(path, cache_key_info.should_cache, cache_buf.complete, cache_buf.size);
@@ -485,7 +802,13 @@ void handle_client(SOCKET client_fd, SSL *ssl, const Proxy_Config *config) {
 
 cleanup:
 
-    cache_buffer_free(&cache_buf);
+    if (prefetch_learn && prefetch_page[0]) {
+        cache_prefetch_observe(host_from_request, prefetch_page, path, query);
+    }
+    cache_release_fill_leader(&cache_key_info);
+    cache_buffer_free(&cache_buf, &cache_key_info);
+    cache_value_release(stale_value);
+    http_compress_free(&compressor);
     if (backend_ssl) {
         SSL_shutdown(backend_ssl);
         SSL_free(backend_ssl);
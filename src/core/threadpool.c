@@ -28,9 +28,14 @@ static unsigned __stdcall worker_thread(void *arg) {
 }
 
 void initThreadPool(ThreadPool *pool, int thread_count) {
+    initThreadPoolBounded(pool, thread_count, MAX_TASKS);
+}
+
+void initThreadPoolBounded(ThreadPool *pool, int thread_count, int max_tasks) {
     InitializeCriticalSection(&pool->lock);
     InitializeConditionVariable(&pool->cond);
     pool->head = pool->tail = pool->task_count = 0;
+    pool->max_tasks = max_tasks > 0 && max_tasks < MAX_TASKS ? max_tasks : MAX_TASKS;
     pool->stop = 0;
     pool->thread_count = thread_count;
 
@@ -38,12 +43,12 @@ void initThreadPool(ThreadPool *pool, int thread_count) {
         pool->threads[i] = (HANDLE)_beginthreadex(NULL,0,worker_thread,pool,0,NULL);
 }
 
-void enqueueThreadPool(ThreadPool *pool, void (*func)(void*), void *arg) {
+int enqueueThreadPool(ThreadPool *pool, void (*func)(void*), void *arg) {
     EnterCriticalSection(&pool->lock);
-    if (pool->task_count == MAX_TASKS) {
+    if (pool->task_count >= pool->max_tasks) {
         LeaveCriticalSection(&pool->lock);
         printf("Task queue full!\n");
-        return;
+        return -1;
     }
     pool->tasks[pool->tail].func = func;
     pool->tasks[pool->tail].arg = arg;
@@ -51,6 +56,7 @@ void enqueueThreadPool(ThreadPool *pool, void (*func)(void*), void *arg) {
     pool->task_count++;
     WakeConditionVariable(&pool->cond);
     LeaveCriticalSection(&pool->lock);
+    return 0;
 }
 
 void shutdownThreadPool(ThreadPool *pool) {
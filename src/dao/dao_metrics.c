@@ -260,6 +260,75 @@ int dao_metrics_insert_route_cache(
     return 0;
 }
 
+int dao_metrics_insert_tenant_cache(
+    time_t timestamp,
+    uint64_t domain_id,
+    const char *host,
+    uint64_t hit_count,
+    uint64_t miss_count,
+    uint64_t byte_hit,
+    uint64_t byte_miss,
+    uint64_t bytes_cached,
+    uint64_t entries_cached,
+    uint64_t quota_bytes,
+    uint64_t evictions
+) {
+    if (!host) {
+        return -1;
+    }
+
+    char datetime_buf[64];
+    format_datetime(timestamp, datetime_buf, sizeof(datetime_buf));
+
+    char host_escaped[512];
+    escape_string(host, host_escaped, sizeof(host_escaped));
+
+    // Occupancy is a level, not a count: the last flush of the minute wins
+    char query[1536];
+    int n = snprintf(query, sizeof(query),
+        "INSERT INTO cache_stats_minute ("
+        "ts_minute, domain_id, host, route_bucket, "
+        "hit, miss, byte_hit, byte_miss, "
+        "bytes_cached, entries_cached, quota_bytes, evictions"
+        ") VALUES ("
+        "%s, %llu, '%s', '*', "
+        "%llu, %llu, %llu, %llu, "
+        "%llu, %llu, %llu, %llu"
+        ") ON DUPLICATE KEY UPDATE "
+        "hit = hit + VALUES(hit), "
+        "miss = miss + VALUES(miss), "
+        "byte_hit = byte_hit + VALUES(byte_hit), "
+        "byte_miss = byte_miss + VALUES(byte_miss), "
+        "bytes_cached = VALUES(bytes_cached), "
+        "entries_cached = VALUES(entries_cached), "
+        "quota_bytes = VALUES(quota_bytes), "
+        "evictions = IFNULL(evictions, 0) + VALUES(evictions)",
+        datetime_buf,
+        (unsigned long long)domain_id,
+        host_escaped,
+        (unsigned long long)hit_count,
+        (unsigned long long)miss_count,
+        (unsigned long long)byte_hit,
+        (unsigned long long)byte_miss,
+        (unsigned long long)bytes_cached,
+        (unsigned long long)entries_cached,
+        (unsigned long long)quota_bytes,
+        (unsigned long long)evictions
+    );
+
+    if (n < 0 || n >= (int)sizeof(query)) {
+        log_message("ERROR", "dao_metrics_insert_tenant_cache: query buffer overflow");
+        return -1;
+    }
+
+    if (db_execute(query) != 0) {
+        log_message("ERROR", "dao_metrics_insert_tenant_cache: failed to insert");
+        return -1;
+    }
+
+    return 0;
+}
+
 uint64_t dao_metrics_lookup_domain_id(const char *host) {
     if (!host || strlen(host) == 0) {
         return 0;
@@ -1,6 +1,7 @@
 #include "../include/dao_routes.h"
 #include "../include/dbhelper.h"
 #include "../include/proxy_routes.h"
+#include "../include/logger.h"
 #include <mysql.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,10 +11,10 @@ int dao_routes_load_all_into(ProxyRoute *out, int max_out) {
     if (!out || max_out <= 0) return 0;
 
     const char *q =
-    "SELECT d.domain, o.origin_ip AS backend_host, o.backend_port FROM domains d LEFT JOIN domain_origins o ON o.domain_id = d.id WHERE d.status = 1 ORDER BY d.id, o.id";
+    "SELECT d.domain, o.origin_ip AS backend_host, o.backend_port, d.stale_while_revalidate_sec, d.stale_if_error_sec, d.cache_ttl_sec, d.cache_quota_bytes, d.cache_weight FROM domains d LEFT JOIN domain_origins o ON o.domain_id = d.id WHERE d.status = 1 ORDER BY d.id, o.id";
 
     MYSQL_RES *res = db_query(q);
-    if (!res) return 0;
+    if (!res) return -1;
 
     MYSQL_ROW row;
     int n = 0;
@@ -22,6 +23,11 @@ int dao_routes_load_all_into(ProxyRoute *out, int max_out) {
         const char *c_domain = row[0];
         const char *c_host   = row[1];
         const char *c_port   = row[2];
+        const char *c_swr    = row[3];
+        const char *c_sie    = row[4];
+        const char *c_ttl    = row[5];
+        const char *c_quota  = row[6];
+        const char *c_weight = row[7];
 
         if (!c_domain || !c_domain[0]) continue;
 
@@ -42,6 +48,83 @@ int dao_routes_load_all_into(ProxyRoute *out, int max_out) {
         }
 
         r->is_https = -1;
+        r->stale_while_revalidate_sec = (c_swr && c_swr[0]) ? atoi(c_swr) : -1;
+        r->stale_if_error_sec         = (c_sie && c_sie[0]) ? atoi(c_sie) : -1;
+        r->cache_ttl_sec              = (c_ttl && c_ttl[0]) ? atoi(c_ttl) : 0;
+        r->cache_quota_bytes          = (c_quota && c_quota[0]) ? strtoull(c_quota, NULL, 10) : 0;
+        r->cache_weight               = (c_weight && c_weight[0]) ? atoi(c_weight) : 0;
+        r->policy_count               = 0;
+    }
+
+    mysql_free_result(res);
+    return n;
+}
+
+int dao_cache_policies_load_all_into(CachePolicy *out, int max_out) {
+    if (!out || max_out <= 0) return 0;
+
+    const char *q =
+    "SELECT d.domain, p.path_prefix, p.ttl_sec, p.max_object_bytes, p.admission, p.ignore_query_params, p.cacheable_statuses, p.keep_query_params, p.key_headers, p.key_cookies, p.key_fold_path, p.key_device_class FROM domain_cache_policies p JOIN domains d ON d.id = p.domain_id WHERE d.status = 1 ORDER BY p.id";
+
+    MYSQL_RES *res = db_query(q);
+    if (!res) return -1;
+
+    MYSQL_ROW row;
+    int n = 0;
+
+    while ((row = mysql_fetch_row(res)) && n < max_out) {
+        const char *c_domain   = row[0];
+        const char *c_prefix   = row[1];
+        const char *c_ttl      = row[2];
+        const char *c_max_obj  = row[3];
+        const char *c_admit    = row[4];
+        const char *c_ignore   = row[5];
+        const char *c_statuses = row[6];
+        const char *c_keep     = row[7];
+        const char *c_headers  = row[8];
+        const char *c_cookies  = row[9];
+        const char *c_fold     = row[10];
+        const char *c_device   = row[11];
+
+        if (!c_domain || !c_domain[0]) continue;
+
+        CachePolicy *p = &out[n++];
+        memset(p, 0, sizeof(*p));
+
+        snprintf(p->domain, sizeof(p->domain), "%s", c_domain);
+
+        // Prefixes match whole path segments: "/media" is stored as "/media/"
+        const char *prefix = (c_prefix && c_prefix[0] == '/') ? c_prefix : "/";
+        size_t len = strlen(prefix);
+        if (len > sizeof(p->path_prefix) - 2) len = sizeof(p->path_prefix) - 2;
+        memcpy(p->path_prefix, prefix, len);
+        if (p->path_prefix[len - 1] != '/') p->path_prefix[len++] = '/';
+        p->path_prefix[len] = '\0';
+        p->prefix_len = (int)len;
+
+        p->ttl_sec          = (c_ttl && c_ttl[0]) ? atoi(c_ttl) : 0;
+        p->max_object_bytes = (c_max_obj && c_max_obj[0]) ? atoi(c_max_obj) : 0;
+        p->admission        = (c_admit && c_admit[0]) ? atoi(c_admit) : -1;
+
+        if (cache_key_rules_compile(&p->key_rules, c_ignore, c_keep, c_headers, c_cookies,
+                                    c_fold && atoi(c_fold), c_device && atoi(c_device)) != 0) {
+            char log_buf[512];
+            snprintf(log_buf, sizeof(log_buf), "[routes] cache key rules of %s%s truncated to %d names per list",
+                     p->domain, p->path_prefix, CACHE_KEY_MAX_NAMES);
+            log_message("WARN", log_buf);
+        }
+
+        // "200,203,301,404"
+        for (const char *s = c_statuses; s && *s && p->status_count < MAX_POLICY_STATUSES; ) {
+            char *end;
+            long status = strtol(s, &end, 10);
+            if (end == s) {
+                s++;
+                continue;
+            }
+            if (status >= 200 && status <= 599) p->statuses[p->status_count++] = (int)status;
+            s = end;
+        }
     }
 
     mysql_free_result(res);
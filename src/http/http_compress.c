@@ -0,0 +1,241 @@
+#include <winsock2.h>
+#include <openssl/ssl.h>
+#include "../include/http_compress.h"
+#include "../include/cache_encoding.h"
+#include <stdio.h>
+#include <string.h>
+
+// Level by CPU busy percentage, sampled at most every HTTP_COMPRESS_SAMPLE_MS
+static volatile LONG g_level = CACHE_GZIP_LEVEL;
+static volatile LONG g_sample_tick = 0;
+static uint64_t g_prev_idle = 0;
+static uint64_t g_prev_total = 0;
+
+static volatile LONG64 g_responses = 0;
+static volatile LONG64 g_bytes_in = 0;
+static volatile LONG64 g_bytes_out = 0;
+
+static uint64_t filetime_u64(const FILETIME *ft) {
+    return ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+static int current_level(void) {
+    DWORD now = GetTickCount();
+    LONG last = InterlockedCompareExchange(&g_sample_tick, 0, 0);
+    if (now - (DWORD)last >= HTTP_COMPRESS_SAMPLE_MS &&
+        InterlockedCompareExchange(&g_sample_tick, (LONG)now, last) == last) {
+        FILETIME idle, kernel, user;
+        if (GetSystemTimes(&idle, &kernel, &user)) {
+            // Kernel time includes idle time
+            uint64_t i = filetime_u64(&idle);
+            uint64_t t = filetime_u64(&kernel) + filetime_u64(&user);
+            if (g_prev_total && t > g_prev_total) {
+                uint64_t busy = 100 - (i - g_prev_idle) * 100 / (t - g_prev_total);
+                LONG level = busy < 50 ? CACHE_GZIP_LEVEL : busy < 70 ? 4 : busy < 85 ? 1 : 0;
+                InterlockedExchange(&g_level, level);
+            }
+            g_prev_idle = i;
+            g_prev_total = t;
+        }
+    }
+    return (int)InterlockedCompareExchange(&g_level, 0, 0);
+}
+
+static int header_value(const char *buf, const char *hdr_end, const char *name,
+                        char *out, size_t out_size) {
+    size_t name_len = strlen(name);
+    for (const char *line = buf; line && line < hdr_end; ) {
+        if (_strnicmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            const char *e = strstr(v, "\r\n");
+            if (!e || e > hdr_end) e = hdr_end;
+            size_t len = (size_t)(e - v);
+            if (len >= out_size) len = out_size - 1;
+            memcpy(out, v, len);
+            out[len] = '\0';
+            return (int)len;
+        }
+        line = strstr(line, "\r\n");
+        if (line) line += 2;
+    }
+    return -1;
+}
+
+int http_compress_begin(http_compress_t *c, uint32_t accept_encoding,
+                        const char *resp_header, int header_len, uint32_t status_code,
+                        long long content_length, int is_chunked,
+                        void *client_fd, void *ssl) {
+    if (!c || !resp_header || header_len <= 0) return 0;
+    memset(c, 0, sizeof(*c));
+
+    if (!(accept_encoding & CACHE_ENCODING_GZIP)) return 0;
+    if (status_code < 200 || status_code >= 300 || status_code == 204 || status_code == 206) return 0;
+    if (content_length >= 0 && content_length < HTTP_COMPRESS_MIN_BYTES) return 0;
+
+    const char *hdr_end = resp_header + header_len - 2;
+    char value[128];
+    if (header_value(resp_header, hdr_end, "Content-Encoding", value, sizeof(value)) >= 0 &&
+        _stricmp(value, "identity") != 0) {
+        return 0;
+    }
+    if (header_value(resp_header, hdr_end, "Content-Range", value, sizeof(value)) >= 0) return 0;
+    if (header_value(resp_header, hdr_end, "Content-Type", value, sizeof(value)) < 0 ||
+        !cache_content_type_compressible(value)) {
+        return 0;
+    }
+
+    int level = current_level();
+    if (level <= 0) return 0;
+    if (deflateInit2(&c->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+
+    c->active = 1;
+    c->is_chunked = is_chunked;
+    if (is_chunked) cache_dechunk_init(&c->dechunk, 0);
+    c->client_fd = client_fd;
+    c->ssl = ssl;
+    return 1;
+}
+
+// Whether a Vary value already covers Accept-Encoding ("*" covers everything)
+static int vary_covers_encoding(const char *v, const char *eol) {
+    while (v < eol) {
+        while (v < eol && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char *tok = v;
+        while (v < eol && *v != ',') v++;
+        const char *tok_end = v;
+        while (tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\t')) tok_end--;
+        size_t n = (size_t)(tok_end - tok);
+        if ((n == 1 && *tok == '*') || (n == 15 && _strnicmp(tok, "Accept-Encoding", 15) == 0)) return 1;
+    }
+    return 0;
+}
+
+int http_compress_rewrite_header(const char *in, int in_len, char *out, int out_size) {
+    if (!in || !out || in_len < 4) return -1;
+
+    const char *end = in + in_len - 2;   // start of the blank line
+    int len = 0;
+    int vary_done = 0;
+    for (const char *line = in, *next; line < end; line = next) {
+        const char *eol = strstr(line, "\r\n");
+        if (!eol || eol > end) eol = end;
+        int n = (int)(eol - line) + 2;
+        next = eol + 2;
+
+        // The gzip body is a different representation: no byte ranges into it,
+        // no strong validator shared with the identity body
+        if (_strnicmp(line, "Content-Length:", 15) == 0 ||
+            _strnicmp(line, "Transfer-Encoding:", 18) == 0 ||
+            _strnicmp(line, "Content-Encoding:", 17) == 0 ||
+            _strnicmp(line, "Accept-Ranges:", 14) == 0) {
+            continue;
+        }
+        if (_strnicmp(line, "ETag:", 5) == 0) {
+            const char *v = line + 5;
+            while (v < eol && (*v == ' ' || *v == '\t')) v++;
+            if (strncmp(v, "W/", 2) != 0) {
+                int w = snprintf(out + len, out_size - len, "ETag: W/%.*s\r\n", (int)(eol - v), v);
+                if (w <= 0 || w >= out_size - len) return -1;
+                len += w;
+                continue;
+            }
+        }
+        if (_strnicmp(line, "Vary:", 5) == 0 && !vary_done) {
+            vary_done = 1;
+            if (!vary_covers_encoding(line + 5, eol)) {
+                int w = snprintf(out + len, out_size - len, "%.*s, Accept-Encoding\r\n",
+                                 (int)(eol - line), line);
+                if (w <= 0 || w >= out_size - len) return -1;
+                len += w;
+                continue;
+            }
+        }
+
+        if (len + n >= out_size) return -1;
+        memcpy(out + len, line, n);
+        len += n;
+    }
+
+    int n = snprintf(out + len, out_size - len,
+                     "Content-Encoding: gzip\r\n"
+                     "%s"
+                     "\r\n",
+                     vary_done ? "" : "Vary: Accept-Encoding\r\n");
+    if (n <= 0 || n >= out_size - len) return -1;
+    return len + n;
+}
+
+static int send_out(http_compress_t *c, const uint8_t *data, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int n = c->ssl ? SSL_write((SSL *)c->ssl, data + sent, len - sent)
+                       : send((SOCKET)(uintptr_t)c->client_fd, (const char *)data + sent, len - sent, 0);
+        if (n <= 0) return -1;
+        sent += n;
+    }
+    c->bytes_out += (uint64_t)len;
+    return 0;
+}
+
+static int deflate_send(http_compress_t *c, int flush) {
+    uint8_t buf[CACHE_SEGMENT_BYTES];
+    int rc;
+    do {
+        c->zs.next_out = buf;
+        c->zs.avail_out = sizeof(buf);
+        rc = deflate(&c->zs, flush);
+        if (rc == Z_STREAM_ERROR) return -1;
+        int produced = (int)(sizeof(buf) - c->zs.avail_out);
+        if (produced > 0 && send_out(c, buf, produced) != 0) return -1;
+    } while (c->zs.avail_out == 0);
+    return flush == Z_FINISH && rc != Z_STREAM_END ? -1 : 0;
+}
+
+static int compress_sink(void *ctx, const uint8_t *data, size_t len) {
+    http_compress_t *c = (http_compress_t *)ctx;
+    c->zs.next_in = (Bytef *)data;
+    c->zs.avail_in = (uInt)len;
+    c->bytes_in += len;
+    return deflate_send(c, Z_NO_FLUSH);
+}
+
+int http_compress_write(http_compress_t *c, const uint8_t *data, size_t len) {
+    if (!c || !c->active || !data) return -1;
+
+    int rc = 0;
+    if (c->is_chunked) {
+        rc = cache_dechunk(&c->dechunk, data, len, compress_sink, c);
+        if (rc < 0) return -1;
+    } else if (compress_sink(c, data, len) != 0) {
+        return -1;
+    }
+
+    // Streamed responses (APIs, SSE) must not sit in the compressor
+    if (deflate_send(c, Z_SYNC_FLUSH) != 0) return -1;
+    return rc;
+}
+
+int http_compress_finish(http_compress_t *c) {
+    if (!c || !c->active) return -1;
+    c->zs.next_in = NULL;
+    c->zs.avail_in = 0;
+    int rc = deflate_send(c, Z_FINISH);
+
+    InterlockedIncrement64(&g_responses);
+    InterlockedExchangeAdd64(&g_bytes_in, (LONG64)c->bytes_in);
+    InterlockedExchangeAdd64(&g_bytes_out, (LONG64)c->bytes_out);
+    return rc;
+}
+
+void http_compress_free(http_compress_t *c) {
+    if (!c || !c->active) return;
+    deflateEnd(&c->zs);
+    c->active = 0;
+}
+
+void http_compress_get_metrics(uint64_t *responses, uint64_t *bytes_in, uint64_t *bytes_out) {
+    if (responses) *responses = (uint64_t)g_responses;
+    if (bytes_in) *bytes_in = (uint64_t)g_bytes_in;
+    if (bytes_out) *bytes_out = (uint64_t)g_bytes_out;
+}
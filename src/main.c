@@ -12,6 +12,12 @@
 #include "../include/filter_request_guard.h"
 #include "../include/captcha_filter.h"
 #include "../include/cache.h"
+#include "../include/cache_disk.h"
+#include "../include/cache_memory.h"
+#include "../include/cache_prefetch.h"
+#include "../include/cache_snapshot.h"
+#include "../include/cache_warm.h"
+#include "../include/proxy.h"
 #include "../include/request_metrics.h"
 #include "../include/metrics_flush.h"
 #include "../include/dbhelper.h"
@@ -106,6 +112,38 @@ int main(){
             log_message("ERROR", "Cache initialization failed");
         } else {
             log_message("INFO", "Cache initialized successfully");
+
+            cache_status_rule_t rules[MAX_CACHE_STATUS_RULES];
+            for (unsigned int i = 0; i < cfg->cache_status_count; i++) {
+                rules[i].status_code = cfg->cache_status_code[i];
+                rules[i].ttl_sec = cfg->cache_status_ttl_sec[i];
+                rules[i].max_bytes = cfg->cache_status_max_bytes[i];
+            }
+            cache_set_status_rules(rules, cfg->cache_status_count);
+        }
+
+        if (cfg->cache_disk_enabled) {
+            if (cache_disk_init(cfg->cache_disk_dir, cfg->cache_disk_max_bytes,
+                                cfg->cache_disk_max_object_bytes) != 0) {
+                fprintf(stderr, "Failed to initialize disk cache tier\n");
+                log_message("ERROR", "Disk cache tier initialization failed");
+            }
+        }
+
+        if (cfg->cache_prefetch_enabled) {
+            cache_prefetch_configure(cfg->cache_prefetch_max_inflight, cfg->cache_prefetch_per_sec);
+        }
+        cache_warm_configure(cfg->cache_warm_per_sec, cfg->cache_warm_per_origin, proxy_build_fetch_req);
+        cache_admin_configure(cfg->cache_admin_trust_loopback);
+
+        // Refill RAM from the last snapshot before any listener opens
+        if (cfg->cache_snapshot_enabled) {
+            cache_snapshot_load(cfg->cache_snapshot_path);
+        }
+
+        if (cfg->cache_memory_governor_enabled) {
+            cache_memory_start(cfg->cache_memory_limit_bytes, cfg->cache_memory_target_pct,
+                               cfg->cache_min_bytes);
         }
     }
 
@@ -123,10 +161,17 @@ int main(){
     
     load_proxy_routes();
     initThreadPool(&pool,MAX_THREADS);
+    if (cfg->cache_enabled) cache_fetch_start();
+    if (cfg->cache_enabled && cfg->cache_snapshot_enabled) {
+        cache_snapshot_start(cfg->cache_snapshot_path, cfg->cache_snapshot_interval_sec,
+                             cfg->cache_snapshot_max_bytes ? cfg->cache_snapshot_max_bytes : cfg->cache_max_bytes);
+    }
     // Thread reload ACL mỗi ... sec
     _beginthread(acl_reloader_thread, 0, NULL);
     _beginthreadex(NULL, 0, https_thread, NULL, 0, NULL);
     start_server();
+    cache_warm_stop();
+    cache_fetch_stop();
     shutdownThreadPool(&pool);
 
     // Stop metrics flush thread
@@ -137,6 +182,9 @@ int main(){
     
     // Shutdown cache
     if (cfg->cache_enabled) {
+        cache_memory_stop();
+        cache_snapshot_stop();
+        cache_disk_shutdown();
         cache_shutdown();
     }
 
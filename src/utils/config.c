@@ -35,6 +35,36 @@ static void set_default_config(Proxy_Config *config) {
     config->cache_default_ttl_sec = 120;     // 2 minutes
     config->cache_max_object_bytes = 131072; // 128KB
     config->cache_second_hit_window = 10;    // 10 seconds
+
+    // Disk tier defaults (off unless configured)
+    config->cache_disk_enabled = 0;
+    snprintf(config->cache_disk_dir, sizeof(config->cache_disk_dir), "cache_disk");
+    config->cache_disk_max_bytes = 4294967296ULL;       // 4GB
+    config->cache_disk_max_object_bytes = 33554432;     // 32MB
+
+    config->cache_stale_while_revalidate_sec = 30;
+    config->cache_stale_if_error_sec = 300;
+
+    config->cache_min_ttl_sec = 0;
+    config->cache_max_ttl_sec = 86400;       // 1 day
+
+    config->cache_snapshot_enabled = 0;
+    snprintf(config->cache_snapshot_path, sizeof(config->cache_snapshot_path), "cache_snapshot.bin");
+    config->cache_snapshot_interval_sec = 300;
+    config->cache_snapshot_max_bytes = 0;
+
+    config->cache_prefetch_enabled = 0;
+    config->cache_prefetch_max_inflight = 4;
+    config->cache_prefetch_per_sec = 20;
+    config->cache_warm_per_sec = 10;
+    config->cache_warm_per_origin = 2;
+    config->cache_memory_governor_enabled = 0;
+    config->cache_memory_limit_bytes = 0;
+    config->cache_memory_target_pct = 85;
+    config->cache_min_bytes = 0;
+
+    config->cache_purge_token[0] = '\0';
+    config->cache_admin_trust_loopback = 0;
 }
 
 static int parse_line(const char *line) {
@@ -65,6 +95,39 @@ static int parse_line(const char *line) {
     if (sscanf(line, "cache_default_ttl_sec = %u", &global_config.cache_default_ttl_sec) == 1) return 0;
     if (sscanf(line, "cache_max_object_bytes = %u", &global_config.cache_max_object_bytes) == 1) return 0;
     if (sscanf(line, "cache_second_hit_window = %u", &global_config.cache_second_hit_window) == 1) return 0;
+    if (sscanf(line, "cache_disk_enabled = %d", &global_config.cache_disk_enabled) == 1) return 0;
+    if (sscanf(line, "cache_disk_dir = %259s", global_config.cache_disk_dir) == 1) return 0;
+    if (sscanf(line, "cache_disk_max_bytes = %llu", &global_config.cache_disk_max_bytes) == 1) return 0;
+    if (sscanf(line, "cache_disk_max_object_bytes = %u", &global_config.cache_disk_max_object_bytes) == 1) return 0;
+    if (sscanf(line, "cache_stale_while_revalidate_sec = %u", &global_config.cache_stale_while_revalidate_sec) == 1) return 0;
+    if (sscanf(line, "cache_stale_if_error_sec = %u", &global_config.cache_stale_if_error_sec) == 1) return 0;
+    if (sscanf(line, "cache_min_ttl_sec = %u", &global_config.cache_min_ttl_sec) == 1) return 0;
+    if (sscanf(line, "cache_max_ttl_sec = %u", &global_config.cache_max_ttl_sec) == 1) return 0;
+    if (strncmp(line, "cache_status =", 14) == 0) {
+        unsigned int n = global_config.cache_status_count;
+        if (n == MAX_CACHE_STATUS_RULES) return -1;
+        if (sscanf(line, "cache_status = %u %u %llu", &global_config.cache_status_code[n],
+                   &global_config.cache_status_ttl_sec[n], &global_config.cache_status_max_bytes[n]) != 3) {
+            return -1;
+        }
+        global_config.cache_status_count = n + 1;
+        return 0;
+    }
+    if (sscanf(line, "cache_snapshot_enabled = %d", &global_config.cache_snapshot_enabled) == 1) return 0;
+    if (sscanf(line, "cache_snapshot_path = %259s", global_config.cache_snapshot_path) == 1) return 0;
+    if (sscanf(line, "cache_snapshot_interval_sec = %u", &global_config.cache_snapshot_interval_sec) == 1) return 0;
+    if (sscanf(line, "cache_snapshot_max_bytes = %llu", &global_config.cache_snapshot_max_bytes) == 1) return 0;
+    if (sscanf(line, "cache_prefetch_enabled = %d", &global_config.cache_prefetch_enabled) == 1) return 0;
+    if (sscanf(line, "cache_prefetch_max_inflight = %u", &global_config.cache_prefetch_max_inflight) == 1) return 0;
+    if (sscanf(line, "cache_prefetch_per_sec = %u", &global_config.cache_prefetch_per_sec) == 1) return 0;
+    if (sscanf(line, "cache_warm_per_sec = %u", &global_config.cache_warm_per_sec) == 1) return 0;
+    if (sscanf(line, "cache_warm_per_origin = %u", &global_config.cache_warm_per_origin) == 1) return 0;
+    if (sscanf(line, "cache_memory_governor_enabled = %d", &global_config.cache_memory_governor_enabled) == 1) return 0;
+    if (sscanf(line, "cache_memory_limit_bytes = %llu", &global_config.cache_memory_limit_bytes) == 1) return 0;
+    if (sscanf(line, "cache_memory_target_pct = %u", &global_config.cache_memory_target_pct) == 1) return 0;
+    if (sscanf(line, "cache_min_bytes = %llu", &global_config.cache_min_bytes) == 1) return 0;
+    if (sscanf(line, "cache_purge_token = \"%127[^\"]\"", global_config.cache_purge_token) == 1) return 0;
+    if (sscanf(line, "cache_admin_trust_loopback = %d", &global_config.cache_admin_trust_loopback) == 1) return 0;
 
     return -1;
 }
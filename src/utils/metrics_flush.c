@@ -1,6 +1,10 @@
 #include "../include/metrics_flush.h"
 #include "../include/request_metrics.h"
 #include "../include/cache.h"
+#include "../include/cache_encoding.h"
+#include "../include/cache_memory.h"
+#include "../include/cache_prefetch.h"
+#include "../include/http_compress.h"
 #include "../include/dao_metrics.h"
 #include "../include/dbhelper.h"
 #include "../include/db_config.h"
@@ -177,6 +181,7 @@ static int flush_metrics_to_db(time_t minute_timestamp) {
                     (unsigned long long)domain_id);
             log_message("ERROR", err_buf);
         }
+        uint64_t tenant_hits = 0, tenant_misses = 0, tenant_byte_hit = 0, tenant_byte_miss = 0;
         if (domain_counters) {
             request_counter_t *counter = domain_counters;
             while (counter) {
@@ -195,6 +200,10 @@ static int flush_metrics_to_db(time_t minute_timestamp) {
                 } else {
                     route_byte_miss = counter->bytes_out;
                 }
+                tenant_hits += route_hits;
+                tenant_misses += route_misses;
+                tenant_byte_hit += route_byte_hit;
+                tenant_byte_miss += route_byte_miss;
                 if (route_hits > 0 || route_misses > 0) {
                     if (dao_metrics_insert_route_cache(
                             flush_timestamp,
@@ -215,6 +224,27 @@ static int flush_metrics_to_db(time_t minute_timestamp) {
                 counter = counter->next;
             }
         }
+        // Per-tenant hit ratio and RAM occupancy, for domains with a cache partition
+        cache_tenant_stats_t tenant;
+        if (cache_tenant_take_stats(host, &tenant) == 0) {
+            if (dao_metrics_insert_tenant_cache(
+                    flush_timestamp,
+                    domain_id,
+                    host,
+                    tenant_hits,
+                    tenant_misses,
+                    tenant_byte_hit,
+                    tenant_byte_miss,
+                    tenant.bytes_used,
+                    tenant.entries,
+                    tenant.quota_bytes ? tenant.quota_bytes : tenant.share_bytes,
+                    tenant.evictions) == 0) {
+                success_count++;
+            } else {
+                error_count++;
+                log_message("WARN", "metrics_flush: failed to insert tenant cache metrics");
+            }
+        }
         if (domain_counters) {
             if (dao_metrics_insert_request_metrics_batch(domain_counters, flush_timestamp, domain_id, host) == 0) {
                 success_count++;
@@ -250,6 +280,57 @@ static int flush_metrics_to_db(time_t minute_timestamp) {
     (void)cache_bytes_used;
     (void)cached_bytes;
     (void)missed_bytes;
+
+    // Egress saved by gzip: cached variants and on-the-fly compression
+    uint64_t gz_variants = 0, gz_hits = 0, gz_hit_saved = 0;
+    cache_encoding_get_metrics(&gz_variants, &gz_hits, &gz_hit_saved);
+    uint64_t gz_responses = 0, gz_in = 0, gz_out = 0;
+    http_compress_get_metrics(&gz_responses, &gz_in, &gz_out);
+    if (gz_hits > 0 || gz_responses > 0) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "metrics_flush: gzip cache variants=%llu hits=%llu saved=%llu; streamed responses=%llu saved=%llu",
+                 (unsigned long long)gz_variants, (unsigned long long)gz_hits,
+                 (unsigned long long)gz_hit_saved, (unsigned long long)gz_responses,
+                 (unsigned long long)(gz_in > gz_out ? gz_in - gz_out : 0));
+        log_message("INFO", log_buf);
+    }
+
+    // RAM saved by storing identical bodies once across keys
+    uint64_t dedup_contents = 0, dedup_unique = 0, dedup_hits = 0, dedup_saved = 0;
+    cache_content_get_metrics(&dedup_contents, &dedup_unique, &dedup_hits, &dedup_saved);
+    if (dedup_hits > 0) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "metrics_flush: cache dedup distinct bodies=%llu bytes=%llu duplicate stores=%llu saved=%llu",
+                 (unsigned long long)dedup_contents, (unsigned long long)dedup_unique,
+                 (unsigned long long)dedup_hits, (unsigned long long)dedup_saved);
+        log_message("INFO", log_buf);
+    }
+
+    // Sub-resources warmed ahead of the browser asking for them
+    uint64_t prefetch_queued = 0, prefetch_stored = 0, prefetch_dropped = 0;
+    cache_prefetch_get_metrics(&prefetch_queued, &prefetch_stored, &prefetch_dropped);
+    if (prefetch_queued > 0 || prefetch_dropped > 0) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf), "metrics_flush: cache prefetch queued=%llu stored=%llu dropped=%llu",
+                 (unsigned long long)prefetch_queued, (unsigned long long)prefetch_stored,
+                 (unsigned long long)prefetch_dropped);
+        log_message("INFO", log_buf);
+    }
+
+    // RAM budget while the memory governor holds it below cache_max_bytes
+    uint64_t mem_budget = 0, mem_ceiling = 0, mem_commit = 0, mem_limit = 0, mem_shrinks = 0;
+    cache_memory_get_metrics(&mem_budget, &mem_ceiling, &mem_commit, &mem_limit, &mem_shrinks);
+    if (mem_ceiling > 0 && mem_budget < mem_ceiling) {
+        char log_buf[256];
+        snprintf(log_buf, sizeof(log_buf),
+                 "metrics_flush: cache memory budget=%llu/%llu commit=%llu limit=%llu shrinks=%llu",
+                 (unsigned long long)mem_budget, (unsigned long long)mem_ceiling,
+                 (unsigned long long)mem_commit, (unsigned long long)mem_limit,
+                 (unsigned long long)mem_shrinks);
+        log_message("INFO", log_buf);
+    }
     if (error_count > 0) {
         char log_buf[128];
         snprintf(log_buf, sizeof(log_buf), "metrics_flush: %d success, %d errors", success_count, error_count);
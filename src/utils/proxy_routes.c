@@ -1,48 +1,169 @@
 #include "../include/proxy_routes.h"
 #include "../include/logger.h"
 #include "../include/dao_routes.h"
+#include "../include/cache.h"
 #include <windows.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef MAX_PROXY_ROUTES
 #define MAX_PROXY_ROUTES 4096
 #endif
 
+#ifndef MAX_CACHE_POLICIES
+#define MAX_CACHE_POLICIES 4096
+#endif
+
+// Open addressing, kept under half full
+#define ROUTE_HASH_SLOTS (MAX_PROXY_ROUTES * 2)
+#define POLICY_HASH_SLOTS (MAX_CACHE_POLICIES * 2)
+#define POLICY_MAX_DEPTH 16
+
 static ProxyRoute records[MAX_PROXY_ROUTES];
 static int record_count = 0;
+static int route_slots[ROUTE_HASH_SLOTS];      // index into records, -1 empty
+
+static CachePolicy policies[MAX_CACHE_POLICIES];
+static int policy_count = 0;
+static int policy_slots[POLICY_HASH_SLOTS];    // index into policies, -1 empty
+
 static CRITICAL_SECTION records_lock;
 static int records_inited = 0;
 
 static void ensure_init() {
     if (!records_inited) {
         InitializeCriticalSection(&records_lock);
+        memset(route_slots, 0xff, sizeof(route_slots));
+        memset(policy_slots, 0xff, sizeof(policy_slots));
         records_inited = 1;
     }
 }
 
+// FNV-1a of the lowercased domain; policy keys continue it over the prefix
+static uint64_t domain_hash(const char *domain) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = domain; *p; p++) {
+        char c = *p;
+        if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        h ^= (uint8_t)c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_more(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void build_route_slots(const ProxyRoute *recs, int n, int *slots) {
+    memset(slots, 0xff, sizeof(int) * ROUTE_HASH_SLOTS);
+    for (int i = 0; i < n; i++) {
+        uint32_t s = (uint32_t)domain_hash(recs[i].domain) & (ROUTE_HASH_SLOTS - 1);
+        while (slots[s] >= 0) {
+            // Several origins per domain: the first row wins, as before
+            if (_stricmp(recs[slots[s]].domain, recs[i].domain) == 0) break;
+            s = (s + 1) & (ROUTE_HASH_SLOTS - 1);
+        }
+        if (slots[s] < 0) slots[s] = i;
+    }
+}
+
+static void build_policy_slots(const CachePolicy *pols, int n, int *slots) {
+    memset(slots, 0xff, sizeof(int) * POLICY_HASH_SLOTS);
+    for (int i = 0; i < n; i++) {
+        uint64_t h = hash_more(domain_hash(pols[i].domain), pols[i].path_prefix, (size_t)pols[i].prefix_len);
+        uint32_t s = (uint32_t)h & (POLICY_HASH_SLOTS - 1);
+        while (slots[s] >= 0) {
+            const CachePolicy *o = &pols[slots[s]];
+            if (o->prefix_len == pols[i].prefix_len && _stricmp(o->domain, pols[i].domain) == 0 &&
+                memcmp(o->path_prefix, pols[i].path_prefix, (size_t)o->prefix_len) == 0) {
+                break;
+            }
+            s = (s + 1) & (POLICY_HASH_SLOTS - 1);
+        }
+        if (slots[s] < 0) slots[s] = i;
+    }
+}
+
+static int find_route_slot(const ProxyRoute *recs, const int *slots, const char *domain) {
+    uint32_t s = (uint32_t)domain_hash(domain) & (ROUTE_HASH_SLOTS - 1);
+    while (slots[s] >= 0) {
+        if (_stricmp(recs[slots[s]].domain, domain) == 0) return slots[s];
+        s = (s + 1) & (ROUTE_HASH_SLOTS - 1);
+    }
+    return -1;
+}
+
 int load_proxy_routes() {
     ensure_init();
 
     ProxyRoute *tmp = (ProxyRoute*)malloc(sizeof(ProxyRoute) * MAX_PROXY_ROUTES);
-    if (!tmp) {
+    CachePolicy *tmp_pol = (CachePolicy*)malloc(sizeof(CachePolicy) * MAX_CACHE_POLICIES);
+    int *tmp_route_slots = (int*)malloc(sizeof(int) * ROUTE_HASH_SLOTS);
+    int *tmp_policy_slots = (int*)malloc(sizeof(int) * POLICY_HASH_SLOTS);
+    if (!tmp || !tmp_pol || !tmp_route_slots || !tmp_policy_slots) {
         log_message("ERROR", "[routes] malloc failed");
+        free(tmp);
+        free(tmp_pol);
+        free(tmp_route_slots);
+        free(tmp_policy_slots);
         return 0;
     }
 
     int n = dao_routes_load_all_into(tmp, MAX_PROXY_ROUTES);
-    if (n < 0) n = 0;
+    int np = n < 0 ? -1 : dao_cache_policies_load_all_into(tmp_pol, MAX_CACHE_POLICIES);
+    if (n < 0 || np < 0) {
+        // An empty table would stop all routing: keep serving the last good one
+        log_message("ERROR", "[routes] route or cache policy query failed, keeping the previous routes");
+        free(tmp);
+        free(tmp_pol);
+        free(tmp_route_slots);
+        free(tmp_policy_slots);
+        EnterCriticalSection(&records_lock);
+        n = record_count;
+        LeaveCriticalSection(&records_lock);
+        return n;
+    }
     if (n > MAX_PROXY_ROUTES) n = MAX_PROXY_ROUTES;
+    if (np > MAX_CACHE_POLICIES) np = MAX_CACHE_POLICIES;
+
+    // Hash tables are built off the lock; only the copy is done under it
+    build_route_slots(tmp, n, tmp_route_slots);
+    build_policy_slots(tmp_pol, np, tmp_policy_slots);
+    for (int i = 0; i < np; i++) {
+        int r = find_route_slot(tmp, tmp_route_slots, tmp_pol[i].domain);
+        if (r >= 0) tmp[r].policy_count++;
+    }
 
     EnterCriticalSection(&records_lock);
     memcpy(records, tmp, (size_t)n * sizeof(ProxyRoute));
     record_count = n;
+    memcpy(route_slots, tmp_route_slots, sizeof(route_slots));
+    memcpy(policies, tmp_pol, (size_t)np * sizeof(CachePolicy));
+    policy_count = np;
+    memcpy(policy_slots, tmp_policy_slots, sizeof(policy_slots));
     LeaveCriticalSection(&records_lock);
 
+    // Each domain is a cache tenant; several origin rows configure it alike
+    for (int i = 0; i < n; i++) {
+        cache_tenant_configure(tmp[i].domain, tmp[i].cache_quota_bytes,
+                               tmp[i].cache_weight > 0 ? (uint32_t)tmp[i].cache_weight : 0);
+    }
+
     free(tmp);
+    free(tmp_pol);
+    free(tmp_route_slots);
+    free(tmp_policy_slots);
 
-    char buf[96];
-    snprintf(buf, sizeof(buf), "[routes] loaded %d row(s) from DAO", n);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "[routes] loaded %d row(s), %d cache polic%s from DAO",
+             n, np, np == 1 ? "y" : "ies");
     log_message("INFO", buf);
     return n;
 }
@@ -53,13 +174,53 @@ const ProxyRoute* find_proxy_routes(const char *domain) {
     ensure_init();
 
     EnterCriticalSection(&records_lock);
-    for (int i = 0; i < record_count; ++i) {
-        if (_stricmp(records[i].domain, domain) == 0) {
-            const ProxyRoute *res = &records[i];
-            LeaveCriticalSection(&records_lock);
-            return res;
+    int i = find_route_slot(records, route_slots, domain);
+    const ProxyRoute *res = i >= 0 ? &records[i] : NULL;
+    LeaveCriticalSection(&records_lock);
+    return res;
+}
+
+const CachePolicy* find_cache_policy(const ProxyRoute *route, const char *path) {
+    if (!route || route->policy_count == 0 || !path || path[0] != '/') return NULL;
+    ensure_init();
+
+    // Hash of every "/"-terminated prefix in one pass, then probe longest first
+    uint64_t hashes[POLICY_MAX_DEPTH + 1];
+    int lens[POLICY_MAX_DEPTH + 1];
+    int depth = 0;
+    uint64_t h = domain_hash(route->domain);
+    const char *p = path;
+    for (; *p && *p != '?'; p++) {
+        h = hash_more(h, p, 1);
+        if (*p == '/') {
+            if (depth == POLICY_MAX_DEPTH) break;
+            hashes[depth] = h;
+            lens[depth++] = (int)(p - path) + 1;
+        }
+    }
+    // Prefixes are stored with a trailing '/': "/media" is the "/media/" policy's too
+    int bare = -1;
+    if ((!*p || *p == '?') && p[-1] != '/') {
+        bare = depth;
+        hashes[depth] = hash_more(h, "/", 1);
+        lens[depth++] = (int)(p - path) + 1;
+    }
+
+    const CachePolicy *res = NULL;
+    EnterCriticalSection(&records_lock);
+    for (int d = depth - 1; d >= 0 && !res; d--) {
+        uint32_t s = (uint32_t)hashes[d] & (POLICY_HASH_SLOTS - 1);
+        size_t cmp_len = (size_t)(d == bare ? lens[d] - 1 : lens[d]);
+        while (policy_slots[s] >= 0) {
+            const CachePolicy *pol = &policies[policy_slots[s]];
+            if (pol->prefix_len == lens[d] && memcmp(pol->path_prefix, path, cmp_len) == 0 &&
+                _stricmp(pol->domain, route->domain) == 0) {
+                res = pol;
+                break;
+            }
+            s = (s + 1) & (POLICY_HASH_SLOTS - 1);
         }
     }
     LeaveCriticalSection(&records_lock);
-    return NULL;
+    return res;
 }
@@ -0,0 +1,127 @@
+#include <windows.h>
+#include "../include/cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lookup cost of one shard's entry index as the cache grows from 1k to 10M
+// entries (spread over CACHE_NUM_SHARDS shards): the previous fixed 256-bucket
+// chained table against the open-addressing cache_index.
+//
+//   make bench && build\bench_cache_index.exe [lookups]
+
+#define LEGACY_BUCKETS 256
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_rand(void) {
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static cache_entry_t *legacy_find(cache_entry_t **buckets, uint64_t key_hash, const char *fp) {
+    for (cache_entry_t *e = buckets[key_hash % LEGACY_BUCKETS]; e; e = e->hnext) {
+        if (e->key_hash == key_hash && memcmp(e->key_fingerprint, fp, 16) == 0) return e;
+    }
+    return NULL;
+}
+
+static double elapsed_ns(LARGE_INTEGER start, LARGE_INTEGER end, LARGE_INTEGER freq) {
+    return (double)(end.QuadPart - start.QuadPart) * 1e9 / (double)freq.QuadPart;
+}
+
+// Inserts, removes and re-inserts through several resizes, checking every key
+static int verify(void) {
+    const uint32_t n = 50000;
+    cache_entry_t *entries = (cache_entry_t *)calloc(n, sizeof(cache_entry_t));
+    cache_index_t idx;
+    if (!entries || cache_index_init(&idx, CACHE_INDEX_INITIAL_SLOTS) != 0) return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        entries[i].key_hash = next_rand() & ~(uint64_t)(CACHE_NUM_SHARDS - 1);
+        memcpy(entries[i].key_fingerprint, &entries[i].key_hash, 8);
+        memcpy(entries[i].key_fingerprint + 8, &i, 4);
+        if (cache_index_insert(&idx, &entries[i]) != 0) return -1;
+        if (i % 3 == 0) cache_index_remove(&idx, &entries[i / 2]);
+        if (i % 3 == 0 && cache_index_insert(&idx, &entries[i / 2]) != 0) return -1;
+    }
+    for (uint32_t i = 0; i < n; i += 2) cache_index_remove(&idx, &entries[i]);
+    for (uint32_t i = 0; i < n; i++) {
+        cache_entry_t *e = cache_index_find(&idx, entries[i].key_hash, entries[i].key_fingerprint);
+        if (e != (i % 2 ? &entries[i] : NULL)) return -1;
+    }
+    int rc = cache_index_count(&idx) == n / 2 ? 0 : -1;
+    cache_index_free(&idx);
+    free(entries);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    long lookups = argc > 1 ? atol(argv[1]) : 2000000;
+    if (lookups <= 0) lookups = 2000000;
+
+    if (verify() != 0) {
+        fprintf(stderr, "index verification failed\n");
+        return 1;
+    }
+
+    static const uint32_t totals[] = {1000, 10000, 100000, 1000000, 10000000};
+    LARGE_INTEGER freq, t0, t1, t2;
+    QueryPerformanceFrequency(&freq);
+    volatile uintptr_t sink = 0;
+
+    printf("lookups per shard over %ld hits (%d shards)\n", lookups, CACHE_NUM_SHARDS);
+    printf("  %10s %10s %14s %14s\n", "entries", "per shard", "chained 256", "index");
+    for (size_t t = 0; t < sizeof(totals) / sizeof(totals[0]); t++) {
+        uint32_t n = totals[t] / CACHE_NUM_SHARDS;
+        if (n == 0) n = 1;
+        cache_entry_t *entries = (cache_entry_t *)calloc(n, sizeof(cache_entry_t));
+        uint32_t *order = (uint32_t *)malloc((size_t)n * sizeof(uint32_t));
+        cache_entry_t **buckets = (cache_entry_t **)calloc(LEGACY_BUCKETS, sizeof(cache_entry_t *));
+        cache_index_t idx;
+        if (!entries || !order || !buckets || cache_index_init(&idx, CACHE_INDEX_INITIAL_SLOTS) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            // One shard: the low bits that pick it are the same for every key
+            entries[i].key_hash = next_rand() & ~(uint64_t)(CACHE_NUM_SHARDS - 1);
+            memcpy(entries[i].key_fingerprint, &entries[i].key_hash, 8);
+            memcpy(entries[i].key_fingerprint + 8, &i, 4);
+            uint32_t b = (uint32_t)(entries[i].key_hash % LEGACY_BUCKETS);
+            entries[i].hnext = buckets[b];
+            buckets[b] = &entries[i];
+            cache_index_insert(&idx, &entries[i]);
+            order[i] = (uint32_t)(next_rand() % n);
+        }
+
+        // Long chains make the old table so slow that it gets fewer lookups
+        long legacy_lookups = lookups / (1 + n / LEGACY_BUCKETS / 8);
+        if (legacy_lookups < 1000) legacy_lookups = 1000;
+        QueryPerformanceCounter(&t0);
+        for (long k = 0; k < legacy_lookups; k++) {
+            const cache_entry_t *q = &entries[order[k % n]];
+            sink += (uintptr_t)legacy_find(buckets, q->key_hash, q->key_fingerprint);
+        }
+        QueryPerformanceCounter(&t1);
+        for (long k = 0; k < lookups; k++) {
+            const cache_entry_t *q = &entries[order[k % n]];
+            sink += (uintptr_t)cache_index_find(&idx, q->key_hash, q->key_fingerprint);
+        }
+        QueryPerformanceCounter(&t2);
+
+        printf("  %10u %10u %11.1f ns %11.1f ns\n", totals[t], n,
+               elapsed_ns(t0, t1, freq) / (double)legacy_lookups, elapsed_ns(t1, t2, freq) / (double)lookups);
+
+        cache_index_free(&idx);
+        free(buckets);
+        free(order);
+        free(entries);
+    }
+    return sink == 1;
+}
@@ -0,0 +1,162 @@
+#include <windows.h>
+#include "../include/cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Per-request cost of cache key hashing: the previous scheme (snprintf into a
+// 2 KB buffer, malloc + strtok_s + qsort query normalisation, two FNV passes,
+// done twice per miss) against one cache_key_compute() per request.
+//
+//   make bench && build\bench_cache_key.exe [iterations]
+
+typedef struct {
+    const char *host;
+    const char *path;
+    const char *query;
+} sample_t;
+
+static const sample_t samples[] = {
+    {"www.example.com", "/", NULL},
+    {"www.example.com", "/static/js/app.3f9a1c.js", NULL},
+    {"api.example.com", "/v1/products", "page=2&sort=price&category=shoes&limit=50"},
+    {"shop.example.com", "/search", "q=running+shoes&utm_source=newsletter&utm_medium=email&utm_campaign=spring&size=42&color=blue"},
+    {"cdn.example.com", "/images/products/2024/08/hero-banner-large@2x.webp", "w=1200&h=630&fit=crop&auto=format"},
+};
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+// ---- previous implementation, kept here as the baseline ----
+
+typedef struct {
+    char *key;
+    char *value;
+    size_t key_len;
+    size_t value_len;
+} legacy_param_t;
+
+static int legacy_compare(const void *a, const void *b) {
+    const legacy_param_t *pa = (const legacy_param_t *)a;
+    const legacy_param_t *pb = (const legacy_param_t *)b;
+    size_t min_len = pa->key_len < pb->key_len ? pa->key_len : pb->key_len;
+    int cmp = memcmp(pa->key, pb->key, min_len);
+    if (cmp != 0) return cmp;
+    return (int)(pa->key_len - pb->key_len);
+}
+
+static void legacy_normalize_query(const char *query, char *out, size_t out_size) {
+    size_t query_len = strlen(query);
+    legacy_param_t params[64];
+    int count = 0;
+    char *copy = (char *)malloc(query_len + 1);
+    if (!copy) {
+        out[0] = '\0';
+        return;
+    }
+    memcpy(copy, query, query_len + 1);
+
+    char *saveptr = NULL;
+    for (char *p = strtok_s(copy, "&", &saveptr); p && count < 64; p = strtok_s(NULL, "&", &saveptr)) {
+        char *eq = strchr(p, '=');
+        if (eq) *eq = '\0';
+        params[count].key = p;
+        params[count].key_len = strlen(p);
+        params[count].value = eq ? eq + 1 : NULL;
+        params[count].value_len = eq ? strlen(eq + 1) : 0;
+        count++;
+    }
+    if (count > 1) qsort(params, count, sizeof(legacy_param_t), legacy_compare);
+
+    size_t pos = 0;
+    for (int i = 0; i < count && pos + params[i].key_len + params[i].value_len + 2 < out_size; i++) {
+        if (i > 0) out[pos++] = '&';
+        memcpy(out + pos, params[i].key, params[i].key_len);
+        pos += params[i].key_len;
+        if (params[i].value_len) {
+            out[pos++] = '=';
+            memcpy(out + pos, params[i].value, params[i].value_len);
+            pos += params[i].value_len;
+        }
+    }
+    out[pos] = '\0';
+    free(copy);
+}
+
+static void legacy_key_hash(const sample_t *s, uint64_t *hash_out, char *fp_out) {
+    char norm_query[512] = {0};
+    if (s->query && s->query[0]) legacy_normalize_query(s->query, norm_query, sizeof(norm_query));
+
+    char query_part[513] = {0};
+    if (norm_query[0]) _snprintf(query_part, sizeof(query_part), "?%s", norm_query);
+
+    char key[2048];
+    _snprintf(key, sizeof(key), "%s:%s://%s%s%s|vary:%s", "GET", "https", s->host, s->path, query_part, "");
+    key[sizeof(key) - 1] = '\0';
+
+    size_t len = strlen(key);
+    uint64_t h1 = fnv1a_hash(key, len);
+    uint64_t h2 = fnv1a_hash(key, len);
+    uint64_t h3 = 0x811c9dc5ULL;
+    for (size_t i = 0; i < len; i++) {
+        h3 ^= (uint8_t)key[i];
+        h3 *= 0x01000193ULL;
+    }
+    *hash_out = h1;
+    memcpy(fp_out, &h2, 8);
+    memcpy(fp_out + 8, &h3, 8);
+}
+
+// ----
+
+static double elapsed_ns(LARGE_INTEGER start, LARGE_INTEGER end, LARGE_INTEGER freq) {
+    return (double)(end.QuadPart - start.QuadPart) * 1e9 / (double)freq.QuadPart;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iterations <= 0) iterations = 1000000;
+
+    // The streaming hash must match hashing the rendered key string
+    for (size_t i = 0; i < NSAMPLES; i++) {
+        char key[2048];
+        uint64_t h1, h2;
+        char fp1[16], fp2[16];
+        build_cache_key("GET", "https", samples[i].host, samples[i].path, samples[i].query, NULL, key, sizeof(key));
+        cache_key_hash(key, &h1, fp1);
+        cache_key_compute("GET", "https", samples[i].host, samples[i].path, samples[i].query, NULL, &h2, fp2);
+        if (h1 != h2 || memcmp(fp1, fp2, 16) != 0) {
+            fprintf(stderr, "mismatch for %s\n", key);
+            return 1;
+        }
+    }
+
+    LARGE_INTEGER freq, t0, t1, t2;
+    QueryPerformanceFrequency(&freq);
+    volatile uint64_t sink = 0;
+    uint64_t hash;
+    char fp[16];
+
+    QueryPerformanceCounter(&t0);
+    for (long n = 0; n < iterations; n++) {
+        const sample_t *s = &samples[n % NSAMPLES];
+        // cache_get() and cache_prepare_key() each built and hashed the key
+        legacy_key_hash(s, &hash, fp);
+        sink += hash;
+        legacy_key_hash(s, &hash, fp);
+        sink += hash;
+    }
+    QueryPerformanceCounter(&t1);
+    for (long n = 0; n < iterations; n++) {
+        const sample_t *s = &samples[n % NSAMPLES];
+        cache_key_compute("GET", "https", s->host, s->path, s->query, NULL, &hash, fp);
+        sink += hash;
+    }
+    QueryPerformanceCounter(&t2);
+
+    double legacy = elapsed_ns(t0, t1, freq) / (double)iterations;
+    double current = elapsed_ns(t1, t2, freq) / (double)iterations;
+    printf("cache key per request over %ld requests (%u URL shapes)\n", iterations, (unsigned)NSAMPLES);
+    printf("  previous (2x build + FNV): %8.1f ns\n", legacy);
+    printf("  streaming (1x compute):    %8.1f ns\n", current);
+    printf("  saved:                     %8.1f ns (%.1fx)\n", legacy - current, current > 0 ? legacy / current : 0.0);
+    return sink == 0xFFFFFFFFFFFFFFFFULL;
+}
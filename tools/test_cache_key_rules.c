@@ -0,0 +1,75 @@
+#include <windows.h>
+#include "../include/cache.h"
+#include "../include/cache_key_rules.h"
+#include <stdio.h>
+#include <string.h>
+
+// Checks of the key inputs cache_key_rules_apply() builds, header prefixes in
+// particular. Exits non-zero on the first failure.
+//
+//   make test && build\test_cache_key_rules.exe
+
+// cache_utils.c's lookup, reduced to what the rules need: first line named name
+int cache_header_value(const char *buf, const char *hdr_end, const char *name,
+                       char *out, size_t out_size) {
+    size_t name_len = strlen(name);
+    for (const char *p = strstr(buf, "\r\n"); p && p < hdr_end; p = strstr(p, "\r\n")) {
+        p += 2;
+        if (_strnicmp(p, name, name_len) != 0 || p[name_len] != ':') continue;
+        const char *v = p + name_len + 1;
+        while (*v == ' ') v++;
+        const char *end = strstr(v, "\r\n");
+        size_t len = (size_t)(end - v);
+        if (len >= out_size) return -1;
+        memcpy(out, v, len);
+        out[len] = '\0';
+        return (int)len;
+    }
+    return -1;
+}
+
+static int failures = 0;
+
+static void expect_vary(const char *what, const cache_key_rules_t *rules, const char *request,
+                        int expect_rc, const char *expect) {
+    char path[256], query[256], vary[512];
+    int rc = cache_key_rules_apply(rules, request, "/a", "", path, sizeof(path),
+                                   query, sizeof(query), vary, sizeof(vary));
+    if (rc != expect_rc || (rc == 0 && strcmp(vary, expect) != 0)) {
+        printf("FAIL %s: rc=%d vary=\"%s\", expected rc=%d vary=\"%s\"\n",
+               what, rc, rc == 0 ? vary : "", expect_rc, expect);
+        failures++;
+    }
+}
+
+int main(void) {
+    cache_key_rules_t rules;
+    cache_key_rules_compile(&rules, NULL, NULL, "X-Foo-*", NULL, 0, 0);
+
+    expect_vary("prefix matches", &rules,
+                "GET /a HTTP/1.1\r\nHost: h\r\nX-Foo-B: 2\r\nx-foo-a:  1 \r\nX-Bar: 3\r\n\r\n",
+                0, "h:x-foo-a=1|h:x-foo-b=2");
+    expect_vary("order does not matter", &rules,
+                "GET /a HTTP/1.1\r\nHost: h\r\nX-FOO-A: 1\r\nX-Foo-B: 2\r\n\r\n",
+                0, "h:x-foo-a=1|h:x-foo-b=2");
+    expect_vary("no match", &rules,
+                "GET /a HTTP/1.1\r\nHost: h\r\nX-Foo: 1\r\n\r\n",
+                0, "");
+
+    char request[4096];
+    size_t len = (size_t)snprintf(request, sizeof(request), "GET /a HTTP/1.1\r\nHost: h\r\n");
+    for (int i = 0; i < 17; i++) {
+        len += (size_t)snprintf(request + len, sizeof(request) - len, "X-Foo-%02d: v\r\n", i);
+    }
+    snprintf(request + len, sizeof(request) - len, "\r\n");
+    expect_vary("too many matches", &rules, request, -1, "");
+
+    cache_key_rules_compile(&rules, NULL, NULL, "Accept-Language, X-Foo-*", NULL, 0, 0);
+    expect_vary("exact and prefix", &rules,
+                "GET /a HTTP/1.1\r\nX-Foo-Z: z\r\nAccept-Language: de\r\n\r\n",
+                0, "h:accept-language=de|h:x-foo-z=z");
+
+    if (failures) return 1;
+    printf("ok\n");
+    return 0;
+}
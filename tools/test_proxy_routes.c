@@ -0,0 +1,83 @@
+#include <windows.h>
+#include "../include/proxy_routes.h"
+#include "../include/dao_routes.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Checks of route and cache policy lookup against a fixed table standing in for
+// the DAO. Exits non-zero on the first failure.
+//
+//   make test && build\test_proxy_routes.exe
+
+static const char *policy_prefixes[] = { "/", "/media/", "/media/video/", "/api/v1/" };
+#define NPOLICIES (sizeof(policy_prefixes) / sizeof(policy_prefixes[0]))
+
+int dao_routes_load_all_into(ProxyRoute *out, int max_out) {
+    if (max_out < 1) return 0;
+    memset(out, 0, sizeof(*out));
+    snprintf(out->domain, sizeof(out->domain), "example.com");
+    snprintf(out->backend_host, sizeof(out->backend_host), "127.0.0.1");
+    out->backend_port = 8080;
+    return 1;
+}
+
+int dao_cache_policies_load_all_into(CachePolicy *out, int max_out) {
+    int n = 0;
+    for (size_t i = 0; i < NPOLICIES && n < max_out; i++, n++) {
+        memset(&out[n], 0, sizeof(out[n]));
+        snprintf(out[n].domain, sizeof(out[n].domain), "example.com");
+        snprintf(out[n].path_prefix, sizeof(out[n].path_prefix), "%s", policy_prefixes[i]);
+        out[n].prefix_len = (int)strlen(policy_prefixes[i]);
+    }
+    return n;
+}
+
+void log_message(const char *log_level, const char *message) {
+    (void)log_level;
+    (void)message;
+}
+
+uint16_t cache_tenant_configure(const char *host, uint64_t quota_bytes, uint32_t weight) {
+    (void)host;
+    (void)quota_bytes;
+    (void)weight;
+    return 0;
+}
+
+static int failures = 0;
+
+static void expect_policy(const ProxyRoute *route, const char *path, const char *expect) {
+    const CachePolicy *pol = find_cache_policy(route, path);
+    const char *got = pol ? pol->path_prefix : "(none)";
+    if (strcmp(got, expect) != 0) {
+        printf("FAIL %s: got %s, expected %s\n", path, got, expect);
+        failures++;
+    }
+}
+
+int main(void) {
+    load_proxy_routes();
+    const ProxyRoute *route = find_proxy_routes("Example.COM");
+    if (!route || route->policy_count != (int)NPOLICIES) {
+        printf("FAIL route lookup\n");
+        return 1;
+    }
+
+    expect_policy(route, "/", "/");
+    expect_policy(route, "/index.html", "/");
+    expect_policy(route, "/media/a.jpg", "/media/");
+    expect_policy(route, "/media/", "/media/");
+    expect_policy(route, "/media", "/media/");
+    expect_policy(route, "/media?w=100", "/media/");
+    expect_policy(route, "/mediax", "/");
+    expect_policy(route, "/media/video", "/media/video/");
+    expect_policy(route, "/media/video/clip.mp4", "/media/video/");
+    expect_policy(route, "/media/videos", "/media/");
+    expect_policy(route, "/api/v1", "/api/v1/");
+    expect_policy(route, "/api", "/");
+
+    if (failures) return 1;
+    printf("ok\n");
+    return 0;
+}